@@ -0,0 +1,47 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __BACKEND_H__
+#define __BACKEND_H__
+
+#include "config.h"
+
+/*
+ * The source of the file system events.
+ *
+ * The library talks to its backend through the subset of the kqueue(2)
+ * interface it needs: kqueue() creates a queue, kevent() registers the
+ * EVFILT_VNODE filters on the watched files (and the EVFILT_READ,
+ * EVFILT_TIMER and EVFILT_USER filters of the worker) and waits for the
+ * events. The real kqueue(2) is used where the system has one. With
+ * --enable-simulated-kqueue, it is replaced with a simulation fed by
+ * the Linux inotify, so the library, its tests and its benchmarks run
+ * on Linux too.
+ */
+#ifdef ENABLE_SIMULATED_KQUEUE
+#include "kqueue-sim.h"
+#else
+#include <sys/types.h>
+#include <sys/event.h>
+#endif
+
+#endif /* __BACKEND_H__ */
@@ -0,0 +1,276 @@
+/*******************************************************************************
+  Copyright (c) 2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "sys/inotify.h"
+#include "bench.h"
+
+/**
+ * Take the current wall clock and process CPU time.
+ *
+ * @param[out] clk A pointer to #bench_clock.
+ **/
+void
+bench_now (bench_clock *clk)
+{
+    struct timeval tv;
+    struct rusage ru;
+
+    gettimeofday (&tv, NULL);
+    getrusage (RUSAGE_SELF, &ru);
+
+    clk->wall = tv.tv_sec + tv.tv_usec / 1e6;
+    clk->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/**
+ * Measure the time passed since a point.
+ *
+ * @param[in]  since   A point taken with bench_now().
+ * @param[out] elapsed The wall clock and CPU time passed.
+ **/
+void
+bench_elapsed (const bench_clock *since, bench_clock *elapsed)
+{
+    bench_clock now;
+    bench_now (&now);
+
+    elapsed->wall = now.wall - since->wall;
+    elapsed->cpu = now.cpu - since->cpu;
+}
+
+/**
+ * Create a temporary directory for a benchmark.
+ *
+ * @param[in] parent A directory to create the temporary one in.
+ * @return A path to the new directory. Should be freed with free().
+ **/
+char*
+bench_mkdtemp (const char *parent)
+{
+    char *path = malloc (strlen (parent) + 32);
+    if (path == NULL) {
+        perror ("malloc");
+        exit (1);
+    }
+
+    sprintf (path, "%s/inotify-bench.XXXXXX", parent);
+    if (mkdtemp (path) == NULL) {
+        perror ("mkdtemp");
+        exit (1);
+    }
+    return path;
+}
+
+/**
+ * Remove a directory with all its contents.
+ *
+ * @param[in] path A path to the directory.
+ **/
+void
+bench_rmtree (const char *path)
+{
+    DIR *dir = opendir (path);
+    if (dir != NULL) {
+        struct dirent *ent;
+        while ((ent = readdir (dir)) != NULL) {
+            if (!strcmp (ent->d_name, ".") || !strcmp (ent->d_name, "..")) {
+                continue;
+            }
+
+            char sub[4096];
+            struct stat st;
+            snprintf (sub, sizeof (sub), "%s/%s", path, ent->d_name);
+            if (lstat (sub, &st) == 0 && S_ISDIR (st.st_mode)) {
+                bench_rmtree (sub);
+            } else {
+                unlink (sub);
+            }
+        }
+        closedir (dir);
+    }
+    rmdir (path);
+}
+
+/**
+ * Create (or update) a file named PREFIX + INDEX in a directory.
+ **/
+void
+bench_touch (const char *dir, const char *prefix, int index)
+{
+    char path[4096];
+    snprintf (path, sizeof (path), "%s/%s%d", dir, prefix, index);
+
+    int fd = open (path, O_WRONLY | O_CREAT, 0644);
+    if (fd == -1) {
+        perror (path);
+        exit (1);
+    }
+    close (fd);
+}
+
+/**
+ * Remove a file named PREFIX + INDEX from a directory.
+ **/
+void
+bench_unlink (const char *dir, const char *prefix, int index)
+{
+    char path[4096];
+    snprintf (path, sizeof (path), "%s/%s%d", dir, prefix, index);
+    unlink (path);
+}
+
+/**
+ * Append a byte to a file named PREFIX + INDEX in a directory.
+ **/
+void
+bench_append (const char *dir, const char *prefix, int index)
+{
+    char path[4096];
+    snprintf (path, sizeof (path), "%s/%s%d", dir, prefix, index);
+
+    int fd = open (path, O_WRONLY | O_APPEND);
+    if (fd == -1) {
+        perror (path);
+        exit (1);
+    }
+    if (write (fd, "x", 1) != 1) {
+        perror (path);
+        exit (1);
+    }
+    close (fd);
+}
+
+/**
+ * The library keeps every watched file open, so let it have plenty
+ * of descriptors.
+ **/
+void
+bench_raise_fd_limit (void)
+{
+    struct rlimit rl;
+    if (getrlimit (RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit (RLIMIT_NOFILE, &rl);
+    }
+}
+
+/**
+ * Count the open descriptors.
+ *
+ * @param[in] limit Count the descriptors below this number only.
+ * @return The number of the open descriptors.
+ **/
+int
+bench_count_fds (int limit)
+{
+    int fd, count = 0;
+    for (fd = 0; fd < limit; fd++) {
+        if (fcntl (fd, F_GETFD) != -1) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+/**
+ * Wait until the number of the open descriptors stops changing.
+ *
+ * The closed instances release their watches asynchronously.
+ *
+ * @param[in] limit Count the descriptors below this number only.
+ **/
+void
+bench_settle_fds (int limit)
+{
+    int last = -1, count;
+    while ((count = bench_count_fds (limit)) != last) {
+        last = count;
+        usleep (100000);
+    }
+}
+
+/**
+ * Read events from an inotify instance.
+ *
+ * @param[in] fd      An inotify instance file descriptor.
+ * @param[in] idle_ms Stop if no events arrive during this period.
+ * @param[in] cb      A callback to invoke on every event.
+ * @param[in] udata   A pointer to the user data for the callback.
+ * @return The number of events read.
+ **/
+int
+bench_drain (int fd, int idle_ms, bench_event_cb cb, void *udata)
+{
+    static char buf[256 * 1024];
+    size_t have = 0;
+    int count = 0;
+
+    for (;;) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if (poll (&pfd, 1, idle_ms) <= 0) {
+            return count;
+        }
+
+        ssize_t len = read (fd, buf + have, sizeof (buf) - have);
+        if (len <= 0) {
+            return count;
+        }
+        have += len;
+
+        /* The stream can be split in the middle of an event */
+        size_t off = 0;
+        while (off + sizeof (struct inotify_event) <= have) {
+            struct inotify_event *ie = (struct inotify_event *) (buf + off);
+            size_t ev_len = sizeof (struct inotify_event) + ie->len;
+            if (off + ev_len > have) {
+                break;
+            }
+            off += ev_len;
+            ++count;
+
+            if (cb (udata, ie->wd, ie->mask, ie->len ? ie->name : NULL)) {
+                return count;
+            }
+        }
+
+        memmove (buf, buf + off, have - off);
+        have -= off;
+    }
+}
@@ -0,0 +1,52 @@
+/*******************************************************************************
+  Copyright (c) 2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdint.h>
+
+/* A point in time, both on the wall clock and in the process CPU time */
+typedef struct bench_clock {
+    double wall;    /* seconds */
+    double cpu;     /* seconds, user + system */
+} bench_clock;
+
+void bench_now (bench_clock *clk);
+void bench_elapsed (const bench_clock *since, bench_clock *elapsed);
+
+char* bench_mkdtemp (const char *parent);
+void  bench_rmtree  (const char *path);
+void  bench_touch   (const char *dir, const char *prefix, int index);
+void  bench_unlink  (const char *dir, const char *prefix, int index);
+void  bench_append  (const char *dir, const char *prefix, int index);
+void  bench_raise_fd_limit (void);
+int   bench_count_fds (int limit);
+void  bench_settle_fds (int limit);
+
+/* Called for every event received, returns non-zero to stop reading */
+typedef int (* bench_event_cb) (void *udata, int wd, uint32_t mask,
+                                const char *name);
+
+int bench_drain (int fd, int idle_ms, bench_event_cb cb, void *udata);
+
+#endif /* __BENCH_H__ */
@@ -0,0 +1,194 @@
+/*******************************************************************************
+  Copyright (c) 2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+/*
+ * Directory churn benchmark.
+ *
+ * Creates and then removes a lot of files in a watched directory as
+ * fast as possible, and reports how many directory rescans the library
+ * made and how much CPU it took, with and without the debounce window
+ * (IN_DEBOUNCE_MSEC), and with the periodic rescans of hot directories
+ * (IN_HOT_RATE).
+ *
+ * Usage: churn_bench [-n files] [-w window_ms] [-r hot_rate] [parent_dir]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sys/inotify.h"
+#include "bench.h"
+
+typedef struct {
+    const char *dir;
+    int files;
+    int created;
+    int deleted;
+} churn_state;
+
+static void*
+create_files (void *arg)
+{
+    churn_state *st = arg;
+    int i;
+    for (i = 0; i < st->files; i++) {
+        bench_touch (st->dir, "f", i);
+    }
+    return NULL;
+}
+
+static void*
+remove_files (void *arg)
+{
+    churn_state *st = arg;
+    int i;
+    for (i = 0; i < st->files; i++) {
+        bench_unlink (st->dir, "f", i);
+    }
+    return NULL;
+}
+
+static int
+on_created (void *udata, int wd, uint32_t mask, const char *name)
+{
+    churn_state *st = udata;
+    (void) wd;
+    (void) name;
+
+    if (mask & IN_CREATE) {
+        ++st->created;
+    }
+    return st->created >= st->files;
+}
+
+static int
+on_deleted (void *udata, int wd, uint32_t mask, const char *name)
+{
+    churn_state *st = udata;
+    (void) wd;
+    (void) name;
+
+    if (mask & IN_DELETE) {
+        ++st->deleted;
+    }
+    return st->deleted >= st->files;
+}
+
+/* Run a writer thread while reading the events in the current one */
+static void
+churn (churn_state *st, int fd, void* (*writer) (void *), bench_event_cb cb)
+{
+    pthread_t thread;
+    pthread_create (&thread, NULL, writer, st);
+    bench_drain (fd, 2000, cb, st);
+    pthread_join (thread, NULL);
+}
+
+static void
+run (const char *parent, int files, int window_ms, int hot_rate)
+{
+    char *dir = bench_mkdtemp (parent);
+    int fd = inotify_init ();
+    if (fd == -1) {
+        perror ("inotify_init");
+        exit (1);
+    }
+
+    if (libinotify_set_param (fd, IN_DEBOUNCE_MSEC, window_ms) == -1
+        || libinotify_set_param (fd, IN_HOT_RATE, hot_rate) == -1) {
+        fprintf (stderr, "libinotify_set_param failed\n");
+        exit (1);
+    }
+    if (inotify_add_watch (fd, dir, IN_CREATE | IN_DELETE) == -1) {
+        perror ("inotify_add_watch");
+        exit (1);
+    }
+
+    churn_state st = { dir, files, 0, 0 };
+    bench_clock start, elapsed;
+
+    bench_now (&start);
+    churn (&st, fd, create_files, on_created);
+    churn (&st, fd, remove_files, on_deleted);
+    bench_elapsed (&start, &elapsed);
+
+    struct inotify_stats stats;
+    libinotify_get_stats (fd, &stats);
+
+    printf ("%6d ms %9d %9d %9d %9llu %9llu %5llu %11.1f %8.3f %8.3f\n",
+            window_ms,
+            hot_rate,
+            st.created,
+            st.deleted,
+            (unsigned long long) stats.rescans,
+            (unsigned long long) stats.rescans_folded,
+            (unsigned long long) stats.hot_entered,
+            stats.rescans / elapsed.wall,
+            elapsed.wall,
+            elapsed.cpu);
+
+    close (fd);
+    bench_rmtree (dir);
+    free (dir);
+}
+
+int
+main (int argc, char *argv[])
+{
+    int files = 1000;
+    int window_ms = 5;
+    int hot_rate = 1000;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "n:w:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            files = atoi (optarg);
+            break;
+        case 'w':
+            window_ms = atoi (optarg);
+            break;
+        case 'r':
+            hot_rate = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "Usage: %s [-n files] [-w window_ms] "
+                     "[-r hot_rate] [dir]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    bench_raise_fd_limit ();
+
+    printf ("Creating and removing %d files\n", files);
+    printf ("%9s %9s %9s %9s %9s %9s %5s %11s %8s %8s\n",
+            "window", "hot rate", "created", "deleted", "rescans", "folded",
+            "hot", "rescans/s", "wall, s", "cpu, s");
+
+    const char *parent = optind < argc ? argv[optind] : ".";
+    run (parent, files, 0, 0);
+    run (parent, files, window_ms, 0);
+    run (parent, files, 0, hot_rate);
+    return 0;
+}
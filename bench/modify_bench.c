@@ -0,0 +1,145 @@
+/*******************************************************************************
+  Copyright (c) 2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+/*
+ * Modification storm benchmark.
+ *
+ * Watches a directory with a lot of files and modifies every file in
+ * it, round after round, while reading the events. Reports the event
+ * throughput and how many kernel events the library handled per
+ * kevent() call.
+ *
+ * Usage: modify_bench [-n files] [-r rounds] [parent_dir]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sys/inotify.h"
+#include "bench.h"
+
+typedef struct {
+    const char *dir;
+    int files;
+    int received;
+} storm_state;
+
+static void*
+modify_files (void *arg)
+{
+    storm_state *st = arg;
+    int i;
+    for (i = 0; i < st->files; i++) {
+        bench_append (st->dir, "f", i);
+    }
+    return NULL;
+}
+
+static int
+on_modified (void *udata, int wd, uint32_t mask, const char *name)
+{
+    storm_state *st = udata;
+    (void) wd;
+    (void) name;
+
+    if (mask & IN_MODIFY) {
+        ++st->received;
+    }
+    return st->received >= st->files;
+}
+
+int
+main (int argc, char *argv[])
+{
+    int files = 10000;
+    int rounds = 5;
+    int opt, i;
+
+    while ((opt = getopt (argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            files = atoi (optarg);
+            break;
+        case 'r':
+            rounds = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "Usage: %s [-n files] [-r rounds] [dir]\n",
+                     argv[0]);
+            return 1;
+        }
+    }
+
+    bench_raise_fd_limit ();
+
+    char *dir = bench_mkdtemp (optind < argc ? argv[optind] : ".");
+    for (i = 0; i < files; i++) {
+        bench_touch (dir, "f", i);
+    }
+
+    int fd = inotify_init ();
+    if (fd == -1) {
+        perror ("inotify_init");
+        return 1;
+    }
+    if (inotify_add_watch (fd, dir, IN_MODIFY) == -1) {
+        perror ("inotify_add_watch");
+        return 1;
+    }
+
+    storm_state st = { dir, files, 0 };
+    bench_clock start, elapsed;
+    int total = 0;
+
+    bench_now (&start);
+    for (i = 0; i < rounds; i++) {
+        pthread_t thread;
+
+        /* Every file is modified once per round, so no events coalesce */
+        st.received = 0;
+        pthread_create (&thread, NULL, modify_files, &st);
+        bench_drain (fd, 2000, on_modified, &st);
+        pthread_join (thread, NULL);
+        total += st.received;
+    }
+    bench_elapsed (&start, &elapsed);
+
+    struct inotify_stats stats;
+    libinotify_get_stats (fd, &stats);
+
+    printf ("Modifying %d files, %d rounds\n", files, rounds);
+    printf ("%9s %11s %13s %8s %8s\n",
+            "events", "events/s", "kevents/call", "wall, s", "cpu, s");
+    printf ("%9d %11.1f %13.2f %8.3f %8.3f\n",
+            total,
+            total / elapsed.wall,
+            stats.batches ? (double) stats.kevents / stats.batches : 0.0,
+            elapsed.wall,
+            elapsed.cpu);
+
+    close (fd);
+    bench_rmtree (dir);
+    free (dir);
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*******************************************************************************
+  Copyright (c) 2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+/*
+ * Directory population benchmark.
+ *
+ * Measures how long inotify_add_watch() takes on directories of growing
+ * sizes, with the entries opened by 0, 1, 2, 4... helper threads
+ * (IN_OPEN_THREADS), and in the background (IN_ASYNC): then the wd is
+ * returned at once, and all the entries are watched by IN_POPULATED.
+ *
+ * Usage: populate_bench [-n max_files] [-t max_threads] [parent_dir]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sys/inotify.h"
+#include "bench.h"
+
+static int
+on_populated (void *udata, int wd, uint32_t mask, const char *name)
+{
+    (void) udata;
+    (void) wd;
+    (void) name;
+
+    return (mask & IN_POPULATED) != 0;
+}
+
+static void
+run (const char *dir, int files, int threads, int async)
+{
+    int limit = files + 64;
+
+    int fd = inotify_init ();
+    if (fd == -1) {
+        perror ("inotify_init");
+        exit (1);
+    }
+    if (libinotify_set_param (fd, IN_OPEN_THREADS, threads) == -1) {
+        fprintf (stderr, "libinotify_set_param failed\n");
+        exit (1);
+    }
+
+    bench_clock start, added, populated;
+    bench_now (&start);
+    if (inotify_add_watch (fd, dir, IN_ALL_EVENTS | (async ? IN_ASYNC : 0)) == -1) {
+        perror ("inotify_add_watch");
+        exit (1);
+    }
+    bench_elapsed (&start, &added);
+    populated = added;
+    if (async) {
+        bench_drain (fd, 10000, on_populated, NULL);
+        bench_elapsed (&start, &populated);
+    }
+
+    printf ("%8d %8d %6s %9.3f %9.3f %8.3f\n",
+            files,
+            threads,
+            async ? "async" : "sync",
+            added.wall,
+            populated.wall,
+            populated.cpu);
+
+    close (fd);
+    bench_settle_fds (limit);
+}
+
+int
+main (int argc, char *argv[])
+{
+    int max_files = 100000;
+    int max_threads = 8;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "n:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            max_files = atoi (optarg);
+            break;
+        case 't':
+            max_threads = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "Usage: %s [-n max_files] [-t max_threads] [dir]\n",
+                     argv[0]);
+            return 1;
+        }
+    }
+
+    bench_raise_fd_limit ();
+
+    char *dir = bench_mkdtemp (optind < argc ? argv[optind] : ".");
+
+    printf ("Adding a watch on a directory\n");
+    printf ("%8s %8s %6s %9s %9s %8s\n",
+            "files", "threads", "mode", "add, s", "ready, s", "cpu, s");
+
+    int files = 0, size, threads;
+    for (size = 1000; size <= max_files; size *= 10) {
+        for (; files < size; files++) {
+            bench_touch (dir, "f", files);
+        }
+        run (dir, files, 0, 0);
+        for (threads = 1; threads <= max_threads; threads *= 2) {
+            run (dir, files, threads, 0);
+        }
+        run (dir, files, 0, 1);
+    }
+
+    bench_rmtree (dir);
+    free (dir);
+    return 0;
+}
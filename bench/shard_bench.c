@@ -0,0 +1,195 @@
+/*******************************************************************************
+  Copyright (c) 2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+/*
+ * Sharded worker benchmark.
+ *
+ * Watches several large directories with a single inotify instance and
+ * creates files in all of them at once, so every directory is rescanned
+ * over and over. Reports the throughput of the events with the watches
+ * served by 1, 2, 4... threads (IN_SHARDS).
+ *
+ * Usage: shard_bench [-d dirs] [-f files] [-n new_files] [-s max_shards]
+ *                    [parent_dir]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sys/inotify.h"
+#include "bench.h"
+
+typedef struct {
+    const char *dir;
+    int files;
+} writer_state;
+
+typedef struct {
+    int expected;
+    int received;
+} shard_state;
+
+static void*
+create_files (void *arg)
+{
+    writer_state *ws = arg;
+    int i;
+    for (i = 0; i < ws->files; i++) {
+        bench_touch (ws->dir, "n", i);
+    }
+    return NULL;
+}
+
+static int
+on_created (void *udata, int wd, uint32_t mask, const char *name)
+{
+    shard_state *st = udata;
+    (void) wd;
+    (void) name;
+
+    if (mask & IN_CREATE) {
+        ++st->received;
+    }
+    return st->received >= st->expected;
+}
+
+static void
+run (char **dirs, int ndirs, int files, int created, int shards)
+{
+    int i, j;
+
+    int fd = inotify_init ();
+    if (fd == -1) {
+        perror ("inotify_init");
+        exit (1);
+    }
+    if (libinotify_set_param (fd, IN_SHARDS, shards) == -1) {
+        fprintf (stderr, "libinotify_set_param failed\n");
+        exit (1);
+    }
+    for (i = 0; i < ndirs; i++) {
+        if (inotify_add_watch (fd, dirs[i], IN_CREATE) == -1) {
+            perror ("inotify_add_watch");
+            exit (1);
+        }
+    }
+
+    writer_state *ws = calloc (ndirs, sizeof (writer_state));
+    pthread_t *threads = calloc (ndirs, sizeof (pthread_t));
+    shard_state st = { ndirs * created, 0 };
+
+    bench_clock start, elapsed;
+    bench_now (&start);
+
+    for (i = 0; i < ndirs; i++) {
+        ws[i].dir = dirs[i];
+        ws[i].files = created;
+        pthread_create (&threads[i], NULL, create_files, &ws[i]);
+    }
+    bench_drain (fd, 2000, on_created, &st);
+    for (i = 0; i < ndirs; i++) {
+        pthread_join (threads[i], NULL);
+    }
+    bench_elapsed (&start, &elapsed);
+
+    struct inotify_stats stats;
+    libinotify_get_stats (fd, &stats);
+
+    printf ("%6d %9d %9llu %9.3f %8.3f %10.0f\n",
+            shards,
+            st.received,
+            (unsigned long long) stats.rescans,
+            elapsed.wall,
+            elapsed.cpu,
+            st.received / elapsed.wall);
+
+    close (fd);
+    bench_settle_fds (ndirs * (files + 2) * 2 + 64);
+    for (i = 0; i < ndirs; i++) {
+        for (j = 0; j < created; j++) {
+            bench_unlink (dirs[i], "n", j);
+        }
+    }
+    free (threads);
+    free (ws);
+}
+
+int
+main (int argc, char *argv[])
+{
+    int ndirs = 8;
+    int files = 2000;
+    int created = 500;
+    int max_shards = 4;
+    int opt, i, j;
+
+    while ((opt = getopt (argc, argv, "d:f:n:s:")) != -1) {
+        switch (opt) {
+        case 'd':
+            ndirs = atoi (optarg);
+            break;
+        case 'f':
+            files = atoi (optarg);
+            break;
+        case 'n':
+            created = atoi (optarg);
+            break;
+        case 's':
+            max_shards = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "Usage: %s [-d dirs] [-f files] [-n new_files] "
+                     "[-s max_shards] [dir]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    bench_raise_fd_limit ();
+
+    char *root = bench_mkdtemp (optind < argc ? argv[optind] : ".");
+    char **dirs = calloc (ndirs, sizeof (char *));
+    for (i = 0; i < ndirs; i++) {
+        dirs[i] = bench_mkdtemp (root);
+        for (j = 0; j < files; j++) {
+            bench_touch (dirs[i], "f", j);
+        }
+    }
+
+    printf ("Creating %d files in each of %d directories of %d files\n",
+            created, ndirs, files);
+    printf ("%6s %9s %9s %9s %8s %10s\n",
+            "shards", "events", "rescans", "wall, s", "cpu, s", "events/s");
+    int shards;
+    for (shards = 1; shards <= max_shards; shards *= 2) {
+        run (dirs, ndirs, files, created, shards);
+    }
+
+    for (i = 0; i < ndirs; i++) {
+        free (dirs[i]);
+    }
+    free (dirs);
+    bench_rmtree (root);
+    free (root);
+    return 0;
+}
@@ -0,0 +1,170 @@
+/*******************************************************************************
+  Copyright (c) 2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+/*
+ * Shared watches benchmark.
+ *
+ * Starts several inotify instances watching the same directory with a
+ * lot of files, modifies every file and reads the events from every
+ * instance. Reports the descriptors taken by the library and the time
+ * it took, with and without sharing the watches (IN_SHARED).
+ *
+ * Usage: share_bench [-n files] [-i instances] [parent_dir]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sys/inotify.h"
+#include "bench.h"
+
+typedef struct {
+    const char *dir;
+    int files;
+    int received;
+} share_state;
+
+static void*
+modify_files (void *arg)
+{
+    share_state *st = arg;
+    int i;
+    for (i = 0; i < st->files; i++) {
+        bench_append (st->dir, "f", i);
+    }
+    return NULL;
+}
+
+static int
+on_modified (void *udata, int wd, uint32_t mask, const char *name)
+{
+    share_state *st = udata;
+    (void) wd;
+    (void) name;
+
+    if (mask & IN_MODIFY) {
+        ++st->received;
+    }
+    return st->received >= st->files;
+}
+
+static void
+run (const char *dir, int files, int instances, int shared)
+{
+    int limit = (files + 16) * (instances + 1) + 64;
+    int before = bench_count_fds (limit);
+    int *fds = calloc (instances, sizeof (int));
+    int i;
+
+    bench_clock start, added, elapsed;
+    bench_now (&start);
+
+    for (i = 0; i < instances; i++) {
+        fds[i] = inotify_init ();
+        if (fds[i] == -1) {
+            perror ("inotify_init");
+            exit (1);
+        }
+        if (libinotify_set_param (fds[i], IN_SHARED, shared) == -1) {
+            fprintf (stderr, "libinotify_set_param failed\n");
+            exit (1);
+        }
+        if (inotify_add_watch (fds[i], dir, IN_MODIFY) == -1) {
+            perror ("inotify_add_watch");
+            exit (1);
+        }
+    }
+    bench_elapsed (&start, &added);
+    int taken = bench_count_fds (limit) - before;
+
+    /* The events wait in the other instances while one is read */
+    share_state st = { dir, files, 0 };
+    pthread_t thread;
+    int total = 0;
+
+    pthread_create (&thread, NULL, modify_files, &st);
+    for (i = 0; i < instances; i++) {
+        st.received = 0;
+        bench_drain (fds[i], 2000, on_modified, &st);
+        total += st.received;
+    }
+    pthread_join (thread, NULL);
+    bench_elapsed (&start, &elapsed);
+
+    printf ("%6s %9d %9d %9d %9.3f %8.3f %8.3f\n",
+            shared ? "yes" : "no",
+            instances,
+            taken,
+            total,
+            added.wall,
+            elapsed.wall,
+            elapsed.cpu);
+
+    for (i = 0; i < instances; i++) {
+        close (fds[i]);
+    }
+    bench_settle_fds (limit);
+    free (fds);
+}
+
+int
+main (int argc, char *argv[])
+{
+    int files = 5000;
+    int instances = 4;
+    int opt, i;
+
+    while ((opt = getopt (argc, argv, "n:i:")) != -1) {
+        switch (opt) {
+        case 'n':
+            files = atoi (optarg);
+            break;
+        case 'i':
+            instances = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "Usage: %s [-n files] [-i instances] [dir]\n",
+                     argv[0]);
+            return 1;
+        }
+    }
+
+    bench_raise_fd_limit ();
+
+    char *dir = bench_mkdtemp (optind < argc ? argv[optind] : ".");
+    for (i = 0; i < files; i++) {
+        bench_touch (dir, "f", i);
+    }
+
+    printf ("Modifying %d files watched by %d instances\n", files, instances);
+    printf ("%6s %9s %9s %9s %9s %8s %8s\n",
+            "shared", "instances", "fds", "events", "add, s", "wall, s",
+            "cpu, s");
+    run (dir, files, instances, 0);
+    run (dir, files, instances, 1);
+
+    bench_rmtree (dir);
+    free (dir);
+    return 0;
+}
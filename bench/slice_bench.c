@@ -0,0 +1,181 @@
+/*******************************************************************************
+  Copyright (c) 2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+/*
+ * Command latency benchmark.
+ *
+ * Moves a growing number of files into a watched directory at once and,
+ * while the worker rescans it, measures how long an inotify_add_watch()
+ * on another directory waits for the worker, with the directories
+ * handled at once and IN_SLICE entries at a time. The ready column is
+ * the time until all the files are reported.
+ *
+ * Usage: slice_bench [-n max_files] [parent_dir]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h> /* mkdir */
+
+#include "sys/inotify.h"
+#include "bench.h"
+
+/* Changes are folded into a single rescan of the whole directory */
+#define DEBOUNCE_MSEC 1000
+
+static const int slices[] = { 0, 256, 1024, 4096 };
+
+static int
+on_created (void *udata, int wd, uint32_t mask, const char *name)
+{
+    (void) wd;
+    (void) name;
+
+    int *left = udata;
+    if (mask & IN_CREATE) {
+        --*left;
+    }
+    return *left == 0;
+}
+
+static void
+move_files (const char *from, const char *to, int files)
+{
+    char src[4096], dst[4096];
+    int i;
+    for (i = 0; i < files; i++) {
+        snprintf (src, sizeof (src), "%s/f%d", from, i);
+        snprintf (dst, sizeof (dst), "%s/f%d", to, i);
+        if (rename (src, dst) == -1) {
+            perror (src);
+            exit (1);
+        }
+    }
+}
+
+static void
+run (const char *root, int files, int slice)
+{
+    char stage[4096], watched[4096], other[4096];
+    snprintf (stage, sizeof (stage), "%s/stage", root);
+    snprintf (watched, sizeof (watched), "%s/watched", root);
+    snprintf (other, sizeof (other), "%s/other", root);
+
+    int fd = inotify_init ();
+    if (fd == -1) {
+        perror ("inotify_init");
+        exit (1);
+    }
+    if (libinotify_set_param (fd, IN_SLICE, slice) == -1
+        || libinotify_set_param (fd, IN_DEBOUNCE_MSEC, DEBOUNCE_MSEC) == -1) {
+        fprintf (stderr, "libinotify_set_param failed\n");
+        exit (1);
+    }
+    if (inotify_add_watch (fd, watched, IN_CREATE) == -1) {
+        perror ("inotify_add_watch");
+        exit (1);
+    }
+
+    bench_clock start, moved, before, command, ready;
+    bench_now (&start);
+    move_files (stage, watched, files);
+    bench_elapsed (&start, &moved);
+
+    /* Let the rescan started by the first move begin */
+    double wait = DEBOUNCE_MSEC / 1000.0 + 0.01 - moved.wall;
+    if (wait > 0) {
+        usleep (wait * 1000000);
+    }
+
+    bench_now (&before);
+    if (inotify_add_watch (fd, other, IN_CREATE) == -1) {
+        perror ("inotify_add_watch");
+        exit (1);
+    }
+    bench_elapsed (&before, &command);
+
+    int left = files;
+    bench_drain (fd, 10000, on_created, &left);
+    bench_elapsed (&start, &ready);
+
+    printf ("%8d %6d %10.2f %9.3f%s\n",
+            files,
+            slice,
+            command.wall * 1000,
+            ready.wall,
+            left > 0 ? " (lost events)" : "");
+
+    close (fd);
+    bench_settle_fds (files + 64);
+    move_files (watched, stage, files);
+}
+
+int
+main (int argc, char *argv[])
+{
+    int max_files = 100000;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            max_files = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "Usage: %s [-n max_files] [dir]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    bench_raise_fd_limit ();
+
+    char *root = bench_mkdtemp (optind < argc ? argv[optind] : ".");
+    char path[4096];
+    const char *subdirs[] = { "stage", "watched", "other" };
+    size_t i;
+    for (i = 0; i < sizeof (subdirs) / sizeof (subdirs[0]); i++) {
+        snprintf (path, sizeof (path), "%s/%s", root, subdirs[i]);
+        if (mkdir (path, 0755) == -1) {
+            perror (path);
+            return 1;
+        }
+    }
+    snprintf (path, sizeof (path), "%s/stage", root);
+
+    printf ("Adding a watch while a directory is rescanned\n");
+    printf ("%8s %6s %10s %9s\n", "files", "slice", "wait, ms", "ready, s");
+
+    int files = 0, size;
+    for (size = 1000; size <= max_files; size *= 10) {
+        for (; files < size; files++) {
+            bench_touch (path, "f", files);
+        }
+        for (i = 0; i < sizeof (slices) / sizeof (slices[0]); i++) {
+            run (root, files, slices[i]);
+        }
+    }
+
+    bench_rmtree (root);
+    free (root);
+    return 0;
+}
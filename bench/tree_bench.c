@@ -0,0 +1,183 @@
+/*******************************************************************************
+  Copyright (c) 2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+
+/*
+ * Subtree registration benchmark.
+ *
+ * Builds a tree of directories with a few files in each, and measures
+ * how long it takes to start watching the whole tree: by walking it and
+ * calling inotify_add_watch() on every directory, as the applications
+ * do, and with a single IN_RECURSIVE watch.
+ *
+ * Usage: tree_bench [-d depth] [-f fanout] [-n files] [parent_dir]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sys/inotify.h"
+#include "bench.h"
+
+static int
+make_tree (const char *dir, int depth, int fanout, int files)
+{
+    int i, dirs = 1;
+
+    for (i = 0; i < files; i++) {
+        bench_touch (dir, "f", i);
+    }
+    if (depth == 0) {
+        return dirs;
+    }
+
+    for (i = 0; i < fanout; i++) {
+        char sub[4096];
+        snprintf (sub, sizeof (sub), "%s/d%d", dir, i);
+        if (mkdir (sub, 0755) == -1) {
+            perror (sub);
+            exit (1);
+        }
+        dirs += make_tree (sub, depth - 1, fanout, files);
+    }
+    return dirs;
+}
+
+/* Watch every directory of a tree separately */
+static int
+walk_tree (int fd, const char *dir)
+{
+    int watches = 0;
+
+    if (inotify_add_watch (fd, dir, IN_ALL_EVENTS) == -1) {
+        perror ("inotify_add_watch");
+        exit (1);
+    }
+    ++watches;
+
+    DIR *d = opendir (dir);
+    if (d == NULL) {
+        return watches;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir (d)) != NULL) {
+        if (!strcmp (ent->d_name, ".") || !strcmp (ent->d_name, "..")) {
+            continue;
+        }
+
+        char sub[4096];
+        struct stat st;
+        snprintf (sub, sizeof (sub), "%s/%s", dir, ent->d_name);
+        if (lstat (sub, &st) == 0 && S_ISDIR (st.st_mode)) {
+            watches += walk_tree (fd, sub);
+        }
+    }
+    closedir (d);
+    return watches;
+}
+
+static void
+run (const char *dir, int dirs, int recursive)
+{
+    bench_clock start, elapsed;
+    int calls = 1;
+
+    int fd = inotify_init ();
+    if (fd == -1) {
+        perror ("inotify_init");
+        exit (1);
+    }
+
+    bench_now (&start);
+    if (recursive) {
+        if (inotify_add_watch (fd, dir, IN_ALL_EVENTS | IN_RECURSIVE) == -1) {
+            perror ("inotify_add_watch");
+            exit (1);
+        }
+    } else {
+        calls = walk_tree (fd, dir);
+    }
+    bench_elapsed (&start, &elapsed);
+
+    struct inotify_stats stats;
+    libinotify_get_stats (fd, &stats);
+
+    printf ("%10s %9d %11.1f %8.3f %8.3f\n",
+            recursive ? "recursive" : "walk",
+            calls,
+            dirs / elapsed.wall,
+            elapsed.wall,
+            elapsed.cpu);
+
+    close (fd);
+}
+
+int
+main (int argc, char *argv[])
+{
+    int depth = 4;
+    int fanout = 5;
+    int files = 10;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "d:f:n:")) != -1) {
+        switch (opt) {
+        case 'd':
+            depth = atoi (optarg);
+            break;
+        case 'f':
+            fanout = atoi (optarg);
+            break;
+        case 'n':
+            files = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "Usage: %s [-d depth] [-f fanout] [-n files] [dir]\n",
+                     argv[0]);
+            return 1;
+        }
+    }
+
+    bench_raise_fd_limit ();
+
+    const char *parent = optind < argc ? argv[optind] : ".";
+    char *dir = bench_mkdtemp (parent);
+    int dirs = make_tree (dir, depth, fanout, files);
+
+    printf ("Watching a tree of %d directories, %d files each\n", dirs, files);
+    printf ("%10s %9s %11s %8s %8s\n",
+            "mode", "calls", "dirs/s", "wall, s", "cpu, s");
+
+    run (dir, dirs, 0);
+    run (dir, dirs, 1);
+
+    bench_rmtree (dir);
+    free (dir);
+    return 0;
+}
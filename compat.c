@@ -21,7 +21,7 @@
 *******************************************************************************/
 
 #include <assert.h>
-#include <string.h> /* memset */
+#include <string.h> /* memset, memcpy, strlen */
 
 #include "compat.h"
 #include "config.h"
@@ -100,3 +100,32 @@ pthread_barrier_destroy (pthread_barrier_t *impl)
     impl->sleeping = 0;
 }
 #endif /* HAVE_PTHREAD_BARRIER */
+
+
+#ifndef HAVE_STRLCPY
+/**
+ * Copy a string to a buffer of a limited size, as the BSD strlcpy(3).
+ *
+ * The result is always NUL-terminated if the buffer is not empty.
+ *
+ * @param[out] dst  A buffer to copy to.
+ * @param[in]  src  A string to copy.
+ * @param[in]  size The size of the buffer.
+ * @return The length of the source string. The string is truncated if
+ *     it is not less than the size.
+ **/
+size_t
+strlcpy (char *dst, const char *src, size_t size)
+{
+    assert (dst != NULL);
+    assert (src != NULL);
+
+    size_t len = strlen (src);
+    if (size > 0) {
+        size_t to_copy = len < size ? len : size - 1;
+        memcpy (dst, src, to_copy);
+        dst[to_copy] = '\0';
+    }
+    return len;
+}
+#endif /* HAVE_STRLCPY */
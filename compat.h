@@ -26,6 +26,7 @@
 #include "config.h"
 
 #include <pthread.h>
+#include <stddef.h> /* size_t */
 
 #ifndef HAVE_PTHREAD_BARRIER
 typedef struct {
@@ -47,4 +48,8 @@ void pthread_barrier_wait    (pthread_barrier_t *impl);
 void pthread_barrier_destroy (pthread_barrier_t *impl);
 #endif
 
+#ifndef HAVE_STRLCPY
+size_t strlcpy (char *dst, const char *src, size_t size);
+#endif
+
 #endif /* __COMPAT_H__ */
@@ -29,9 +29,8 @@
 #include <stdio.h>
 
 #include <sys/types.h>
-#include <sys/event.h>
-
 #include "sys/inotify.h"
+#include "backend.h"
 
 #include "utils.h"
 #include "worker.h"
@@ -51,14 +50,14 @@ static pthread_mutex_t workers_mutex = PTHREAD_MUTEX_INITIALIZER;
  * @return  -1 on failure, a file descriptor on success.
  **/
 INO_EXPORT int
-inotify_init (void) __THROW
+inotify_init (void)
 {
     pthread_mutex_lock (&workers_mutex);
 
     int i;
     for (i = 0; i < WORKER_SZ; i++) {
         if (workers[i] == NULL) {
-            worker *wrk = worker_create ();
+            worker *wrk = worker_create (&worker_default_params);
             if (wrk != NULL) {
                 workers[i] = wrk;
 
@@ -92,24 +91,25 @@ inotify_init (void) __THROW
 
 
 /**
- * Add or modify a watch.
+ * Look up a running worker by its inotify file descriptor and lock it.
  *
- * If the watch with a such filename is already exist, its mask will
- * be updated. A new watch will be created otherwise.
+ * On success, both the list of workers and the worker itself are left
+ * locked, so a command can be sent with worker_exec().
  *
- * @param[in] fd   A file descriptor of an inotify instance.
- * @param[in] name A path to a file to watch.
- * @param[in] mask A combination of inotify flags. 
- * @return id of a watch, -1 on failure.
+ * @param[in]  fd    A file descriptor of an inotify instance.
+ * @param[out] slot  An index of the worker in the list of workers.
+ * @param[out] found Set to 1 if a worker was found, even a closed one.
+ * @return A pointer to a locked worker, NULL if not found or closed.
  **/
-INO_EXPORT int
-inotify_add_watch (int         fd,
-                   const char *name,
-                   uint32_t    mask) __THROW
+static worker*
+worker_acquire (int fd, int *slot, int *found)
 {
+    assert (slot != NULL);
+    assert (found != NULL);
+
     pthread_mutex_lock (&workers_mutex);
+    *found = 0;
 
-    /* look up for an appropriate worker */
     int i;
     for (i = 0; i < WORKER_SZ; i++) {
         worker *wrk = workers[i];
@@ -118,37 +118,119 @@ inotify_add_watch (int         fd,
             && wrk->closed == 0
             && is_opened (wrk->io[INOTIFY_FD])) {
             pthread_mutex_lock (&wrk->mutex);
+            *found = 1;
 
             /* Closed flag could be set before we lock on a mutex */
             if (wrk->closed) {
                 pthread_mutex_unlock (&wrk->mutex);
                 worker_free (wrk);
                 workers[i] = NULL;
-                pthread_mutex_unlock (&workers_mutex);
-                return -1;
+                break;
             }
 
-            worker_cmd_add (&wrk->cmd, name, mask);
-            safe_write (wrk->io[INOTIFY_FD], "*", 1);
+            *slot = i;
+            return wrk;
+        }
+    }
 
-            worker_cmd_wait (&wrk->cmd);
-            int retval = wrk->cmd.retval;
+    pthread_mutex_unlock (&workers_mutex);
+    return NULL;
+}
 
-            pthread_mutex_unlock (&wrk->mutex);
+/**
+ * Execute a prepared command on a worker acquired with worker_acquire().
+ *
+ * Blocks until the worker thread processes the command, then unlocks
+ * the worker and the list of workers.
+ *
+ * @param[in] wrk  A pointer to a locked worker.
+ * @param[in] slot An index of the worker in the list of workers.
+ * @return The command's return value.
+ **/
+static int
+worker_exec (worker *wrk, int slot)
+{
+    assert (wrk != NULL);
 
-            /* TODO: ???? */
-            if (wrk->closed) {
-                worker_free (wrk);
-                workers[i] = NULL;
-            }
+    safe_write (wrk->io[INOTIFY_FD], "*", 1);
 
-            pthread_mutex_unlock (&workers_mutex);
-            return retval;
-        }
+    worker_cmd_wait (&wrk->cmd);
+    int retval = wrk->cmd.retval;
+
+    pthread_mutex_unlock (&wrk->mutex);
+
+    /* TODO: ???? */
+    if (wrk->closed) {
+        worker_free (wrk);
+        workers[slot] = NULL;
     }
 
     pthread_mutex_unlock (&workers_mutex);
-    return -1;
+    return retval;
+}
+
+/**
+ * Add or modify a watch.
+ *
+ * If the watch with a such filename is already exist, its mask will
+ * be updated. A new watch will be created otherwise.
+ *
+ * @param[in] fd   A file descriptor of an inotify instance.
+ * @param[in] name A path to a file to watch.
+ * @param[in] mask A combination of inotify flags. 
+ * @return id of a watch, -1 on failure.
+ **/
+INO_EXPORT int
+inotify_add_watch (int         fd,
+                   const char *name,
+                   uint32_t    mask)
+{
+    int slot, found;
+    worker *wrk = worker_acquire (fd, &slot, &found);
+    if (wrk == NULL) {
+        return -1;
+    }
+
+    worker_cmd_add (&wrk->cmd, name, mask);
+    return worker_exec (wrk, slot);
+}
+
+/**
+ * Add or modify a watch, skipping some entries of a directory.
+ *
+ * The skipped entries are not opened and produce no events. For an
+ * existing watch, the filter is replaced.
+ *
+ * @param[in] fd      A file descriptor of an inotify instance.
+ * @param[in] name    A path to a file to watch.
+ * @param[in] mask    A combination of inotify flags.
+ * @param[in] exclude A NULL-terminated list of patterns of the entries
+ *     to skip. May be NULL.
+ * @param[in] include A NULL-terminated list of patterns of the only
+ *     files to watch. May be NULL.
+ * @return id of a watch, -1 on failure.
+ **/
+INO_EXPORT int
+libinotify_add_watch_filtered (int                fd,
+                               const char        *name,
+                               uint32_t           mask,
+                               const char *const *exclude,
+                               const char *const *include)
+{
+    filter *f = filter_create (exclude, include);
+    if (f == NULL) {
+        return -1;
+    }
+
+    int slot, found;
+    worker *wrk = worker_acquire (fd, &slot, &found);
+    if (wrk == NULL) {
+        filter_free (f);
+        return -1;
+    }
+
+    worker_cmd_add_filtered (&wrk->cmd, name, mask, f);
+    return worker_exec (wrk, slot);
 }
 
 /**
@@ -164,51 +246,105 @@ inotify_add_watch (int         fd,
  **/
 INO_EXPORT int
 inotify_rm_watch (int fd,
-                  int wd) __THROW
+                  int wd)
 {
     assert (fd != -1);
     assert (wd != -1);
-    
-    pthread_mutex_lock (&workers_mutex);
 
-    int i;
-    for (i = 0; i < WORKER_SZ; i++) {
-        worker *wrk = workers[i];
-        if (wrk != NULL
-            && wrk->io[INOTIFY_FD] == fd
-            && wrk->closed == 0
-            && is_opened (wrk->io[INOTIFY_FD])) {
-            pthread_mutex_lock (&wrk->mutex);
+    int slot, found;
+    worker *wrk = worker_acquire (fd, &slot, &found);
+    if (wrk == NULL) {
+        return found ? -1 : 0;
+    }
 
-            if (wrk->closed) {
-                pthread_mutex_unlock (&wrk->mutex);
-                worker_free (wrk);
-                workers[i] = NULL;
-                pthread_mutex_unlock (&workers_mutex);
-                return -1;
-            }
+    worker_cmd_remove (&wrk->cmd, wd);
+    return worker_exec (wrk, slot);
+}
 
-            worker_cmd_remove (&wrk->cmd, wd);
-            safe_write (wrk->io[INOTIFY_FD], "*", 1);
+/**
+ * Set a parameter of an inotify instance.
+ *
+ * @param[in] fd    Inotify instance file descriptor, or -1 to change
+ *     the default for the instances created afterwards.
+ * @param[in] param A parameter id (IN_DEBOUNCE_MSEC, etc).
+ * @param[in] value A new value of the parameter.
+ * @return 0 on success, -1 on failure.
+ **/
+INO_EXPORT int
+libinotify_set_param (int      fd,
+                      int      param,
+                      intptr_t value)
+{
+    if (fd == -1) {
+        pthread_mutex_lock (&workers_mutex);
+        int retval = worker_params_set (&worker_default_params, param, value);
+        pthread_mutex_unlock (&workers_mutex);
+        return retval;
+    }
 
-            worker_cmd_wait (&wrk->cmd);
-            int retval = wrk->cmd.retval;
+    if (param == IN_THREAD_STACK) {
+        /* The threads of the instance are already running */
+        errno = EBUSY;
+        return -1;
+    }
 
-            pthread_mutex_unlock (&wrk->mutex);
+    int slot, found;
+    worker *wrk = worker_acquire (fd, &slot, &found);
+    if (wrk == NULL) {
+        return -1;
+    }
 
-            /* TODO: ???? */
-            if (wrk->closed) {
-                worker_free (wrk);
-                workers[i] = NULL;
-            }
+    worker_cmd_param (&wrk->cmd, param, value);
+    return worker_exec (wrk, slot);
+}
 
-            pthread_mutex_unlock (&workers_mutex);
-            return retval;
-        }
+/**
+ * Read the counters of an inotify instance.
+ *
+ * @param[in]  fd    Inotify instance file descriptor.
+ * @param[out] stats A pointer to the counters to fill.
+ * @return 0 on success, -1 on failure.
+ **/
+INO_EXPORT int
+libinotify_get_stats (int                   fd,
+                      struct inotify_stats *stats)
+{
+    assert (stats != NULL);
+
+    int slot, found;
+    worker *wrk = worker_acquire (fd, &slot, &found);
+    if (wrk == NULL) {
+        return -1;
     }
 
-    pthread_mutex_unlock (&workers_mutex);
-    return 0;
+    worker_cmd_stats (&wrk->cmd, stats);
+    return worker_exec (wrk, slot);
+}
+
+/**
+ * Copy the cached listing of a watched directory.
+ *
+ * @param[in]  fd      Inotify instance file descriptor.
+ * @param[in]  wd      Watch id of a directory.
+ * @param[out] entries A pointer to store the entries to. Should be freed
+ *     with free().
+ * @return The number of entries on success, -1 on failure.
+ **/
+INO_EXPORT int
+libinotify_get_snapshot (int                     fd,
+                         int                     wd,
+                         struct inotify_dirent **entries)
+{
+    assert (entries != NULL);
+
+    int slot, found;
+    worker *wrk = worker_acquire (fd, &slot, &found);
+    if (wrk == NULL) {
+        return -1;
+    }
+
+    worker_cmd_snapshot (&wrk->cmd, wd, entries);
+    return worker_exec (wrk, slot);
 }
 
 /**
@@ -21,9 +21,8 @@
 *******************************************************************************/
 
 #include <sys/types.h>
-#include <sys/event.h>
-
 #include "sys/inotify.h"
+#include "backend.h"
 #include "conversions.h"
 
 /**
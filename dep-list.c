@@ -20,10 +20,12 @@
   THE SOFTWARE.
 *******************************************************************************/
 
+#include <stddef.h>  /* offsetof */
 #include <stdlib.h>  /* calloc */
 #include <stdio.h>   /* printf */
 #include <dirent.h>  /* opendir, readdir, closedir */
 #include <string.h>  /* strcmp */
+#include <stdint.h>  /* SIZE_MAX */
 #include <assert.h>
 
 #include "utils.h"
@@ -44,12 +46,96 @@ dl_print (const dep_list *dl)
     printf ("\n");
 }
 
+/**
+ * A file name shared by the listing of a directory and the watches on
+ * its entries. The users keep a pointer to the string.
+ *
+ * The names normally stay on the worker owning the listing, as the
+ * events and the snapshots copy them. Still the references are counted
+ * with atomic operations, so dropping them on the other threads (the
+ * shards, the hub of the shared watches) is safe.
+ **/
+typedef struct dl_name {
+    unsigned int refs;      /* changed with the __atomic builtins only */
+    char str[];
+} dl_name;
+
+/**
+ * Create a shared file name.
+ *
+ * @param[in] name A file name, not necessarily terminated.
+ * @param[in] len  The length of the name.
+ * @return A pointer to the name with a single reference or NULL on failure.
+ **/
+char*
+dl_name_new (const char *name, size_t len)
+{
+    dl_name *n = malloc (offsetof (dl_name, str) + len + 1);
+    if (n == NULL) {
+        return NULL;
+    }
+
+    n->refs = 1;
+    memcpy (n->str, name, len);
+    n->str[len] = '\0';
+    return n->str;
+}
+
+/**
+ * Take one more reference to a shared file name.
+ *
+ * @param[in] name A name created with dl_name_new().
+ * @return The same name.
+ **/
+char*
+dl_name_ref (const char *name)
+{
+    assert (name != NULL);
+
+    dl_name *n = (dl_name *) (name - offsetof (dl_name, str));
+    __atomic_add_fetch (&n->refs, 1, __ATOMIC_RELAXED);
+    return n->str;
+}
+
+/**
+ * Drop a reference to a shared file name, freeing it with the last one.
+ *
+ * @param[in] name A name created with dl_name_new(). May be NULL.
+ **/
+void
+dl_name_unref (char *name)
+{
+    if (name != NULL) {
+        dl_name *n = (dl_name *) (name - offsetof (dl_name, str));
+        if (__atomic_sub_fetch (&n->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+            free (n);
+        }
+    }
+}
+
+/**
+ * Calculate a hash of a file name (djb2).
+ *
+ * @param[in] name A file name.
+ * @return The hash value.
+ **/
+static size_t
+dl_name_hash (const char *name)
+{
+    size_t hash = 5381;
+    while (*name != '\0') {
+        hash = hash * 33 + (unsigned char) *name++;
+    }
+    return hash;
+}
+
 /**
  * Create a new list item.
  *
  * Create a new list item and initialize its fields.
  *
- * @param[in] path  A name of a file (the string is not copied!).
+ * @param[in] path  A name of a file created with dl_name_new() (the
+ *     reference is taken over).
  * @param[in] inode A file's inode number.
  * @return A pointer to a new item or NULL in the case of error.
  **/
@@ -95,6 +181,7 @@ dl_shallow_copy (const dep_list *dl)
     while (it != NULL) {
         cp->path = it->path;
         cp->inode = it->inode;
+        cp->type = it->type;
         if (it->next) {
             cp->next = calloc (1, sizeof (dep_list));
             if (cp->next == NULL) {
@@ -143,11 +230,124 @@ dl_free (dep_list *dl)
         dep_list *ptr = dl;
         dl = dl->next;
 
-        free (ptr->path);
+        dl_name_unref (ptr->path);
         free (ptr);
     }
 }
 
+/**
+ * Start a directory listing to be read in slices.
+ *
+ * A directory which can not be opened produces an empty listing, as
+ * dl_listing() does.
+ *
+ * @param[in] path A path to a directory.
+ * @return A pointer to a listing or NULL on failure.
+ **/
+dep_listing*
+dl_listing_start (const char *path)
+{
+    assert (path != NULL);
+
+    dep_listing *ls = calloc (1, sizeof (dep_listing));
+    if (ls == NULL) {
+        perror_msg ("Failed to allocate a listing");
+        return NULL;
+    }
+
+    ls->dir = opendir (path);
+    return ls;
+}
+
+/**
+ * Read the next entries of a directory listing.
+ *
+ * @param[in] ls    A pointer to a listing.
+ * @param[in] count The maximum number of entries to read.
+ * @return 1 if the listing is complete, 0 if there are entries left,
+ *     -1 on failure.
+ **/
+int
+dl_listing_next (dep_listing *ls, size_t count)
+{
+    assert (ls != NULL);
+
+    if (ls->dir == NULL) {
+        return 1;
+    }
+
+    size_t i;
+    for (i = 0; i < count; i++) {
+        struct dirent *ent = readdir (ls->dir);
+        if (ent == NULL) {
+            closedir (ls->dir);
+            ls->dir = NULL;
+            return 1;
+        }
+
+        if (!strcmp (ent->d_name, ".") || !strcmp (ent->d_name, "..")) {
+            continue;
+        }
+
+        dep_list *iter = calloc (1, sizeof (dep_list));
+        if (iter == NULL) {
+            perror_msg ("Failed to allocate a new element during listing");
+            return -1;
+        }
+
+        iter->path = dl_name_new (ent->d_name, strlen (ent->d_name));
+        if (iter->path == NULL) {
+            perror_msg ("Failed to copy a string during listing");
+            free (iter);
+            return -1;
+        }
+
+        iter->inode = ent->d_ino;
+        iter->type = ent->d_type;
+        if (ls->tail != NULL) {
+            ls->tail->next = iter;
+        } else {
+            ls->head = iter;
+        }
+        ls->tail = iter;
+    }
+    return 0;
+}
+
+/**
+ * Complete a directory listing and return it as a list.
+ *
+ * The entries left unread are not listed.
+ *
+ * @param[in] ls A pointer to a listing. Freed by this function.
+ * @return A pointer to a list. May be NULL.
+ **/
+dep_list*
+dl_listing_finish (dep_listing *ls)
+{
+    assert (ls != NULL);
+
+    dep_list *head = ls->head;
+    if (ls->dir != NULL) {
+        closedir (ls->dir);
+    }
+    free (ls);
+    return head;
+}
+
+/**
+ * Abandon a directory listing.
+ *
+ * @param[in] ls A pointer to a listing. May be NULL.
+ **/
+void
+dl_listing_free (dep_listing *ls)
+{
+    if (ls != NULL) {
+        dl_free (dl_listing_finish (ls));
+    }
+}
+
 /**
  * Create a directory listing and return it as a list.
  *
@@ -160,63 +360,77 @@ dl_listing (const char *path, int *failed)
 {
     assert (path != NULL);
 
-    dep_list *head = NULL;
-    dep_list *prev = NULL;
-    DIR *dir = opendir (path);
-
     if (failed) {
         *failed = 0;
     }
 
-    if (dir != NULL) {
-        struct dirent *ent;
+    dep_listing *ls = dl_listing_start (path);
+    if (ls == NULL || dl_listing_next (ls, SIZE_MAX) == -1) {
+        if (failed) {
+            *failed = 1;
+        }
+        dl_listing_free (ls);
+        return NULL;
+    }
+    return dl_listing_finish (ls);
+}
 
-        while ((ent = readdir (dir)) != NULL) {
-            if (!strcmp (ent->d_name, ".") || !strcmp (ent->d_name, "..")) {
-                continue;
-            }
+/**
+ * Make the entries of a new listing refer to the names of the same
+ * entries of the previous one.
+ *
+ * The watches on the entries refer to these names too, so every name is
+ * kept once, however many times the directory is listed. The names are
+ * looked up with a hash table built for the call: it costs as much as
+ * the listing itself, and nothing is kept between the rescans.
+ *
+ * @param[in]     before The previous listing.
+ * @param[in,out] after  The new listing.
+ **/
+void
+dl_share_names (const dep_list *before, dep_list *after)
+{
+    size_t count = 0, size = 16, i;
+    const dep_list *iter;
 
-            if (head == NULL) {
-                head = calloc (1, sizeof (dep_list));
-                if (head == NULL) {
-                    perror_msg ("Failed to allocate head during listing");
-                    goto error;
-                }
-            }
+    for (iter = before; iter != NULL; iter = iter->next) {
+        ++count;
+    }
+    if (count == 0 || after == NULL) {
+        return;
+    }
+    while (size < count * 2) {
+        size *= 2;
+    }
 
-            dep_list *iter = (prev == NULL) ? head : calloc (1, sizeof (dep_list));
-            if (iter == NULL) {
-                perror_msg ("Failed to allocate a new element during listing");
-                goto error;
-            }
+    const dep_list **table = calloc (size, sizeof (dep_list *));
+    if (table == NULL) {
+        perror_msg ("Failed to allocate a table of names");
+        return;
+    }
 
-            iter->path = strdup (ent->d_name);
-            if (iter->path == NULL) {
-                perror_msg ("Failed to copy a string during listing");
-                goto error;
-            }
+    for (iter = before; iter != NULL; iter = iter->next) {
+        for (i = dl_name_hash (iter->path) & (size - 1);
+             table[i] != NULL;
+             i = (i + 1) & (size - 1)) {
+        }
+        table[i] = iter;
+    }
 
-            iter->inode = ent->d_ino;
-            iter->next = NULL;
-            if (prev) {
-                prev->next = iter;
+    for (; after != NULL; after = after->next) {
+        for (i = dl_name_hash (after->path) & (size - 1);
+             table[i] != NULL;
+             i = (i + 1) & (size - 1)) {
+            if (strcmp (table[i]->path, after->path) == 0) {
+                char *name = dl_name_ref (table[i]->path);
+                dl_name_unref (after->path);
+                after->path = name;
+                break;
             }
-            prev = iter;
         }
-
-        closedir (dir);
     }
-    return head;
 
-error:
-    if (failed) {
-        *failed = 1;
-    }
-    if (dir != NULL) {
-        closedir (dir);
-    }
-    dl_free (head);
-    return NULL;
+    free (table);
 }
 
 /**
@@ -249,7 +463,8 @@ dl_diff (dep_list **before, dep_list **after)
 
         int matched = 0;
         while (after_iter != NULL) {
-            if (strcmp (before_iter->path, after_iter->path) == 0) {
+            if (before_iter->path == after_iter->path
+                || strcmp (before_iter->path, after_iter->path) == 0) {
                 matched = 1;
                 /* removing the entry from the both lists */
                 if (before_prev) {
@@ -319,6 +534,7 @@ dl_diff (dep_list **before, dep_list **after)
                 free (added_list##_iter);                               \
                 break;                                                  \
             }                                                           \
+            added_list##_prev = added_list##_iter;                      \
             added_list##_iter = added_list##_iter->next;                \
         }                                                               \
         dep_list *oldptr = removed_list##_iter;                         \
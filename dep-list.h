@@ -24,14 +24,22 @@
 #define __DEP_LIST_H__
 
 #include <sys/types.h> /* ino_t */
+#include <dirent.h>    /* DIR */
 
 typedef struct dep_list {
     struct dep_list *next;
 
-    char *path;
+    char *path;          /* shared with the watch, see dl_name_new() */
     ino_t inode;
+    unsigned char type;  /* DT_* type of the entry, may be DT_UNKNOWN */
 } dep_list;
 
+typedef struct dep_listing {
+    DIR *dir;         /* NULL once the directory is read through */
+    dep_list *head;
+    dep_list *tail;
+} dep_listing;
+
 typedef void (* no_entry_cb)     (void *udata);
 typedef void (* single_entry_cb) (void *udata, const char *path, ino_t inode);
 typedef void (* dual_entry_cb)   (void *udata,
@@ -51,6 +59,10 @@ typedef struct traverse_cbs {
     no_entry_cb      names_updated;
 } traverse_cbs;
 
+char*     dl_name_new     (const char *name, size_t len);
+char*     dl_name_ref     (const char *name);
+void      dl_name_unref   (char *name);
+
 dep_list* dl_create       (char *path, ino_t inode);
 void      dl_print        (const dep_list *dl);
 dep_list* dl_shallow_copy (const dep_list *dl);
@@ -58,6 +70,12 @@ void      dl_shallow_free (dep_list *dl);
 void      dl_free         (dep_list *dl);
 dep_list* dl_listing      (const char *path, int *failed);
 void      dl_diff         (dep_list **before, dep_list **after);
+void      dl_share_names  (const dep_list *before, dep_list *after);
+
+dep_listing* dl_listing_start  (const char *path);
+int          dl_listing_next   (dep_listing *ls, size_t count);
+dep_list*    dl_listing_finish (dep_listing *ls);
+void         dl_listing_free   (dep_listing *ls);
 
 void
 dl_calculate (dep_list            *before,
@@ -0,0 +1,414 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <stdlib.h> /* realloc, free */
+#include <string.h> /* memset, memcpy, strlen */
+#include <errno.h>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <sys/socket.h> /* send */
+
+#include "sys/inotify.h"
+
+#include "utils.h"
+#include "event-queue.h"
+
+#define EQ_RESERVED 4096         /* initial size of the buffer, bytes */
+#define EQ_SHRINK_SIZE (1 << 20) /* buffers larger are freed after flush */
+
+/* The names are padded so every event in the buffer stays aligned */
+#define EQ_ALIGN sizeof (int)
+
+/* Do not get killed by SIGPIPE if the user has closed the descriptor */
+#ifdef MSG_NOSIGNAL
+#define EQ_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define EQ_SEND_FLAGS 0
+#endif
+
+/**
+ * Initialize an event queue.
+ *
+ * @param[in] eq A pointer to #event_queue.
+ **/
+void
+event_queue_init (event_queue *eq)
+{
+    assert (eq != NULL);
+    memset (eq, 0, sizeof (event_queue));
+}
+
+/**
+ * Free the memory allocated for an event queue.
+ *
+ * @param[in] eq A pointer to #event_queue.
+ **/
+void
+event_queue_free (event_queue *eq)
+{
+    assert (eq != NULL);
+    free (eq->mem);
+    memset (eq, 0, sizeof (event_queue));
+}
+
+/**
+ * Make room for the specified number of bytes in the queue.
+ *
+ * The buffer grows geometrically, so a long sequence of events costs
+ * only a logarithmic number of reallocations.
+ *
+ * @param[in] eq   A pointer to #event_queue.
+ * @param[in] size The number of bytes to make room for.
+ * @return 0 on success, -1 on failure.
+ **/
+static int
+event_queue_reserve (event_queue *eq, size_t size)
+{
+    assert (eq != NULL);
+
+    if (eq->used + size <= eq->allocated) {
+        return 0;
+    }
+
+    /* Reclaim the space of the already delivered events first */
+    if (eq->head > 0) {
+        memmove (eq->mem, eq->mem + eq->head, eq->used - eq->head);
+        eq->used -= eq->head;
+        eq->last -= eq->head;
+        eq->head = 0;
+
+        if (eq->used + size <= eq->allocated) {
+            return 0;
+        }
+    }
+
+    size_t to_allocate = eq->allocated ? eq->allocated : EQ_RESERVED;
+    while (to_allocate < eq->used + size) {
+        to_allocate *= 2;
+    }
+
+    void *ptr = realloc (eq->mem, to_allocate);
+    if (ptr == NULL) {
+        perror_msg ("Failed to extend events to %d bytes", to_allocate);
+        return -1;
+    }
+
+    eq->mem = ptr;
+    eq->allocated = to_allocate;
+    return 0;
+}
+
+/**
+ * Encode an inotify event at the end of the queue.
+ *
+ * @param[in] eq     A pointer to #event_queue.
+ * @param[in] wd     An associated watch's id.
+ * @param[in] mask   An inotify watch mask.
+ * @param[in] cookie Event cookie.
+ * @param[in] name   File name (may be NULL).
+ * @param[in] info   File metadata to attach (may be NULL). If specified,
+ *     IN_STATINFO should be set in the mask.
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+event_queue_enqueue (event_queue                   *eq,
+                     int                            wd,
+                     uint32_t                       mask,
+                     uint32_t                       cookie,
+                     const char                    *name,
+                     const struct inotify_statinfo *info)
+{
+    assert (eq != NULL);
+    assert (info == NULL || (mask & IN_STATINFO));
+
+    /* The metadata goes after the name, so there is always a name, at
+     * least an empty one, for the consumers unaware of IN_STATINFO */
+    size_t name_len = name ? strlen (name) + 1 : (info ? 1 : 0);
+    size_t padded_len = (name_len + EQ_ALIGN - 1) & ~(EQ_ALIGN - 1);
+    size_t info_len = info ? sizeof (struct inotify_statinfo) : 0;
+    size_t event_len = sizeof (struct inotify_event) + padded_len + info_len;
+
+    if (event_queue_reserve (eq, event_len) == -1) {
+        return -1;
+    }
+
+    struct inotify_event *event
+        = (struct inotify_event *) (eq->mem + eq->used);
+
+    event->wd = wd;
+    event->mask = mask;
+    event->cookie = cookie;
+    event->len = padded_len + info_len;
+
+    if (name) {
+        memcpy (event->name, name, name_len);
+        memset (event->name + name_len, 0, padded_len - name_len);
+    } else {
+        memset (event->name, 0, padded_len);
+    }
+    if (info) {
+        memcpy (event->name + padded_len, info, info_len);
+    }
+
+    eq->last = eq->used;
+    eq->used += event_len;
+    ++eq->count;
+    return 0;
+}
+
+/**
+ * Check if the last queued event is the same as the specified one.
+ *
+ * Used to merge identical consecutive events, like Linux does.
+ *
+ * @param[in] eq     A pointer to #event_queue.
+ * @param[in] wd     An associated watch's id.
+ * @param[in] mask   An inotify watch mask.
+ * @param[in] cookie Event cookie.
+ * @param[in] name   File name (may be NULL).
+ * @return 1 if the events are identical, 0 otherwise.
+ **/
+int
+event_queue_is_last (const event_queue *eq,
+                     int                wd,
+                     uint32_t           mask,
+                     uint32_t           cookie,
+                     const char        *name)
+{
+    assert (eq != NULL);
+
+    /* A partially sent event can not be changed anymore */
+    if (eq->count == 0 || eq->last < eq->head
+        || (eq->last == eq->head && eq->sent > 0)) {
+        return 0;
+    }
+
+    const struct inotify_event *event
+        = (const struct inotify_event *) (eq->mem + eq->last);
+
+    if (event->wd != wd || event->mask != mask || event->cookie != cookie) {
+        return 0;
+    }
+
+    /* An empty name only precedes the attached metadata */
+    const char *last_name
+        = (event->len == 0 || event->name[0] == '\0') ? NULL : event->name;
+
+    if (name == NULL || last_name == NULL) {
+        return name == NULL && last_name == NULL;
+    }
+    return strcmp (last_name, name) == 0;
+}
+
+/**
+ * Replace the metadata attached to the last queued event.
+ *
+ * Used to keep the metadata of merged events up to date.
+ *
+ * @param[in] eq   A pointer to #event_queue.
+ * @param[in] info New file metadata.
+ **/
+void
+event_queue_update_last (event_queue *eq, const struct inotify_statinfo *info)
+{
+    assert (eq != NULL);
+    assert (info != NULL);
+    assert (eq->count > 0);
+
+    struct inotify_event *event = (struct inotify_event *) (eq->mem + eq->last);
+    if (event->mask & IN_STATINFO) {
+        memcpy (event->name + event->len - sizeof (struct inotify_statinfo),
+                info,
+                sizeof (struct inotify_statinfo));
+    }
+}
+
+/**
+ * Empty the queue.
+ *
+ * @param[in] eq A pointer to #event_queue.
+ **/
+static void
+event_queue_reset (event_queue *eq)
+{
+    eq->used = 0;
+    eq->count = 0;
+    eq->last = 0;
+    eq->head = 0;
+    eq->sent = 0;
+
+    /* Do not hold on to the memory of an occasional huge batch */
+    if (eq->allocated > EQ_SHRINK_SIZE) {
+        event_queue_free (eq);
+    }
+}
+
+/**
+ * Get the events not delivered yet.
+ *
+ * @param[in]  eq   A pointer to #event_queue.
+ * @param[out] size The size of the events, in bytes.
+ * @return A pointer to the first event not delivered yet. Valid until
+ *     the queue is modified.
+ **/
+const char*
+event_queue_peek (const event_queue *eq, size_t *size)
+{
+    assert (eq != NULL);
+    assert (size != NULL);
+
+    *size = eq->used - eq->head - eq->sent;
+    return eq->mem + eq->head + eq->sent;
+}
+
+/**
+ * Drop the delivered part of the queue.
+ *
+ * @param[in] eq   A pointer to #event_queue.
+ * @param[in] size The number of bytes just delivered.
+ **/
+static void
+event_queue_consume (event_queue *eq, size_t size)
+{
+    size_t pos = eq->head + eq->sent + size;
+    assert (pos <= eq->used);
+
+    while (eq->head < eq->used) {
+        const struct inotify_event *event
+            = (const struct inotify_event *) (eq->mem + eq->head);
+        size_t event_len = sizeof (struct inotify_event) + event->len;
+
+        if (eq->head + event_len > pos) {
+            break;
+        }
+        eq->head += event_len;
+        --eq->count;
+    }
+    eq->sent = pos - eq->head;
+}
+
+/**
+ * Write the queued events to a non-blocking socket.
+ *
+ * The events are sent as a single buffer, so the number of events in a
+ * batch is not limited by IOV_MAX. If the socket is full, the rest of
+ * the events stay in the queue until the next flush.
+ *
+ * @param[in] eq A pointer to #event_queue.
+ * @param[in] fd A socket to write to.
+ * @return 0 if all the events are sent, 1 if some are left in the queue,
+ *     -1 on failure. The queue is emptied on failure.
+ **/
+int
+event_queue_flush (event_queue *eq, int fd)
+{
+    assert (eq != NULL);
+
+    while (eq->head + eq->sent < eq->used) {
+        ssize_t len = send (fd,
+                            eq->mem + eq->head + eq->sent,
+                            eq->used - eq->head - eq->sent,
+                            EQ_SEND_FLAGS);
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            /* Nobody to deliver the events to */
+            event_queue_reset (eq);
+            return -1;
+        }
+        event_queue_consume (eq, len);
+    }
+
+    event_queue_reset (eq);
+    return 0;
+}
+
+/**
+ * Move the queued events to the end of another queue.
+ *
+ * If the target queue is empty, the buffers are just swapped.
+ *
+ * @param[in] to   A pointer to the #event_queue to append to.
+ * @param[in] from A pointer to the #event_queue to move from. Must have
+ *     no partially sent events. Empty on success.
+ * @return 0 on success, -1 on failure.
+ **/
+int
+event_queue_move (event_queue *to, event_queue *from)
+{
+    assert (to != NULL);
+    assert (from != NULL);
+    assert (from->sent == 0);
+
+    size_t size = from->used - from->head;
+    if (size == 0) {
+        return 0;
+    }
+
+    if (to->count == 0 && to->head == to->used) {
+        event_queue swapped = *to;
+        *to = *from;
+        *from = swapped;
+        event_queue_reset (from);
+        return 0;
+    }
+
+    if (event_queue_reserve (to, size) == -1) {
+        return -1;
+    }
+    memcpy (to->mem + to->used, from->mem + from->head, size);
+    to->last = to->used + (from->last - from->head);
+    to->used += size;
+    to->count += from->count;
+
+    event_queue_reset (from);
+    return 0;
+}
+
+/**
+ * Copy the file metadata attached to an event.
+ *
+ * @param[in]  event An inotify event.
+ * @param[out] info  A pointer to the metadata to fill.
+ * @return 0 on success, -1 if the event carries no metadata.
+ **/
+int
+libinotify_get_statinfo (const struct inotify_event *event,
+                         struct inotify_statinfo    *info)
+{
+    if (event == NULL || info == NULL || !(event->mask & IN_STATINFO)
+        || event->len < sizeof (struct inotify_statinfo)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The metadata may be unaligned in the buffer of the user */
+    memcpy (info,
+            event->name + event->len - sizeof (struct inotify_statinfo),
+            sizeof (struct inotify_statinfo));
+    return 0;
+}
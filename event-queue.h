@@ -0,0 +1,71 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __EVENT_QUEUE_H__
+#define __EVENT_QUEUE_H__
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint32_t */
+
+struct inotify_statinfo;
+
+/**
+ * A queue of inotify events waiting to be sent to the user.
+ *
+ * The events are encoded one after another into a single buffer, in
+ * the same format as read(2) on an inotify descriptor returns them.
+ * The buffer is reused between the flushes and only grows, so no
+ * allocations are made once it is large enough for a usual batch.
+ * The events the socket could not take yet stay at the head of the
+ * buffer.
+ **/
+typedef struct event_queue {
+    char *mem;          /* the encoded events */
+    size_t used;        /* number of bytes used */
+    size_t allocated;   /* number of bytes allocated */
+    size_t count;       /* number of events not delivered yet */
+    size_t last;        /* offset of the last event in the queue */
+    size_t head;        /* offset of the first event not delivered yet */
+    size_t sent;        /* number of bytes of that event already sent */
+} event_queue;
+
+void event_queue_init    (event_queue *eq);
+void event_queue_free    (event_queue *eq);
+int  event_queue_enqueue (event_queue                   *eq,
+                          int                            wd,
+                          uint32_t                       mask,
+                          uint32_t                       cookie,
+                          const char                    *name,
+                          const struct inotify_statinfo *info);
+int  event_queue_is_last (const event_queue *eq,
+                          int                wd,
+                          uint32_t           mask,
+                          uint32_t           cookie,
+                          const char        *name);
+void event_queue_update_last (event_queue                   *eq,
+                              const struct inotify_statinfo *info);
+int  event_queue_flush   (event_queue *eq, int fd);
+int  event_queue_move    (event_queue *to, event_queue *from);
+
+const char* event_queue_peek    (const event_queue *eq, size_t *size);
+
+#endif /* __EVENT_QUEUE_H__ */
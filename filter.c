@@ -0,0 +1,416 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <stdlib.h>   /* calloc, realloc, free, qsort, bsearch */
+#include <string.h>   /* strcmp, strchr, strlen, memcpy, memset */
+#include <limits.h>   /* NAME_MAX */
+#include <fnmatch.h>
+#include <dirent.h>   /* DT_DIR, DT_UNKNOWN */
+#include <errno.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "filter.h"
+
+#define FILTER_WILDCARDS "*?[\\"
+
+/**
+ * Compare two strings for qsort(3) and bsearch(3).
+ **/
+static int
+compare_strings (const void *a, const void *b)
+{
+    return strcmp (*(char * const *) a, *(char * const *) b);
+}
+
+/**
+ * Add a string to a bucket.
+ *
+ * @param[in] b   A pointer to #pattern_bucket.
+ * @param[in] str A string to add.
+ * @param[in] len The number of characters of the string to add.
+ * @return 0 on success, -1 on failure.
+ **/
+static int
+bucket_add (pattern_bucket *b, const char *str, size_t len)
+{
+    char **items = realloc (b->items, sizeof (char *) * (b->count + 1));
+    if (items == NULL) {
+        perror_msg ("Failed to extend a bucket of patterns");
+        return -1;
+    }
+    b->items = items;
+
+    char *item = malloc (len + 1);
+    if (item == NULL) {
+        perror_msg ("Failed to copy a pattern");
+        return -1;
+    }
+    memcpy (item, str, len);
+    item[len] = '\0';
+
+    b->items[b->count++] = item;
+    return 0;
+}
+
+/**
+ * Find a bucket for the strings of a length, add one if needed.
+ *
+ * @param[in,out] buckets A pointer to the array of buckets.
+ * @param[in,out] count   A pointer to the number of buckets.
+ * @param[in]     len     The length of the strings.
+ * @return A pointer to the bucket, NULL on failure.
+ **/
+static pattern_bucket*
+bucket_for_length (pattern_bucket **buckets, size_t *count, size_t len)
+{
+    size_t i;
+    for (i = 0; i < *count; i++) {
+        if ((*buckets)[i].len == len) {
+            return &(*buckets)[i];
+        }
+    }
+
+    pattern_bucket *ptr = realloc (*buckets, sizeof (pattern_bucket) * (*count + 1));
+    if (ptr == NULL) {
+        perror_msg ("Failed to extend a set of patterns");
+        return NULL;
+    }
+    *buckets = ptr;
+
+    pattern_bucket *b = &ptr[(*count)++];
+    memset (b, 0, sizeof (pattern_bucket));
+    b->len = len;
+    return b;
+}
+
+/**
+ * Free the strings of a bucket.
+ **/
+static void
+bucket_free (pattern_bucket *b)
+{
+    size_t i;
+    for (i = 0; i < b->count; i++) {
+        free (b->items[i]);
+    }
+    free (b->items);
+}
+
+/**
+ * Look a string up in a bucket.
+ **/
+static int
+bucket_has (const pattern_bucket *b, const char *str)
+{
+    return b->count > 0
+        && bsearch (&str, b->items, b->count, sizeof (char *), compare_strings);
+}
+
+/**
+ * Add a pattern to a set.
+ *
+ * @param[in] ps      A pointer to #pattern_set.
+ * @param[in] pattern A fnmatch(3) pattern.
+ * @param[in] len     The length of the pattern.
+ * @return 0 on success, -1 on failure.
+ **/
+static int
+pattern_set_add (pattern_set *ps, const char *pattern, size_t len)
+{
+    size_t wildcards = 0, i;
+    for (i = 0; i < len; i++) {
+        if (strchr (FILTER_WILDCARDS, pattern[i]) != NULL) {
+            ++wildcards;
+        }
+    }
+
+    if (wildcards == 0) {
+        return bucket_add (&ps->exact, pattern, len);
+    }
+
+    if (wildcards == 1 && pattern[0] == '*') {
+        pattern_bucket *b = bucket_for_length (&ps->suffixes,
+                                               &ps->suffix_buckets,
+                                               len - 1);
+        return b ? bucket_add (b, pattern + 1, len - 1) : -1;
+    }
+
+    if (wildcards == 1 && pattern[len - 1] == '*') {
+        pattern_bucket *b = bucket_for_length (&ps->prefixes,
+                                               &ps->prefix_buckets,
+                                               len - 1);
+        return b ? bucket_add (b, pattern, len - 1) : -1;
+    }
+
+    char **globs = realloc (ps->globs, sizeof (char *) * (ps->glob_count + 1));
+    if (globs == NULL) {
+        perror_msg ("Failed to extend a set of patterns");
+        return -1;
+    }
+    ps->globs = globs;
+
+    ps->globs[ps->glob_count] = malloc (len + 1);
+    if (ps->globs[ps->glob_count] == NULL) {
+        perror_msg ("Failed to copy a pattern");
+        return -1;
+    }
+    memcpy (ps->globs[ps->glob_count], pattern, len);
+    ps->globs[ps->glob_count][len] = '\0';
+    ++ps->glob_count;
+    return 0;
+}
+
+/**
+ * Sort the buckets of a set once all the patterns are added.
+ **/
+static void
+pattern_set_sort (pattern_set *ps)
+{
+    size_t i;
+
+    qsort (ps->exact.items, ps->exact.count, sizeof (char *), compare_strings);
+    for (i = 0; i < ps->prefix_buckets; i++) {
+        qsort (ps->prefixes[i].items,
+               ps->prefixes[i].count,
+               sizeof (char *),
+               compare_strings);
+    }
+    for (i = 0; i < ps->suffix_buckets; i++) {
+        qsort (ps->suffixes[i].items,
+               ps->suffixes[i].count,
+               sizeof (char *),
+               compare_strings);
+    }
+}
+
+/**
+ * Free the memory allocated for a set.
+ **/
+static void
+pattern_set_free (pattern_set *ps)
+{
+    size_t i;
+
+    bucket_free (&ps->exact);
+    for (i = 0; i < ps->prefix_buckets; i++) {
+        bucket_free (&ps->prefixes[i]);
+    }
+    free (ps->prefixes);
+    for (i = 0; i < ps->suffix_buckets; i++) {
+        bucket_free (&ps->suffixes[i]);
+    }
+    free (ps->suffixes);
+    for (i = 0; i < ps->glob_count; i++) {
+        free (ps->globs[i]);
+    }
+    free (ps->globs);
+}
+
+/**
+ * Check if a name matches any pattern of a set.
+ *
+ * @param[in] ps   A pointer to #pattern_set.
+ * @param[in] name A file name.
+ * @return 1 if matches, 0 otherwise.
+ **/
+static int
+pattern_set_matches (const pattern_set *ps, const char *name)
+{
+    size_t name_len = strlen (name);
+    size_t i;
+
+    if (bucket_has (&ps->exact, name)) {
+        return 1;
+    }
+
+    for (i = 0; i < ps->suffix_buckets; i++) {
+        const pattern_bucket *b = &ps->suffixes[i];
+        if (b->len <= name_len && bucket_has (b, name + name_len - b->len)) {
+            return 1;
+        }
+    }
+
+    for (i = 0; i < ps->prefix_buckets; i++) {
+        const pattern_bucket *b = &ps->prefixes[i];
+        if (b->len <= name_len && b->len <= NAME_MAX) {
+            char prefix[NAME_MAX + 1];
+            memcpy (prefix, name, b->len);
+            prefix[b->len] = '\0';
+            if (bucket_has (b, prefix)) {
+                return 1;
+            }
+        }
+    }
+
+    for (i = 0; i < ps->glob_count; i++) {
+        if (fnmatch (ps->globs[i], name, 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Create a filter for the entries of a watched directory.
+ *
+ * The patterns are matched against the entry names. A pattern ending
+ * with a slash matches only directories.
+ *
+ * @param[in] exclude A NULL-terminated list of patterns of the entries
+ *     to skip. May be NULL.
+ * @param[in] include A NULL-terminated list of patterns of the only files
+ *     to watch. Directories are not checked against it. May be NULL.
+ * @return A pointer to the filter, NULL on failure.
+ **/
+filter*
+filter_create (const char *const *exclude, const char *const *include)
+{
+    filter *f = calloc (1, sizeof (filter));
+    if (f == NULL) {
+        perror_msg ("Failed to allocate a filter");
+        return NULL;
+    }
+
+    for (; exclude != NULL && *exclude != NULL; exclude++) {
+        size_t len = strlen (*exclude);
+        int retval;
+
+        if (len > 1 && (*exclude)[len - 1] == '/') {
+            retval = pattern_set_add (&f->exclude_dirs, *exclude, len - 1);
+        } else if (len > 0) {
+            retval = pattern_set_add (&f->exclude, *exclude, len);
+        } else {
+            errno = EINVAL;
+            retval = -1;
+        }
+
+        if (retval == -1) {
+            filter_free (f);
+            return NULL;
+        }
+    }
+
+    for (; include != NULL && *include != NULL; include++) {
+        size_t len = strlen (*include);
+        if (len == 0 || pattern_set_add (&f->include, *include, len) == -1) {
+            errno = EINVAL;
+            filter_free (f);
+            return NULL;
+        }
+        f->has_include = 1;
+    }
+
+    pattern_set_sort (&f->exclude);
+    pattern_set_sort (&f->exclude_dirs);
+    pattern_set_sort (&f->include);
+    return f;
+}
+
+/**
+ * Free the memory allocated for a filter.
+ *
+ * @param[in] f A pointer to #filter. May be NULL.
+ **/
+void
+filter_free (filter *f)
+{
+    if (f == NULL) {
+        return;
+    }
+
+    pattern_set_free (&f->exclude);
+    pattern_set_free (&f->exclude_dirs);
+    pattern_set_free (&f->include);
+    free (f);
+}
+
+/**
+ * Check if a directory entry should be skipped.
+ *
+ * The entries of unknown type are treated as directories by the
+ * directory patterns, and as files by the include patterns.
+ *
+ * @param[in] f    A pointer to #filter. May be NULL.
+ * @param[in] name The entry name.
+ * @param[in] type The entry type (DT_*), may be DT_UNKNOWN.
+ * @return 1 if the entry should be skipped, 0 otherwise.
+ **/
+int
+filter_skips (const filter *f, const char *name, unsigned char type)
+{
+    assert (name != NULL);
+
+    if (f == NULL) {
+        return 0;
+    }
+
+    if (pattern_set_matches (&f->exclude, name)) {
+        return 1;
+    }
+
+    if ((type == DT_DIR || type == DT_UNKNOWN)
+        && pattern_set_matches (&f->exclude_dirs, name)) {
+        return 1;
+    }
+
+    if (f->has_include && type != DT_DIR) {
+        return !pattern_set_matches (&f->include, name);
+    }
+    return 0;
+}
+
+/**
+ * Remove the entries skipped by a filter from a directory listing.
+ *
+ * @param[in] f  A pointer to #filter. May be NULL.
+ * @param[in] dl A directory listing.
+ * @return The filtered listing.
+ **/
+dep_list*
+filter_apply (const filter *f, dep_list *dl)
+{
+    if (f == NULL) {
+        return dl;
+    }
+
+    dep_list *head = dl;
+    dep_list *prev = NULL;
+
+    while (dl != NULL) {
+        dep_list *next = dl->next;
+
+        if (filter_skips (f, dl->path, dl->type)) {
+            if (prev) {
+                prev->next = next;
+            } else {
+                head = next;
+            }
+            dl->next = NULL;
+            dl_free (dl);
+        } else {
+            prev = dl;
+        }
+        dl = next;
+    }
+    return head;
+}
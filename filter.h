@@ -0,0 +1,75 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <stddef.h> /* size_t */
+
+#include "dep-list.h"
+
+/**
+ * Patterns of the same kind with fixed parts of the same length.
+ *
+ * The strings are sorted, so a name is looked up with a binary search.
+ **/
+typedef struct pattern_bucket {
+    size_t len;             /* length of the strings, for prefixes and
+                             * suffixes */
+    size_t count;           /* number of the strings */
+    char **items;           /* the sorted strings */
+} pattern_bucket;
+
+/**
+ * A set of fnmatch(3) patterns.
+ *
+ * The usual patterns, such as "node_modules", "*.o" or ".#*", are split
+ * into exact names, suffixes and prefixes, which are matched without
+ * trying every pattern. Only the rest are matched with fnmatch(3).
+ **/
+typedef struct pattern_set {
+    pattern_bucket exact;       /* names without wildcards */
+    pattern_bucket *prefixes;   /* "prefix*", a bucket per length */
+    size_t prefix_buckets;
+    pattern_bucket *suffixes;   /* "*suffix", a bucket per length */
+    size_t suffix_buckets;
+    char **globs;               /* everything else */
+    size_t glob_count;
+} pattern_set;
+
+/**
+ * Directory entries to skip for a watch.
+ **/
+typedef struct filter {
+    pattern_set exclude;        /* entries to skip */
+    pattern_set exclude_dirs;   /* directories to skip ("name/") */
+    pattern_set include;        /* if not empty, the only files to watch */
+    int has_include;
+} filter;
+
+filter*   filter_create (const char *const *exclude,
+                         const char *const *include);
+void      filter_free   (filter *f);
+int       filter_skips  (const filter *f, const char *name, unsigned char type);
+dep_list* filter_apply  (const filter *f, dep_list *dl);
+
+#endif /* __FILTER_H__ */
@@ -0,0 +1,971 @@
+/*******************************************************************************
+  Copyright (c) 2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <stddef.h>  /* NULL */
+#include <stdlib.h>  /* calloc, realloc */
+#include <string.h>  /* memset */
+#include <unistd.h>  /* read, write, close */
+#include <stdio.h>   /* snprintf */
+#include <errno.h>
+#include <fcntl.h>   /* fcntl */
+#include <poll.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>       /* FIONREAD */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "sys/inotify.h"     /* the constants are the same as in Linux */
+
+#include "utils.h"
+#include "kqueue-sim.h"
+
+/*
+ * The library itself exports inotify_* symbols, so the host inotify is
+ * reached through the raw system calls.
+ */
+#define host_inotify_init1(flags) \
+    syscall (SYS_inotify_init1, (flags))
+#define host_inotify_add_watch(fd, path, mask) \
+    syscall (SYS_inotify_add_watch, (fd), (path), (mask))
+#define host_inotify_rm_watch(fd, wd) \
+    syscall (SYS_inotify_rm_watch, (fd), (wd))
+
+#define HOST_WATCH_MASK \
+    ( IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE \
+    | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | IN_DELETE_SELF )
+
+/* Directories do not receive IN_DELETE_SELF while we hold them open */
+#define DIR_POLL_INTERVAL_MS 100
+
+typedef struct knote {
+    struct knote *next;       /* all knotes of a queue */
+    struct knote *fd_next;    /* knotes sharing an ident (fd-based filters) */
+    struct knote *wd_next;    /* knotes sharing a host inotify watch */
+    struct knote *act_next;   /* active knotes */
+
+    struct kevent kev;        /* the registered event */
+    int enabled;
+    int active;               /* 1 if queued on the active list */
+    unsigned int pending;     /* fflags collected since the last report */
+    intptr_t pdata;           /* data collected since the last report */
+    int eof;
+
+    int wd;                   /* host inotify watch (EVFILT_VNODE) */
+    dev_t dev;
+    ino_t ino;
+    nlink_t nlink;
+    int is_dir;
+
+    long long deadline;       /* expiration time in ms (EVFILT_TIMER) */
+} knote;
+
+typedef struct kqsim {
+    int epfd;                 /* epoll descriptor, also the kqueue id */
+    int infd;                 /* host inotify descriptor */
+    int evfd;                 /* eventfd to interrupt a waiter */
+    pthread_mutex_t mtx;
+
+    knote *notes;             /* all knotes */
+    knote *act_head;          /* active knotes, FIFO */
+    knote *act_tail;
+
+    knote **by_fd;            /* fd-based knotes, indexed by ident */
+    size_t by_fd_len;
+    knote **by_wd;            /* vnode knotes, indexed by inotify wd */
+    size_t by_wd_len;
+
+    long long next_dir_poll;
+} kqsim;
+
+static kqsim **queues = NULL;
+static size_t queues_len = 0;
+static pthread_mutex_t queues_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+
+static long long
+now_ms (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+grow_index (knote ***index, size_t *len, size_t slot)
+{
+    if (slot < *len) {
+        return 0;
+    }
+
+    size_t to_allocate = *len ? *len : 64;
+    while (to_allocate <= slot) {
+        to_allocate *= 2;
+    }
+
+    knote **ptr = realloc (*index, sizeof (knote *) * to_allocate);
+    if (ptr == NULL) {
+        return -1;
+    }
+    memset (ptr + *len, 0, sizeof (knote *) * (to_allocate - *len));
+    *index = ptr;
+    *len = to_allocate;
+    return 0;
+}
+
+static void
+kqsim_free (kqsim *kq)
+{
+    knote *kn = kq->notes;
+    while (kn != NULL) {
+        knote *next = kn->next;
+        free (kn);
+        kn = next;
+    }
+    close (kq->infd);
+    close (kq->evfd);
+    free (kq->by_fd);
+    free (kq->by_wd);
+    pthread_mutex_destroy (&kq->mtx);
+    free (kq);
+}
+
+static kqsim*
+kqsim_lookup (int fd)
+{
+    kqsim *kq = NULL;
+    pthread_mutex_lock (&queues_mtx);
+    if (fd >= 0 && (size_t) fd < queues_len) {
+        kq = queues[fd];
+    }
+    pthread_mutex_unlock (&queues_mtx);
+    return kq;
+}
+
+/**
+ * Create a new simulated kernel event queue.
+ *
+ * @return A queue descriptor on success, -1 on failure.
+ **/
+int
+kqsim_kqueue (void)
+{
+    kqsim *kq = calloc (1, sizeof (kqsim));
+    if (kq == NULL) {
+        return -1;
+    }
+
+    kq->epfd = epoll_create1 (EPOLL_CLOEXEC);
+    kq->infd = host_inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    kq->evfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (kq->epfd == -1 || kq->infd == -1 || kq->evfd == -1) {
+        goto failure;
+    }
+
+    struct epoll_event ee;
+    memset (&ee, 0, sizeof (ee));
+    ee.events = EPOLLIN;
+    ee.data.fd = kq->infd;
+    if (epoll_ctl (kq->epfd, EPOLL_CTL_ADD, kq->infd, &ee) == -1) {
+        goto failure;
+    }
+    ee.data.fd = kq->evfd;
+    if (epoll_ctl (kq->epfd, EPOLL_CTL_ADD, kq->evfd, &ee) == -1) {
+        goto failure;
+    }
+
+    pthread_mutex_init (&kq->mtx, NULL);
+
+    pthread_mutex_lock (&queues_mtx);
+    if ((size_t) kq->epfd >= queues_len) {
+        size_t to_allocate = queues_len ? queues_len : 16;
+        while (to_allocate <= (size_t) kq->epfd) {
+            to_allocate *= 2;
+        }
+        kqsim **ptr = realloc (queues, sizeof (kqsim *) * to_allocate);
+        if (ptr == NULL) {
+            pthread_mutex_unlock (&queues_mtx);
+            pthread_mutex_destroy (&kq->mtx);
+            goto failure;
+        }
+        memset (ptr + queues_len, 0, sizeof (kqsim *) * (to_allocate - queues_len));
+        queues = ptr;
+        queues_len = to_allocate;
+    }
+
+    /* The previous queue with this descriptor has been closed */
+    if (queues[kq->epfd] != NULL) {
+        kqsim_free (queues[kq->epfd]);
+    }
+    queues[kq->epfd] = kq;
+    pthread_mutex_unlock (&queues_mtx);
+
+    return kq->epfd;
+
+failure:
+    if (kq->epfd != -1) close (kq->epfd);
+    if (kq->infd != -1) close (kq->infd);
+    if (kq->evfd != -1) close (kq->evfd);
+    free (kq);
+    return -1;
+}
+
+
+static void
+activate (kqsim *kq, knote *kn)
+{
+    if (kn->active || !kn->enabled) {
+        return;
+    }
+    kn->active = 1;
+    kn->act_next = NULL;
+    if (kq->act_tail) {
+        kq->act_tail->act_next = kn;
+    } else {
+        kq->act_head = kn;
+    }
+    kq->act_tail = kn;
+}
+
+static void
+deactivate (kqsim *kq, knote *kn)
+{
+    if (!kn->active) {
+        return;
+    }
+
+    knote *it = kq->act_head, *prev = NULL;
+    while (it != NULL && it != kn) {
+        prev = it;
+        it = it->act_next;
+    }
+    if (it == NULL) {
+        return;
+    }
+    if (prev) {
+        prev->act_next = kn->act_next;
+    } else {
+        kq->act_head = kn->act_next;
+    }
+    if (kq->act_tail == kn) {
+        kq->act_tail = prev;
+    }
+    kn->active = 0;
+}
+
+static int
+uses_fd (short filter)
+{
+    return filter == EVFILT_READ
+        || filter == EVFILT_WRITE
+        || filter == EVFILT_VNODE;
+}
+
+static knote*
+find_knote (kqsim *kq, uintptr_t ident, short filter)
+{
+    knote *kn;
+    if (uses_fd (filter)) {
+        if (ident >= kq->by_fd_len) {
+            return NULL;
+        }
+        for (kn = kq->by_fd[ident]; kn != NULL; kn = kn->fd_next) {
+            if (kn->kev.filter == filter) {
+                return kn;
+            }
+        }
+        return NULL;
+    }
+
+    for (kn = kq->notes; kn != NULL; kn = kn->next) {
+        if (kn->kev.ident == ident && kn->kev.filter == filter) {
+            return kn;
+        }
+    }
+    return NULL;
+}
+
+/* Update the epoll registration of a socket or pipe */
+static int
+update_epoll (kqsim *kq, int fd)
+{
+    uint32_t events = 0;
+    knote *kn;
+
+    for (kn = kq->by_fd[fd]; kn != NULL; kn = kn->fd_next) {
+        if (kn->kev.filter == EVFILT_READ) {
+            events |= EPOLLIN | EPOLLRDHUP;
+        } else if (kn->kev.filter == EVFILT_WRITE) {
+            events |= EPOLLOUT;
+        }
+    }
+
+    struct epoll_event ee;
+    memset (&ee, 0, sizeof (ee));
+    ee.events = events | EPOLLET;
+    ee.data.fd = fd;
+
+    if (events == 0) {
+        epoll_ctl (kq->epfd, EPOLL_CTL_DEL, fd, &ee);
+        return 0;
+    }
+    /* MOD re-arms the edge, so a ready descriptor is reported again */
+    if (epoll_ctl (kq->epfd, EPOLL_CTL_MOD, fd, &ee) == -1) {
+        if (errno != ENOENT
+            || epoll_ctl (kq->epfd, EPOLL_CTL_ADD, fd, &ee) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void
+unlink_wd (kqsim *kq, knote *kn)
+{
+    if (kn->wd < 0 || (size_t) kn->wd >= kq->by_wd_len) {
+        kn->wd = -1;
+        return;
+    }
+
+    knote **pp = &kq->by_wd[kn->wd];
+    while (*pp != NULL && *pp != kn) {
+        pp = &(*pp)->wd_next;
+    }
+    if (*pp == kn) {
+        *pp = kn->wd_next;
+    }
+    if (kq->by_wd[kn->wd] == NULL) {
+        host_inotify_rm_watch (kq->infd, kn->wd);
+    }
+    kn->wd = -1;
+    kn->wd_next = NULL;
+}
+
+static void
+drop_knote (kqsim *kq, knote *kn)
+{
+    knote **pp;
+
+    deactivate (kq, kn);
+    if (kn->kev.filter == EVFILT_VNODE) {
+        unlink_wd (kq, kn);
+    }
+
+    if (uses_fd (kn->kev.filter) && kn->kev.ident < kq->by_fd_len) {
+        pp = &kq->by_fd[kn->kev.ident];
+        while (*pp != NULL && *pp != kn) {
+            pp = &(*pp)->fd_next;
+        }
+        if (*pp == kn) {
+            *pp = kn->fd_next;
+        }
+        if (kn->kev.filter != EVFILT_VNODE) {
+            update_epoll (kq, kn->kev.ident);
+        }
+    }
+
+    pp = &kq->notes;
+    while (*pp != NULL && *pp != kn) {
+        pp = &(*pp)->next;
+    }
+    if (*pp == kn) {
+        *pp = kn->next;
+    }
+    free (kn);
+}
+
+static int
+attach_vnode (kqsim *kq, knote *kn)
+{
+    struct stat st;
+    if (fstat (kn->kev.ident, &st) == -1) {
+        return -1;
+    }
+
+    char path[64];
+    snprintf (path, sizeof (path), "/proc/self/fd/%d", (int) kn->kev.ident);
+    int wd = host_inotify_add_watch (kq->infd, path, HOST_WATCH_MASK);
+    if (wd == -1) {
+        return -1;
+    }
+    if (grow_index (&kq->by_wd, &kq->by_wd_len, wd) == -1) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    kn->wd = wd;
+    kn->wd_next = kq->by_wd[wd];
+    kq->by_wd[wd] = kn;
+
+    kn->dev = st.st_dev;
+    kn->ino = st.st_ino;
+    kn->nlink = st.st_nlink;
+    kn->is_dir = S_ISDIR (st.st_mode);
+    return 0;
+}
+
+/* Check that the descriptor of a vnode knote has not been closed or reused */
+static int
+vnode_alive (knote *kn, struct stat *st)
+{
+    if (fstat (kn->kev.ident, st) == -1) {
+        return 0;
+    }
+    return st->st_dev == kn->dev && st->st_ino == kn->ino;
+}
+
+static void
+arm_timer (knote *kn, long long now)
+{
+    kn->deadline = now + (kn->kev.data > 0 ? kn->kev.data : 0);
+}
+
+static int
+apply_change (kqsim *kq, const struct kevent *change)
+{
+    knote *kn = find_knote (kq, change->ident, change->filter);
+
+    if (change->filter != EVFILT_READ
+        && change->filter != EVFILT_WRITE
+        && change->filter != EVFILT_VNODE
+        && change->filter != EVFILT_TIMER
+        && change->filter != EVFILT_USER) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (uses_fd (change->filter) && fcntl (change->ident, F_GETFD) == -1) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (kn != NULL && kn->kev.filter == EVFILT_VNODE) {
+        struct stat st;
+        if (!vnode_alive (kn, &st)) {
+            /* The descriptor was closed and then reused for another file */
+            drop_knote (kq, kn);
+            kn = NULL;
+        }
+    }
+
+    if (change->flags & EV_DELETE) {
+        if (kn == NULL) {
+            errno = ENOENT;
+            return -1;
+        }
+        drop_knote (kq, kn);
+        return 0;
+    }
+
+    if (kn == NULL) {
+        if (!(change->flags & EV_ADD)) {
+            errno = ENOENT;
+            return -1;
+        }
+
+        kn = calloc (1, sizeof (knote));
+        if (kn == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        kn->kev = *change;
+        kn->wd = -1;
+        kn->enabled = 1;
+
+        if (uses_fd (change->filter)
+            && grow_index (&kq->by_fd, &kq->by_fd_len, change->ident) == -1) {
+            free (kn);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        if (change->filter == EVFILT_VNODE && attach_vnode (kq, kn) == -1) {
+            int saved = errno;
+            free (kn);
+            errno = saved;
+            return -1;
+        }
+
+        kn->next = kq->notes;
+        kq->notes = kn;
+        if (uses_fd (change->filter)) {
+            kn->fd_next = kq->by_fd[change->ident];
+            kq->by_fd[change->ident] = kn;
+        }
+    } else if (change->flags & EV_ADD) {
+        /* modify the existing knote */
+        kn->kev.flags = change->flags;
+        kn->kev.fflags = change->fflags;
+        kn->kev.data = change->data;
+        kn->kev.udata = change->udata;
+        kn->enabled = 1;
+        if (change->filter == EVFILT_VNODE) {
+            kn->pending &= change->fflags;
+            if (kn->pending == 0) {
+                deactivate (kq, kn);
+            }
+        }
+    }
+
+    if (change->flags & EV_DISABLE) {
+        kn->enabled = 0;
+        deactivate (kq, kn);
+    } else if (change->flags & EV_ENABLE) {
+        kn->enabled = 1;
+        if (kn->pending || kn->eof) {
+            activate (kq, kn);
+        }
+    }
+
+    switch (change->filter) {
+    case EVFILT_READ:
+    case EVFILT_WRITE:
+        if (update_epoll (kq, change->ident) == -1) {
+            int saved = errno;
+            drop_knote (kq, kn);
+            errno = saved;
+            return -1;
+        }
+        break;
+    case EVFILT_TIMER:
+        if (change->flags & EV_ADD) {
+            deactivate (kq, kn);
+            kn->pdata = 0;
+            arm_timer (kn, now_ms ());
+        }
+        break;
+    case EVFILT_USER:
+        if (change->fflags & NOTE_TRIGGER) {
+            kn->pending = 1;
+            activate (kq, kn);
+        }
+        break;
+    }
+
+    return 0;
+}
+
+
+/* Translate a host inotify event into the vnode filter flags */
+static unsigned int
+translate (knote *kn, const struct inotify_event *ie, const struct stat *st)
+{
+    unsigned int fflags = 0;
+    uint32_t mask = ie->mask;
+
+    if (ie->len > 0) {
+        /* an event about an entry of a directory */
+        if (mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+            fflags |= NOTE_WRITE;
+            if (mask & IN_ISDIR) {
+                fflags |= NOTE_LINK;
+            }
+        }
+        return fflags;
+    }
+
+    if (mask & IN_MODIFY) {
+        fflags |= NOTE_WRITE;
+    }
+    if (mask & IN_ATTRIB) {
+        if (st->st_nlink < kn->nlink) {
+            fflags |= NOTE_DELETE;
+        } else if (st->st_nlink > kn->nlink) {
+            fflags |= NOTE_LINK;
+        } else {
+            fflags |= NOTE_ATTRIB;
+        }
+    }
+    if (mask & IN_MOVE_SELF) {
+        fflags |= NOTE_RENAME;
+    }
+    if (mask & IN_DELETE_SELF) {
+        fflags |= NOTE_DELETE;
+    }
+
+    kn->nlink = st->st_nlink;
+    return fflags;
+}
+
+static void
+post_vnode (kqsim *kq, knote *kn, unsigned int fflags)
+{
+    fflags &= kn->kev.fflags;
+    if (fflags) {
+        kn->pending |= fflags;
+        activate (kq, kn);
+    }
+}
+
+static void
+drain_inotify (kqsim *kq)
+{
+    char buf[16 * 1024] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read (kq->infd, buf, sizeof (buf));
+        if (len <= 0) {
+            break;
+        }
+
+        ssize_t off = 0;
+        while (off < len) {
+            struct inotify_event *ie = (struct inotify_event *) (buf + off);
+            off += sizeof (struct inotify_event) + ie->len;
+
+            if (ie->mask & IN_Q_OVERFLOW) {
+                /* force the directory rescans */
+                knote *kn;
+                for (kn = kq->notes; kn != NULL; kn = kn->next) {
+                    if (kn->kev.filter == EVFILT_VNODE && kn->is_dir) {
+                        post_vnode (kq, kn, NOTE_WRITE);
+                    }
+                }
+                continue;
+            }
+
+            if (ie->wd < 0 || (size_t) ie->wd >= kq->by_wd_len) {
+                continue;
+            }
+
+            if (ie->mask & IN_IGNORED) {
+                knote *kn = kq->by_wd[ie->wd];
+                while (kn != NULL) {
+                    knote *next = kn->wd_next;
+                    kn->wd = -1;
+                    kn->wd_next = NULL;
+                    kn = next;
+                }
+                kq->by_wd[ie->wd] = NULL;
+                continue;
+            }
+
+            knote *kn = kq->by_wd[ie->wd];
+            while (kn != NULL) {
+                knote *next = kn->wd_next;
+                struct stat st;
+                if (vnode_alive (kn, &st)) {
+                    post_vnode (kq, kn, translate (kn, ie, &st));
+                } else {
+                    /* kqueue forgets the knotes of the closed descriptors */
+                    drop_knote (kq, kn);
+                }
+                kn = next;
+            }
+        }
+    }
+}
+
+static void
+poll_dirs (kqsim *kq, long long now)
+{
+    if (now < kq->next_dir_poll) {
+        return;
+    }
+    kq->next_dir_poll = now + DIR_POLL_INTERVAL_MS;
+
+    knote *kn = kq->notes;
+    while (kn != NULL) {
+        knote *next = kn->next;
+        if (kn->kev.filter == EVFILT_VNODE
+            && kn->is_dir
+            && (kn->kev.fflags & NOTE_DELETE)
+            && !(kn->pending & NOTE_DELETE)) {
+            struct stat st;
+            if (fstat (kn->kev.ident, &st) == -1) {
+                drop_knote (kq, kn);
+            } else if (st.st_nlink == 0) {
+                post_vnode (kq, kn, NOTE_DELETE);
+            }
+        }
+        kn = next;
+    }
+}
+
+static int
+has_dir_polls (kqsim *kq)
+{
+    knote *kn;
+    for (kn = kq->notes; kn != NULL; kn = kn->next) {
+        if (kn->kev.filter == EVFILT_VNODE
+            && kn->is_dir
+            && (kn->kev.fflags & NOTE_DELETE)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+expire_timers (kqsim *kq, long long now, long long *nearest)
+{
+    knote *kn;
+    for (kn = kq->notes; kn != NULL; kn = kn->next) {
+        if (kn->kev.filter != EVFILT_TIMER || !kn->enabled) {
+            continue;
+        }
+        if (kn->deadline <= now && !(kn->kev.flags & EV_ONESHOT && kn->pdata)) {
+            ++kn->pdata;
+            activate (kq, kn);
+            if (kn->kev.flags & EV_ONESHOT || kn->kev.data <= 0) {
+                kn->deadline = (long long) 1 << 62;
+            } else {
+                while (kn->deadline <= now) {
+                    kn->deadline += kn->kev.data;
+                }
+            }
+        }
+        if (kn->deadline < *nearest) {
+            *nearest = kn->deadline;
+        }
+    }
+}
+
+static void
+process_epoll (kqsim *kq, struct epoll_event *ee, int count)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        int fd = ee[i].data.fd;
+
+        if (fd == kq->infd) {
+            drain_inotify (kq);
+            continue;
+        }
+        if (fd == kq->evfd) {
+            uint64_t unused;
+            read (kq->evfd, &unused, sizeof (unused));
+            continue;
+        }
+        if (fd < 0 || (size_t) fd >= kq->by_fd_len) {
+            continue;
+        }
+
+        knote *kn;
+        for (kn = kq->by_fd[fd]; kn != NULL; kn = kn->fd_next) {
+            if (kn->kev.filter == EVFILT_READ
+                && ee[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                if (ee[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    kn->eof = 1;
+                }
+                kn->pending = 1;
+                activate (kq, kn);
+            } else if (kn->kev.filter == EVFILT_WRITE
+                       && ee[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                if (ee[i].events & (EPOLLHUP | EPOLLERR)) {
+                    kn->eof = 1;
+                }
+                kn->pending = 1;
+                activate (kq, kn);
+            }
+        }
+    }
+}
+
+/* Move the active knotes to the user's event list */
+static int
+collect (kqsim *kq, struct kevent *eventlist, int nevents)
+{
+    int n = 0;
+
+    while (n < nevents && kq->act_head != NULL) {
+        knote *kn = kq->act_head;
+        kq->act_head = kn->act_next;
+        if (kq->act_head == NULL) {
+            kq->act_tail = NULL;
+        }
+        kn->active = 0;
+
+        struct kevent *ev = &eventlist[n];
+        *ev = kn->kev;
+        ev->flags &= ~(EV_ADD | EV_ENABLE | EV_DISABLE);
+        ev->fflags = 0;
+        ev->data = 0;
+
+        switch (kn->kev.filter) {
+        case EVFILT_VNODE: {
+            struct stat st;
+            if (!vnode_alive (kn, &st)) {
+                drop_knote (kq, kn);
+                continue;
+            }
+            ev->fflags = kn->pending;
+            break;
+        }
+        case EVFILT_READ: {
+            int avail = 0;
+            ioctl (kn->kev.ident, FIONREAD, &avail);
+            ev->data = avail;
+            if (kn->eof) {
+                ev->flags |= EV_EOF;
+            }
+            break;
+        }
+        case EVFILT_WRITE:
+            ev->data = 1;
+            if (kn->eof) {
+                ev->flags |= EV_EOF;
+            }
+            break;
+        case EVFILT_TIMER:
+            ev->data = kn->pdata;
+            kn->pdata = 0;
+            break;
+        case EVFILT_USER:
+            ev->fflags = kn->kev.fflags & ~NOTE_TRIGGER;
+            break;
+        }
+        kn->pending = 0;
+        ++n;
+
+        if (kn->kev.flags & EV_ONESHOT) {
+            drop_knote (kq, kn);
+        } else if (kn->kev.flags & EV_DISPATCH) {
+            kn->enabled = 0;
+        }
+    }
+    return n;
+}
+
+/**
+ * Register events and wait for them, like kevent(2).
+ *
+ * @param[in]  fd         A simulated queue descriptor.
+ * @param[in]  changelist An array of changes to apply. May be NULL.
+ * @param[in]  nchanges   The number of changes.
+ * @param[out] eventlist  An array to receive the events. May be NULL.
+ * @param[in]  nevents    The size of the event list.
+ * @param[in]  timeout    A timeout to wait, NULL to wait infinitely.
+ * @return The number of events received, -1 on failure.
+ **/
+int
+kqsim_kevent (int                    fd,
+              const struct kevent   *changelist,
+              int                    nchanges,
+              struct kevent         *eventlist,
+              int                    nevents,
+              const struct timespec *timeout)
+{
+    kqsim *kq = kqsim_lookup (fd);
+    if (kq == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    int i, nerrors = 0;
+    pthread_mutex_lock (&kq->mtx);
+    for (i = 0; i < nchanges; i++) {
+        int retval = apply_change (kq, &changelist[i]);
+        if (retval == -1 || changelist[i].flags & EV_RECEIPT) {
+            if (nerrors < nevents) {
+                eventlist[nerrors] = changelist[i];
+                eventlist[nerrors].flags |= EV_ERROR;
+                eventlist[nerrors].data = (retval == -1) ? errno : 0;
+                ++nerrors;
+            } else if (retval == -1) {
+                pthread_mutex_unlock (&kq->mtx);
+                return -1;
+            }
+        }
+    }
+    pthread_mutex_unlock (&kq->mtx);
+
+    if (nchanges > 0) {
+        /* wake up a waiter to let it see the changes */
+        uint64_t one = 1;
+        write (kq->evfd, &one, sizeof (one));
+    }
+
+    if (nerrors > 0 || nevents == 0) {
+        return nerrors;
+    }
+
+    long long deadline = -1;
+    if (timeout != NULL) {
+        deadline = now_ms () + timeout->tv_sec * 1000
+            + timeout->tv_nsec / 1000000;
+    }
+
+    /* Take the pending file system events first, as kqueue(2) reports
+     * them along with the expired timers */
+    {
+        struct epoll_event ee[64];
+        int count = epoll_wait (kq->epfd, ee, 64, 0);
+        if (count > 0) {
+            pthread_mutex_lock (&kq->mtx);
+            process_epoll (kq, ee, count);
+            pthread_mutex_unlock (&kq->mtx);
+        }
+    }
+
+    int first = 1;
+    for (;;) {
+        struct epoll_event ee[64];
+        long long now = now_ms ();
+        long long nearest = (long long) 1 << 62;
+        int wait_ms = -1;
+
+        pthread_mutex_lock (&kq->mtx);
+        expire_timers (kq, now, &nearest);
+        if (has_dir_polls (kq)) {
+            poll_dirs (kq, now);
+            if (kq->next_dir_poll < nearest) {
+                nearest = kq->next_dir_poll;
+            }
+        }
+        int n = collect (kq, eventlist, nevents);
+        pthread_mutex_unlock (&kq->mtx);
+
+        if (n > 0) {
+            return n;
+        }
+
+        if (!first) {
+            if (deadline != -1 && now >= deadline) {
+                return 0;
+            }
+            if (deadline != -1) {
+                wait_ms = deadline - now;
+            }
+            if (nearest != ((long long) 1 << 62)
+                && (wait_ms == -1 || nearest - now < wait_ms)) {
+                wait_ms = nearest > now ? nearest - now : 0;
+            }
+        } else {
+            wait_ms = 0;
+        }
+        first = 0;
+
+        int count = epoll_wait (kq->epfd, ee, 64, wait_ms);
+        if (count == -1) {
+            return -1;
+        }
+
+        pthread_mutex_lock (&kq->mtx);
+        process_epoll (kq, ee, count);
+        pthread_mutex_unlock (&kq->mtx);
+    }
+}
@@ -0,0 +1,103 @@
+/*******************************************************************************
+  Copyright (c) 2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __KQUEUE_SIM_H__
+#define __KQUEUE_SIM_H__
+
+#include <stdint.h>    /* uintptr_t, intptr_t */
+#include <time.h>      /* timespec */
+
+/*
+ * A simulated kqueue(2) for the hosts without one, see backend.h. Only
+ * the subset of the interface used by the library is provided. The
+ * constants match the FreeBSD ones.
+ */
+
+#define kqueue kqsim_kqueue
+#define kevent kqsim_kevent
+
+struct kevent {
+    uintptr_t      ident;   /* identifier for this event */
+    short          filter;  /* filter for event */
+    unsigned short flags;   /* action flags for kqueue */
+    unsigned int   fflags;  /* filter flag value */
+    intptr_t       data;    /* filter data value */
+    void          *udata;   /* opaque user data identifier */
+};
+
+#define EV_SET(kevp_, a, b, c, d, e, f) do {   \
+    struct kevent *kevp = (kevp_);             \
+    (kevp)->ident = (a);                       \
+    (kevp)->filter = (b);                      \
+    (kevp)->flags = (c);                       \
+    (kevp)->fflags = (d);                      \
+    (kevp)->data = (e);                        \
+    (kevp)->udata = (f);                       \
+} while (0)
+
+#define EVFILT_READ     (-1)
+#define EVFILT_WRITE    (-2)
+#define EVFILT_VNODE    (-4)
+#define EVFILT_TIMER    (-7)
+#define EVFILT_USER     (-11)
+
+/* actions */
+#define EV_ADD          0x0001
+#define EV_DELETE       0x0002
+#define EV_ENABLE       0x0004
+#define EV_DISABLE      0x0008
+
+/* flags */
+#define EV_ONESHOT      0x0010
+#define EV_CLEAR        0x0020
+#define EV_RECEIPT      0x0040
+#define EV_DISPATCH     0x0080
+
+/* returned values */
+#define EV_EOF          0x8000
+#define EV_ERROR        0x4000
+
+/* data/hint flags for EVFILT_READ and EVFILT_WRITE */
+#define NOTE_LOWAT      0x0001
+
+/* data/hint flags for EVFILT_USER */
+#define NOTE_FFNOP      0x00000000
+#define NOTE_TRIGGER    0x01000000
+
+/* data/hint flags for EVFILT_VNODE */
+#define NOTE_DELETE     0x0001
+#define NOTE_WRITE      0x0002
+#define NOTE_EXTEND     0x0004
+#define NOTE_ATTRIB     0x0008
+#define NOTE_LINK       0x0010
+#define NOTE_RENAME     0x0020
+#define NOTE_REVOKE     0x0040
+
+int kqsim_kqueue (void);
+int kqsim_kevent (int                   kq,
+                  const struct kevent  *changelist,
+                  int                   nchanges,
+                  struct kevent        *eventlist,
+                  int                   nevents,
+                  const struct timespec *timeout);
+
+#endif /* __KQUEUE_SIM_H__ */
@@ -0,0 +1,249 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <stdlib.h> /* calloc */
+#include <fcntl.h>  /* open, openat */
+#include <unistd.h> /* close */
+#include <errno.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "config.h"
+#include "utils.h"
+#include "open-pool.h"
+#include "worker.h"
+
+/*
+ * Watching a directory takes an open(2) and an fstat(2) for each of its
+ * entries, and these are the most of the time a large directory is
+ * added in. The syscalls of the different entries are independent, so
+ * they are made by a few helper threads at once, started for the
+ * directory and stopped when it is done. The watches themselves are
+ * still created by the worker, from the results, in the listing order.
+ * The helpers run with the thread parameters of the worker.
+ */
+
+/* The entries a helper takes at once */
+#define OPEN_POOL_CHUNK 64
+
+/* The entries worth starting a helper for */
+#define OPEN_POOL_MIN_ENTRIES 256
+
+typedef struct open_job {
+    const char *dir;         /* the path of the directory */
+    int dirfd;               /* its descriptor */
+    const char **names;      /* the entries to open */
+    open_result *results;    /* the results, in the same order */
+    size_t count;            /* the number of the entries */
+    const worker_params *params; /* the thread parameters of the helpers */
+
+    pthread_mutex_t mutex;   /* guards next */
+    size_t next;             /* the first entry not taken yet */
+} open_job;
+
+
+/**
+ * Open an entry of a directory and take its status.
+ *
+ * @param[in]  job    A pointer to #open_job.
+ * @param[in]  index  The index of the entry.
+ **/
+static void
+open_entry (open_job *job, size_t index)
+{
+    open_result *res = &job->results[index];
+    const char *name = job->names[index];
+
+#ifdef HAVE_OPENAT
+    res->fd = openat (job->dirfd, name, O_RDONLY);
+#else
+    char *path = path_concat (job->dir, name);
+    res->fd = (path != NULL) ? open (path, O_RDONLY) : -1;
+    free (path);
+#endif
+    if (res->fd == -1) {
+        res->error = errno;
+        return;
+    }
+
+    if (fstat (res->fd, &res->st) == -1) {
+        res->error = errno;
+        close (res->fd);
+        res->fd = -1;
+    }
+}
+
+/**
+ * Open the entries of a job until there are none left.
+ *
+ * @param[in] job A pointer to #open_job.
+ **/
+static void
+open_entries (open_job *job)
+{
+    for (;;) {
+        pthread_mutex_lock (&job->mutex);
+        size_t first = job->next;
+        job->next += OPEN_POOL_CHUNK;
+        pthread_mutex_unlock (&job->mutex);
+
+        if (first >= job->count) {
+            return;
+        }
+
+        size_t last = first + OPEN_POOL_CHUNK;
+        if (last > job->count) {
+            last = job->count;
+        }
+
+        size_t i;
+        for (i = first; i < last; i++) {
+            open_entry (job, i);
+        }
+    }
+}
+
+/**
+ * The routine of a helper thread.
+ *
+ * @param[in] arg A pointer to #open_job.
+ * @return NULL.
+ **/
+static void*
+open_helper (void *arg)
+{
+    open_job *job = arg;
+
+    /* Failures are reported, the entries are opened anyway */
+    worker_thread_setup (job->params);
+    open_entries (job);
+    return NULL;
+}
+
+/**
+ * Open the entries of a directory in parallel.
+ *
+ * The calling thread opens the entries too, so nothing is started for
+ * small directories.
+ *
+ * @param[in] dir     The path of the directory.
+ * @param[in] dirfd   A descriptor of the directory.
+ * @param[in] entries The entries to open.
+ * @param[in] params  The parameters of the worker: the maximum number
+ *     of the helper threads and how to run them.
+ * @return The results, one per entry in the list order, to be freed
+ *     with open_pool_free(). NULL if the entries should be opened one
+ *     by one, as there are too few of them or on failure.
+ **/
+open_result*
+open_pool_run (const char          *dir,
+               int                  dirfd,
+               const dep_list      *entries,
+               const worker_params *params)
+{
+    assert (dir != NULL);
+    assert (params != NULL);
+
+    int helpers = params->open_threads;
+
+    size_t count = 0;
+    const dep_list *iter;
+    for (iter = entries; iter != NULL; iter = iter->next) {
+        ++count;
+    }
+
+    if ((size_t) helpers > count / OPEN_POOL_MIN_ENTRIES) {
+        helpers = count / OPEN_POOL_MIN_ENTRIES;
+    }
+    if (helpers <= 0) {
+        return NULL;
+    }
+
+    open_job job;
+    job.dir = dir;
+    job.dirfd = dirfd;
+    job.count = count;
+    job.params = params;
+    job.next = 0;
+    job.names = calloc (count, sizeof (const char *));
+    job.results = calloc (count, sizeof (open_result));
+    pthread_t *threads = calloc (helpers, sizeof (pthread_t));
+    if (job.names == NULL || job.results == NULL || threads == NULL) {
+        perror_msg ("Failed to allocate a job to open %d entries", (int) count);
+        free (job.names);
+        free (job.results);
+        free (threads);
+        return NULL;
+    }
+
+    size_t i = 0;
+    for (iter = entries; iter != NULL; iter = iter->next) {
+        job.names[i++] = iter->path;
+    }
+
+    pthread_mutex_init (&job.mutex, NULL);
+
+    pthread_attr_t attr;
+    pthread_attr_init (&attr);
+    if (params->thread_stack != 0) {
+        pthread_attr_setstacksize (&attr, params->thread_stack);
+    }
+
+    int started;
+    for (started = 0; started < helpers; started++) {
+        if (pthread_create (&threads[started], &attr, open_helper, &job) != 0) {
+            perror_msg ("Failed to start a helper thread");
+            break;
+        }
+    }
+    pthread_attr_destroy (&attr);
+
+    open_entries (&job);
+
+    int j;
+    for (j = 0; j < started; j++) {
+        pthread_join (threads[j], NULL);
+    }
+
+    pthread_mutex_destroy (&job.mutex);
+    free (threads);
+    free (job.names);
+    return job.results;
+}
+
+/**
+ * Close the descriptors not taken from the results and free them.
+ *
+ * @param[in] results The results returned by open_pool_run().
+ * @param[in] count   The number of them.
+ **/
+void
+open_pool_free (open_result *results, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; i++) {
+        if (results[i].fd != -1) {
+            close (results[i].fd);
+        }
+    }
+    free (results);
+}
@@ -0,0 +1,51 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __OPEN_POOL_H__
+#define __OPEN_POOL_H__
+
+#include <stddef.h>     /* size_t */
+#include <sys/types.h>
+#include <sys/stat.h>   /* struct stat */
+
+#include "dep-list.h"
+
+struct worker_params;
+
+#define OPEN_POOL_MAX_HELPERS 32
+
+/**
+ * A directory entry opened in advance to be watched.
+ **/
+typedef struct open_result {
+    int fd;             /* the descriptor, -1 on failure */
+    int error;          /* errno of the failure */
+    struct stat st;     /* the status of the file, if opened */
+} open_result;
+
+open_result* open_pool_run  (const char                 *dir,
+                             int                         dirfd,
+                             const dep_list             *entries,
+                             const struct worker_params *params);
+void         open_pool_free (open_result *results, size_t count);
+
+#endif /* __OPEN_POOL_H__ */
@@ -0,0 +1,320 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <stdlib.h> /* calloc */
+#include <unistd.h> /* close */
+#include <assert.h>
+
+#include "sys/inotify.h"
+
+#include "utils.h"
+#include "worker.h"
+#include "shard.h"
+
+/*
+ * The watches of an instance can be spread between several workers, the
+ * shards, each with a thread and a kqueue of its own. A user watch is
+ * served by the worker its path hashes to, and so are all its
+ * dependencies, so the events of a watch are produced by one thread
+ * only. The worker of the instance serves its share of the watches
+ * too and merges the events of the shards, sent to its inbox after each
+ * batch of theirs, into the only stream the user reads. The inbox keeps
+ * them in the order they were produced, so the events of each watch
+ * stay ordered.
+ */
+
+
+/**
+ * Execute a prepared command on a shard.
+ *
+ * @param[in] shard A pointer to the #worker of the shard.
+ * @return The command's return value.
+ **/
+static int
+shard_exec (worker *shard)
+{
+    safe_write (shard->io[INOTIFY_FD], "*", 1);
+    worker_cmd_wait (&shard->cmd);
+    return shard->cmd.retval;
+}
+
+/**
+ * Start the shards of an instance.
+ *
+ * Should be called before the instance has any watches.
+ *
+ * @param[in] wrk   A pointer to the #worker of the instance.
+ * @param[in] count The number of the threads to serve the watches with,
+ *     including the one of the instance itself.
+ * @return 0 on success, -1 on failure.
+ **/
+int
+shard_start (worker *wrk, int count)
+{
+    assert (wrk != NULL);
+    assert (wrk->shards == NULL);
+
+    if (count <= 1) {
+        return 0;
+    }
+
+    wrk->shards = calloc (count - 1, sizeof (worker *));
+    if (wrk->shards == NULL) {
+        perror_msg ("Failed to allocate %d shards", count - 1);
+        return -1;
+    }
+
+    worker_params params = wrk->params;
+    params.shards = 1;
+
+    while (wrk->nshards < count - 1) {
+        worker *shard = worker_create (&params);
+        if (shard == NULL) {
+            return -1;
+        }
+        shard->owner = wrk;
+        wrk->shards[wrk->nshards++] = shard;
+    }
+    return 0;
+}
+
+/**
+ * Stop the shards of an instance.
+ *
+ * The shards are detached from the instance first, so they do not send
+ * the events to it anymore, and then closed to free themselves.
+ *
+ * @param[in] wrk A pointer to the #worker of the instance.
+ **/
+void
+shard_stop (worker *wrk)
+{
+    assert (wrk != NULL);
+
+    int i;
+    for (i = 0; i < wrk->nshards; i++) {
+        worker *shard = wrk->shards[i];
+
+        pthread_mutex_lock (&shard->mutex);
+        worker_cmd_detach (&shard->cmd);
+        shard_exec (shard);
+        pthread_mutex_unlock (&shard->mutex);
+
+        close (shard->io[INOTIFY_FD]);
+    }
+
+    free (wrk->shards);
+    wrk->shards = NULL;
+    wrk->nshards = 0;
+}
+
+/**
+ * Find the worker serving a path.
+ *
+ * @param[in] wrk  A pointer to the #worker of the instance.
+ * @param[in] path A path of a user watch.
+ * @return A pointer to the #worker of the shard, NULL if the path is
+ *     served by the instance itself.
+ **/
+worker*
+shard_route (worker *wrk, const char *path)
+{
+    assert (wrk != NULL);
+    assert (path != NULL);
+
+    if (wrk->nshards == 0) {
+        return NULL;
+    }
+
+    /* djb2 */
+    unsigned long hash = 5381;
+    const unsigned char *c;
+    for (c = (const unsigned char *) path; *c != '\0'; c++) {
+        hash = hash * 33 + *c;
+    }
+
+    unsigned long index = hash % (wrk->nshards + 1);
+    return index == 0 ? NULL : wrk->shards[index - 1];
+}
+
+/**
+ * Add or modify a watch on a shard.
+ *
+ * @param[in] shard  A pointer to the #worker of the shard.
+ * @param[in] path   A file path to watch.
+ * @param[in] flags  A combination of inotify watch flags.
+ * @param[in] filter The entries to skip, may be NULL. Taken over.
+ * @return An id of the watch on success, -1 on failure.
+ **/
+int
+shard_add (worker *shard, const char *path, uint32_t flags, filter *filter)
+{
+    assert (shard != NULL);
+    assert (path != NULL);
+
+    pthread_mutex_lock (&shard->mutex);
+    worker_cmd_add_filtered (&shard->cmd, path, flags, filter);
+    int wd = shard_exec (shard);
+    pthread_mutex_unlock (&shard->mutex);
+    return wd;
+}
+
+/**
+ * Remove a watch served by a shard.
+ *
+ * The wd does not tell the shard, but it is unique in the process, so
+ * the shards not having the watch just ignore it.
+ *
+ * @param[in] wrk A pointer to the #worker of the instance.
+ * @param[in] wd  An id of the watch.
+ **/
+void
+shard_remove (worker *wrk, int wd)
+{
+    assert (wrk != NULL);
+
+    int i;
+    for (i = 0; i < wrk->nshards; i++) {
+        worker *shard = wrk->shards[i];
+
+        pthread_mutex_lock (&shard->mutex);
+        worker_cmd_remove (&shard->cmd, wd);
+        shard_exec (shard);
+        pthread_mutex_unlock (&shard->mutex);
+    }
+}
+
+/**
+ * Copy the listing of a directory watched by a shard.
+ *
+ * @param[in]  wrk     A pointer to the #worker of the instance.
+ * @param[in]  wd      An id of the watch on a directory.
+ * @param[out] entries A pointer to store the entries to.
+ * @return The number of entries on success, -1 on failure.
+ **/
+int
+shard_get_snapshot (worker *wrk, int wd, struct inotify_dirent **entries)
+{
+    assert (wrk != NULL);
+    assert (entries != NULL);
+
+    int retval = -1;
+    int i;
+    for (i = 0; i < wrk->nshards && retval == -1; i++) {
+        worker *shard = wrk->shards[i];
+
+        pthread_mutex_lock (&shard->mutex);
+        worker_cmd_snapshot (&shard->cmd, wd, entries);
+        retval = shard_exec (shard);
+        pthread_mutex_unlock (&shard->mutex);
+    }
+    return retval;
+}
+
+/**
+ * Add the counters of the shards to the counters of an instance.
+ *
+ * @param[in]     wrk   A pointer to the #worker of the instance.
+ * @param[in,out] stats The counters to add to.
+ **/
+void
+shard_stats (worker *wrk, struct inotify_stats *stats)
+{
+    assert (wrk != NULL);
+    assert (stats != NULL);
+
+    int i;
+    for (i = 0; i < wrk->nshards; i++) {
+        worker *shard = wrk->shards[i];
+        struct inotify_stats st;
+
+        pthread_mutex_lock (&shard->mutex);
+        worker_cmd_stats (&shard->cmd, &st);
+        shard_exec (shard);
+        pthread_mutex_unlock (&shard->mutex);
+
+        stats->rescans += st.rescans;
+        stats->rescans_folded += st.rescans_folded;
+        stats->kevents += st.kevents;
+        stats->batches += st.batches;
+        stats->events_merged += st.events_merged;
+        stats->events_dropped += st.events_dropped;
+        stats->storms += st.storms;
+        stats->hot_entered += st.hot_entered;
+        stats->hot_left += st.hot_left;
+    }
+}
+
+/**
+ * Pass a parameter of an instance to its shards.
+ *
+ * @param[in] wrk   A pointer to the #worker of the instance.
+ * @param[in] param A parameter id, other than IN_SHARDS.
+ * @param[in] value A new value of the parameter.
+ **/
+void
+shard_param (worker *wrk, int param, intptr_t value)
+{
+    assert (wrk != NULL);
+    assert (param != IN_SHARDS);
+
+    int i;
+    for (i = 0; i < wrk->nshards; i++) {
+        worker *shard = wrk->shards[i];
+
+        pthread_mutex_lock (&shard->mutex);
+        worker_cmd_param (&shard->cmd, param, value);
+        shard_exec (shard);
+        pthread_mutex_unlock (&shard->mutex);
+    }
+}
+
+/**
+ * Send the events produced by a shard to the inbox of its instance.
+ *
+ * Runs on the shard.
+ *
+ * @param[in] shard A pointer to the #worker of the shard.
+ **/
+void
+shard_forward (worker *shard)
+{
+    assert (shard != NULL);
+    assert (shard->owner != NULL);
+
+    if (shard->eq.count == 0) {
+        return;
+    }
+
+    worker *owner = shard->owner;
+
+    pthread_mutex_lock (&owner->inbox_mutex);
+    int was_empty = (owner->inbox.count == 0);
+    int retval = event_queue_move (&owner->inbox, &shard->eq);
+    pthread_mutex_unlock (&owner->inbox_mutex);
+
+    if (retval == -1) {
+        perror_msg ("Failed to send the events of a shard");
+    } else if (was_empty) {
+        worker_wake (owner);
+    }
+}
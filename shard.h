@@ -0,0 +1,46 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include <stdint.h> /* intptr_t */
+
+#include "worker.h"
+
+#define WORKER_MAX_SHARDS 64
+
+/* Called by the worker of an instance */
+int     shard_start        (worker *wrk, int count);
+void    shard_stop         (worker *wrk);
+worker* shard_route        (worker *wrk, const char *path);
+int     shard_add          (worker *shard, const char *path, uint32_t flags,
+                            filter *filter);
+void    shard_remove       (worker *wrk, int wd);
+int     shard_get_snapshot (worker *wrk, int wd, struct inotify_dirent **entries);
+void    shard_stats        (worker *wrk, struct inotify_stats *stats);
+void    shard_param        (worker *wrk, int param, intptr_t value);
+
+/* Called by a shard */
+void    shard_forward      (worker *shard);
+
+#endif /* __SHARD_H__ */
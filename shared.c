@@ -0,0 +1,564 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <stdlib.h> /* realloc */
+#include <string.h> /* strcmp */
+#include <unistd.h> /* close */
+#include <assert.h>
+
+#include <sys/types.h>
+
+#include "sys/inotify.h"
+#include "backend.h"
+
+#include "utils.h"
+#include "worker.h"
+#include "shared.h"
+
+/*
+ * The watches shared between the inotify instances are served by a
+ * single worker of its own, the hub. It is started with the first
+ * shared watch and is stopped when no instance is subscribed to any. An instance sharing a watch is
+ * subscribed to it: the hub copies the events of the watch to the
+ * inboxes of its subscribers, and the subscribers deliver them as their
+ * own. The wd of a shared watch is the same for all the subscribers.
+ * It is a descriptor kept open by the hub, so it never clashes with the
+ * wds of the own watches of an instance.
+ *
+ * A path is shared by the instances watching it the same way, see
+ * SHARED_KEY_FLAGS. Each subscriber chooses its events, and the hub
+ * watches for all of them.
+ */
+
+/* The flags to be the same for all the subscribers of a watch */
+#define SHARED_KEY_FLAGS (~(uint32_t) (IN_ALL_EVENTS | IN_MASK_ADD))
+
+typedef struct subscription {
+    worker *sub;    /* the subscribed instance */
+    int wd;         /* the shared watch */
+    uint32_t mask;  /* the events the instance asked for */
+} subscription;
+
+static worker *hub = NULL;
+static pthread_mutex_t hub_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Guards the subscriptions */
+static pthread_mutex_t subs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static subscription *subs = NULL;
+static size_t subs_length = 0;
+static size_t subs_allocated = 0;
+
+
+/**
+ * Execute a prepared command on the hub.
+ *
+ * Should be called with hub_mutex locked.
+ *
+ * @return The command's return value.
+ **/
+static int
+shared_exec (void)
+{
+    assert (hub != NULL);
+
+    safe_write (hub->io[INOTIFY_FD], "*", 1);
+    worker_cmd_wait (&hub->cmd);
+    return hub->cmd.retval;
+}
+
+/**
+ * Stop the hub if no instance is subscribed to a shared watch anymore.
+ *
+ * Should be called with hub_mutex locked. The hub frees itself once it
+ * sees its socket closed, like an instance closed by the user, and the
+ * next shared watch starts a new one.
+ **/
+static void
+shared_stop_idle (void)
+{
+    pthread_mutex_lock (&subs_mutex);
+    int idle = (subs_length == 0);
+    if (idle) {
+        free (subs);
+        subs = NULL;
+        subs_allocated = 0;
+    }
+    pthread_mutex_unlock (&subs_mutex);
+
+    if (hub != NULL && idle) {
+        close (hub->io[INOTIFY_FD]);
+        hub = NULL;
+    }
+}
+
+/**
+ * Share a watch with an instance, or change the events it takes from
+ * a shared watch.
+ *
+ * If the path is watched the same way by the other instances, the
+ * watch is reused, otherwise it is started by the hub. A path already
+ * shared with the instance keeps its wd.
+ *
+ * @param[in] wrk   A pointer to the #worker of the instance.
+ * @param[in] path  A path to a file to watch.
+ * @param[in] mask  A combination of the inotify watch flags.
+ * @param[in] share 0 if the watch can not be shared. The instance then
+ *     leaves the shared watch on the path, if any.
+ * @return The id of the shared watch, -1 if the watch could not be
+ *     shared and should be started by the instance itself.
+ **/
+int
+shared_add (worker *wrk, const char *path, uint32_t mask, int share)
+{
+    assert (wrk != NULL);
+    assert (path != NULL);
+
+    if (!share) {
+        pthread_mutex_lock (&subs_mutex);
+        size_t subscriptions = wrk->subscriptions;
+        pthread_mutex_unlock (&subs_mutex);
+
+        if (subscriptions == 0) {
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock (&hub_mutex);
+    if (hub == NULL) {
+        /* The metadata would be taken for all the subscribers at once */
+        worker_params params = worker_default_params;
+        params.stat_events = 0;
+        params.shards = 1;
+
+        hub = worker_create (&params);
+        if (hub == NULL) {
+            pthread_mutex_unlock (&hub_mutex);
+            return -1;
+        }
+        hub->is_hub = 1;
+    }
+
+    worker_cmd_subscribe (&hub->cmd, wrk, path, mask, share);
+    int wd = shared_exec ();
+    shared_stop_idle ();
+    pthread_mutex_unlock (&hub_mutex);
+    return wd;
+}
+
+/**
+ * Stop sharing a watch with an instance.
+ *
+ * @param[in] wrk A pointer to the #worker of the instance.
+ * @param[in] wd  An id of the shared watch.
+ * @return 0 on success, -1 if the instance is not subscribed to it.
+ **/
+int
+shared_remove (worker *wrk, int wd)
+{
+    assert (wrk != NULL);
+
+    if (!shared_has (wrk, wd)) {
+        return -1;
+    }
+
+    pthread_mutex_lock (&hub_mutex);
+    worker_cmd_unsubscribe (&hub->cmd, wrk, wd);
+    int retval = shared_exec ();
+    shared_stop_idle ();
+    pthread_mutex_unlock (&hub_mutex);
+    return retval;
+}
+
+/**
+ * Find a subscription.
+ *
+ * Should be called with subs_mutex locked.
+ *
+ * @param[in] sub A pointer to the #worker of the instance, NULL for any.
+ * @param[in] wd  An id of the shared watch.
+ * @return An index of the subscription, -1 if not found.
+ **/
+static int
+shared_find (const worker *sub, int wd)
+{
+    size_t i;
+    for (i = 0; i < subs_length; i++) {
+        if (subs[i].wd == wd && (sub == NULL || subs[i].sub == sub)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Check if an instance is subscribed to a shared watch.
+ *
+ * @param[in] wrk A pointer to the #worker of the instance.
+ * @param[in] wd  An id of a watch.
+ * @return 1 if subscribed, 0 otherwise.
+ **/
+int
+shared_has (worker *wrk, int wd)
+{
+    assert (wrk != NULL);
+
+    pthread_mutex_lock (&subs_mutex);
+    int found = wrk->subscriptions > 0 && shared_find (wrk, wd) != -1;
+    pthread_mutex_unlock (&subs_mutex);
+    return found;
+}
+
+/**
+ * Copy the cached listing of a shared watch on a directory.
+ *
+ * @param[in]  wd      An id of the shared watch.
+ * @param[out] entries A pointer to store the entries to.
+ * @return The number of entries on success, -1 on failure.
+ **/
+int
+shared_get_snapshot (int wd, struct inotify_dirent **entries)
+{
+    assert (entries != NULL);
+
+    pthread_mutex_lock (&hub_mutex);
+    int retval = -1;
+    if (hub != NULL) {
+        worker_cmd_snapshot (&hub->cmd, wd, entries);
+        retval = shared_exec ();
+    }
+    pthread_mutex_unlock (&hub_mutex);
+    return retval;
+}
+
+/**
+ * Unsubscribe an instance being closed from all the shared watches.
+ *
+ * @param[in] wrk A pointer to the #worker of the instance.
+ **/
+void
+shared_release (worker *wrk)
+{
+    assert (wrk != NULL);
+
+    if (wrk->is_hub) {
+        return;
+    }
+
+    pthread_mutex_lock (&subs_mutex);
+    size_t subscriptions = wrk->subscriptions;
+    pthread_mutex_unlock (&subs_mutex);
+
+    if (subscriptions > 0) {
+        pthread_mutex_lock (&hub_mutex);
+        worker_cmd_unsubscribe (&hub->cmd, wrk, -1);
+        shared_exec ();
+        shared_stop_idle ();
+        pthread_mutex_unlock (&hub_mutex);
+    }
+}
+
+/**
+ * Put an event to the inbox of a subscribed instance.
+ *
+ * Should be called with subs_mutex locked.
+ *
+ * @param[in] sub    A pointer to the #worker of the instance.
+ * @param[in] wd     An id of the shared watch.
+ * @param[in] mask   An inotify watch mask.
+ * @param[in] cookie Event cookie.
+ * @param[in] name   File name (may be NULL).
+ **/
+static void
+shared_post (worker      *sub,
+             int          wd,
+             uint32_t     mask,
+             uint32_t     cookie,
+             const char  *name)
+{
+    pthread_mutex_lock (&sub->inbox_mutex);
+    int was_empty = (sub->inbox.count == 0);
+    int retval = event_queue_enqueue (&sub->inbox, wd, mask, cookie, name, NULL);
+    pthread_mutex_unlock (&sub->inbox_mutex);
+
+    if (retval == -1) {
+        perror_msg ("Failed to share an inotify event %x", mask);
+    } else if (was_empty) {
+        worker_wake (sub);
+    }
+}
+
+/**
+ * Find a shared watch.
+ *
+ * @param[in] hub  A pointer to the hub #worker.
+ * @param[in] path A path to the watched file, NULL to look up by wd.
+ * @param[in] wd   An id of the shared watch, if path is NULL.
+ * @return A pointer to the #watch, NULL if not found.
+ **/
+static watch*
+shared_watch (worker *hub, const char *path, int wd)
+{
+    size_t i;
+    for (i = 0; i < hub->sets.length; i++) {
+        watch *iw = hub->sets.watches[i];
+        if (iw->type == WATCH_USER
+            && (path != NULL ? strcmp (path, iw->filename) == 0 : iw->fd == wd)) {
+            return iw;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Watch for the events any subscriber of a shared watch asked for.
+ * Runs on the hub.
+ *
+ * @param[in] hub A pointer to the hub #worker.
+ * @param[in] w   A pointer to the shared #watch.
+ * @param[in] key The SHARED_KEY_FLAGS of the watch.
+ **/
+static void
+shared_update (worker *hub, watch *w, uint32_t key)
+{
+    uint32_t events = 0;
+    size_t i;
+
+    pthread_mutex_lock (&subs_mutex);
+    for (i = 0; i < subs_length; i++) {
+        if (subs[i].wd == w->fd) {
+            events |= subs[i].mask;
+        }
+    }
+    pthread_mutex_unlock (&subs_mutex);
+
+    /* IN_POLL may be set automatically on some file systems */
+    uint32_t flags = key | events;
+    if ((flags & ~IN_POLL) != (w->flags & ~IN_POLL)) {
+        worker_add_or_modify (hub, w->filename, flags, NULL);
+    }
+}
+
+/**
+ * Start sharing a watch with an instance, or change the events the
+ * instance takes from it. Runs on the hub.
+ *
+ * @param[in] hub   A pointer to the hub #worker.
+ * @param[in] sub   A pointer to the #worker of the instance.
+ * @param[in] path  A path to a file to watch.
+ * @param[in] mask  A combination of the inotify watch flags.
+ * @param[in] share 0 if the watch can not be shared, see shared_add().
+ * @return The id of the shared watch, -1 if the path is watched another
+ *     way, the watch can not be shared or on failure.
+ **/
+int
+shared_attach (worker     *hub,
+               worker     *sub,
+               const char *path,
+               uint32_t    mask,
+               int         share)
+{
+    assert (hub != NULL);
+    assert (sub != NULL);
+    assert (path != NULL);
+
+    watch *w = shared_watch (hub, path, -1);
+    uint32_t key = mask & SHARED_KEY_FLAGS;
+    uint32_t events = mask & IN_ALL_EVENTS;
+    int found = -1;
+    size_t others = 0;
+
+    if (w != NULL) {
+        pthread_mutex_lock (&subs_mutex);
+        size_t i;
+        for (i = 0; i < subs_length; i++) {
+            if (subs[i].wd != w->fd) {
+                continue;
+            }
+            if (subs[i].sub == sub) {
+                found = i;
+                if (mask & IN_MASK_ADD) {
+                    events |= subs[i].mask;
+                }
+            } else {
+                ++others;
+            }
+        }
+        pthread_mutex_unlock (&subs_mutex);
+
+        /* A watch is changed the other way only for its only subscriber */
+        uint32_t shared_key = w->flags & SHARED_KEY_FLAGS;
+        if (others > 0 && key != shared_key && (key | IN_POLL) != shared_key) {
+            share = 0;
+        } else if (others > 0) {
+            key = shared_key;
+        }
+    }
+
+    if (!share) {
+        if (found != -1) {
+            /* The instance watches the path by itself from now on */
+            shared_detach (hub, sub, w->fd);
+        }
+        return -1;
+    }
+
+    if (w == NULL) {
+        w = worker_start_watching (hub, path, NULL, key | events, WATCH_USER, NULL, NULL);
+        if (w == NULL) {
+            return -1;
+        }
+    }
+
+    int wd = w->fd;
+
+    pthread_mutex_lock (&subs_mutex);
+    if (found != -1) {
+        subs[found].mask = events;
+    } else {
+        if (subs_length == subs_allocated) {
+            size_t to_allocate = subs_allocated ? subs_allocated * 2 : 16;
+            subscription *ptr = realloc (subs, sizeof (subscription) * to_allocate);
+            if (ptr == NULL) {
+                perror_msg ("Failed to extend the subscriptions to %d items",
+                            to_allocate);
+                int orphan = (shared_find (NULL, wd) == -1);
+                pthread_mutex_unlock (&subs_mutex);
+                if (orphan) {
+                    worker_remove (hub, wd);
+                }
+                return -1;
+            }
+            subs = ptr;
+            subs_allocated = to_allocate;
+        }
+        subs[subs_length].sub = sub;
+        subs[subs_length].wd = wd;
+        subs[subs_length].mask = events;
+        ++subs_length;
+        ++sub->subscriptions;
+    }
+    pthread_mutex_unlock (&subs_mutex);
+
+    shared_update (hub, w, key);
+    return wd;
+}
+
+/**
+ * Stop sharing watches with an instance. Runs on the hub.
+ *
+ * The watches with no subscribers left are removed.
+ *
+ * @param[in] hub A pointer to the hub #worker.
+ * @param[in] sub A pointer to the #worker of the instance.
+ * @param[in] wd  An id of the shared watch, -1 for all of them. The
+ *     instance receives IN_IGNORED only in the former case, as the
+ *     latter is used when it is closed.
+ * @return 0 on success, -1 if the instance is not subscribed.
+ **/
+int
+shared_detach (worker *hub, worker *sub, int wd)
+{
+    assert (hub != NULL);
+    assert (sub != NULL);
+
+    int retval = -1;
+    for (;;) {
+        pthread_mutex_lock (&subs_mutex);
+
+        size_t i;
+        int removed = -1;
+        for (i = 0; i < subs_length; i++) {
+            if (subs[i].sub == sub && (wd == -1 || subs[i].wd == wd)) {
+                removed = subs[i].wd;
+                subs[i] = subs[--subs_length];
+                --sub->subscriptions;
+                break;
+            }
+        }
+
+        if (removed != -1 && wd != -1) {
+            shared_post (sub, removed, IN_IGNORED, 0, NULL);
+        }
+        int orphan = (removed != -1 && shared_find (NULL, removed) == -1);
+        pthread_mutex_unlock (&subs_mutex);
+
+        if (removed == -1) {
+            break;
+        }
+        if (orphan) {
+            worker_remove (hub, removed);
+        } else {
+            watch *w = shared_watch (hub, NULL, removed);
+            if (w != NULL) {
+                shared_update (hub, w, w->flags & SHARED_KEY_FLAGS);
+            }
+        }
+        retval = 0;
+    }
+    return retval;
+}
+
+/**
+ * Copy an event of a shared watch to its subscribers. Runs on the hub.
+ *
+ * A subscriber takes only the events it asked for, and the events
+ * about the watch itself (IN_IGNORED, etc).
+ *
+ * @param[in] wd     An id of the shared watch.
+ * @param[in] mask   An inotify watch mask.
+ * @param[in] cookie Event cookie.
+ * @param[in] name   File name (may be NULL).
+ **/
+void
+shared_deliver (int wd, uint32_t mask, uint32_t cookie, const char *name)
+{
+    pthread_mutex_lock (&subs_mutex);
+    size_t i;
+    for (i = 0; i < subs_length; i++) {
+        if (subs[i].wd == wd
+            && (!(mask & IN_ALL_EVENTS) || (mask & subs[i].mask))) {
+            shared_post (subs[i].sub, wd, mask, cookie, name);
+        }
+    }
+    pthread_mutex_unlock (&subs_mutex);
+}
+
+/**
+ * Drop the subscriptions to a removed shared watch. Runs on the hub.
+ *
+ * @param[in] wd An id of the removed watch.
+ **/
+void
+shared_forget (int wd)
+{
+    pthread_mutex_lock (&subs_mutex);
+    size_t i = 0;
+    while (i < subs_length) {
+        if (subs[i].wd == wd) {
+            --subs[i].sub->subscriptions;
+            subs[i] = subs[--subs_length];
+        } else {
+            ++i;
+        }
+    }
+    pthread_mutex_unlock (&subs_mutex);
+}
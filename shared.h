@@ -0,0 +1,47 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __SHARED_H__
+#define __SHARED_H__
+
+#include <stdint.h> /* uint32_t */
+
+#include "worker.h"
+
+/* Called by the workers of the instances */
+int  shared_add          (worker *wrk, const char *path, uint32_t mask, int share);
+int  shared_remove       (worker *wrk, int wd);
+int  shared_has          (worker *wrk, int wd);
+int  shared_get_snapshot (int wd, struct inotify_dirent **entries);
+void shared_release      (worker *wrk);
+
+/* Called by the worker serving the shared watches */
+int  shared_attach  (worker     *hub,
+                     worker     *sub,
+                     const char *path,
+                     uint32_t    mask,
+                     int         share);
+int  shared_detach  (worker *hub, worker *sub, int wd);
+void shared_deliver (int wd, uint32_t mask, uint32_t cookie, const char *name);
+void shared_forget  (int wd);
+
+#endif /* __SHARED_H__ */
@@ -0,0 +1,271 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <stdlib.h>   /* calloc, free */
+#include <string.h>   /* memcpy, strlen */
+#include <stdio.h>    /* snprintf, rename */
+#include <fcntl.h>    /* open */
+#include <unistd.h>   /* close, write, unlink */
+#include <limits.h>   /* PATH_MAX */
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h> /* fstat */
+#include <sys/mman.h> /* mmap, munmap */
+
+#include "utils.h"
+#include "snapshot.h"
+
+/*
+ * A snapshot of a watched directory is a file in the snapshot store,
+ * named after the device and inode numbers of the directory, so it is
+ * found whatever path the directory is watched by. The file consists of
+ * a header, the path the directory was watched by and then of the
+ * entries of the directory:
+ *
+ *    header | path | entry | name | entry | name | ...
+ *
+ * All the records are in the host byte order and are not aligned, so
+ * they are read with memcpy.
+ */
+
+#define SNAPSHOT_MAGIC "INOSNAP1"
+
+typedef struct snapshot_header {
+    char     magic[8];
+    uint64_t dev;
+    uint64_t inode;
+    uint32_t path_len;
+    uint32_t count;
+} snapshot_header;
+
+typedef struct snapshot_entry {
+    uint64_t inode;
+    uint32_t name_len;
+    uint8_t  type;
+} snapshot_entry;
+
+/**
+ * Make a file name for a snapshot of the watched directory.
+ *
+ * @param[in]  store  A path to the snapshot store directory.
+ * @param[in]  w      A pointer to the directory #watch.
+ * @param[out] buf    A buffer for the file name.
+ * @param[in]  size   The size of the buffer.
+ * @return 0 on success, -1 if the name does not fit into the buffer.
+ **/
+static int
+snapshot_path (const char *store, const watch *w, char *buf, size_t size)
+{
+    int len = snprintf (buf, size, "%s/%016llx-%016llx",
+                        store,
+                        (unsigned long long) w->dev,
+                        (unsigned long long) w->inode);
+    return (len < 0 || (size_t) len >= size) ? -1 : 0;
+}
+
+/**
+ * Write a whole buffer to a file.
+ *
+ * @return 0 on success, -1 on failure.
+ **/
+static int
+snapshot_write (int fd, const void *data, size_t size)
+{
+    return safe_write (fd, data, size) == (ssize_t) size ? 0 : -1;
+}
+
+/**
+ * Save the contents of a watched directory to the snapshot store.
+ *
+ * The snapshot is written to a temporary file first and then is renamed,
+ * so a reader never sees a partially written snapshot.
+ *
+ * @param[in] store A path to the snapshot store directory.
+ * @param[in] w     A pointer to the directory #watch.
+ * @return 0 on success, -1 on failure.
+ **/
+int
+snapshot_save (const char *store, const watch *w)
+{
+    assert (store != NULL);
+    assert (w != NULL);
+    assert (w->type == WATCH_USER && w->is_directory);
+
+    char path[PATH_MAX], tmp_path[PATH_MAX];
+    if (snapshot_path (store, w, path, sizeof (path)) == -1
+        || snprintf (tmp_path, sizeof (tmp_path), "%s.tmp", path)
+           >= (int) sizeof (tmp_path)) {
+        perror_msg ("Snapshot path for %s is too long", w->filename);
+        return -1;
+    }
+
+    int fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror_msg ("Failed to create a snapshot %s", tmp_path);
+        return -1;
+    }
+
+    snapshot_header hdr;
+    memset (&hdr, 0, sizeof (hdr));
+    memcpy (hdr.magic, SNAPSHOT_MAGIC, sizeof (hdr.magic));
+    hdr.dev = w->dev;
+    hdr.inode = w->inode;
+    hdr.path_len = strlen (w->filename);
+
+    /* The new entries not reported yet are left to the next rescan */
+    const dep_list *iter, *pending = w->added;
+    for (iter = watch_next_known (w->deps, &pending);
+         iter != NULL;
+         iter = watch_next_known (iter->next, &pending)) {
+        ++hdr.count;
+    }
+
+    int failed = snapshot_write (fd, &hdr, sizeof (hdr))
+        || snapshot_write (fd, w->filename, hdr.path_len);
+
+    pending = w->added;
+    for (iter = watch_next_known (w->deps, &pending);
+         iter != NULL && !failed;
+         iter = watch_next_known (iter->next, &pending)) {
+        snapshot_entry ent;
+        memset (&ent, 0, sizeof (ent));
+        ent.inode = iter->inode;
+        ent.name_len = strlen (iter->path);
+        ent.type = iter->type;
+
+        failed = snapshot_write (fd, &ent, sizeof (ent))
+            || snapshot_write (fd, iter->path, ent.name_len);
+    }
+
+    if (close (fd) == -1 || failed || rename (tmp_path, path) == -1) {
+        perror_msg ("Failed to write a snapshot %s", path);
+        unlink (tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Load a snapshot of a watched directory from the snapshot store.
+ *
+ * The snapshot is removed from the store once loaded, it will be
+ * saved again when the watch is removed.
+ *
+ * @param[in]  store A path to the snapshot store directory.
+ * @param[in]  w     A pointer to the directory #watch.
+ * @param[out] found Set to 1 if a valid snapshot was found.
+ * @return The saved contents of the directory. May be NULL if the
+ *     directory was empty or if no snapshot was found.
+ **/
+dep_list*
+snapshot_load (const char *store, const watch *w, int *found)
+{
+    assert (store != NULL);
+    assert (w != NULL);
+    assert (found != NULL);
+
+    *found = 0;
+
+    char path[PATH_MAX];
+    if (snapshot_path (store, w, path, sizeof (path)) == -1) {
+        return NULL;
+    }
+
+    int fd = open (path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat (fd, &st) == -1 || st.st_size < (off_t) sizeof (snapshot_header)) {
+        close (fd);
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    const char *data = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (data == MAP_FAILED) {
+        perror_msg ("Failed to map a snapshot %s", path);
+        return NULL;
+    }
+
+    dep_list *head = NULL, *tail = NULL;
+    const char *end = data + size;
+    const char *ptr = data;
+
+    snapshot_header hdr;
+    memcpy (&hdr, ptr, sizeof (hdr));
+    ptr += sizeof (hdr);
+
+    /* The same directory may be watched by another path this time */
+    if (memcmp (hdr.magic, SNAPSHOT_MAGIC, sizeof (hdr.magic)) != 0
+        || hdr.dev != (uint64_t) w->dev
+        || hdr.inode != (uint64_t) w->inode
+        || (size_t) (end - ptr) < hdr.path_len) {
+        goto done;
+    }
+    ptr += hdr.path_len;
+
+    uint32_t i;
+    for (i = 0; i < hdr.count; i++) {
+        snapshot_entry ent;
+        if ((size_t) (end - ptr) < sizeof (ent)) {
+            goto corrupted;
+        }
+        memcpy (&ent, ptr, sizeof (ent));
+        ptr += sizeof (ent);
+
+        if ((size_t) (end - ptr) < ent.name_len) {
+            goto corrupted;
+        }
+
+        char *name = dl_name_new (ptr, ent.name_len);
+        dep_list *item = name ? dl_create (name, ent.inode) : NULL;
+        if (item == NULL) {
+            dl_name_unref (name);
+            goto corrupted;
+        }
+        item->type = ent.type;
+        ptr += ent.name_len;
+
+        if (tail) {
+            tail->next = item;
+        } else {
+            head = item;
+        }
+        tail = item;
+    }
+
+    *found = 1;
+    unlink (path);
+    goto done;
+
+corrupted:
+    perror_msg ("Ignoring a corrupted snapshot %s", path);
+    dl_free (head);
+    head = NULL;
+
+done:
+    munmap ((void *) data, size);
+    return head;
+}
@@ -0,0 +1,291 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <stdlib.h> /* calloc, free, qsort, bsearch */
+#include <string.h> /* memset, strcmp, strncmp */
+#include <fcntl.h>  /* fstatat, AT_SYMLINK_NOFOLLOW */
+#include <assert.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>  /* fstat */
+
+#include "config.h"
+
+#if defined (HAVE_STRUCT_STATFS_F_FSTYPENAME)
+#include <sys/param.h>
+#include <sys/mount.h> /* fstatfs */
+#endif
+
+#include "sys/inotify.h"
+#include "utils.h"
+#include "stat-poll.h"
+
+#if defined (HAVE_STRUCT_STATFS_F_FSTYPENAME)
+/* File systems where the vnode events miss the remote changes. A name
+ * matches also with a subtype, like "fusefs.sshfs" */
+static const char *poll_fs_types[] = {
+    "nfs",
+    "smbfs",
+    "fusefs",
+    "osxfusefs",
+    "webdav",
+    "afpfs",
+    NULL
+};
+#endif
+
+/**
+ * Check if a file resides on a file system kqueue(2) is not reliable on.
+ *
+ * @param[in] fd A file descriptor.
+ * @return 1 if the file should be polled, 0 otherwise.
+ **/
+int
+poll_needed (int fd)
+{
+#if defined (HAVE_STRUCT_STATFS_F_FSTYPENAME)
+    struct statfs sf;
+    int i;
+
+    if (fstatfs (fd, &sf) == -1) {
+        return 0;
+    }
+
+    for (i = 0; poll_fs_types[i] != NULL; i++) {
+        size_t len = strlen (poll_fs_types[i]);
+        if (strncmp (sf.f_fstypename, poll_fs_types[i], len) == 0
+            && (sf.f_fstypename[len] == '\0' || sf.f_fstypename[len] == '.')) {
+            return 1;
+        }
+    }
+#else
+    (void) fd;
+#endif
+    return 0;
+}
+
+/**
+ * Create a polling state of a watch.
+ *
+ * @param[in] fd       A file descriptor of the watched file.
+ * @param[in] interval The initial polling interval, ms.
+ * @return A pointer to a new #poll_state, NULL on failure.
+ **/
+poll_state*
+poll_create (int fd, int interval)
+{
+    poll_state *ps = calloc (1, sizeof (poll_state));
+    if (ps == NULL) {
+        perror_msg ("Failed to allocate a polling state");
+        return NULL;
+    }
+
+    poll_update (&ps->self, fd, NULL);
+    ps->interval = interval;
+    return ps;
+}
+
+/**
+ * Free a polling state.
+ *
+ * @param[in] ps A pointer to #poll_state. May be NULL.
+ **/
+void
+poll_free (poll_state *ps)
+{
+    if (ps != NULL) {
+        free (ps->entries);
+        free (ps);
+    }
+}
+
+/**
+ * Check a polled file for changes.
+ *
+ * The first check of a file, or of a file replaced with another one,
+ * only remembers its metadata.
+ *
+ * @param[in,out] pe    A pointer to #poll_entry.
+ * @param[in]     dirfd A descriptor of the directory, or of the file
+ *     itself if the name is NULL.
+ * @param[in]     name  An entry name, NULL to check dirfd itself.
+ * @return IN_MODIFY if the contents have changed, IN_ATTRIB if only the
+ *     metadata has, 0 if nothing, -1 if the file can not be checked.
+ **/
+int
+poll_update (poll_entry *pe, int dirfd, const char *name)
+{
+    assert (pe != NULL);
+
+    struct stat st;
+    int retval = (name != NULL)
+        ? fstatat (dirfd, name, &st, AT_SYMLINK_NOFOLLOW)
+        : fstat (dirfd, &st);
+    if (retval == -1) {
+        pe->known = 0;
+        return -1;
+    }
+
+    long mtime_nsec = 0, ctime_nsec = 0;
+#if defined (HAVE_STRUCT_STAT_ST_MTIM)
+    mtime_nsec = st.st_mtim.tv_nsec;
+    ctime_nsec = st.st_ctim.tv_nsec;
+#elif defined (HAVE_STRUCT_STAT_ST_MTIMESPEC)
+    mtime_nsec = st.st_mtimespec.tv_nsec;
+    ctime_nsec = st.st_ctimespec.tv_nsec;
+#endif
+
+    int mask = 0;
+    if (pe->known && pe->inode == st.st_ino) {
+        if (pe->size != st.st_size
+            || pe->mtime != st.st_mtime
+            || pe->mtime_nsec != mtime_nsec) {
+            mask = IN_MODIFY;
+        } else if (pe->mode != st.st_mode
+                   || pe->ctime != st.st_ctime
+                   || pe->ctime_nsec != ctime_nsec) {
+            mask = IN_ATTRIB;
+        }
+    }
+
+    pe->known = 1;
+    pe->inode = st.st_ino;
+    pe->mode = st.st_mode;
+    pe->size = st.st_size;
+    pe->mtime = st.st_mtime;
+    pe->mtime_nsec = mtime_nsec;
+    pe->ctime = st.st_ctime;
+    pe->ctime_nsec = ctime_nsec;
+    return mask;
+}
+
+/**
+ * Compare polled entries by their inode numbers.
+ *
+ * @param[in] a A pointer to #poll_entry.
+ * @param[in] b A pointer to #poll_entry.
+ * @return A negative, zero or positive value, as for qsort(3).
+ **/
+static int
+poll_entry_cmp (const void *a, const void *b)
+{
+    ino_t ia = ((const poll_entry *) a)->inode;
+    ino_t ib = ((const poll_entry *) b)->inode;
+    return (ia > ib) - (ia < ib);
+}
+
+/**
+ * Update the entries of a polled directory after its rescan.
+ *
+ * The entries seen before keep their metadata, so their changes made
+ * in between are still noticed. The new ones are checked right away.
+ *
+ * @param[in] ps    A pointer to #poll_state.
+ * @param[in] deps  The new listing of the directory.
+ * @param[in] dirfd A descriptor of the directory.
+ * @return 0 on success, -1 on failure.
+ **/
+int
+poll_rebuild (poll_state *ps, const dep_list *deps, int dirfd)
+{
+    assert (ps != NULL);
+
+    const dep_list *iter;
+    size_t count = 0, i, j;
+    for (iter = deps; iter != NULL; iter = iter->next) {
+        ++count;
+    }
+
+    poll_entry *entries = NULL;
+    if (count > 0) {
+        entries = calloc (count, sizeof (poll_entry));
+        if (entries == NULL) {
+            perror_msg ("Failed to allocate %d polled entries", count);
+            return -1;
+        }
+    }
+
+    for (i = 0, iter = deps; iter != NULL; i++, iter = iter->next) {
+        entries[i].inode = iter->inode;
+        entries[i].name = iter->path;
+    }
+    qsort (entries, count, sizeof (poll_entry), poll_entry_cmp);
+
+    /* Both lists are sorted, carry the metadata over in a single pass */
+    for (i = 0, j = 0; i < count; i++) {
+        while (j < ps->count && ps->entries[j].inode < entries[i].inode) {
+            ++j;
+        }
+
+        if (j < ps->count && ps->entries[j].inode == entries[i].inode) {
+            const char *name = entries[i].name;
+            entries[i] = ps->entries[j];
+            entries[i].name = name;
+        } else {
+            poll_update (&entries[i], dirfd, entries[i].name);
+        }
+    }
+
+    free (ps->entries);
+    ps->entries = entries;
+    ps->count = count;
+    if (ps->cursor >= count) {
+        ps->cursor = 0;
+    }
+    return 0;
+}
+
+/**
+ * Find a polled entry by its inode number.
+ *
+ * @param[in] ps    A pointer to #poll_state.
+ * @param[in] inode An inode number.
+ * @return A pointer to #poll_entry, NULL if not found.
+ **/
+const poll_entry*
+poll_find (const poll_state *ps, ino_t inode)
+{
+    assert (ps != NULL);
+
+    poll_entry key;
+    key.inode = inode;
+    return bsearch (&key, ps->entries, ps->count, sizeof (poll_entry), poll_entry_cmp);
+}
+
+/**
+ * Take the current metadata of a polled entry without reporting it.
+ *
+ * @param[in] ps    A pointer to #poll_state.
+ * @param[in] inode An inode number of the entry.
+ * @param[in] dirfd A descriptor of the directory.
+ * @param[in] name  The current name of the entry.
+ **/
+void
+poll_refresh (poll_state *ps, ino_t inode, int dirfd, const char *name)
+{
+    assert (ps != NULL);
+
+    poll_entry *pe = (poll_entry *) poll_find (ps, inode);
+    if (pe != NULL) {
+        poll_update (pe, dirfd, name);
+    }
+}
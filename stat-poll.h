@@ -0,0 +1,70 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __STAT_POLL_H__
+#define __STAT_POLL_H__
+
+#include <sys/types.h> /* ino_t, mode_t, off_t */
+#include <time.h>      /* time_t */
+#include <stdint.h>    /* uint32_t */
+
+#include "dep-list.h"
+
+#define POLL_SLICE   1024 /* directory entries checked per tick */
+#define POLL_BACKOFF 8    /* max factor the interval of an idle watch grows by */
+
+/**
+ * The metadata of a polled file, as seen on the last check.
+ **/
+typedef struct poll_entry {
+    ino_t inode;
+    const char *name;     /* an entry name, points to the watch's dep_list */
+    int known;            /* 0 if not checked yet */
+    mode_t mode;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+    time_t ctime;
+    long ctime_nsec;
+} poll_entry;
+
+/**
+ * The state of a watch polled with stat(2) instead of kqueue(2).
+ **/
+typedef struct poll_state {
+    poll_entry self;      /* the watched file or directory itself */
+    poll_entry *entries;  /* the entries of a directory, sorted by inode */
+    size_t count;         /* the number of entries */
+    size_t cursor;        /* the entry to check next */
+    int interval;         /* the current polling interval, ms */
+} poll_state;
+
+int         poll_needed   (int fd);
+poll_state* poll_create   (int fd, int interval);
+void        poll_free     (poll_state *ps);
+
+int         poll_update   (poll_entry *pe, int dirfd, const char *name);
+int         poll_rebuild  (poll_state *ps, const dep_list *deps, int dirfd);
+const poll_entry* poll_find (const poll_state *ps, ino_t inode);
+void        poll_refresh  (poll_state *ps, ino_t inode, int dirfd, const char *name);
+
+#endif /* __STAT_POLL_H__ */
@@ -55,13 +55,16 @@ struct inotify_event
 
 /* Additional events */
 #define IN_IGNORED       0x00008000
+#define IN_Q_OVERFLOW    0x00004000 /* Event queued overflowed.  */
 
 /* ...and flags */
 #define IN_ISDIR	     0x40000000
+#define IN_STATINFO      0x00010000 /* The event carries a struct
+                                       inotify_statinfo (libinotify-kqueue
+                                       extension, see IN_STAT_EVENTS).  */
 
 /* These flags are unsupported, but still should be present */
 #define IN_UNMOUNT	     0x00002000	/* Backing fs was unmounted.  */
-#define IN_Q_OVERFLOW	 0x00004000	/* Event queued overflowed.  */
 #define IN_IGNORED	     0x00008000	/* File was ignored.  */
 
 #define IN_ONLYDIR	     0x01000000	/* Only watch the path if it is a
@@ -74,6 +77,20 @@ struct inotify_event
 #define IN_ISDIR	    0x40000000	/* Event occurred against dir.  */
 #define IN_ONESHOT	    0x80000000	/* Only send event once.  */
 
+#define IN_RECURSIVE     0x00100000 /* Watch the whole subtree of a
+                                       directory (libinotify-kqueue
+                                       extension).  */
+#define IN_POLL          0x00200000 /* Detect the changes by polling with
+                                       stat(2) rather than with kqueue(2)
+                                       (libinotify-kqueue extension).  */
+#define IN_ASYNC         0x00400000 /* Return the wd at once and watch the
+                                       entries of a directory in the
+                                       background (libinotify-kqueue
+                                       extension).  */
+#define IN_POPULATED     0x00800000 /* All the entries of a directory
+                                       watched with IN_ASYNC are watched
+                                       now (libinotify-kqueue extension).  */
+
 
 /*
  * All of the events - we build the list by hand so that we can add flags in
@@ -99,4 +116,155 @@ INO_EXPORT int inotify_add_watch (int fd, const char *name, uint32_t mask) __THR
 INO_EXPORT int inotify_rm_watch (int fd, int wd) __THROW;
 
 
+/*
+ * libinotify-kqueue specific extensions.
+ */
+
+/* Parameters for libinotify_set_param.  */
+#define IN_DEBOUNCE_MSEC 0 /* Fold directory changes arriving within this
+                              window (in ms) into a single rescan. 0 to
+                              rescan on every change (default).  */
+#define IN_SNAPSHOT_DIR  1 /* A directory (const char *) to save directory
+                              snapshots to when the watches are removed,
+                              and to load them from when the watches are
+                              added again. NULL to disable (default).  */
+#define IN_COALESCE      2 /* Merge an event into the previous one if they
+                              are identical, as Linux does. 1 (default) to
+                              enable, 0 to disable.  */
+#define IN_MAX_QUEUED_EVENTS 3 /* The maximum number of events waiting
+                              for delivery. Further events are dropped
+                              and a single IN_Q_OVERFLOW is queued.
+                              Default is 16384.  */
+#define IN_STAT_EVENTS   4 /* Attach a struct inotify_statinfo of the
+                              changed file to IN_CREATE, IN_MODIFY and
+                              IN_ATTRIB events and set IN_STATINFO in their
+                              masks. 1 to enable, 0 to disable (default).  */
+#define IN_STORM_LIMIT   5 /* The maximum number of events about the entries
+                              of a directory in a single batch. Past it, the
+                              rest are replaced with an IN_Q_OVERFLOW event
+                              with the wd of the directory. 0 for no limit
+                              (default).  */
+#define IN_POLL_MSEC     6 /* The interval (in ms) the IN_POLL watches are
+                              checked at after a change. It grows up to 8
+                              times while nothing changes. Default is
+                              1000.  */
+#define IN_HOT_RATE      7 /* The number of changes a second which make a
+                              directory hot: its changes are then folded
+                              into rescans every IN_HOT_MSEC until the rate
+                              drops below a half. 0 to disable (default).  */
+#define IN_HOT_MSEC      8 /* The rescan interval (in ms) of the hot
+                              directories. Default is 250.  */
+#define IN_SHARED        9 /* Share the watches with the other instances
+                              having it set: the same path watched the
+                              same way is watched once in the process and
+                              the events are copied to every instance that
+                              asked for them. A shared path has the same
+                              wd in all the instances, whatever events
+                              each of them asked for. The watches with a
+                              filter or IN_ONESHOT, and all the watches
+                              of an instance with IN_STAT_EVENTS set, are
+                              not shared. 1 to enable, 0 to disable
+                              (default).  */
+#define IN_SHARDS       10 /* The number of threads (up to 64) serving the
+                              watches of an instance, each with its own
+                              kqueue. The watches are spread between them
+                              by path. Can be changed only until a watch
+                              is added. Default is 1.  */
+#define IN_OPEN_THREADS 11 /* The number of helper threads (up to 32) to
+                              open the entries of a large directory being
+                              watched with. 0 to open them on the worker
+                              thread only (default).  */
+#define IN_SLICE        12 /* The number of directory entries listed or
+                              watched at a time before the worker serves
+                              the commands and the other events. 0 to
+                              handle a directory at once. Default is
+                              1024.  */
+#define IN_THREAD_CPUS  13 /* The CPUs the worker threads may run on (a
+                              const int * casted to intptr_t, the CPU
+                              numbers up to 1023 terminated with -1). 0 to
+                              let them run anywhere (default).  */
+#define IN_THREAD_STACK 14 /* The stack size of the worker threads in
+                              bytes. Set only with FD -1, for the instances
+                              created later; fails with EBUSY for a running
+                              instance. 0 for the system default
+                              (default).  */
+#define IN_THREAD_POLICY 15 /* The scheduling policy of the worker threads
+                              (SCHED_OTHER, SCHED_FIFO or SCHED_RR). -1 to
+                              inherit the one of the caller (default).  */
+#define IN_THREAD_PRIORITY 16 /* The scheduling priority of the worker
+                              threads with IN_THREAD_POLICY. Default is
+                              0.  */
+#define IN_THREAD_NAME  17 /* The name of the worker threads (a const
+                              char * casted to intptr_t, up to 15
+                              characters). Default is "libinotify".  */
+
+/* Counters of an inotify instance.  */
+struct inotify_stats
+{
+    uint64_t rescans;        /* Directory listings made.  */
+    uint64_t rescans_folded; /* Directory changes folded into a pending
+                                rescan.  */
+    uint64_t kevents;        /* Kernel events received.  */
+    uint64_t batches;        /* kevent() calls returned events.  */
+    uint64_t events_merged;  /* Events merged into identical previous
+                                ones.  */
+    uint64_t events_dropped; /* Events dropped on a queue overflow or
+                                past IN_STORM_LIMIT.  */
+    uint64_t storms;         /* IN_Q_OVERFLOW events sent for the
+                                directories past IN_STORM_LIMIT.  */
+    uint64_t hot_entered;    /* Directories switched to periodic rescans
+                                past IN_HOT_RATE.  */
+    uint64_t hot_left;       /* Hot directories switched back to
+                                rescans on every change.  */
+};
+
+/* File metadata attached to an event with IN_STATINFO set. It is stored
+   past the NUL-terminated name and counted in LEN, so take it with
+   libinotify_get_statinfo rather than directly.  */
+struct inotify_statinfo
+{
+    uint64_t ino;        /* Inode number.  */
+    uint64_t size;       /* Size in bytes.  */
+    int64_t mtime_sec;   /* Modification time.  */
+    uint32_t mtime_nsec;
+    uint32_t mode;       /* File type and permissions, as st_mode.  */
+};
+
+/* An entry of a watched directory, see libinotify_get_snapshot.  */
+struct inotify_dirent
+{
+    uint64_t ino;       /* Inode number.  */
+    uint32_t mask;      /* IN_ISDIR for directories, 0 otherwise.  */
+    const char *name;   /* Entry name.  */
+};
+
+/* Like inotify_add_watch, but do not watch the entries of directory NAME
+   whose names match the fnmatch(3) patterns of the NULL-terminated list
+   EXCLUDE, or, if INCLUDE is not NULL, the files whose names match none
+   of its patterns. A pattern ending with "/" matches only directories.
+   Skipped entries use no resources and produce no events. Replaces the
+   filter of an existing watch. */
+INO_EXPORT int libinotify_add_watch_filtered (int fd, const char *name, uint32_t mask,
+                                              const char *const *exclude,
+                                              const char *const *include) __THROW;
+
+/* Set parameter PARAM of the inotify instance FD to VALUE. If FD is -1,
+   set the default value for the instances created afterwards. */
+INO_EXPORT int libinotify_set_param (int fd, int param, intptr_t value) __THROW;
+
+/* Fill STATS with the counters of the inotify instance FD. */
+INO_EXPORT int libinotify_get_stats (int fd, struct inotify_stats *stats) __THROW;
+
+/* Copy the file metadata attached to EVENT to INFO. Returns -1 if
+   IN_STATINFO is not set in the event mask. */
+INO_EXPORT int libinotify_get_statinfo (const struct inotify_event *event,
+                                        struct inotify_statinfo *info) __THROW;
+
+/* Store to ENTRIES the listing of the directory watched with WD, as the
+   library knows it: the entries it watches, in no particular order, with
+   the changes reported by the events sent so far. Returns the number of
+   entries, -1 on failure. Free ENTRIES with free(3). */
+INO_EXPORT int libinotify_get_snapshot (int fd, int wd,
+                                        struct inotify_dirent **entries) __THROW;
+
 #endif /* __BSD_INOTIFY_H__ */
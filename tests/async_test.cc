@@ -0,0 +1,91 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+
+#include "async_test.hh"
+#include "core/library_client.hh"
+
+#define AST_FILES 300
+#define AST_FILES_CMD "seq -f 'f%g' 100 | xargs touch"
+
+async_test::async_test (journal &j)
+: test ("Watches populated in the background", j)
+{
+}
+
+void async_test::setup ()
+{
+    cleanup ();
+    system ("mkdir -p ast-working/flat ast-working/tree/a/b");
+    system ("cd ast-working/flat && " AST_FILES_CMD
+            " && seq -f 'g%g' 200 | xargs touch");
+    system ("cd ast-working/tree/a/b && " AST_FILES_CMD);
+}
+
+void async_test::run ()
+{
+    library_client client;
+    event_list received;
+
+    should ("watch a few entries at a time", client.set_param (IN_SLICE, 10) == 0);
+
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ASYNC;
+    int wid = client.watch ("ast-working/flat", mask);
+    should ("start watching a directory in the background", wid != -1);
+    should ("list the entries of a directory before they are watched",
+            client.snapshot (wid).size () == AST_FILES);
+
+    system ("touch ast-working/flat/new");
+    received = client.receive_until_idle (500);
+    should ("report all the entries watched once",
+            count (received, event ("", wid, IN_POPULATED)) == 1);
+    should ("not report the entries the directory had",
+            !contains (received, event ("f1", wid, IN_CREATE))
+            && !contains (received, event ("g200", wid, IN_CREATE)));
+    should ("report a file created while the entries are watched",
+            contains (received, event ("new", wid, IN_CREATE)));
+
+    system ("echo data >> ast-working/flat/g200");
+    received = client.receive_until_idle (500);
+    should ("report the changes of the entries watched in the background",
+            contains (received, event ("g200", wid, IN_MODIFY)));
+
+    int rwid = client.watch ("ast-working/tree", mask | IN_RECURSIVE);
+    should ("start watching a tree in the background", rwid != -1);
+
+    received = client.receive_until_idle (500);
+    should ("report the whole tree watched once",
+            count (received, event ("", rwid, IN_POPULATED)) == 1);
+
+    system ("echo data >> ast-working/tree/a/b/f100");
+    system ("touch ast-working/tree/a/b/new");
+    received = client.receive_until_idle (500);
+    should ("report the changes deep in a tree watched in the background",
+            contains (received, event ("a/b/f100", rwid, IN_MODIFY))
+            && contains (received, event ("a/b/new", rwid, IN_CREATE)));
+}
+
+void async_test::cleanup ()
+{
+    system ("rm -rf ast-working");
+}
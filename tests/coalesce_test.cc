@@ -0,0 +1,107 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+#include <unistd.h>
+
+#include "coalesce_test.hh"
+#include "core/library_client.hh"
+
+/* Create and remove long names a few times, more events than the
+ * socket of an instance takes */
+#define COT_ROUNDS 4
+#define COT_FILES 200
+#define COT_FILL_CMD \
+    "for n in $(seq 4); do " \
+    "seq -f \"%g-$(printf '%0240d' $n)\" 200 | xargs touch; sleep 0.3; " \
+    "rm -f ./*-*; sleep 0.3; done"
+
+coalesce_test::coalesce_test (journal &j)
+: test ("Event coalescing", j)
+{
+}
+
+void coalesce_test::setup ()
+{
+    cleanup ();
+    system ("mkdir -p cot-working/on cot-working/off");
+    system ("touch cot-working/on/file cot-working/off/file");
+}
+
+/* Modify a file a few times while the events are not read. The socket
+ * is filled first, so the worker keeps the rest of the events queued */
+static event_list modify_stalled (library_client &client,
+                                  const std::string &dir,
+                                  int &wid)
+{
+    wid = client.watch (dir, IN_CREATE | IN_DELETE | IN_MODIFY);
+
+    system (("cd " + dir + " && " COT_FILL_CMD).c_str ());
+
+    for (int i = 0; i < 5; i++) {
+        system (("echo data >> " + dir + "/file").c_str ());
+        usleep (100000);
+    }
+    return client.receive_until_idle (500);
+}
+
+void coalesce_test::run ()
+{
+    {
+        library_client client;
+        int wid = -1;
+        event_list received = modify_stalled (client, "cot-working/on", wid);
+
+        size_t created = 0, deleted = 0;
+        for (size_t i = 0; i < received.size (); i++) {
+            if (received[i].flags & IN_CREATE) {
+                ++created;
+            } else if (received[i].flags & IN_DELETE) {
+                ++deleted;
+            }
+        }
+        should ("receive the events queued behind a full socket",
+                created == COT_ROUNDS * COT_FILES
+                && deleted == COT_ROUNDS * COT_FILES);
+        should ("merge the repeated modifications queued for a slow user",
+                count (received, event ("file", wid, IN_MODIFY)) == 1);
+        should ("count the merged events", client.stats ().events_merged > 0);
+    }
+
+    {
+        library_client client;
+        should ("turn the coalescing off",
+                client.set_param (IN_COALESCE, 0) == 0);
+        int wid = -1;
+        event_list received = modify_stalled (client, "cot-working/off", wid);
+
+        should ("receive the repeated modifications without coalescing",
+                count (received, event ("file", wid, IN_MODIFY)) > 1);
+        should ("merge no events without coalescing",
+                client.stats ().events_merged == 0);
+    }
+}
+
+void coalesce_test::cleanup ()
+{
+    system ("rm -rf cot-working");
+}
@@ -0,0 +1,241 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include "library_client.hh"
+#include "log.hh"
+
+library_client::library_client ()
+: fd (inotify_init())
+{
+    assert (fd != -1);
+}
+
+library_client::~library_client ()
+{
+    close (fd);
+}
+
+int library_client::set_param (int param, intptr_t value)
+{
+    return libinotify_set_param (fd, param, value);
+}
+
+int library_client::watch (const std::string &filename, uint32_t flags)
+{
+    LOG ("LIB: Adding " << VAR (filename) << VAR (flags));
+    return inotify_add_watch (fd, filename.c_str(), flags);
+}
+
+int library_client::watch_filtered (const std::string &filename,
+                                    uint32_t flags,
+                                    const char *const exclude[],
+                                    const char *const include[])
+{
+    LOG ("LIB: Adding filtered " << VAR (filename) << VAR (flags));
+    return libinotify_add_watch_filtered (fd, filename.c_str(), flags,
+                                          exclude, include);
+}
+
+int library_client::unwatch (int wid)
+{
+    LOG ("LIB: Removing " << VAR (wid));
+    return inotify_rm_watch (fd, wid);
+}
+
+static event to_event (const struct inotify_event *ie, const char *name)
+{
+    event ev;
+    if (ie->len) {
+        ev.filename = name;
+    }
+    ev.flags = ie->mask;
+    ev.watch = ie->wd;
+    ev.cookie = ie->cookie;
+    return ev;
+}
+
+static long now_ms ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool library_client::receive_once (int timeout_ms, event_list &received, size_t *taken)
+{
+    struct pollfd pfd;
+    memset (&pfd, 0, sizeof (struct pollfd));
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    if (poll (&pfd, 1, timeout_ms) <= 0) {
+        return false;
+    }
+
+    char buffer[4096];
+    ssize_t avail = read (fd, buffer, sizeof (buffer));
+    if (avail <= 0) {
+        return false;
+    }
+
+    if (taken != NULL) {
+        *taken += avail;
+    }
+
+    /* An event may be split between the reads */
+    pending.insert (pending.end (), buffer, buffer + avail);
+
+    size_t offset = 0;
+    while (pending.size () - offset >= sizeof (struct inotify_event)) {
+        struct inotify_event ie;
+        memcpy (&ie, &pending[offset], sizeof (ie));
+        if (pending.size () - offset < sizeof (ie) + ie.len) {
+            break;
+        }
+
+        event ev = to_event (&ie, &pending[offset + sizeof (ie)]);
+
+        if (ie.mask & IN_STATINFO) {
+            /* The event may be unaligned in the buffer */
+            std::vector<uint64_t> copy ((sizeof (ie) + ie.len + 7) / 8);
+            memcpy (&copy[0], &pending[offset], sizeof (ie) + ie.len);
+
+            struct inotify_statinfo info;
+            if (libinotify_get_statinfo ((const struct inotify_event *) &copy[0],
+                                         &info) == 0) {
+                statinfos[ev.filename] = info;
+            }
+        }
+
+        LOG ("LIB: Got next event! " << VAR (ev.filename) << VAR (ev.watch) << VAR (ev.flags));
+        received.push_back (ev);
+        offset += sizeof (ie) + ie.len;
+    }
+    pending.erase (pending.begin (), pending.begin () + offset);
+    return true;
+}
+
+event_list library_client::receive_until_idle (int idle_ms)
+{
+    event_list received;
+    while (receive_once (idle_ms, received, NULL)) {
+    }
+    return received;
+}
+
+event_list library_client::receive_during (int ms)
+{
+    event_list received;
+
+    /* The data already sent is taken anyway */
+    int sent = 0;
+    ioctl (fd, FIONREAD, &sent);
+
+    size_t taken = 0;
+    long deadline = now_ms () + ms;
+    for (;;) {
+        long left = deadline - now_ms ();
+        if (left < 0) {
+            if (taken >= (size_t) sent) {
+                break;
+            }
+            left = 0;
+        }
+        if (!receive_once ((int) left, received, &taken)) {
+            break;
+        }
+    }
+    return received;
+}
+
+std::set<std::string> library_client::snapshot (int wid)
+{
+    std::set<std::string> names;
+    struct inotify_dirent *entries = NULL;
+
+    int count = libinotify_get_snapshot (fd, wid, &entries);
+    for (int i = 0; i < count; i++) {
+        names.insert (entries[i].name);
+    }
+    free (entries);
+    return names;
+}
+
+int library_client::snapshot_entries (int wid,
+                                      std::map<std::string, struct inotify_dirent> &entries)
+{
+    struct inotify_dirent *listing = NULL;
+
+    int count = libinotify_get_snapshot (fd, wid, &listing);
+    for (int i = 0; i < count; i++) {
+        /* The names are freed with the listing */
+        struct inotify_dirent entry = listing[i];
+        entry.name = NULL;
+        entries[listing[i].name] = entry;
+    }
+    free (listing);
+    return count;
+}
+
+struct inotify_stats library_client::stats ()
+{
+    struct inotify_stats st;
+    memset (&st, 0, sizeof (st));
+    libinotify_get_stats (fd, &st);
+    return st;
+}
+
+bool library_client::statinfo (const std::string &name,
+                               struct inotify_statinfo &info) const
+{
+    std::map<std::string, struct inotify_statinfo>::const_iterator it =
+        statinfos.find (name);
+    if (it == statinfos.end ()) {
+        return false;
+    }
+    info = it->second;
+    return true;
+}
+
+size_t count (const event_list &evs, const event &ev)
+{
+    event_matcher matcher (ev);
+    size_t found = 0;
+    for (size_t i = 0; i < evs.size (); i++) {
+        if (matcher (evs[i])) {
+            ++found;
+        }
+    }
+    return found;
+}
+
+bool contains (const event_list &evs, const event &ev)
+{
+    return count (evs, ev) > 0;
+}
@@ -0,0 +1,67 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __LIBRARY_CLIENT_HH__
+#define __LIBRARY_CLIENT_HH__
+
+#include <map>
+#include <vector>
+#include "platform.hh"
+#include "event.hh"
+
+/* The events in the order of arrival, with the repeated ones */
+typedef std::vector<event> event_list;
+
+/* A synchronous client of the extensions of libinotify-kqueue (see
+ * sys/inotify.h), built only with the library */
+class library_client {
+    int fd;
+    std::vector<char> pending;
+    /* The metadata of the last event with IN_STATINFO for each name */
+    std::map<std::string, struct inotify_statinfo> statinfos;
+
+    bool receive_once (int timeout_ms, event_list &received, size_t *taken);
+
+public:
+    library_client ();
+    ~library_client ();
+
+    int set_param (int param, intptr_t value);
+    int watch (const std::string &filename, uint32_t flags);
+    int watch_filtered (const std::string &filename,
+                        uint32_t flags,
+                        const char *const exclude[],
+                        const char *const include[]);
+    int unwatch (int wid);
+    event_list receive_until_idle (int idle_ms);
+    event_list receive_during (int ms);
+    std::set<std::string> snapshot (int wid);
+    int snapshot_entries (int wid,
+                          std::map<std::string, struct inotify_dirent> &entries);
+    struct inotify_stats stats ();
+    bool statinfo (const std::string &name, struct inotify_statinfo &info) const;
+};
+
+size_t count (const event_list &evs, const event &ev);
+bool   contains (const event_list &evs, const event &ev);
+
+#endif // __LIBRARY_CLIENT_HH__
@@ -0,0 +1,111 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+
+#include "debounce_test.hh"
+#include "core/library_client.hh"
+
+#define DBT_FILES 20
+
+/* All the files are created well within the window */
+#define DBT_CREATE_CMD(dir) \
+    "for i in $(seq 20); do touch " dir "/f$i; done"
+
+debounce_test::debounce_test (journal &j)
+: test ("Debounced rescans", j)
+{
+}
+
+void debounce_test::setup ()
+{
+    cleanup ();
+    system ("mkdir dbt-working dbt-plain");
+    system ("touch dbt-working/b");
+}
+
+static size_t created (const event_list &evs)
+{
+    size_t found = 0;
+    for (size_t i = 0; i < evs.size (); i++) {
+        if (evs[i].flags & IN_CREATE) {
+            ++found;
+        }
+    }
+    return found;
+}
+
+static size_t position (const event_list &evs, const event &ev)
+{
+    event_matcher matcher (ev);
+    for (size_t i = 0; i < evs.size (); i++) {
+        if (matcher (evs[i])) {
+            return i;
+        }
+    }
+    return evs.size ();
+}
+
+void debounce_test::run ()
+{
+    event_list received;
+
+    {
+        library_client client;
+        should ("set the debounce window",
+                client.set_param (IN_DEBOUNCE_MSEC, 300) == 0);
+
+        int wid = client.watch ("dbt-working", IN_CREATE | IN_MODIFY);
+        should ("start watching a directory successfully", wid != -1);
+
+        system (DBT_CREATE_CMD ("dbt-working"));
+        received = client.receive_until_idle (800);
+
+        should ("report all the files created within the window",
+                created (received) == DBT_FILES);
+        should ("fold the changes within the window into a pending rescan",
+                client.stats ().rescans_folded > 0);
+
+        /* The change of an entry flushes the pending rescan first */
+        system ("touch dbt-working/a && echo data >> dbt-working/b");
+        received = client.receive_until_idle (800);
+        size_t created_at = position (received, event ("a", wid, IN_CREATE));
+        size_t modified_at = position (received, event ("b", wid, IN_MODIFY));
+        should ("keep the order of the events with a pending rescan",
+                created_at < modified_at && modified_at < received.size ());
+    }
+
+    library_client client;
+    int wid = client.watch ("dbt-plain", IN_CREATE);
+
+    system (DBT_CREATE_CMD ("dbt-plain"));
+    received = client.receive_until_idle (500);
+    should ("report all the files created without a window",
+            wid != -1 && created (received) == DBT_FILES);
+    should ("fold no changes without a window",
+            client.stats ().rescans_folded == 0);
+}
+
+void debounce_test::cleanup ()
+{
+    system ("rm -rf dbt-working dbt-plain");
+}
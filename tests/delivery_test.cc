@@ -0,0 +1,95 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+#include <ctime>
+
+#include "delivery_test.hh"
+#include "core/library_client.hh"
+
+/* Create and remove long names a few times, more events than the
+ * socket of an instance takes */
+#define DLT_ROUNDS 4
+#define DLT_FILES 200
+#define DLT_FILL_CMD \
+    "for n in $(seq 4); do " \
+    "seq -f \"%g-$(printf '%0240d' $n)\" 200 | xargs touch; sleep 0.3; " \
+    "rm -f ./*-*; sleep 0.3; done"
+
+delivery_test::delivery_test (journal &j)
+: test ("Non-blocking delivery", j)
+{
+}
+
+void delivery_test::setup ()
+{
+    cleanup ();
+    system ("mkdir dlt-working dlt-other");
+}
+
+static long now_ms ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void delivery_test::run ()
+{
+    library_client client;
+
+    int wid = client.watch ("dlt-working", IN_CREATE | IN_DELETE);
+    should ("start watching a directory successfully", wid != -1);
+
+    /* The events are not read, the worker can not send them all */
+    system ("cd dlt-working && " DLT_FILL_CMD);
+
+    long started = now_ms ();
+    int other_wid = client.watch ("dlt-other", IN_CREATE);
+    should ("serve the commands while the socket is full",
+            other_wid != -1 && now_ms () - started < 1000);
+
+    system ("touch dlt-other/after");
+    event_list received = client.receive_until_idle (500);
+
+    size_t created = 0, deleted = 0;
+    for (size_t i = 0; i < received.size (); i++) {
+        if (received[i].watch != wid) {
+            continue;
+        }
+        if (received[i].flags & IN_CREATE) {
+            ++created;
+        } else if (received[i].flags & IN_DELETE) {
+            ++deleted;
+        }
+    }
+    should ("deliver the events held back by a full socket",
+            created == DLT_ROUNDS * DLT_FILES
+            && deleted == DLT_ROUNDS * DLT_FILES);
+    should ("deliver the events queued behind a full socket",
+            contains (received, event ("after", other_wid, IN_CREATE)));
+}
+
+void delivery_test::cleanup ()
+{
+    system ("rm -rf dlt-working dlt-other");
+}
@@ -0,0 +1,92 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+
+#include "filter_test.hh"
+#include "core/library_client.hh"
+
+filter_test::filter_test (journal &j)
+: test ("Filtered watches", j)
+{
+}
+
+void filter_test::setup ()
+{
+    cleanup ();
+    system ("mkdir -p flt-working/ex flt-working/in");
+    system ("touch flt-working/ex/old.c flt-working/ex/old.o");
+}
+
+void filter_test::run ()
+{
+    library_client client;
+    event_list received;
+
+    const char *const exclude[] = { "*.o", "skip/", NULL };
+    int ex_wid = client.watch_filtered ("flt-working/ex",
+                                        IN_CREATE | IN_MODIFY | IN_RECURSIVE,
+                                        exclude,
+                                        NULL);
+    should ("start watching with the exclusions", ex_wid != -1);
+
+    const char *const include[] = { "*.c", NULL };
+    int in_wid = client.watch_filtered ("flt-working/in",
+                                        IN_CREATE | IN_MODIFY,
+                                        NULL,
+                                        include);
+    should ("start watching with the inclusions", in_wid != -1);
+
+    std::set<std::string> names = client.snapshot (ex_wid);
+    should ("leave the excluded entries out of the listing",
+            names.count ("old.c") == 1 && names.count ("old.o") == 0);
+
+    system ("touch flt-working/ex/new.c flt-working/ex/new.o");
+    system ("echo data >> flt-working/ex/old.o");
+    received = client.receive_until_idle (500);
+    should ("report the entries not excluded",
+            contains (received, event ("new.c", ex_wid, IN_CREATE)));
+    should ("not report the excluded entries",
+            !contains (received, event ("new.o", ex_wid, IN_CREATE))
+            && !contains (received, event ("old.o", ex_wid, IN_MODIFY)));
+
+    system ("mkdir flt-working/ex/skip flt-working/ex/keep");
+    system ("touch flt-working/ex/skip/f.c flt-working/ex/keep/f.c");
+    received = client.receive_until_idle (500);
+    should ("enter the directories not excluded",
+            contains (received, event ("keep/f.c", ex_wid, IN_CREATE)));
+    should ("not enter the excluded directories",
+            !contains (received, event ("skip", ex_wid, IN_CREATE))
+            && !contains (received, event ("skip/f.c", ex_wid, IN_CREATE)));
+
+    system ("touch flt-working/in/new.c flt-working/in/new.h");
+    received = client.receive_until_idle (500);
+    should ("report the included files",
+            contains (received, event ("new.c", in_wid, IN_CREATE)));
+    should ("not report the files not included",
+            !contains (received, event ("new.h", in_wid, IN_CREATE)));
+}
+
+void filter_test::cleanup ()
+{
+    system ("rm -rf flt-working");
+}
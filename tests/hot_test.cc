@@ -0,0 +1,107 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+#include <unistd.h>
+
+#include "hot_test.hh"
+#include "core/library_client.hh"
+
+#define HTT_FILES 30
+
+/* About 20 changes a second for a second and a half: the rate is taken
+ * over a second at least. Then the hot directory is rescanned later than
+ * the other one, whichever way a file is moved */
+#define HTT_CHANGE_CMD \
+    "for i in $(seq 30); do touch htt-working/f$i; sleep 0.05; done; " \
+    "mv htt-working/f1 htt-cool/f1; mv htt-cool/g htt-working/g"
+
+hot_test::hot_test (journal &j)
+: test ("Hot directories", j)
+{
+}
+
+void hot_test::setup ()
+{
+    cleanup ();
+    system ("mkdir htt-working");
+    system ("mkdir htt-cool");
+    system ("touch htt-cool/g");
+}
+
+void hot_test::run ()
+{
+    library_client client;
+    event_list received;
+
+    should ("set the rate of the hot directories",
+            client.set_param (IN_HOT_RATE, 5) == 0
+            && client.set_param (IN_HOT_MSEC, 100) == 0);
+
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+    int wid = client.watch ("htt-working", mask);
+    int cool_wid = client.watch ("htt-cool", mask);
+    should ("start watching a directory successfully",
+            wid != -1 && cool_wid != -1);
+
+    system (HTT_CHANGE_CMD);
+    received = client.receive_until_idle (500);
+
+    size_t created = 0;
+    for (size_t i = 0; i < received.size (); i++) {
+        if (received[i].flags & IN_CREATE) {
+            ++created;
+        }
+    }
+    should ("switch a frequently changed directory to the periodic rescans",
+            client.stats ().hot_entered > 0);
+    should ("report all the changes of a hot directory",
+            created == HTT_FILES);
+    should ("pair a move out of a hot directory",
+            contains (received, event ("f1", wid, IN_MOVED_FROM))
+            && contains (received, event ("f1", cool_wid, IN_MOVED_TO))
+            && !contains (received, event ("f1", wid, IN_DELETE))
+            && !contains (received, event ("f1", cool_wid, IN_CREATE)));
+    should ("pair a move into a hot directory",
+            contains (received, event ("g", cool_wid, IN_MOVED_FROM))
+            && contains (received, event ("g", wid, IN_MOVED_TO))
+            && !contains (received, event ("g", cool_wid, IN_DELETE))
+            && !contains (received, event ("g", wid, IN_CREATE)));
+
+    /* The rate is checked on the changes, so the first one after a
+     * quiet period still closes the window of the burst */
+    usleep (1500000);
+    system ("touch htt-working/quiet1");
+    usleep (1500000);
+    system ("touch htt-working/quiet2");
+    received = client.receive_until_idle (500);
+    should ("report the changes after a quiet period",
+            contains (received, event ("quiet1", wid, IN_CREATE))
+            && contains (received, event ("quiet2", wid, IN_CREATE)));
+    should ("switch a quiet directory back to the rescans on every change",
+            client.stats ().hot_left > 0);
+}
+
+void hot_test::cleanup ()
+{
+    system ("rm -rf htt-working htt-cool");
+}
@@ -0,0 +1,170 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+#include <algorithm>
+
+#include "move_test.hh"
+
+move_test::move_test (journal &j)
+: test ("Moves between directories", j)
+{
+}
+
+void move_test::setup ()
+{
+    cleanup ();
+    system ("mkdir mvt-from");
+    system ("mkdir mvt-to");
+    system ("touch mvt-from/1");
+    system ("touch mvt-from/2");
+    system ("mkdir mvt-from/dir");
+}
+
+void move_test::run ()
+{
+    consumer cons;
+    events received;
+    events::iterator iter_from, iter_to;
+    int from_wid = 0;
+    int to_wid = 0;
+    uint32_t mask = IN_MODIFY | IN_CREATE | IN_DELETE
+                  | IN_MOVED_FROM | IN_MOVED_TO;
+
+    cons.input.setup ("mvt-from", mask);
+    cons.output.wait ();
+
+    from_wid = cons.output.added_watch_id ();
+    should ("start watching the source directory", from_wid != -1);
+
+
+    cons.output.reset ();
+    cons.input.setup ("mvt-to", mask);
+    cons.output.wait ();
+
+    to_wid = cons.output.added_watch_id ();
+    should ("start watching the target directory", to_wid != -1);
+
+
+    cons.output.reset ();
+    cons.input.receive (2);
+
+    system ("mv mvt-from/1 mvt-to/one");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+
+    iter_from = std::find_if (received.begin(),
+                              received.end(),
+                              event_matcher (event ("1", from_wid, IN_MOVED_FROM)));
+    iter_to = std::find_if (received.begin(),
+                            received.end(),
+                            event_matcher (event ("one", to_wid, IN_MOVED_TO)));
+
+    if (should ("receive IN_MOVED_FROM and IN_MOVED_TO for a move between directories",
+                iter_from != received.end () && iter_to != received.end())) {
+        should ("both events for a move between directories have the same cookie",
+                iter_from->cookie == iter_to->cookie);
+    }
+    should ("do not receive IN_DELETE and IN_CREATE for a move between directories",
+            !contains (received, event ("1", from_wid, IN_DELETE))
+            && !contains (received, event ("one", to_wid, IN_CREATE)));
+
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("echo Hello >> mvt-to/one");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_MODIFY on a file moved between directories",
+            contains (received, event ("one", to_wid, IN_MODIFY)));
+
+
+    cons.output.reset ();
+    cons.input.receive (2);
+
+    system ("mv mvt-from/dir mvt-to/dir");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+
+    iter_from = std::find_if (received.begin(),
+                              received.end(),
+                              event_matcher (event ("dir", from_wid, IN_MOVED_FROM)));
+    iter_to = std::find_if (received.begin(),
+                            received.end(),
+                            event_matcher (event ("dir", to_wid, IN_MOVED_TO)));
+
+    if (should ("receive IN_MOVED_FROM and IN_MOVED_TO for a directory move",
+                iter_from != received.end () && iter_to != received.end())) {
+        should ("both events for a directory move have the same cookie",
+                iter_from->cookie == iter_to->cookie);
+    }
+
+
+    cons.output.reset ();
+    cons.input.receive (4);
+
+    /* Whichever directory is rescanned first, it is the destination of
+     * one of the moves */
+    system ("mv mvt-from/2 mvt-to/2 && mv mvt-to/one mvt-from/one");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+
+    events::iterator iter_back_from, iter_back_to;
+    iter_from = std::find_if (received.begin(),
+                              received.end(),
+                              event_matcher (event ("2", from_wid, IN_MOVED_FROM)));
+    iter_to = std::find_if (received.begin(),
+                            received.end(),
+                            event_matcher (event ("2", to_wid, IN_MOVED_TO)));
+    iter_back_from = std::find_if (received.begin(),
+                                   received.end(),
+                                   event_matcher (event ("one", to_wid, IN_MOVED_FROM)));
+    iter_back_to = std::find_if (received.begin(),
+                                 received.end(),
+                                 event_matcher (event ("one", from_wid, IN_MOVED_TO)));
+
+    if (should ("receive IN_MOVED_FROM and IN_MOVED_TO for moves both ways",
+                iter_from != received.end () && iter_to != received.end()
+                && iter_back_from != received.end ()
+                && iter_back_to != received.end ())) {
+        should ("both events for moves both ways have the same cookie",
+                iter_from->cookie == iter_to->cookie
+                && iter_back_from->cookie == iter_back_to->cookie);
+    }
+    should ("do not receive IN_DELETE and IN_CREATE for moves both ways",
+            !contains (received, event ("2", to_wid, IN_CREATE))
+            && !contains (received, event ("one", from_wid, IN_CREATE))
+            && !contains (received, event ("2", from_wid, IN_DELETE))
+            && !contains (received, event ("one", to_wid, IN_DELETE)));
+
+    cons.input.interrupt ();
+}
+
+void move_test::cleanup ()
+{
+    system ("rm -rf mvt-from mvt-to");
+}
@@ -0,0 +1,95 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+
+#include "names_test.hh"
+#include "core/library_client.hh"
+
+#define NMT_MASK (IN_CREATE | IN_DELETE | IN_MOVE | IN_MODIFY)
+
+names_test::names_test (journal &j)
+: test ("Entry names", j)
+{
+}
+
+void names_test::setup ()
+{
+    cleanup ();
+    system ("mkdir -p nmt-working nmt-tree/sub");
+    system ("touch nmt-working/a nmt-working/b nmt-tree/sub/f");
+}
+
+void names_test::run ()
+{
+    library_client client;
+    event_list received;
+
+    int wid = client.watch ("nmt-working", NMT_MASK);
+    int tree_wid = client.watch ("nmt-tree", NMT_MASK | IN_RECURSIVE);
+    should ("start watching the directories successfully",
+            wid != -1 && tree_wid != -1);
+
+    system ("mv nmt-working/a nmt-working/c");
+    received = client.receive_until_idle (500);
+    should ("report a rename",
+            contains (received, event ("a", wid, IN_MOVED_FROM))
+            && contains (received, event ("c", wid, IN_MOVED_TO)));
+
+    system ("echo data >> nmt-working/c");
+    received = client.receive_until_idle (500);
+    should ("report a renamed entry by its new name",
+            contains (received, event ("c", wid, IN_MODIFY))
+            && !contains (received, event ("a", wid, IN_MODIFY)));
+
+    system ("mv nmt-working/c nmt-working/d");
+    client.receive_until_idle (500);
+    system ("echo data >> nmt-working/d");
+    received = client.receive_until_idle (500);
+    should ("report an entry renamed twice by its last name",
+            contains (received, event ("d", wid, IN_MODIFY)));
+
+    std::set<std::string> names = client.snapshot (wid);
+    should ("list the renamed entries by their new names",
+            names.size () == 2 && names.count ("b") && names.count ("d"));
+
+    system ("mv nmt-working/b nmt-working/d");
+    client.receive_until_idle (500);
+    system ("echo data >> nmt-working/d");
+    received = client.receive_until_idle (500);
+    names = client.snapshot (wid);
+    should ("report an entry renamed over another one by its new name",
+            contains (received, event ("d", wid, IN_MODIFY))
+            && names.size () == 1 && names.count ("d"));
+
+    system ("mv nmt-tree/sub nmt-tree/sub2");
+    client.receive_until_idle (500);
+    system ("echo data >> nmt-tree/sub2/f");
+    received = client.receive_until_idle (500);
+    should ("report the entries of a renamed subdirectory by the new path",
+            contains (received, event ("sub2/f", tree_wid, IN_MODIFY)));
+}
+
+void names_test::cleanup ()
+{
+    system ("rm -rf nmt-working nmt-tree");
+}
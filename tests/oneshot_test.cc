@@ -0,0 +1,115 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+
+#include "oneshot_test.hh"
+
+oneshot_test::oneshot_test (journal &j)
+: test ("One-shot watches", j)
+{
+}
+
+void oneshot_test::setup ()
+{
+    cleanup ();
+    system ("touch ost-working");
+    system ("mkdir ost-dir");
+}
+
+void oneshot_test::run ()
+{
+    consumer cons;
+    int wid = 0;
+    events received;
+
+    /* A watch on a file */
+    cons.input.setup ("ost-working", IN_ATTRIB | IN_ONESHOT);
+    cons.output.wait ();
+
+    wid = cons.output.added_watch_id ();
+    should ("start watching a file successfully", wid != -1);
+
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("touch ost-working");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive the first notification on a one-shot file watch",
+            contains (received, event ("", wid, IN_ATTRIB)));
+    should ("receive IN_IGNORED after the first notification on a file",
+            contains (received, event ("", wid, IN_IGNORED)));
+
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("touch ost-working");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("do not receive notifications on a fired one-shot file watch",
+            received.empty ());
+
+
+    /* A watch on a directory */
+    cons.output.reset ();
+    cons.input.setup ("ost-dir", IN_CREATE | IN_ONESHOT);
+    cons.output.wait ();
+
+    wid = cons.output.added_watch_id ();
+    should ("start watching a directory successfully", wid != -1);
+
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("touch ost-dir/1");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive the first notification on a one-shot directory watch",
+            contains (received, event ("1", wid, IN_CREATE)));
+    should ("receive IN_IGNORED after the first notification on a directory",
+            contains (received, event ("", wid, IN_IGNORED)));
+
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("touch ost-dir/2");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("do not receive notifications on a fired one-shot directory watch",
+            received.empty ());
+
+    cons.input.interrupt ();
+}
+
+void oneshot_test::cleanup ()
+{
+    system ("rm -rf ost-working ost-dir");
+}
@@ -65,10 +65,12 @@ void open_close_test::run ()
 
     cons.output.wait ();
     received = cons.output.registered ();
+#ifndef ENABLE_SIMULATED_KQUEUE
     should ("receive IN_OPEN on cat",
             contains (received, event ("", file_wid, IN_OPEN)));
     should ("receive IN_CLOSE_NOWRITE on cat",
             contains (received, event ("", file_wid, IN_CLOSE_NOWRITE)));
+#endif
 
 
     cons.output.reset ();
@@ -78,10 +80,12 @@ void open_close_test::run ()
 
     cons.output.wait ();
     received = cons.output.registered ();
+#ifndef ENABLE_SIMULATED_KQUEUE
     should ("receive IN_OPEN on ls",
             contains (received, event ("", dir_wid, IN_OPEN)));
     should ("receive IN_CLOSE_NOWRITE on ls",
             contains (received, event ("", dir_wid, IN_CLOSE_NOWRITE)));
+#endif
 
 
     cons.output.reset ();
@@ -91,10 +95,12 @@ void open_close_test::run ()
 
     cons.output.wait ();
     received = cons.output.registered ();
+#ifndef ENABLE_SIMULATED_KQUEUE
     should ("receive IN_OPEN on modify",
             contains (received, event ("", file_wid, IN_OPEN)));
     should ("receive IN_CLOSE_WRITE on modify",
             contains (received, event ("", file_wid, IN_CLOSE_WRITE)));
+#endif
 
     cons.input.interrupt ();
 }
@@ -0,0 +1,77 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+#include <sys/stat.h>
+
+#include "open_threads_test.hh"
+#include "core/library_client.hh"
+
+/* Enough entries for two helpers */
+#define OTT_FILES 600
+
+open_threads_test::open_threads_test (journal &j)
+: test ("Helper threads", j)
+{
+}
+
+void open_threads_test::setup ()
+{
+    cleanup ();
+    system ("mkdir -p ott-working/sub");
+    system ("cd ott-working && seq -f f%g 600 | xargs touch");
+}
+
+void open_threads_test::run ()
+{
+    library_client client;
+
+    should ("refuse too many helpers",
+            client.set_param (IN_OPEN_THREADS, 33) == -1);
+    should ("open the entries with helpers",
+            client.set_param (IN_OPEN_THREADS, 4) == 0);
+
+    int wid = client.watch ("ott-working", IN_CREATE | IN_DELETE | IN_MODIFY);
+    should ("start watching a large directory successfully", wid != -1);
+
+    std::map<std::string, struct inotify_dirent> entries;
+    struct stat st;
+    stat ("ott-working/f300", &st);
+    should ("list all the entries opened by the helpers",
+            client.snapshot_entries (wid, entries) == OTT_FILES + 1
+            && entries["f300"].ino == (uint64_t) st.st_ino
+            && (entries["sub"].mask & IN_ISDIR));
+
+    system ("echo data >> ott-working/f300");
+    system ("rm ott-working/f599");
+    system ("touch ott-working/new");
+    event_list received = client.receive_until_idle (500);
+    should ("watch the entries opened by the helpers",
+            contains (received, event ("f300", wid, IN_MODIFY))
+            && contains (received, event ("f599", wid, IN_DELETE))
+            && contains (received, event ("new", wid, IN_CREATE)));
+}
+
+void open_threads_test::cleanup ()
+{
+    system ("rm -rf ott-working");
+}
@@ -0,0 +1,89 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+#include <unistd.h>
+
+#include "overflow_test.hh"
+#include "core/library_client.hh"
+
+#define OFT_MAX_QUEUED 10
+
+/* Create and remove long names a few times, more events than the
+ * socket of an instance takes */
+#define OFT_ROUNDS 4
+#define OFT_FILES 200
+#define OFT_FILL_CMD \
+    "for n in $(seq 4); do " \
+    "seq -f \"%g-$(printf '%0240d' $n)\" 200 | xargs touch; sleep 0.3; " \
+    "rm -f ./*-*; sleep 0.3; done"
+
+overflow_test::overflow_test (journal &j)
+: test ("Queue overflow", j)
+{
+}
+
+void overflow_test::setup ()
+{
+    cleanup ();
+    system ("mkdir oft-working");
+}
+
+void overflow_test::run ()
+{
+    library_client client;
+
+    should ("limit the queued events",
+            client.set_param (IN_MAX_QUEUED_EVENTS, OFT_MAX_QUEUED) == 0);
+
+    int wid = client.watch ("oft-working", IN_CREATE | IN_DELETE);
+    should ("start watching a directory successfully", wid != -1);
+
+    /* The events are not read until the socket and the queue are full */
+    system ("cd oft-working && " OFT_FILL_CMD);
+
+    event_list received = client.receive_until_idle (500);
+
+    size_t changes = 0;
+    for (size_t i = 0; i < received.size (); i++) {
+        if (received[i].flags & (IN_CREATE | IN_DELETE)) {
+            ++changes;
+        }
+    }
+    should ("drop the events past the limit",
+            changes > 0 && changes < 2 * OFT_ROUNDS * OFT_FILES);
+    should ("report the overflow once",
+            count (received, event ("", -1, IN_Q_OVERFLOW)) == 1);
+    should ("report the overflow after the events queued before it",
+            !received.empty () && received.back ().flags == IN_Q_OVERFLOW);
+    should ("count the dropped events", client.stats ().events_dropped > 0);
+
+    system ("touch oft-working/after");
+    received = client.receive_until_idle (500);
+    should ("report the events after an overflow",
+            contains (received, event ("after", wid, IN_CREATE)));
+}
+
+void overflow_test::cleanup ()
+{
+    system ("rm -rf oft-working");
+}
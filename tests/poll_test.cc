@@ -0,0 +1,83 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+
+#include "poll_test.hh"
+#include "core/library_client.hh"
+
+/* The polls slow down up to 8 times while nothing changes */
+#define PLT_POLL_MSEC 50
+#define PLT_IDLE_MSEC (8 * PLT_POLL_MSEC + 500)
+
+poll_test::poll_test (journal &j)
+: test ("Polled watches", j)
+{
+}
+
+void poll_test::setup ()
+{
+    cleanup ();
+    system ("mkdir plt-working");
+    system ("touch plt-working/old plt-working/file");
+}
+
+void poll_test::run ()
+{
+    library_client client;
+    event_list received;
+
+    should ("set the poll interval",
+            client.set_param (IN_POLL_MSEC, PLT_POLL_MSEC) == 0);
+
+    int wid = client.watch ("plt-working",
+                            IN_CREATE | IN_DELETE | IN_MODIFY | IN_POLL);
+    should ("start polling a directory successfully", wid != -1);
+
+    int fwid = client.watch ("plt-working/file", IN_MODIFY | IN_POLL);
+    should ("start polling a file successfully", fwid != -1);
+
+    system ("touch plt-working/new");
+    received = client.receive_until_idle (PLT_IDLE_MSEC);
+    should ("report a new entry of a polled directory",
+            contains (received, event ("new", wid, IN_CREATE)));
+
+    system ("echo data >> plt-working/old");
+    received = client.receive_until_idle (PLT_IDLE_MSEC);
+    should ("report a modified entry of a polled directory",
+            contains (received, event ("old", wid, IN_MODIFY)));
+
+    system ("rm plt-working/old");
+    received = client.receive_until_idle (PLT_IDLE_MSEC);
+    should ("report a removed entry of a polled directory",
+            contains (received, event ("old", wid, IN_DELETE)));
+
+    system ("echo data >> plt-working/file");
+    received = client.receive_until_idle (PLT_IDLE_MSEC);
+    should ("report a modification of a polled file",
+            contains (received, event ("", fwid, IN_MODIFY)));
+}
+
+void poll_test::cleanup ()
+{
+    system ("rm -rf plt-working");
+}
@@ -0,0 +1,92 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+
+#include "recursive_test.hh"
+#include "core/library_client.hh"
+
+recursive_test::recursive_test (journal &j)
+: test ("Recursive watches", j)
+{
+}
+
+void recursive_test::setup ()
+{
+    cleanup ();
+    system ("mkdir -p rct-working/a/b rct-extra/d");
+    system ("touch rct-working/a/b/old rct-extra/d/f");
+}
+
+void recursive_test::run ()
+{
+    library_client client;
+    event_list received;
+
+    int wid = client.watch ("rct-working",
+                            IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVE
+                            | IN_RECURSIVE);
+    should ("start watching a tree successfully", wid != -1);
+
+    system ("touch rct-working/a/b/new");
+    received = client.receive_until_idle (500);
+    should ("report a file created deep in the tree by its relative path",
+            contains (received, event ("a/b/new", wid, IN_CREATE)));
+
+    system ("echo data >> rct-working/a/b/old");
+    received = client.receive_until_idle (500);
+    should ("report a modification deep in the tree",
+            contains (received, event ("a/b/old", wid, IN_MODIFY)));
+
+    system ("rm rct-working/a/b/new");
+    received = client.receive_until_idle (500);
+    should ("report a removal deep in the tree",
+            contains (received, event ("a/b/new", wid, IN_DELETE)));
+
+    system ("mv rct-extra rct-working/c");
+    received = client.receive_until_idle (500);
+    /* A move from an unwatched directory looks like a creation */
+    should ("report a directory moved into the tree",
+            contains (received, event ("c", wid, IN_MOVED_TO | IN_CREATE)));
+    should ("report the files a moved in directory already has",
+            contains (received, event ("c/d/f", wid, IN_CREATE)));
+
+    system ("touch rct-working/c/d/g");
+    received = client.receive_until_idle (500);
+    should ("watch a directory moved into the tree",
+            contains (received, event ("c/d/g", wid, IN_CREATE)));
+
+    system ("mkdir rct-working/e && touch rct-working/e/h");
+    received = client.receive_until_idle (500);
+    should ("report a directory created in the tree",
+            contains (received, event ("e", wid, IN_CREATE)));
+
+    system ("touch rct-working/e/i");
+    received = client.receive_until_idle (500);
+    should ("watch a directory created in the tree",
+            contains (received, event ("e/i", wid, IN_CREATE)));
+}
+
+void recursive_test::cleanup ()
+{
+    system ("rm -rf rct-working rct-extra");
+}
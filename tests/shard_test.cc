@@ -0,0 +1,110 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+#include <sstream>
+
+#include "shard_test.hh"
+#include "core/library_client.hh"
+
+#define SHT_DIRS 8
+
+shard_test::shard_test (journal &j)
+: test ("Sharded instances", j)
+{
+}
+
+void shard_test::setup ()
+{
+    cleanup ();
+    system ("mkdir -p sht-working/1 sht-working/2 sht-working/3 sht-working/4"
+            " sht-working/5 sht-working/6 sht-working/7 sht-working/8");
+}
+
+static std::string dir_path (int i)
+{
+    std::ostringstream os;
+    os << "sht-working/" << i;
+    return os.str ();
+}
+
+void shard_test::run ()
+{
+    library_client client;
+    event_list received;
+
+    should ("serve an instance with several threads",
+            client.set_param (IN_SHARDS, 4) == 0);
+
+    int wids[SHT_DIRS + 1];
+    std::set<int> distinct;
+    for (int i = 1; i <= SHT_DIRS; i++) {
+        wids[i] = client.watch (dir_path (i), IN_CREATE | IN_DELETE);
+        distinct.insert (wids[i]);
+    }
+    should ("start watching the directories successfully",
+            distinct.size () == SHT_DIRS && distinct.count (-1) == 0);
+    should ("not change the number of threads after a watch is added",
+            client.set_param (IN_SHARDS, 2) == -1);
+
+    system ("for i in 1 2 3 4 5 6 7 8; do touch sht-working/$i/a; done");
+    received = client.receive_until_idle (500);
+    bool all_reported = true;
+    for (int i = 1; i <= SHT_DIRS; i++) {
+        all_reported = all_reported
+            && contains (received, event ("a", wids[i], IN_CREATE));
+    }
+    should ("report the events of the watches of all the threads", all_reported);
+
+    system ("touch sht-working/1/b && rm sht-working/1/b"
+            " && touch sht-working/1/c");
+    received = client.receive_until_idle (500);
+    std::string order;
+    for (size_t i = 0; i < received.size (); i++) {
+        if (received[i].watch == wids[1]) {
+            order += received[i].filename;
+        }
+    }
+    should ("keep the order of the events of a watch",
+            order == "bbc" || order == "c");
+
+    should ("list a directory watched by another thread",
+            client.snapshot (wids[2]).count ("a") == 1);
+    should ("count the events of all the threads",
+            client.stats ().kevents > 0);
+
+    /* The thread of the watch has sent IN_IGNORED by then */
+    bool ignored = true;
+    for (int i = 1; i <= SHT_DIRS; i++) {
+        client.unwatch (wids[i]);
+        received = client.receive_during (0);
+        ignored = ignored
+            && contains (received, event ("", wids[i], IN_IGNORED));
+    }
+    should ("report IN_IGNORED once a watch of another thread is removed",
+            ignored);
+}
+
+void shard_test::cleanup ()
+{
+    system ("rm -rf sht-working");
+}
@@ -0,0 +1,110 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+
+#include "share_test.hh"
+#include "core/library_client.hh"
+
+#define SRT_DIR "srt-working"
+
+share_test::share_test (journal &j)
+: test ("Shared watches", j)
+{
+}
+
+void share_test::setup ()
+{
+    cleanup ();
+    system ("mkdir " SRT_DIR);
+}
+
+void share_test::run ()
+{
+    event_list received_a, received_b;
+
+    {
+        library_client a, b;
+        should ("share the watches of the instances",
+                a.set_param (IN_SHARED, 1) == 0 && b.set_param (IN_SHARED, 1) == 0);
+
+        int wid = a.watch (SRT_DIR, IN_CREATE);
+        should ("start watching a directory successfully", wid != -1);
+        should ("give a path the same wd for the other events",
+                b.watch (SRT_DIR, IN_DELETE) == wid);
+
+        system ("touch " SRT_DIR "/f && sleep 0.2 && rm " SRT_DIR "/f");
+        received_a = a.receive_until_idle (500);
+        received_b = b.receive_until_idle (100);
+        should ("deliver the events an instance asked for",
+                contains (received_a, event ("f", wid, IN_CREATE))
+                && contains (received_b, event ("f", wid, IN_DELETE)));
+        should ("not deliver the events an instance did not ask for",
+                !contains (received_a, event ("f", wid, IN_DELETE))
+                && !contains (received_b, event ("f", wid, IN_CREATE)));
+
+        should ("keep the wd of a path when its events are added",
+                a.watch (SRT_DIR, IN_MODIFY | IN_MASK_ADD) == wid);
+        system ("touch " SRT_DIR "/g && sleep 0.2 && echo data >> " SRT_DIR "/g");
+        received_a = a.receive_until_idle (500);
+        should ("deliver the added events",
+                contains (received_a, event ("g", wid, IN_CREATE))
+                && contains (received_a, event ("g", wid, IN_MODIFY)));
+        b.receive_until_idle (100);
+
+        library_client c;
+        c.set_param (IN_SHARED, 1);
+        int own_wid = c.watch (SRT_DIR, IN_DELETE | IN_ONESHOT);
+        should ("not share a watch with IN_ONESHOT",
+                own_wid != -1 && own_wid != wid);
+
+        a.unwatch (wid);
+        received_a = a.receive_until_idle (100);
+        should ("send IN_IGNORED to an instance leaving a shared watch",
+                contains (received_a, event ("", wid, IN_IGNORED)));
+
+        system ("rm " SRT_DIR "/g");
+        received_b = b.receive_until_idle (500);
+        should ("keep a shared watch for the other instances",
+                contains (received_b, event ("g", wid, IN_DELETE)));
+    }
+
+    /* The shared watches are served anew once all the instances are gone */
+    library_client d, e;
+    d.set_param (IN_SHARED, 1);
+    e.set_param (IN_SHARED, 1);
+    int wid = d.watch (SRT_DIR, IN_CREATE);
+    should ("share a watch again after all the instances are closed",
+            wid != -1 && e.watch (SRT_DIR, IN_CREATE) == wid);
+
+    system ("touch " SRT_DIR "/h");
+    received_a = d.receive_until_idle (500);
+    received_b = e.receive_until_idle (100);
+    should ("deliver the events of a watch shared again",
+            contains (received_a, event ("h", wid, IN_CREATE))
+            && contains (received_b, event ("h", wid, IN_CREATE)));
+}
+
+void share_test::cleanup ()
+{
+    system ("rm -rf " SRT_DIR);
+}
@@ -0,0 +1,102 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+
+#include "slice_test.hh"
+#include "core/library_client.hh"
+
+#define SLT_FILES 500
+#define SLT_FILES_CMD "seq -f 'f%g' 500"
+
+slice_test::slice_test (journal &j)
+: test ("Sliced rescans", j)
+{
+}
+
+void slice_test::setup ()
+{
+    cleanup ();
+    system ("mkdir slt-working");
+    system ("touch slt-working/old");
+}
+
+void slice_test::run ()
+{
+    library_client client;
+
+    should ("report one new entry a slice",
+            client.set_param (IN_SLICE, 1) == 0);
+
+    int wid = client.watch ("slt-working", IN_CREATE);
+    should ("start watching a directory successfully", wid != -1);
+
+    std::set<std::string> reported;
+    reported.insert ("old");
+
+    /* The snapshots are taken while the files are created and reported */
+    system ("(cd slt-working && " SLT_FILES_CMD " | xargs -n 50 touch) &");
+
+    /* Every name in a snapshot must be reported, the unreported new
+     * entries are left to the later snapshots. The events produced with
+     * a snapshot are sent by the time the next one is taken */
+    bool only_reported = true;
+    for (int i = 0; i < 200 && reported.size () <= SLT_FILES; i++) {
+        std::set<std::string> names = client.snapshot (wid);
+        client.snapshot (wid);
+
+        event_list received = client.receive_during (5);
+        for (size_t j = 0; j < received.size (); j++) {
+            if (received[j].flags & IN_CREATE) {
+                reported.insert (received[j].filename);
+            }
+        }
+
+        for (std::set<std::string>::iterator it = names.begin ();
+             it != names.end ();
+             ++it) {
+            if (reported.find (*it) == reported.end ()) {
+                LOG ("SLT: Not reported " << VAR (*it));
+                only_reported = false;
+            }
+        }
+    }
+
+    should ("list only the reported entries in the snapshots during a rescan",
+            only_reported);
+
+    event_list received = client.receive_until_idle (500);
+    for (size_t j = 0; j < received.size (); j++) {
+        if (received[j].flags & IN_CREATE) {
+            reported.insert (received[j].filename);
+        }
+    }
+    should ("report all the new entries of a directory",
+            reported.size () == SLT_FILES + 1);
+    should ("list all the reported entries in a snapshot after a rescan",
+            client.snapshot (wid) == reported);
+}
+
+void slice_test::cleanup ()
+{
+    system ("rm -rf slt-working");
+}
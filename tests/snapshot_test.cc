@@ -0,0 +1,93 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+#include <sys/stat.h>
+
+#include "snapshot_test.hh"
+#include "core/library_client.hh"
+
+typedef std::map<std::string, struct inotify_dirent> entry_map;
+
+snapshot_test::snapshot_test (journal &j)
+: test ("Directory snapshots", j)
+{
+}
+
+void snapshot_test::setup ()
+{
+    cleanup ();
+    system ("mkdir -p snt-working/sub");
+    system ("touch snt-working/a snt-working/b");
+}
+
+static uint64_t inode_of (const char *path)
+{
+    struct stat st;
+    return (stat (path, &st) == 0) ? st.st_ino : 0;
+}
+
+void snapshot_test::run ()
+{
+    library_client client;
+    entry_map entries;
+
+    int wid = client.watch ("snt-working", IN_CREATE | IN_DELETE | IN_MOVE);
+    should ("start watching a directory successfully", wid != -1);
+
+    uint64_t a_ino = inode_of ("snt-working/a");
+
+    should ("list all the entries of a directory",
+            client.snapshot_entries (wid, entries) == 3
+            && entries.count ("a") && entries.count ("b")
+            && entries.count ("sub"));
+    should ("mark the subdirectories with IN_ISDIR",
+            entries["sub"].mask == IN_ISDIR && entries["a"].mask == 0);
+    should ("list the inode numbers of the entries",
+            entries["a"].ino == a_ino
+            && entries["sub"].ino == inode_of ("snt-working/sub"));
+
+    system ("touch snt-working/c");
+    system ("rm snt-working/b");
+    system ("mv snt-working/a snt-working/d");
+    client.receive_until_idle (500);
+
+    entries.clear ();
+    should ("list the entries after the reported changes",
+            client.snapshot_entries (wid, entries) == 3
+            && entries.count ("c") && entries.count ("d")
+            && entries.count ("sub"));
+    should ("keep the inode number of a renamed entry",
+            entries["d"].ino == a_ino);
+
+    int file_wid = client.watch ("snt-working/c", IN_MODIFY);
+    entries.clear ();
+    should ("fail to list a watched file",
+            file_wid != -1 && client.snapshot_entries (file_wid, entries) == -1);
+    should ("fail to list an unknown watch",
+            client.snapshot_entries (wid + 100, entries) == -1);
+}
+
+void snapshot_test::cleanup ()
+{
+    system ("rm -rf snt-working");
+}
@@ -0,0 +1,105 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+#include <sys/stat.h>
+
+#include "statinfo_test.hh"
+#include "core/library_client.hh"
+
+statinfo_test::statinfo_test (journal &j)
+: test ("Events with file metadata", j)
+{
+}
+
+void statinfo_test::setup ()
+{
+    cleanup ();
+    system ("mkdir sit-working sit-plain");
+}
+
+void statinfo_test::run ()
+{
+    event_list received;
+    struct inotify_statinfo info;
+    struct stat st;
+
+    {
+        library_client client;
+        should ("attach the metadata to the events",
+                client.set_param (IN_STAT_EVENTS, 1) == 0);
+
+        uint32_t mask = IN_CREATE | IN_MODIFY | IN_ATTRIB | IN_DELETE;
+        int wid = client.watch ("sit-working", mask);
+        should ("start watching a directory successfully", wid != -1);
+
+        system ("printf 12345 > sit-working/f");
+        received = client.receive_until_idle (500);
+        should ("set IN_STATINFO on the events with the metadata",
+                contains (received, event ("f", wid, IN_STATINFO)));
+
+        stat ("sit-working/f", &st);
+        should ("attach the metadata of the file",
+                client.statinfo ("f", info)
+                && info.ino == (uint64_t) st.st_ino
+                && info.size == 5
+                && info.mtime_sec == (int64_t) st.st_mtime
+                && S_ISREG (info.mode));
+
+        system ("chmod 600 sit-working/f");
+        received = client.receive_until_idle (500);
+        should ("attach the new metadata to IN_ATTRIB",
+                contains (received, event ("f", wid, IN_ATTRIB))
+                && client.statinfo ("f", info)
+                && (info.mode & 0777) == 0600);
+
+        system ("mkdir sit-working/d");
+        received = client.receive_until_idle (500);
+        should ("attach the metadata of a directory",
+                client.statinfo ("d", info) && S_ISDIR (info.mode));
+
+        system ("rm sit-working/f");
+        received = client.receive_until_idle (500);
+        bool with_info = false;
+        for (size_t i = 0; i < received.size (); i++) {
+            if (received[i].flags & IN_STATINFO) {
+                with_info = true;
+            }
+        }
+        should ("attach no metadata to IN_DELETE",
+                contains (received, event ("f", wid, IN_DELETE)) && !with_info);
+    }
+
+    library_client client;
+    int wid = client.watch ("sit-plain", IN_CREATE);
+
+    system ("touch sit-plain/g");
+    received = client.receive_until_idle (500);
+    should ("attach no metadata by default",
+            contains (received, event ("g", wid, IN_CREATE))
+            && !contains (received, event ("g", wid, IN_STATINFO)));
+}
+
+void statinfo_test::cleanup ()
+{
+    system ("rm -rf sit-working sit-plain");
+}
@@ -0,0 +1,90 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+
+#include "storm_test.hh"
+#include "core/library_client.hh"
+
+#define STT_LIMIT 10
+#define STT_FILES 100
+
+storm_test::storm_test (journal &j)
+: test ("Event storms", j)
+{
+}
+
+void storm_test::setup ()
+{
+    cleanup ();
+    system ("mkdir stt-working stt-calm");
+}
+
+void storm_test::run ()
+{
+    library_client client;
+
+    /* The window folds all the files into one rescan */
+    should ("limit the events of a directory in a batch",
+            client.set_param (IN_STORM_LIMIT, STT_LIMIT) == 0
+            && client.set_param (IN_DEBOUNCE_MSEC, 200) == 0);
+
+    int wid = client.watch ("stt-working", IN_CREATE | IN_DELETE);
+    int calm_wid = client.watch ("stt-calm", IN_CREATE);
+    should ("start watching a directory successfully",
+            wid != -1 && calm_wid != -1);
+
+    system ("cd stt-working && seq -f f%g 100 | xargs touch");
+    system ("touch stt-calm/a stt-calm/b");
+    event_list received = client.receive_until_idle (500);
+
+    size_t created = 0;
+    for (size_t i = 0; i < received.size (); i++) {
+        if (received[i].watch == wid && (received[i].flags & IN_CREATE)) {
+            ++created;
+        }
+    }
+    /* A busy host may still split the files between a few rescans */
+    size_t storms = count (received, event ("", wid, IN_Q_OVERFLOW));
+    should ("tell to rescan the directory past the limit", storms > 0);
+    should ("stop reporting the entries of a directory past the limit",
+            created < STT_FILES);
+    should ("count the storms", client.stats ().storms >= storms
+            && client.stats ().events_dropped == STT_FILES - created);
+    should ("list all the entries of the directory past the limit",
+            client.snapshot (wid).size () == STT_FILES);
+    should ("report the other directories as usual",
+            contains (received, event ("a", calm_wid, IN_CREATE))
+            && contains (received, event ("b", calm_wid, IN_CREATE))
+            && !contains (received, event ("", calm_wid, IN_Q_OVERFLOW)));
+
+    system ("touch stt-working/later");
+    received = client.receive_until_idle (500);
+    should ("report the entries of the next batches",
+            contains (received, event ("later", wid, IN_CREATE))
+            && !contains (received, event ("", wid, IN_Q_OVERFLOW)));
+}
+
+void storm_test::cleanup ()
+{
+    system ("rm -rf stt-working stt-calm");
+}
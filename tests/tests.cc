@@ -29,7 +29,30 @@
 #include "update_flags_test.hh"
 #include "update_flags_dir_test.hh"
 #include "open_close_test.hh"
+#include "oneshot_test.hh"
+#include "move_test.hh"
 #include "bugs_test.hh"
+#ifdef LIBINOTIFY_EXTENSIONS
+#include "slice_test.hh"
+#include "coalesce_test.hh"
+#include "overflow_test.hh"
+#include "recursive_test.hh"
+#include "filter_test.hh"
+#include "snapshot_test.hh"
+#include "poll_test.hh"
+#include "hot_test.hh"
+#include "async_test.hh"
+#include "shard_test.hh"
+#include "warm_restart_test.hh"
+#include "share_test.hh"
+#include "debounce_test.hh"
+#include "delivery_test.hh"
+#include "statinfo_test.hh"
+#include "storm_test.hh"
+#include "open_threads_test.hh"
+#include "thread_params_test.hh"
+#include "names_test.hh"
+#endif
 
 #define CONCURRENT
 
@@ -44,8 +67,31 @@ int main (int argc, char *argv[]) {
         new update_flags_test (j),
         new update_flags_dir_test (j),
         new open_close_test (j),
+        new oneshot_test (j),
+        new move_test (j),
         new fail_test (j),
         new bugs_test (j),
+#ifdef LIBINOTIFY_EXTENSIONS
+        new slice_test (j),
+        new coalesce_test (j),
+        new overflow_test (j),
+        new recursive_test (j),
+        new filter_test (j),
+        new snapshot_test (j),
+        new poll_test (j),
+        new hot_test (j),
+        new async_test (j),
+        new shard_test (j),
+        new warm_restart_test (j),
+        new share_test (j),
+        new debounce_test (j),
+        new delivery_test (j),
+        new statinfo_test (j),
+        new storm_test (j),
+        new open_threads_test (j),
+        new thread_params_test (j),
+        new names_test (j),
+#endif
     };
     const int num_tests = sizeof(tests)/sizeof(tests[0]);
 
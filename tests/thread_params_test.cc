@@ -0,0 +1,148 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <sched.h>
+#include <sstream>
+#ifdef __linux__
+#  include <dirent.h>
+#endif
+
+#include "thread_params_test.hh"
+#include "core/library_client.hh"
+
+#define TPT_NAME "ino-params"
+
+thread_params_test::thread_params_test (journal &j)
+: test ("Thread parameters", j)
+{
+}
+
+void thread_params_test::setup ()
+{
+    cleanup ();
+    system ("mkdir tpt-working");
+}
+
+#ifdef __linux__
+/* The status of a thread of the process with the given name, empty if
+ * there is none */
+static std::string thread_status (const std::string &name)
+{
+    DIR *dir = opendir ("/proc/self/task");
+    if (dir == NULL) {
+        return "";
+    }
+
+    std::string status;
+    struct dirent *ent;
+    while (status.empty () && (ent = readdir (dir)) != NULL) {
+        std::string task = std::string ("/proc/self/task/") + ent->d_name;
+        std::ifstream comm ((task + "/comm").c_str ());
+        std::string comm_name;
+        if (std::getline (comm, comm_name) && comm_name == name) {
+            std::ifstream file ((task + "/status").c_str ());
+            std::string line;
+            while (std::getline (file, line)) {
+                status += line + "\n";
+            }
+        }
+    }
+    closedir (dir);
+    return status;
+}
+#endif
+
+void thread_params_test::run ()
+{
+    {
+        library_client client;
+
+        static const int bad_cpus[] = { 5000, -1 };
+        should ("refuse a CPU out of range",
+                client.set_param (IN_THREAD_CPUS, (intptr_t) bad_cpus) == -1);
+        should ("refuse an unknown scheduling policy",
+                client.set_param (IN_THREAD_POLICY, 12345) == -1);
+        should ("refuse a thread name too long",
+                client.set_param (IN_THREAD_NAME,
+                                  (intptr_t) "a-name-too-long-to-fit") == -1);
+        errno = 0;
+        should ("refuse the stack size of a running instance",
+                client.set_param (IN_THREAD_STACK, 1 << 20) == -1
+                && errno == EBUSY);
+
+        should ("take a thread name",
+                client.set_param (IN_THREAD_NAME, (intptr_t) TPT_NAME) == 0);
+        should ("take a scheduling policy",
+                client.set_param (IN_THREAD_POLICY, SCHED_OTHER) == 0
+                && client.set_param (IN_THREAD_PRIORITY, 0) == 0);
+
+#ifdef __linux__
+        /* Take a CPU this process may run on */
+        cpu_set_t allowed;
+        int cpu = 0;
+        if (sched_getaffinity (0, sizeof (allowed), &allowed) == 0) {
+            while (cpu < CPU_SETSIZE - 1 && !CPU_ISSET (cpu, &allowed)) {
+                ++cpu;
+            }
+        }
+        int cpus[] = { cpu, -1 };
+        should ("take the CPUs of the threads",
+                client.set_param (IN_THREAD_CPUS, (intptr_t) cpus) == 0);
+
+        std::string status = thread_status (TPT_NAME);
+        std::ostringstream cpu_line;
+        cpu_line << "Cpus_allowed_list:\t" << cpu << "\n";
+        should ("name the thread of an instance", !status.empty ());
+        should ("bind the thread of an instance to the CPUs",
+                status.find (cpu_line.str ()) != std::string::npos);
+#endif
+
+        int wid = client.watch ("tpt-working", IN_CREATE);
+        system ("touch tpt-working/f");
+        event_list received = client.receive_until_idle (500);
+        should ("serve the watches with the parameters set",
+                contains (received, event ("f", wid, IN_CREATE)));
+    }
+
+    should ("refuse a stack size too small",
+            libinotify_set_param (-1, IN_THREAD_STACK, 1) == -1);
+    should ("take the stack size of the instances created later",
+            libinotify_set_param (-1, IN_THREAD_STACK, 1 << 20) == 0);
+    {
+        library_client client;
+        libinotify_set_param (-1, IN_THREAD_STACK, 0);
+
+        int wid = client.watch ("tpt-working", IN_DELETE);
+        system ("rm tpt-working/f");
+        event_list received = client.receive_until_idle (500);
+        should ("serve the watches with the stack size set",
+                contains (received, event ("f", wid, IN_DELETE)));
+    }
+}
+
+void thread_params_test::cleanup ()
+{
+    system ("rm -rf tpt-working");
+}
@@ -0,0 +1,110 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cstdlib>
+#include <unistd.h>
+
+#include "warm_restart_test.hh"
+#include "core/library_client.hh"
+
+#define WRT_STORE "wrt-store"
+#define WRT_MASK (IN_CREATE | IN_DELETE | IN_MOVE)
+
+warm_restart_test::warm_restart_test (journal &j)
+: test ("Warm restarts", j)
+{
+}
+
+void warm_restart_test::setup ()
+{
+    cleanup ();
+    system ("mkdir -p wrt-working/dir " WRT_STORE);
+    system ("touch wrt-working/dir/a wrt-working/dir/b wrt-working/dir/c");
+}
+
+/* The snapshot is saved by the worker once it sees the instance closed */
+static bool wait_for_snapshot ()
+{
+    for (int i = 0; i < 200; i++) {
+        if (system ("test -n \"$(ls " WRT_STORE ")\"") == 0) {
+            return true;
+        }
+        usleep (50000);
+    }
+    return false;
+}
+
+void warm_restart_test::run ()
+{
+    event_list received;
+
+    {
+        library_client client;
+        should ("set the snapshot store",
+                client.set_param (IN_SNAPSHOT_DIR, (intptr_t) WRT_STORE) == 0);
+        should ("start watching a directory successfully",
+                client.watch ("wrt-working/dir", WRT_MASK) != -1);
+    }
+    should ("save a snapshot when the instance is closed",
+            wait_for_snapshot ());
+
+    system ("touch wrt-working/dir/x");
+    system ("rm wrt-working/dir/a");
+    system ("mv wrt-working/dir/b wrt-working/dir/d");
+
+    {
+        library_client client;
+        client.set_param (IN_SNAPSHOT_DIR, (intptr_t) WRT_STORE);
+        int wid = client.watch ("wrt-working/dir", WRT_MASK);
+        received = client.receive_until_idle (500);
+
+        should ("report the entries created while not watched",
+                contains (received, event ("x", wid, IN_CREATE)));
+        should ("report the entries removed while not watched",
+                contains (received, event ("a", wid, IN_DELETE)));
+        should ("report the entries renamed while not watched",
+                contains (received, event ("b", wid, IN_MOVED_FROM))
+                && contains (received, event ("d", wid, IN_MOVED_TO)));
+        should ("not report the entries left intact",
+                !contains (received, event ("c", wid, IN_CREATE)));
+    }
+    should ("save a snapshot again when the instance is closed",
+            wait_for_snapshot ());
+
+    system ("touch wrt-working/dir/y");
+
+    {
+        library_client client;
+        client.set_param (IN_SNAPSHOT_DIR, (intptr_t) WRT_STORE);
+        int wid = client.watch ("./wrt-working/dir", WRT_MASK);
+        received = client.receive_until_idle (500);
+
+        should ("find the snapshot of a directory watched by another path",
+                contains (received, event ("y", wid, IN_CREATE))
+                && !contains (received, event ("c", wid, IN_CREATE)));
+    }
+}
+
+void warm_restart_test::cleanup ()
+{
+    system ("rm -rf wrt-working " WRT_STORE);
+}
@@ -42,6 +42,7 @@
 
 #include "sys/inotify.h"
 #include "utils.h"
+#include "compat.h"
 
 #include "config.h"
 
@@ -78,48 +79,6 @@ path_concat (const char *dir, const char *file)
     return path;
 }
 
-/**
- * Create a new inotify event.
- *
- * @param[in] wd     An associated watch's id.
- * @param[in] mask   An inotify watch mask.
- * @param[in] cookie Event cookie.
- * @param[in] name   File name (may be NULL).
- * @param[out] event_len The length of the created event, in bytes.
- * @return A pointer to a created event on NULL on a failure.
- **/
-struct inotify_event*
-create_inotify_event (int         wd,
-                      uint32_t    mask,
-                      uint32_t    cookie,
-                      const char *name,
-                      size_t     *event_len)
-{
-    struct inotify_event *event = NULL;
-    size_t name_len = name ? strlen (name) + 1 : 0;
-    *event_len = sizeof (struct inotify_event) + name_len;
-    event = calloc (1, *event_len);
-
-    if (event == NULL) {
-        perror_msg ("Failed to allocate a new inotify event [%s, %X]",
-                    name,
-                    mask);
-        return NULL;
-    }
-
-    event->wd = wd;
-    event->mask = mask;
-    event->cookie = cookie;
-    event->len = name_len;
-
-    if (name) {
-        strlcpy (event->name, name, name_len);
-    }
-
-    return event;
-}
-
-
 #define SAFE_GENERIC_OP(fcn, fd, data, size)    \
     size_t total = 0;                           \
     if (fd == -1) {                             \
@@ -287,6 +246,29 @@ is_opened (int fd)
     return ret;
 }
 
+/**
+ * Set or clear the O_NONBLOCK flag of a file descriptor.
+ *
+ * @param[in] fd    A file descriptor.
+ * @param[in] value 1 to set the flag, 0 to clear it.
+ * @return 0 on success, -1 on failure.
+ **/
+int
+set_nonblock_flag (int fd, int value)
+{
+    int flags = fcntl (fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+
+    if (value) {
+        flags |= O_NONBLOCK;
+    } else {
+        flags &= ~O_NONBLOCK;
+    }
+    return fcntl (fd, F_SETFL, flags);
+}
+
 /**
  * Check if the file referenced by specified descriptor is deleted.
  *
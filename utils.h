@@ -30,17 +30,12 @@
 
 char* path_concat (const char *dir, const char *file);
 
-struct inotify_event* create_inotify_event (int         wd,
-                                            uint32_t    mask,
-                                            uint32_t    cookie,
-                                            const char *name,
-                                            size_t     *event_len);
-
 ssize_t safe_read   (int fd, void *data, size_t size);
 ssize_t safe_write  (int fd, const void *data, size_t size);
 ssize_t safe_writev (int fd, const struct iovec iov[], int iovcnt);
 
 int is_opened (int fd);
+int set_nonblock_flag (int fd, int value);
 int is_deleted (int fd);
 
 void perror_msg (const char *msg, ...);
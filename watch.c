@@ -27,24 +27,28 @@
 #include <assert.h>
 
 #include <sys/types.h>
-#include <sys/event.h> /* kevent */
 #include <sys/stat.h> /* stat */
 #include <stdio.h>    /* snprintf */
 
+#include "config.h"
+#include "backend.h"
 #include "utils.h"
 #include "conversions.h"
 #include "watch.h"
+#include "stat-poll.h"
 #include "sys/inotify.h"
 
 /**
  * Get some file information by its file descriptor.
  *
  * @param[in]  fd      A file descriptor.
+ * @param[in]  pst     The file status if already taken, NULL otherwise.
  * @param[out] is_dir  A flag indicating directory.
+ * @param[out] dev     A file's device number.
  * @param[out] inode   A file's inode number.
  **/
 static void
-_file_information (int fd, int *is_dir, ino_t *inode)
+_file_information (int fd, const struct stat *pst, int *is_dir, dev_t *dev, ino_t *inode)
 {
     assert (fd != -1);
     assert (is_dir != NULL);
@@ -53,7 +57,9 @@ _file_information (int fd, int *is_dir, ino_t *inode)
     struct stat st;
     memset (&st, 0, sizeof (struct stat));
 
-    if (fstat (fd, &st) == -1) {
+    if (pst != NULL) {
+        st = *pst;
+    } else if (fstat (fd, &st) == -1) {
         perror_msg ("fstat failed on %d, assuming it is just a file", fd);
         return;
     }
@@ -62,6 +68,10 @@ _file_information (int fd, int *is_dir, ino_t *inode)
         *is_dir = S_ISDIR (st.st_mode);
     }
 
+    if (dev != NULL) {
+        *dev = st.st_dev;
+    }
+
     if (inode != NULL) {
         *inode = st.st_ino;
     }
@@ -98,19 +108,70 @@ watch_register_event (watch *w, int kq, uint32_t fflags)
             EV_ADD | EV_ENABLE | EV_CLEAR,
             fflags,
             0,
-            NULL);
+            (void *) w->serial);
 
     return kevent (kq, &ev, 1, NULL, 0, NULL);
 }
 
+/**
+ * Arm a one-shot kqueue(2) timer for a watch.
+ *
+ * The timer is identified by the watch's file descriptor and serial,
+ * so the EVFILT_TIMER event can be matched back to the watch.
+ *
+ * @param[in] w    A pointer to a watch
+ * @param[in] kq   A kqueue descriptor
+ * @param[in] msec A timeout in milliseconds
+ * @return 0 on success, -1 on error
+ **/
+int
+watch_register_timer (watch *w, int kq, int msec)
+{
+    assert (w != NULL);
+    assert (kq != -1);
+
+    struct kevent ev;
+
+    EV_SET (&ev,
+            w->fd,
+            EVFILT_TIMER,
+            EV_ADD | EV_ENABLE | EV_ONESHOT,
+            0,
+            msec,
+            (void *) w->serial);
+
+    return kevent (kq, &ev, 1, NULL, 0, NULL);
+}
+
+/**
+ * Disarm a timer registered with watch_register_timer().
+ *
+ * @param[in] w  A pointer to a watch
+ * @param[in] kq A kqueue descriptor
+ **/
+void
+watch_unregister_timer (watch *w, int kq)
+{
+    assert (w != NULL);
+    assert (kq != -1);
+
+    struct kevent ev;
+
+    EV_SET (&ev, w->fd, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+    kevent (kq, &ev, 1, NULL, 0, NULL);
+}
+
 /**
  * Initialize a watch.
  *
  * @param[in,out] w          A pointer to a watch.
  * @param[in]     watch_type The type of the watch.
  * @param[in]     kq         A kqueue descriptor.
+ * @param[in]     serial     A unique id of the watch, passed as udata
+ *     with its kqueue events.
  * @param[in]     path       A full path to a file.
- * @param[in]     entry_name A name of a watched file (for dependency watches).
+ * @param[in]     entry_name A name of a watched file from the listing of
+ *     its directory, see dl_name_new() (for dependency watches).
  * @param[in]     flags      A combination of the inotify watch flags.
  * @return 0 on success, -1 on failure.
  **/
@@ -118,6 +179,7 @@ int
 watch_init (watch         *w,
             watch_type_t   watch_type,
             int            kq,
+            uintptr_t      serial,
             const char    *path,
             const char    *entry_name,
             uint32_t       flags)
@@ -125,30 +187,79 @@ watch_init (watch         *w,
     assert (w != NULL);
     assert (path != NULL);
 
-    memset (w, 0, sizeof (watch));
-
-    w->fd = open (path, O_RDONLY);
-    if (w->fd == -1) {
+    int fd = open (path, O_RDONLY);
+    if (fd == -1) {
         perror_msg ("Failed to open file %s", path);
+        memset (w, 0, sizeof (watch));
+        w->fd = -1;
         return -1;
     }
 
+    return watch_init_opened (w, watch_type, kq, serial, fd, NULL,
+                              path, entry_name, flags);
+}
+
+/**
+ * Initialize a watch on an already opened file.
+ *
+ * @param[in,out] w          A pointer to a watch.
+ * @param[in]     watch_type The type of the watch.
+ * @param[in]     kq         A kqueue descriptor.
+ * @param[in]     serial     A unique id of the watch.
+ * @param[in]     fd         A descriptor of the file, taken over by the
+ *     watch even on failure.
+ * @param[in]     st         The status of the file, NULL to take it.
+ * @param[in]     path       A full path to a file.
+ * @param[in]     entry_name A name of a watched file from the listing of
+ *     its directory, see dl_name_new() (for dependency watches).
+ * @param[in]     flags      A combination of the inotify watch flags.
+ * @return 0 on success, -1 on failure.
+ **/
+int
+watch_init_opened (watch             *w,
+                   watch_type_t       watch_type,
+                   int                kq,
+                   uintptr_t          serial,
+                   int                fd,
+                   const struct stat *st,
+                   const char        *path,
+                   const char        *entry_name,
+                   uint32_t           flags)
+{
+    assert (w != NULL);
+    assert (fd != -1);
+    assert (path != NULL);
+
+    memset (w, 0, sizeof (watch));
+    w->fd = fd;
+
     if (watch_type == WATCH_DEPENDENCY) {
         flags &= ~DEPS_EXCLUDED_FLAGS;
     }
 
     w->type = watch_type;
+    w->serial = serial;
     w->flags = flags;
-    w->filename = strdup (watch_type == WATCH_USER ? path : entry_name);
+    if (watch_type == WATCH_USER) {
+        w->filename = dl_name_new (path, strlen (path));
+    } else {
+        w->filename = dl_name_ref (entry_name);
+    }
 
     int is_dir = 0;
-    _file_information (w->fd, &is_dir, &w->inode);
+    _file_information (w->fd, st, &is_dir, &w->dev, &w->inode);
     w->is_really_dir = is_dir;
     w->is_directory = (watch_type == WATCH_USER ? is_dir : 0);
 
-    int is_subwatch = watch_type != WATCH_USER;
-    uint32_t fflags = inotify_to_kqueue (flags, w->is_really_dir, is_subwatch);
-    if (watch_register_event (w, kq, fflags) == -1) {
+    watch_check_link (w, path);
+
+    /* Where kqueue is not reliable, the worker polls the watch instead */
+    if (watch_type == WATCH_USER && ((flags & IN_POLL) || poll_needed (w->fd))) {
+        w->flags |= IN_POLL;
+        return 0;
+    }
+
+    if (watch_register_event (w, kq, watch_kqueue_flags (w)) == -1) {
         close (w->fd);
         w->fd = -1;
         return -1;
@@ -157,6 +268,227 @@ watch_init (watch         *w,
     return 0;
 }
 
+/**
+ * Check if a subdirectory of a recursive watch is a symbolic link.
+ *
+ * The links are not followed in the recursive mode, as they could make
+ * a loop. The check is made only when it matters, to save a syscall.
+ *
+ * @param[in] w    A pointer to a watch.
+ * @param[in] path The full path of the watched file.
+ **/
+void
+watch_check_link (watch *w, const char *path)
+{
+    assert (w != NULL);
+    assert (path != NULL);
+
+    if (w->type == WATCH_DEPENDENCY
+        && w->is_really_dir
+        && (w->flags & IN_RECURSIVE)) {
+        struct stat st;
+        w->is_link = (lstat (path, &st) == -1 || S_ISLNK (st.st_mode));
+    }
+}
+
+/**
+ * Check if the entries of a directory are watched too.
+ *
+ * It is true for the user watches on directories and, in the recursive
+ * mode (IN_RECURSIVE), for the dependency watches on subdirectories.
+ *
+ * @param[in] w A pointer to a watch.
+ * @return 1 if the watch has (or may have) dependencies, 0 otherwise.
+ **/
+int
+watch_has_dependencies (const watch *w)
+{
+    assert (w != NULL);
+
+    if (w->type == WATCH_USER) {
+        return w->is_directory;
+    }
+    return w->is_really_dir && !w->is_link && (w->flags & IN_RECURSIVE);
+}
+
+/**
+ * Check if the worker is busy with a directory in the background.
+ *
+ * A directory is busy while its entries are watched after IN_ASYNC, or
+ * while a large rescan is listed or its new entries are watched, a slice
+ * at a time. Its rescans wait until then, and the timer of the watch is
+ * taken.
+ *
+ * @param[in] w A pointer to a watch.
+ * @return 1 if busy, 0 otherwise.
+ **/
+int
+watch_is_busy (const watch *w)
+{
+    assert (w != NULL);
+    return w->populating != NULL || w->listing != NULL || w->added != NULL;
+}
+
+/**
+ * Skip the new entries of a directory not reported to the user yet.
+ *
+ * A rescan puts its new entries to the listing at once, but those left
+ * in w->added are reported later, see watch_added(). They come in the
+ * order of the listing and share its names. Iterate the reported
+ * entries as:
+ *
+ *   const dep_list *pending = w->added;
+ *   for (iter = watch_next_known (w->deps, &pending);
+ *        iter != NULL;
+ *        iter = watch_next_known (iter->next, &pending))
+ *
+ * @param[in]     iter    The next entry of the listing. May be NULL.
+ * @param[in,out] pending The next entry not reported yet.
+ * @return The next reported entry or NULL.
+ **/
+const dep_list*
+watch_next_known (const dep_list *iter, const dep_list **pending)
+{
+    assert (pending != NULL);
+
+    while (iter != NULL && *pending != NULL && (*pending)->path == iter->path) {
+        *pending = (*pending)->next;
+        iter = iter->next;
+    }
+    return iter;
+}
+
+/**
+ * Drop the work done on a directory in the background.
+ *
+ * @param[in] w A pointer to a watch.
+ **/
+void
+watch_stop_background (watch *w)
+{
+    assert (w != NULL);
+
+    w->populating = NULL;
+    dl_listing_free (w->listing);
+    w->listing = NULL;
+    dl_free (w->added);
+    w->added = NULL;
+    w->dirty = 0;
+}
+
+/**
+ * Build the full path of a watched file.
+ *
+ * Dependency watches store only the entry names, so the path is built
+ * up to the user watch.
+ *
+ * @param[in] w A pointer to a watch.
+ * @return A newly allocated path, NULL on failure.
+ **/
+char*
+watch_path (const watch *w)
+{
+    assert (w != NULL);
+
+    if (w->type == WATCH_USER) {
+        return strdup (w->filename);
+    }
+
+    assert (w->parent != NULL);
+    char *dir = watch_path (w->parent);
+    if (dir == NULL) {
+        return NULL;
+    }
+
+    char *path = path_concat (dir, w->filename);
+    free (dir);
+    return path;
+}
+
+/**
+ * Get the kqueue filter flags to watch a file with.
+ *
+ * @param[in] w A pointer to a watch.
+ * @return The kqueue filter flags.
+ **/
+uint32_t
+watch_kqueue_flags (const watch *w)
+{
+    assert (w != NULL);
+
+    int is_subwatch = w->type != WATCH_USER;
+    uint32_t fflags = inotify_to_kqueue (w->flags, w->is_really_dir, is_subwatch);
+
+    /* Subdirectories of a recursive watch are rescanned on changes too */
+    if (is_subwatch && watch_has_dependencies (w)) {
+        fflags |= NOTE_WRITE;
+    }
+    return fflags;
+}
+
+/**
+ * Move a dependency watch to another watched directory.
+ *
+ * It is possible only if the watch would be started there the same way,
+ * i.e. with the same flags and filter.
+ *
+ * @param[in] w      A pointer to a dependency watch.
+ * @param[in] parent A pointer to the watch on the new directory.
+ * @param[in] name   The new entry name from the listing of the directory.
+ * @return 0 on success, -1 if the watch should be started anew.
+ **/
+int
+watch_reparent (watch *w, watch *parent, const char *name)
+{
+    assert (w != NULL);
+    assert (w->type == WATCH_DEPENDENCY);
+    assert (parent != NULL);
+    assert (name != NULL);
+
+    if (w->flags != (parent->flags & ~DEPS_EXCLUDED_FLAGS)
+        || w->filter != parent->filter) {
+        return -1;
+    }
+
+    dl_name_unref (w->filename);
+    w->filename = dl_name_ref (name);
+    w->parent = parent;
+    return 0;
+}
+
+/**
+ * Take the current metadata of a watched file.
+ *
+ * @param[in]  w    A pointer to a watch.
+ * @param[out] info A pointer to the metadata to fill.
+ * @return 0 on success, -1 on failure.
+ **/
+int
+watch_statinfo (const watch *w, struct inotify_statinfo *info)
+{
+    assert (w != NULL);
+    assert (info != NULL);
+
+    struct stat st;
+    if (fstat (w->fd, &st) == -1) {
+        perror_msg ("fstat failed on %d", w->fd);
+        return -1;
+    }
+
+    info->ino = st.st_ino;
+    info->size = st.st_size;
+    info->mtime_sec = st.st_mtime;
+#if defined (HAVE_STRUCT_STAT_ST_MTIM)
+    info->mtime_nsec = st.st_mtim.tv_nsec;
+#elif defined (HAVE_STRUCT_STAT_ST_MTIMESPEC)
+    info->mtime_nsec = st.st_mtimespec.tv_nsec;
+#else
+    info->mtime_nsec = 0;
+#endif
+    info->mode = st.st_mode;
+    return 0;
+}
+
 /**
  * Free a watch and all the associated memory.
  *
@@ -169,9 +501,14 @@ watch_free (watch *w)
     if (w->fd != -1) {
         close (w->fd);
     }
-    if (w->type == WATCH_USER && w->is_directory && w->deps) {
+    if (w->deps) {
         dl_free (w->deps);
     }
-    free (w->filename);
+    watch_stop_background (w);
+    if (w->type == WATCH_USER) {
+        filter_free (w->filter);
+    }
+    poll_free (w->poll);
+    dl_name_unref (w->filename);
     free (w);
 }
@@ -27,6 +27,8 @@
 #include <dirent.h>    /* ino_t */
 
 #include "dep-list.h"
+#include "filter.h"
+#include "stat-poll.h"
 
 typedef enum watch_type {
     WATCH_USER,
@@ -39,29 +41,90 @@ typedef struct watch {
     int is_directory;         /* legacy. 1 if directory IF AND ONLY IF it is a
                                * USER watch. 0 otherwise. TODO: rename this field */
     int is_really_dir;        /* a flag, a directory or not. */
+    int is_link;              /* 1 if a directory entry is a symbolic link
+                               * (only checked in the recursive mode) */
 
     uint32_t flags;           /* flags in the inotify format */
     char *filename;           /* file name of a watched file
                                * NB: an entry file name for dependencies! */
     int fd;                   /* file descriptor of a watched entry */
+    uintptr_t serial;         /* unique id, tells apart watches reusing
+                               * the same fd in a batch of kevents */
+    dev_t dev;                /* device number for the watched entry */
     ino_t inode;              /* inode number for the watched entry */
-
-    union {
-        dep_list *deps;       /* dependencies for an user-defined watch */
-        struct watch *parent; /* parent watch for an automatic (dependency) watch */
-    };
+    int rescan_pending;       /* 1 if a deferred directory rescan is armed */
+    int hot;                  /* 1 if the directory is rescanned periodically
+                               * because of a high rate of changes */
+    uint64_t hot_since;       /* the start of the rate window, ms */
+    unsigned int hot_changes; /* changes seen since then */
+    int oneshot_fired;        /* 1 if an IN_ONESHOT watch reported its event */
+    int moving;               /* 1 if moved out of its directory in a batch */
+    uint64_t moved_since;     /* when it was, ms */
+    size_t arrival;           /* 1 + its index in the new entries of the
+                               * batch, see worker_finish_moves(), 0 if none */
+    size_t held;              /* the new entries of a user watch held till
+                               * the end of the batch, see hold_arrivals() */
+    dep_list **populating;    /* the link to the next entry to watch while
+                               * the entries are watched in the background
+                               * (IN_ASYNC), NULL otherwise */
+    struct watch *populated_for; /* the user watch waiting for the entries
+                               * of this subdirectory to be watched in the
+                               * background (IN_RECURSIVE), NULL otherwise */
+    unsigned int populating_subdirs; /* the subdirectories a user watch
+                               * waits for, see above */
+    dep_listing *listing;     /* a rescan listing read in slices, or NULL */
+    dep_list *added;          /* the new entries found by a rescan, to be
+                               * watched in slices, or NULL */
+    int dirty;                /* 1 if the directory changed while busy with
+                               * the above, see watch_is_busy() */
+    uint64_t storm_batch;     /* the batch the events below are counted in */
+    unsigned int storm_events;/* events about the entries in that batch */
+
+    dep_list *deps;           /* entries of a directory with watched contents,
+                               * see watch_has_dependencies() */
+    struct watch *parent;     /* parent watch for an automatic (dependency) watch */
+    filter *filter;           /* entries to skip, owned by the user watch and
+                               * shared with its dependencies. May be NULL */
+    poll_state *poll;         /* the polling state if polled with stat(2)
+                               * (IN_POLL), NULL if watched with kqueue */
 } watch;
 
 
 int watch_init (watch         *w,
                 watch_type_t   watch_type,
                 int            kq,
+                uintptr_t      serial,
                 const char    *path,
                 const char    *entry_name,
                 uint32_t       flags);
 
+struct stat;
+int watch_init_opened (watch             *w,
+                       watch_type_t       watch_type,
+                       int                kq,
+                       uintptr_t          serial,
+                       int                fd,
+                       const struct stat *st,
+                       const char        *path,
+                       const char        *entry_name,
+                       uint32_t           flags);
+
 void watch_free   (watch *w);
 
+void      watch_check_link       (watch *w, const char *path);
+int       watch_has_dependencies (const watch *w);
+char*     watch_path             (const watch *w);
+uint32_t  watch_kqueue_flags     (const watch *w);
+int       watch_reparent         (watch *w, watch *parent, const char *name);
+int       watch_is_busy          (const watch *w);
+void      watch_stop_background  (watch *w);
+const dep_list* watch_next_known (const dep_list *iter, const dep_list **pending);
+
+struct inotify_statinfo;
+int  watch_statinfo (const watch *w, struct inotify_statinfo *info);
+
 int  watch_register_event (watch *w, int kq, uint32_t fflags);
+int  watch_register_timer (watch *w, int kq, int msec);
+void watch_unregister_timer (watch *w, int kq);
 
 #endif /* __WATCH_H__ */
@@ -27,9 +27,8 @@
 #include <fcntl.h>  /* open, fstat */
 #include <dirent.h> /* opendir, readdir, closedir */
 #include <sys/types.h>
-#include <sys/event.h>
-
 #include "sys/inotify.h"
+#include "backend.h"
 
 #include "utils.h"
 #include "worker-sets.h"
@@ -83,7 +82,6 @@ worker_sets_extend (worker_sets *ws,
             return -1;
         }
         ws->watches = ptr;
-        ws->watches[0] = NULL;
 
         ws->allocated = to_allocate;
     }
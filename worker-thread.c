@@ -21,23 +21,36 @@
 *******************************************************************************/
 
 #include <stddef.h> /* NULL */
+#include <stdint.h> /* SIZE_MAX */
 #include <assert.h>
 #include <unistd.h> /* write */
 #include <stdlib.h> /* calloc, realloc */
 #include <string.h> /* memset */
 #include <stdio.h>
 #include <errno.h>
+#include <dirent.h> /* DT_DIR */
+#include <time.h>   /* clock_gettime */
+#include <fcntl.h>  /* fstatat */
 
 #include <sys/types.h>
-#include <sys/event.h>
+#include <sys/stat.h>   /* S_ISDIR */
 
 #include "sys/inotify.h"
+#include "backend.h"
 
 #include "utils.h"
 #include "conversions.h"
 #include "worker.h"
 #include "worker-sets.h"
 #include "worker-thread.h"
+#include "shared.h"
+#include "shard.h"
+
+/* The maximum number of kqueue events received with a single kevent() */
+#define WORKER_BATCH_SIZE 64
+
+/* The window the rate of the directory changes is measured over */
+#define WORKER_HOT_WINDOW_MSEC 1000
 
 void worker_erase (worker *wrk);
 static void handle_moved (void       *udata,
@@ -46,6 +59,55 @@ static void handle_moved (void       *udata,
                           const char *to_path,
                           ino_t       to_inode);
 
+/**
+ * Place an inotify event with the metadata taken to event queue.
+ *
+ * @param[in] wrk    A pointer to #worker.
+ * @param[in] wd     An associated watch's id.
+ * @param[in] mask   An inotify watch mask.
+ * @param[in] cookie Event cookie.
+ * @param[in] name   File name (may be NULL).
+ * @param[in] pinfo  File metadata to attach (may be NULL). If specified,
+ *     IN_STATINFO should be set in the mask.
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+enqueue_event_info (worker                        *wrk,
+                    int                            wd,
+                    uint32_t                       mask,
+                    uint32_t                       cookie,
+                    const char                    *name,
+                    const struct inotify_statinfo *pinfo)
+{
+    if (wrk->params.coalesce
+        && event_queue_is_last (&wrk->eq, wd, mask, cookie, name)) {
+        if (pinfo != NULL) {
+            event_queue_update_last (&wrk->eq, pinfo);
+        }
+        ++wrk->stats.events_merged;
+        return 0;
+    }
+
+    /* Keep the memory bounded if the user does not read the events.
+     * As in Linux, the overflow event itself goes beyond the limit */
+    if (wrk->eq.count >= (size_t) wrk->params.max_queued) {
+        flush_events (wrk);
+    }
+    if (wrk->eq.count >= (size_t) wrk->params.max_queued) {
+        ++wrk->stats.events_dropped;
+        if (!event_queue_is_last (&wrk->eq, -1, IN_Q_OVERFLOW, 0, NULL)) {
+            return event_queue_enqueue (&wrk->eq, -1, IN_Q_OVERFLOW, 0, NULL, NULL);
+        }
+        return 0;
+    }
+
+    if (event_queue_enqueue (&wrk->eq, wd, mask, cookie, name, pinfo) == -1) {
+        perror_msg ("Failed to create a inotify event %x", mask);
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * Create a new inotify event and place it to event queue.
  *
@@ -54,369 +116,2074 @@ static void handle_moved (void       *udata,
  * @param[in] mask   An inotify watch mask.
  * @param[in] cookie Event cookie.
  * @param[in] name   File name (may be NULL).
+ * @param[in] source A watch of the file the event is about (may be NULL).
+ *     Used to attach the file metadata if IN_STAT_EVENTS is enabled.
  * @return 0 on success, -1 otherwise.
  **/
 int
-enqueue_event (worker     *wrk,
-               int         wd,
-               uint32_t    mask,
-               uint32_t    cookie,
-               const char *name)
+enqueue_event (worker      *wrk,
+               int          wd,
+               uint32_t     mask,
+               uint32_t     cookie,
+               const char  *name,
+               const watch *source)
 {
     assert (wrk != NULL);
 
-    if (wrk->iovcnt >= wrk->iovalloc) {
-        int to_allocate = wrk->iovcnt + 1;
-        void *ptr = realloc (wrk->iov, sizeof (struct iovec) * to_allocate);
-        if (ptr == NULL) {
-            perror_msg ("Failed to extend events to %d items", to_allocate);       
-            return -1;
+    if (wrk->is_hub) {
+        shared_deliver (wd, mask, cookie, name);
+        return 0;
+    }
+
+    struct inotify_statinfo info;
+    struct inotify_statinfo *pinfo = NULL;
+    if (wrk->params.stat_events
+        && source != NULL
+        && (mask & (IN_CREATE | IN_MODIFY | IN_ATTRIB))
+        && watch_statinfo (source, &info) == 0) {
+        mask |= IN_STATINFO;
+        pinfo = &info;
+    }
+
+    return enqueue_event_info (wrk, wd, mask, cookie, name, pinfo);
+}
+
+/**
+ * Wake up a worker to take the events sent to its inbox.
+ *
+ * The zero timer reuses the ident of the delayed flushes, which only
+ * makes the worker flush its events earlier.
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+void
+worker_wake (worker *wrk)
+{
+    struct kevent ev;
+
+    EV_SET (&ev,
+            wrk->io[KQUEUE_FD],
+            EVFILT_TIMER,
+            EV_ADD | EV_ENABLE | EV_ONESHOT,
+            0,
+            0,
+            0);
+
+    if (kevent (wrk->kq, &ev, 1, NULL, 0, NULL) == -1) {
+        perror_msg ("Failed to wake up a worker for the events sent to it");
+    }
+}
+
+/**
+ * Take the events sent to the inbox of a worker by the other workers.
+ *
+ * They are queued as the events of the worker itself, so its own
+ * parameters (IN_COALESCE, IN_MAX_QUEUED_EVENTS) apply to them.
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+static void
+receive_events (worker *wrk)
+{
+    /* The other workers fill the inbox under the lock, so look at it
+     * under the lock too */
+    pthread_mutex_lock (&wrk->inbox_mutex);
+    if (wrk->inbox.count == 0) {
+        pthread_mutex_unlock (&wrk->inbox_mutex);
+        return;
+    }
+    event_queue received = wrk->inbox;
+    event_queue_init (&wrk->inbox);
+    pthread_mutex_unlock (&wrk->inbox_mutex);
+
+    size_t size, offset = 0;
+    const char *events = event_queue_peek (&received, &size);
+    while (offset < size) {
+        const struct inotify_event *event
+            = (const struct inotify_event *) (events + offset);
+        const char *name = event->len > 0 && event->name[0] != '\0'
+            ? event->name : NULL;
+        const struct inotify_statinfo *pinfo = NULL;
+        if (event->mask & IN_STATINFO) {
+            pinfo = (const struct inotify_statinfo *)
+                (event->name + event->len - sizeof (struct inotify_statinfo));
         }
-        wrk->iov = ptr;
-        wrk->iovalloc = to_allocate;
+
+        enqueue_event_info (wrk, event->wd, event->mask, event->cookie,
+                            name, pinfo);
+        offset += sizeof (struct inotify_event) + event->len;
     }
+    event_queue_free (&received);
+}
 
-    wrk->iov[wrk->iovcnt].iov_base = create_inotify_event (wd, mask,
-        cookie, name, &wrk->iov[wrk->iovcnt].iov_len);
+/**
+ * Account an event of a user watch with IN_ONESHOT.
+ *
+ * Only the first event is reported, the watch is removed at the end of
+ * the batch.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to the user #watch.
+ * @return 1 if the event should be dropped, 0 otherwise.
+ **/
+static int
+oneshot_fire (worker *wrk, watch *w)
+{
+    assert (w->type == WATCH_USER);
 
-    if (wrk->iov[wrk->iovcnt].iov_base != NULL) {
-        ++wrk->iovcnt;
-    } else {
-        perror_msg ("Failed to create a inotify event %x", mask);
-        return -1;
+    if (!(w->flags & IN_ONESHOT)) {
+        return 0;
+    }
+    if (w->oneshot_fired) {
+        return 1;
     }
 
+    w->oneshot_fired = 1;
+    ++wrk->oneshots_fired;
     return 0;
 }
 
+/**
+ * Remove the IN_ONESHOT watches which have reported their event.
+ *
+ * Closes their descriptors, so the kernel stops waking the worker up
+ * for them, and reports IN_IGNORED.
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+static void
+remove_fired_watches (worker *wrk)
+{
+    int *fds = calloc (wrk->oneshots_fired, sizeof (int));
+    size_t count = 0, i;
+
+    if (fds == NULL) {
+        perror_msg ("Failed to allocate a list of one-shot watches");
+        return;
+    }
+
+    /* The removal reorders the watches, so collect them first */
+    for (i = 0; i < wrk->sets.length && count < wrk->oneshots_fired; i++) {
+        const watch *w = wrk->sets.watches[i];
+        if (w->type == WATCH_USER && w->oneshot_fired) {
+            fds[count++] = w->fd;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        worker_remove (wrk, fds[i]);
+    }
+
+    free (fds);
+    wrk->oneshots_fired = 0;
+}
+
+/**
+ * Queue an event about an entry of a watched directory.
+ *
+ * The entries of the subdirectories of a recursive watch are reported to
+ * the user watch, with the paths relative to it.
+ *
+ * If a directory produces more events in a batch than the IN_STORM_LIMIT
+ * parameter allows, the rest of its events in the batch are replaced
+ * with a single IN_Q_OVERFLOW event for its watch, telling the user to
+ * rescan that directory.
+ *
+ * @param[in] wrk    A pointer to #worker.
+ * @param[in] w      A watch on the directory.
+ * @param[in] mask   An inotify watch mask.
+ * @param[in] cookie Event cookie.
+ * @param[in] name   File name of the entry.
+ * @param[in] source A watch of the entry (may be NULL).
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+report_entry_event (worker      *wrk,
+                    watch       *w,
+                    uint32_t     mask,
+                    uint32_t     cookie,
+                    const char  *name,
+                    const watch *source)
+{
+    assert (wrk != NULL);
+    assert (w != NULL);
+    assert (name != NULL);
+
+    char *relpath = NULL;
+    while (w->type != WATCH_USER) {
+        char *path = path_concat (w->filename, relpath ? relpath : name);
+        free (relpath);
+        if (path == NULL) {
+            return -1;
+        }
+        relpath = path;
+        w = w->parent;
+        assert (w != NULL);
+    }
+
+    if (oneshot_fire (wrk, w)) {
+        free (relpath);
+        return 0;
+    }
+
+    int retval = 0;
+    if (wrk->params.storm_limit > 0) {
+        if (w->storm_batch != wrk->stats.batches) {
+            w->storm_batch = wrk->stats.batches;
+            w->storm_events = 0;
+        }
+
+        if (++w->storm_events > (unsigned int) wrk->params.storm_limit) {
+            ++wrk->stats.events_dropped;
+            if (w->storm_events == (unsigned int) wrk->params.storm_limit + 1) {
+                ++wrk->stats.storms;
+                retval = enqueue_event (wrk, w->fd, IN_Q_OVERFLOW, 0, NULL, NULL);
+            }
+            free (relpath);
+            return retval;
+        }
+    }
+
+    retval = enqueue_event (wrk,
+                            w->fd,
+                            mask,
+                            cookie,
+                            relpath ? relpath : name,
+                            source);
+    free (relpath);
+    return retval;
+}
+
 /**
  * Flush inotify events queue to socket
  *
+ * The events of a shard are sent to the instance it serves instead.
+ *
+ * Never blocks: the events the socket can not take now are sent later,
+ * when the socket becomes writable again.
+ *
  * @param[in] wrk A pointer to #worker.
  **/
 void
 flush_events (worker *wrk)
 {
-    if (safe_writev (wrk->io[KQUEUE_FD], wrk->iov, wrk->iovcnt) == -1) {
+    if (wrk->owner != NULL) {
+        shard_forward (wrk);
+        return;
+    }
+
+    int retval = event_queue_flush (&wrk->eq, wrk->io[KQUEUE_FD]);
+    if (retval == -1) {
         perror_msg ("Sending of inotify events to socket failed");
+    } else if (retval == 1 && !wrk->write_armed) {
+        /* The user does not keep up, send the rest when there is room */
+        struct kevent ev;
+        EV_SET (&ev,
+                wrk->io[KQUEUE_FD],
+                EVFILT_WRITE,
+                EV_ADD | EV_ENABLE | EV_ONESHOT,
+                0,
+                0,
+                0);
+
+        if (kevent (wrk->kq, &ev, 1, NULL, 0, NULL) == -1) {
+            perror_msg ("Failed to register kqueue event on socket write");
+        } else {
+            wrk->write_armed = 1;
+        }
+    }
+}
+
+/**
+ * Find a watch on an entry of a watched directory.
+ *
+ * @param[in] wrk    A pointer to #worker.
+ * @param[in] parent A watch on the directory.
+ * @param[in] name   The entry file name.
+ * @return A pointer to the dependency watch, NULL if not found.
+ **/
+static watch*
+find_dependency (worker *wrk, const watch *parent, const char *name)
+{
+    size_t i;
+    for (i = 0; i < wrk->sets.length; i++) {
+        watch *w = wrk->sets.watches[i];
+        if (w != NULL && w->type == WATCH_DEPENDENCY && w->parent == parent
+            && !w->moving && strcmp (name, w->filename) == 0) {
+            return w;
+        }
     }
+    return NULL;
+}
+
+/**
+ * Get the time of the monotonic clock.
+ *
+ * @return The time in milliseconds.
+ **/
+static uint64_t
+now_msec (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Find a watch on a file moved out of a watched directory in this batch.
+ *
+ * @param[in] wrk    A pointer to #worker.
+ * @param[in] parent A watch on the directory the file has appeared in.
+ * @param[in] inode  Inode number of the file.
+ * @return A pointer to the dependency watch, NULL if not found.
+ **/
+static watch*
+find_moved (worker *wrk, const watch *parent, ino_t inode)
+{
+    size_t i;
 
-    int i;
-    for (i = 0; i < wrk->iovcnt; i++) {
-        free (wrk->iov[i].iov_base);
+    if (wrk->moves_pending == 0) {
+        return NULL;
     }
 
-    wrk->iovcnt = 0;
+    for (i = 0; i < wrk->sets.length; i++) {
+        watch *w = wrk->sets.watches[i];
+        if (w->moving && w->inode == inode && w->dev == parent->dev) {
+            return w;
+        }
+    }
+    return NULL;
 }
 
 /**
- * Check if a file under given path is/was a directory. Use worker's
- * cached data (watches) to query file type (this function is called
- * when something happens in a watched directory, so we SHOULD have
- * a watch for its contents
+ * Find the link to an entry in the listing of a watched directory.
  *
- * @param[in] path A file path
- * @param[in] wrk A worker instance for which a change has been triggered.
+ * @param[in] w    A pointer to the directory #watch.
+ * @param[in] name The entry file name.
+ * @return A pointer to the link, NULL if not found.
+ **/
+static dep_list**
+find_entry_link (watch *w, const char *name)
+{
+    dep_list **link;
+    for (link = &w->deps; *link != NULL; link = &(*link)->next) {
+        if (strcmp ((*link)->path, name) == 0) {
+            return link;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Hold the IN_CREATE notifications about the new watches till the end
+ * of the batch, see worker_finish_moves().
  *
- * @return 1 if dir (cached), 0 otherwise.
+ * @param[in] wrk   A pointer to #worker.
+ * @param[in] first The index of the first new watch in the worker sets.
+ *     It and the watches after it are held.
+ * @return 0 on success, -1 otherwise.
  **/
 static int
-check_is_dir_cached (const char *path, worker *wrk)
+hold_arrivals (worker *wrk, size_t first)
 {
-    int i;
-    for (i = 0; i < wrk->sets.length; i++) {
-        const watch *w = wrk->sets.watches[i];
-        if (w != NULL && strcmp (path, w->filename) == 0 && w->is_really_dir)
-            return 1;
+    size_t count = wrk->sets.length - first;
+
+    if (wrk->arrivals_length + count > wrk->arrivals_allocated) {
+        size_t to_allocate = wrk->arrivals_allocated * 2 + count;
+
+        void *ptr = realloc (wrk->arrivals, sizeof (watch *) * to_allocate);
+        if (ptr == NULL) {
+            perror_msg ("Failed to hold %zu new entries", count);
+            return -1;
+        }
+        wrk->arrivals = ptr;
+        wrk->arrivals_allocated = to_allocate;
+    }
+
+    size_t i;
+    for (i = first; i < wrk->sets.length; i++) {
+        watch *w = wrk->sets.watches[i];
+        wrk->arrivals[wrk->arrivals_length++] = w;
+        w->arrival = wrk->arrivals_length;
+        ++worker_root (w)->held;
     }
     return 0;
 }
 
 /**
- * Process a worker command.
+ * Stop holding a new entry, see hold_arrivals().
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to the watch on the entry.
+ **/
+static void
+drop_arrival (worker *wrk, watch *w)
+{
+    wrk->arrivals[w->arrival - 1] = NULL;
+    w->arrival = 0;
+    --worker_root (w)->held;
+}
+
+/**
+ * Report the new entries of a user watch held by hold_arrivals() as
+ * created, in the order they were found.
+ *
+ * @param[in] wrk  A pointer to #worker.
+ * @param[in] root A pointer to the user watch.
+ * @param[in] upto The number of the new entries of the batch to look at.
+ **/
+static void
+release_arrivals (worker *wrk, watch *root, size_t upto)
+{
+    size_t i;
+    for (i = 0; i < upto && root->held > 0; i++) {
+        watch *w = wrk->arrivals[i];
+        if (w == NULL || worker_root (w) != root) {
+            continue;
+        }
+
+        drop_arrival (wrk, w);
+        report_entry_event (wrk,
+                            w->parent,
+                            IN_CREATE | (w->is_really_dir ? IN_ISDIR : 0),
+                            0,
+                            w->filename,
+                            w);
+    }
+}
+
+/**
+ * Report a new entry held by hold_arrivals() as created, along with the
+ * entries of the same user watch found before it.
+ *
+ * Called before anything else is reported about the entry, or before
+ * its watch is removed.
  *
  * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to the watch on the entry.
  **/
 void
-process_command (worker *wrk)
+worker_release_arrival (worker *wrk, watch *w)
+{
+    assert (wrk != NULL);
+    assert (w != NULL);
+
+    if (w->arrival != 0) {
+        release_arrivals (wrk, worker_root (w), w->arrival);
+    }
+}
+
+/**
+ * Report all the new entries of a user watch held by hold_arrivals() as
+ * created, before another event of the watch is queued.
+ *
+ * @param[in] wrk  A pointer to #worker.
+ * @param[in] root A pointer to the user watch.
+ **/
+void
+worker_release_arrivals (worker *wrk, watch *root)
 {
     assert (wrk != NULL);
+    assert (root != NULL);
 
-    /* read a byte */
-    char unused;
-    safe_read (wrk->io[KQUEUE_FD], &unused, 1);
+    release_arrivals (wrk, root, wrk->arrivals_length);
+}
 
-    if (wrk->cmd.type == WCMD_ADD) {
-        wrk->cmd.retval = worker_add_or_modify (wrk,
-                                                wrk->cmd.add.filename,
-                                                wrk->cmd.add.mask);
-    } else if (wrk->cmd.type == WCMD_REMOVE) {
-        wrk->cmd.retval = worker_remove (wrk, wrk->cmd.rm_id);
-    } else {
-        perror_msg ("Worker processing a command without a command - "
-                    "something went wrong.");
+/**
+ * Queue an event about an entry of a watched directory, see
+ * report_entry_event().
+ *
+ * The new entries held for the end of the batch in the same user watch
+ * are reported first, so the events of a watch keep their order.
+ *
+ * @param[in] wrk    A pointer to #worker.
+ * @param[in] w      A watch on the directory.
+ * @param[in] mask   An inotify watch mask.
+ * @param[in] cookie Event cookie.
+ * @param[in] name   File name of the entry.
+ * @param[in] source A watch of the entry (may be NULL).
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+enqueue_entry_event (worker      *wrk,
+                     watch       *w,
+                     uint32_t     mask,
+                     uint32_t     cookie,
+                     const char  *name,
+                     const watch *source)
+{
+    assert (w != NULL);
+
+    release_arrivals (wrk, worker_root (w), wrk->arrivals_length);
+    return report_entry_event (wrk, w, mask, cookie, name, source);
+}
+
+typedef struct {
+    dev_t dev;
+    ino_t inode;
+    size_t index;   /* of the new entry in the worker arrivals */
+} arrival_key;
+
+/**
+ * Compare new entries by their device and inode numbers.
+ *
+ * @param[in] a A pointer to #arrival_key.
+ * @param[in] b A pointer to #arrival_key.
+ * @return A negative, zero or positive value, as for qsort(3).
+ **/
+static int
+arrival_key_cmp (const void *a, const void *b)
+{
+    const arrival_key *ka = (const arrival_key *) a;
+    const arrival_key *kb = (const arrival_key *) b;
+    if (ka->dev != kb->dev) {
+        return (ka->dev > kb->dev) - (ka->dev < kb->dev);
+    }
+    return (ka->inode > kb->inode) - (ka->inode < kb->inode);
+}
+
+/**
+ * Take a watch on a file as the possible source of a new entry of the
+ * batch with the same inode.
+ *
+ * @param[in] keys   The new entries sorted by arrival_key_cmp().
+ * @param[in] nkeys  The number of them.
+ * @param[in] from   The sources of the new entries found so far.
+ * @param[in] w      A pointer to the watch.
+ **/
+static void
+match_arrival (const arrival_key *keys, size_t nkeys, watch **from, watch *w)
+{
+    arrival_key key;
+    key.dev = w->dev;
+    key.inode = w->inode;
+
+    const arrival_key *k = bsearch (&key, keys, nkeys, sizeof (arrival_key), arrival_key_cmp);
+    if (k == NULL) {
         return;
     }
 
-    /* TODO: is the situation when nobody else waits on a barrier possible? */
-    worker_cmd_wait (&wrk->cmd);
+    while (k > keys && arrival_key_cmp (k - 1, &key) == 0) {
+        --k;
+    }
+    for (; k < keys + nkeys && arrival_key_cmp (k, &key) == 0; k++) {
+        if (from[k->index] == NULL) {
+            from[k->index] = w;
+            return;
+        }
+    }
 }
 
-/** 
- * This structure represents a directory diff calculation context.
- * It is passed to dl_calculate as user data and then is used in all
- * the callbacks.
+/**
+ * Check if a watched file has left its directory, while the directory
+ * is not rescanned yet.
+ *
+ * @param[in] w A pointer to the dependency watch.
+ * @return 1 if its name is gone or taken by another file, 0 otherwise.
+ **/
+static int
+has_departed (const watch *w)
+{
+    struct stat st;
+    if (fstatat (w->parent->fd, w->filename, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        return errno == ENOENT;
+    }
+    return st.st_ino != w->inode || st.st_dev != w->dev;
+}
+
+/**
+ * Check if a watch is on an entry of a directory subtree.
+ *
+ * @param[in] w   A pointer to the watch.
+ * @param[in] dir A pointer to the watch on the directory.
+ * @return 1 if inside, 0 otherwise.
+ **/
+static int
+is_inside (const watch *w, const watch *dir)
+{
+    for (w = w->parent; w != NULL; w = w->parent) {
+        if (w == dir) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Find the sources of the new entries of the batch: the files moved out
+ * of the other watched directories, or about to be found so.
+ *
+ * @param[in]  wrk      A pointer to #worker.
+ * @param[in]  deferred 1 if a directory rescan may be left to a later
+ *     batch, then the files not known to be moved are tried too.
+ * @param[out] pending  Set to 1 if a directory has a deferred rescan.
+ * @param[out] busy     Set to 1 if a directory is listed or watched in
+ *     the background, see watch_is_busy().
+ * @return An array of the possible sources indexed as the worker
+ *     arrivals, NULL if none or on failure.
+ **/
+static watch**
+match_arrivals (worker *wrk, int deferred, int *pending, int *busy)
+{
+    arrival_key *keys = NULL;
+    watch **from = NULL;
+    size_t nkeys = 0, i;
+
+    if (wrk->arrivals_length > 0) {
+        keys = calloc (wrk->arrivals_length, sizeof (arrival_key));
+        from = calloc (wrk->arrivals_length, sizeof (watch *));
+        if (keys == NULL || from == NULL) {
+            perror_msg ("Failed to allocate %zu new entries to pair with moves",
+                        wrk->arrivals_length);
+            free (keys);
+            free (from);
+            keys = NULL;
+            from = NULL;
+        }
+    }
+
+    for (i = 0; keys != NULL && i < wrk->arrivals_length; i++) {
+        const watch *w = wrk->arrivals[i];
+        if (w != NULL) {
+            keys[nkeys].dev = w->dev;
+            keys[nkeys].inode = w->inode;
+            keys[nkeys].index = i;
+            ++nkeys;
+        }
+    }
+    if (nkeys > 0) {
+        qsort (keys, nkeys, sizeof (arrival_key), arrival_key_cmp);
+    }
+
+    for (i = 0; i < wrk->sets.length; i++) {
+        watch *w = wrk->sets.watches[i];
+        if (w->arrival != 0) {
+            continue;
+        }
+
+        if (!w->moving) {
+            *pending |= w->rescan_pending;
+            *busy |= watch_is_busy (w);
+        }
+
+        if (nkeys > 0 && w->type == WATCH_DEPENDENCY && (w->moving || deferred)) {
+            match_arrival (keys, nkeys, from, w);
+        }
+    }
+
+    free (keys);
+    return from;
+}
+
+/**
+ * Pair the new entries of the batch with the files moved out of the
+ * other watched directories, and report the rest as created.
+ *
+ * A file moved between two watched directories is paired whichever of
+ * them is rescanned first. The rescan of the source may also be left to
+ * a later batch (IN_DEBOUNCE_MSEC, IN_HOT_RATE, IN_SLICE), then a file
+ * gone from under its name is taken as moved. Its entry is dropped from
+ * the known listing, so the rescan does not report it removed.
+ *
+ * @param[in]  wrk     A pointer to #worker.
+ * @param[out] pending Set to 1 if a directory has a deferred rescan.
+ * @param[out] busy    Set to 1 if a directory is busy, see above.
+ **/
+static void
+finish_arrivals (worker *wrk, int *pending, int *busy)
+{
+    int deferred = (wrk->params.debounce_ms > 0
+                    || wrk->params.hot_rate > 0
+                    || wrk->params.slice > 0);
+    watch **from = NULL;
+    size_t length = wrk->arrivals_length, i, j;
+
+    if ((length > 0 && (deferred || wrk->moves_pending > 0))
+        || (wrk->moves_pending > 0 && deferred)) {
+        from = match_arrivals (wrk, deferred, pending, busy);
+    }
+
+    for (i = 0; i < length; i++) {
+        watch *w = wrk->arrivals[i];
+        if (w == NULL) {
+            continue;
+        }
+
+        watch *source = (from != NULL) ? from[i] : NULL;
+        if (source != NULL && !source->moving
+            && (source->parent == w->parent || !has_departed (source))) {
+            source = NULL;
+        }
+        if (from != NULL) {
+            from[i] = source;
+        }
+
+        if (source == NULL) {
+            worker_release_arrival (wrk, w);
+            continue;
+        }
+
+        drop_arrival (wrk, w);
+
+        /* The entries held before it are reported already */
+        int addMask = w->is_really_dir ? IN_ISDIR : 0;
+        uint32_t cookie = source->inode & 0x00000000FFFFFFFF;
+        report_entry_event (wrk,
+                            source->parent,
+                            IN_MOVED_FROM | addMask,
+                            cookie,
+                            source->filename,
+                            NULL);
+        report_entry_event (wrk,
+                            w->parent,
+                            IN_MOVED_TO | addMask,
+                            cookie,
+                            w->filename,
+                            w);
+
+        if (source->moving) {
+            source->moving = 0;
+            --wrk->moves_pending;
+        } else {
+            dep_list **link = find_entry_link (source->parent, source->filename);
+            if (link != NULL) {
+                dep_list *gone = *link;
+                *link = gone->next;
+                gone->next = NULL;
+                dl_free (gone);
+            }
+        }
+
+        /* The contents of a moved directory are not reported */
+        for (j = i + 1; j < length; j++) {
+            watch *sub = wrk->arrivals[j];
+            if (sub != NULL) {
+                if (!is_inside (sub, w)) {
+                    break;
+                }
+                drop_arrival (wrk, sub);
+            }
+        }
+    }
+    wrk->arrivals_length = 0;
+
+    /* The new watches have taken over. An old one could be gone already
+     * along with an old directory */
+    for (i = 0; from != NULL && i < length; i++) {
+        for (j = 0; from[i] != NULL && j < wrk->sets.length; j++) {
+            watch *w = wrk->sets.watches[j];
+            if (w == from[i]) {
+                worker_remove_many (wrk, w, w->deps, 1);
+                break;
+            }
+        }
+    }
+    free (from);
+}
+
+/**
+ * Report the files moved out of the watched directories as removed.
+ *
+ * A file which has left its directory but is still linked is kept
+ * watched till the end of the batch, in case it shows up in another
+ * watched directory. If it does not, it is reported with IN_DELETE and
+ * its watch is removed. While another directory has its rescan deferred
+ * it is kept for as long as the rescan may be deferred, and for as long
+ * as a directory is listed in slices.
+ *
+ * At the end of a batch the new entries are paired with the moved files
+ * first, see finish_arrivals().
+ *
+ * @param[in] wrk    A pointer to #worker.
+ * @param[in] parent Finish only the files moved out of this directory,
+ *     NULL to finish all of them at the end of a batch.
+ **/
+void
+worker_finish_moves (worker *wrk, const watch *parent)
+{
+    assert (wrk != NULL);
+
+    int pending = 0, busy = 0;
+    if (parent == NULL) {
+        finish_arrivals (wrk, &pending, &busy);
+    }
+
+    uint64_t now = (pending && wrk->moves_pending > 0) ? now_msec () : 0;
+    uint64_t wait = wrk->params.debounce_ms;
+    if (wrk->params.hot_rate > 0 && (uint64_t) wrk->params.hot_msec > wait) {
+        wait = wrk->params.hot_msec;
+    }
+
+    size_t i = 0;
+    while (wrk->moves_pending > 0 && i < wrk->sets.length) {
+        watch *w = wrk->sets.watches[i];
+        if (!w->moving || (parent != NULL && w->parent != parent)
+            || busy || (pending && now - w->moved_since < wait)) {
+            ++i;
+            continue;
+        }
+
+        w->moving = 0;
+        --wrk->moves_pending;
+        enqueue_entry_event (wrk,
+                             w->parent,
+                             IN_DELETE | (w->is_really_dir ? IN_ISDIR : 0),
+                             0,
+                             w->filename,
+                             NULL);
+
+        /* A subdirectory takes its subtree along, start over then */
+        size_t length = wrk->sets.length;
+        worker_remove_many (wrk, w, w->deps, 1);
+        if (wrk->sets.length != length - 1) {
+            i = 0;
+        }
+    }
+}
+
+/**
+ * Process a worker command.
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+void
+process_command (worker *wrk)
+{
+    assert (wrk != NULL);
+
+    /* read a byte */
+    char unused;
+    safe_read (wrk->io[KQUEUE_FD], &unused, 1);
+
+    if (wrk->cmd.type == WCMD_ADD) {
+        wrk->cmd.retval = worker_add_or_modify (wrk,
+                                                wrk->cmd.add.filename,
+                                                wrk->cmd.add.mask,
+                                                wrk->cmd.add.filter);
+        wrk->cmd.add.filter = NULL;
+        if (wrk->cmd.retval != -1) {
+            wrk->watched = 1;
+        }
+    } else if (wrk->cmd.type == WCMD_REMOVE) {
+        wrk->cmd.retval = worker_remove (wrk, wrk->cmd.rm_id);
+        /* IN_IGNORED is readable once inotify_rm_watch returns. The
+         * shards have sent theirs to the inbox by now */
+        receive_events (wrk);
+        flush_events (wrk);
+    } else if (wrk->cmd.type == WCMD_PARAM) {
+        wrk->cmd.retval = worker_set_param (wrk,
+                                            wrk->cmd.param.param,
+                                            wrk->cmd.param.value);
+    } else if (wrk->cmd.type == WCMD_STATS) {
+        *wrk->cmd.stats = wrk->stats;
+        shard_stats (wrk, wrk->cmd.stats);
+        wrk->cmd.retval = 0;
+    } else if (wrk->cmd.type == WCMD_SNAPSHOT) {
+        wrk->cmd.retval = worker_get_snapshot (wrk,
+                                               wrk->cmd.snapshot.wd,
+                                               wrk->cmd.snapshot.result);
+    } else if (wrk->cmd.type == WCMD_SUBSCRIBE) {
+        wrk->cmd.retval = shared_attach (wrk,
+                                         wrk->cmd.subscribe.sub,
+                                         wrk->cmd.subscribe.filename,
+                                         wrk->cmd.subscribe.mask,
+                                         wrk->cmd.subscribe.share);
+    } else if (wrk->cmd.type == WCMD_UNSUBSCRIBE) {
+        wrk->cmd.retval = shared_detach (wrk,
+                                         wrk->cmd.unsubscribe.sub,
+                                         wrk->cmd.unsubscribe.wd);
+    } else if (wrk->cmd.type == WCMD_DETACH) {
+        wrk->owner = NULL;
+        wrk->cmd.retval = 0;
+    } else {
+        perror_msg ("Worker processing a command without a command - "
+                    "something went wrong.");
+        return;
+    }
+
+    /* TODO: is the situation when nobody else waits on a barrier possible? */
+    worker_cmd_wait (&wrk->cmd);
+}
+
+/** 
+ * This structure represents a directory diff calculation context.
+ * It is passed to dl_calculate as user data and then is used in all
+ * the callbacks.
+ **/
+typedef struct {
+    worker *wrk;
+    watch *w;
+    const char *path;       /* the full path of the directory */
+    const dep_list *saved;  /* a snapshot the diff is calculated against */
+    dep_list **deferred;    /* the tail link of the new entries to watch
+                             * later, NULL to watch them all at once */
+    size_t watched;         /* the new entries watched so far */
+} handle_context;
+
+/**
+ * Check if an entry of a watched directory is a directory.
+ *
+ * @param[in] ctx   A pointer to #handle_context.
+ * @param[in] dep   The watch on the entry, if any.
+ * @param[in] inode Inode number of the entry.
+ * @return IN_ISDIR if directory, 0 otherwise.
+ **/
+static uint32_t
+entry_isdir_mask (const handle_context *ctx, const watch *dep, ino_t inode)
+{
+    if (dep != NULL) {
+        return dep->is_really_dir ? IN_ISDIR : 0;
+    }
+
+    /* The entries of a polled directory are known from the last check */
+    if (ctx->w->poll != NULL) {
+        const poll_entry *pe = poll_find (ctx->w->poll, inode);
+        if (pe != NULL && pe->known && S_ISDIR (pe->mode)) {
+            return IN_ISDIR;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Start watching on a new entry of a directory and notify about it.
+ *
+ * @param[in] ctx    A pointer to #handle_context.
+ * @param[in] path   File name of the new entry.
+ * @param[in] mask   IN_CREATE or IN_MOVED_TO.
+ * @param[in] cookie Event cookie.
+ **/
+static void
+add_dependency (handle_context *ctx,
+                const char     *path,
+                uint32_t        mask,
+                uint32_t        cookie)
+{
+    int addMask = 0;
+
+    /* The entries of a polled directory are not opened */
+    if (ctx->w->poll != NULL) {
+        struct stat st;
+        if (fstatat (ctx->w->fd, path, &st, AT_SYMLINK_NOFOLLOW) == 0
+            && S_ISDIR (st.st_mode)) {
+            addMask = IN_ISDIR;
+        }
+        enqueue_entry_event (ctx->wrk, ctx->w, mask | addMask, cookie, path, NULL);
+        return;
+    }
+
+    watch *neww = NULL;
+    size_t first = ctx->wrk->sets.length;
+    char *npath = path_concat (ctx->path, path);
+    if (npath != NULL) {
+        neww = worker_start_watching (ctx->wrk,
+                                      npath,
+                                      path,
+                                      ctx->w->flags,
+                                      WATCH_DEPENDENCY,
+                                      ctx->w,
+                                      NULL);
+        if (neww == NULL) {
+            perror_msg ("Failed to start watching on a new dependency %s", npath);
+        } else if (neww->is_really_dir) {
+            addMask = IN_ISDIR;
+        }
+        free (npath);
+    } else {
+        perror_msg ("Failed to allocate a path to start watching a dependency");
+    }
+
+    /* The file could be moved from another watched directory rescanned
+     * later in the batch, see worker_finish_moves() */
+    if (neww != NULL && mask == IN_CREATE && hold_arrivals (ctx->wrk, first) == 0) {
+        return;
+    }
+
+    enqueue_entry_event (ctx->wrk, ctx->w, mask | addMask, cookie, path, neww);
+
+    /* In the recursive mode, a new subdirectory could get its contents
+     * before it was watched. They are the watches appended after it */
+    if (neww != NULL) {
+        size_t i;
+        for (i = first + 1; i < ctx->wrk->sets.length; i++) {
+            const watch *sub = ctx->wrk->sets.watches[i];
+            enqueue_entry_event (ctx->wrk,
+                                 sub->parent,
+                                 IN_CREATE | (sub->is_really_dir ? IN_ISDIR : 0),
+                                 0,
+                                 sub->filename,
+                                 sub);
+        }
+    }
+}
+
+/**
+ * Leave a new entry of a directory to be watched and reported later,
+ * see watch_added().
+ *
+ * @param[in] ctx   A pointer to #handle_context.
+ * @param[in] path  File name of the new entry.
+ * @param[in] inode Inode number of the new entry.
+ **/
+static void
+defer_dependency (handle_context *ctx, const char *path, ino_t inode)
+{
+    char *name = dl_name_ref (path);
+    dep_list *entry = dl_create (name, inode);
+    if (entry == NULL) {
+        dl_name_unref (name);
+        add_dependency (ctx, path, IN_CREATE, 0);
+        return;
+    }
+
+    *ctx->deferred = entry;
+    ctx->deferred = &entry->next;
+}
+
+/**
+ * Produce an IN_MOVED_FROM/IN_MOVED_TO notifications pair for a file
+ * moved between two watched directories and take its watch along.
+ *
+ * @param[in] ctx   A pointer to #handle_context.
+ * @param[in] moved A pointer to the watch on the moved file.
+ * @param[in] path  The new name of the file.
+ **/
+static void
+handle_moved_in (handle_context *ctx, watch *moved, const char *path)
+{
+    int addMask = moved->is_really_dir ? IN_ISDIR : 0;
+    uint32_t cookie = moved->inode & 0x00000000FFFFFFFF;
+
+    moved->moving = 0;
+    --ctx->wrk->moves_pending;
+
+    enqueue_entry_event (ctx->wrk,
+                         moved->parent,
+                         IN_MOVED_FROM | addMask,
+                         cookie,
+                         moved->filename,
+                         NULL);
+
+    if (watch_reparent (moved, ctx->w, path) == 0) {
+        enqueue_entry_event (ctx->wrk,
+                             ctx->w,
+                             IN_MOVED_TO | addMask,
+                             cookie,
+                             path,
+                             NULL);
+    } else {
+        /* The directories are watched with different flags */
+        worker_remove_many (ctx->wrk, moved, moved->deps, 1);
+        add_dependency (ctx, path, IN_MOVED_TO, cookie);
+    }
+}
+
+/**
+ * Produce an IN_CREATE notification for a new file and start wathing on it.
+ *
+ * This function is used as a callback and is invoked from the dep-list
+ * routines.
+ *
+ * @param[in] udata  A pointer to user data (#handle_context).
+ * @param[in] path   File name of a new file.
+ * @param[in] inode  Inode number of a new file.
+ **/
+static void
+handle_added (void *udata, const char *path, ino_t inode)
+{
+    assert (udata != NULL);
+
+    handle_context *ctx = (handle_context *) udata;
+    assert (ctx->wrk != NULL);
+    assert (ctx->w != NULL);
+
+    watch *moved = find_moved (ctx->wrk, ctx->w, inode);
+    if (moved != NULL) {
+        handle_moved_in (ctx, moved, path);
+    } else if (ctx->deferred != NULL
+               && ctx->watched == (size_t) ctx->wrk->params.slice) {
+        defer_dependency (ctx, path, inode);
+    } else {
+        add_dependency (ctx, path, IN_CREATE, 0);
+        ++ctx->watched;
+    }
+}
+
+/**
+ * Produce an IN_DELETE notification for a removed file.
+ *
+ * This function is used as a callback and is invoked from the dep-list
+ * routines.
+ *
+ * @param[in] udata  A pointer to user data (#handle_context).
+ * @param[in] path   File name of the removed file.
+ * @param[in] inode  Inode number of the removed file.
+ **/
+static void
+handle_removed (void *udata, const char *path, ino_t inode)
+{
+    assert (udata != NULL);
+
+    handle_context *ctx = (handle_context *) udata;
+    assert (ctx->wrk != NULL);
+    assert (ctx->w != NULL);
+
+    watch *dep = find_dependency (ctx->wrk, ctx->w, path);
+    if (dep != NULL) {
+        worker_release_arrival (ctx->wrk, dep);
+    }
+
+    /* A file still linked could have been moved to another watched
+     * directory, which may be rescanned later */
+    if (dep != NULL && !is_deleted (dep->fd)) {
+        dep->moving = 1;
+        dep->moved_since = now_msec ();
+        ++ctx->wrk->moves_pending;
+        return;
+    }
+
+    int addMask = entry_isdir_mask (ctx, dep, inode);
+    enqueue_entry_event (ctx->wrk, ctx->w, IN_DELETE | addMask, 0, path, NULL);
+}
+
+/**
+ * Produce an IN_MOVED_FROM/IN_MOVED_TO notifications pair for a replaced file.
+ * Also stops wathing on the replaced file.
+ *
+ * This function is used as a callback and is invoked from the dep-list
+ * routines.
+ *
+ * @param[in] udata       A pointer to user data (#handle_context).
+ * @param[in] from_path   File name of the source file.
+ * @param[in] from_inode  Inode number of the source file.
+ * @param[in] to_path     File name of the replaced file.
+ * @param[in] to_inode    Inode number of the replaced file.
+**/
+static void
+handle_replaced (void       *udata,
+                 const char *from_path,
+                 ino_t       from_inode,
+                 const char *to_path,
+                 ino_t       to_inode)
+{
+    assert (udata != NULL);
+
+    handle_context *ctx = (handle_context *) udata;
+    assert (ctx->wrk != NULL);
+    assert (ctx->w != NULL);
+
+    handle_moved (udata, from_path, from_inode, to_path, to_inode);
+    worker_remove_watch (ctx->wrk, ctx->w, to_path);
+}
+
+/**
+ * Produce an IN_DELETE/IN_CREATE notifications pair for an overwritten file.
+ * Reopen a watch for the overwritten file.
+ *
+ * This function is used as a callback and is invoked from the dep-list
+ * routines.
+ *
+ * @param[in] udata  A pointer to user data (#handle_context).
+ * @param[in] path   File name of the overwritten file.
+ * @param[in] inode  Inode number of the overwritten file.
+ **/
+static void
+handle_overwritten (void *udata, const char *path, ino_t inode)
+{
+    assert (udata != NULL);
+
+    handle_context *ctx = (handle_context *) udata;
+    assert (ctx->wrk != NULL);
+    assert (ctx->w != NULL);
+
+    watch *dep = find_dependency (ctx->wrk, ctx->w, path);
+    if (dep != NULL) {
+        worker_release_arrival (ctx->wrk, dep);
+    }
+    int addMask = entry_isdir_mask (ctx, dep, inode);
+    enqueue_entry_event (ctx->wrk, ctx->w, IN_DELETE | addMask, 0, path, NULL);
+
+    add_dependency (ctx, path, IN_CREATE, 0);
+    worker_remove_watch (ctx->wrk, ctx->w, path);
+}
+
+/**
+ * Produce an IN_MOVED_FROM/IN_MOVED_TO notifications pair for a renamed file.
+ *
+ * This function is used as a callback and is invoked from the dep-list
+ * routines.
+ *
+ * @param[in] udata       A pointer to user data (#handle_context).
+ * @param[in] from_path   The old name of the file.
+ * @param[in] from_inode  Inode number of the old file.
+ * @param[in] to_path     The new name of the file.
+ * @param[in] to_inode    Inode number of the new file.
+**/
+static void
+handle_moved (void       *udata,
+              const char *from_path,
+              ino_t       from_inode,
+              const char *to_path,
+              ino_t       to_inode)
+{
+    assert (udata != NULL);
+
+    handle_context *ctx = (handle_context *) udata;
+    assert (ctx->wrk != NULL);
+    assert (ctx->w != NULL);
+
+    watch *dep = find_dependency (ctx->wrk, ctx->w, from_path);
+    if (dep != NULL) {
+        worker_release_arrival (ctx->wrk, dep);
+    }
+    int addMask = entry_isdir_mask (ctx, dep, from_inode);
+    uint32_t cookie = from_inode & 0x00000000FFFFFFFF;
+
+    /* A rename changes the ctime, it is not reported as IN_ATTRIB */
+    if (ctx->w->poll != NULL) {
+        poll_refresh (ctx->w->poll, to_inode, ctx->w->fd, to_path);
+    }
+
+    enqueue_entry_event (ctx->wrk, ctx->w, IN_MOVED_FROM | addMask, cookie, from_path, NULL);
+    enqueue_entry_event (ctx->wrk, ctx->w, IN_MOVED_TO | addMask, cookie, to_path, NULL);
+}
+
+/**
+ * Remove the appropriate watches if the files were removed from the directory.
+ * 
+ * This function is used as a callback and is invoked from the dep-list
+ * routines.
+ *
+ * @param[in] udata  A pointer to user data (#handle_context).
+ * @param[in] list   A list of the removed files. 
+ **/
+static void
+handle_many_removed (void *udata, const dep_list *list)
+{
+    assert (udata != NULL);
+    handle_context *ctx = (handle_context *) udata;
+
+    if (list) {
+        worker_remove_many (ctx->wrk, ctx->w, list, 0);
+    }
+}
+
+/**
+ * Update file names for the renamed files.
+ *
+ * This function is used as a callback and is invoked from the dep-list
+ * routines.
+ *
+ * @param[in] udata  A pointer to user data (#handle_context).
+ **/
+static void
+handle_names_updated (void *udata)
+{
+    assert (udata != NULL);
+
+    handle_context *ctx = (handle_context *) udata;
+    assert (ctx->wrk != NULL);
+    assert (ctx->w != NULL);
+
+    worker_update_paths (ctx->wrk, ctx->w);
+}
+
+
+static const traverse_cbs cbs = {
+    handle_added,
+    handle_removed,
+    handle_replaced,
+    handle_overwritten,
+    handle_moved,
+    NULL, /* many_added */
+    handle_many_removed,
+    handle_names_updated,
+};
+
+static void watch_added (handle_context *ctx, size_t count);
+
+/**
+ * Compare a new listing of a watched directory with the known one and
+ * notify about the changes.
+ *
+ * In the kqueue mode, the new entries above IN_SLICE are left in
+ * w->added to be watched and reported later, see watch_added().
+ *
+ * @param[in] wrk  A pointer to #worker.
+ * @param[in] w    A pointer to #watch.
+ * @param[in] path The full path of the directory.
+ * @param[in] now  The new listing. Taken over by the watch.
+ **/
+static void
+diff_directory (worker *wrk, watch *w, const char *path, dep_list *now)
+{
+    dep_list *was = w->deps;
+    now = filter_apply (w->filter, now);
+    dl_share_names (was, now);
+    ++wrk->stats.rescans;
+
+    w->deps = now;
+
+    handle_context ctx;
+    memset (&ctx, 0, sizeof (ctx));
+    ctx.wrk = wrk;
+    ctx.w = w;
+    ctx.path = path;
+    if (w->poll == NULL && wrk->params.slice > 0) {
+        ctx.deferred = &w->added;
+    }
+
+    dl_calculate (was, now, &cbs, &ctx);
+
+    if (w->poll != NULL) {
+        poll_rebuild (w->poll, w->deps, w->fd);
+    }
+
+    dl_free (was);
+
+    if (w->added != NULL) {
+        if (watch_register_timer (w, wrk->kq, 0) == 0) {
+            w->rescan_pending = 0;
+        } else {
+            perror_msg ("Failed to defer watching the entries of %s", path);
+            watch_added (&ctx, SIZE_MAX);
+        }
+    }
+}
+
+/**
+ * Detect and notify about the changes in the watched directory.
+ *
+ * This function is top-level and it operates with other specific routines
+ * to notify about different sets of events in a different conditions.
+ *
+ * A directory larger than IN_SLICE is listed a slice at a time on a zero
+ * timer, so the commands and the other events are served in between,
+ * see continue_listing().
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to #watch.
+ **/
+void
+produce_directory_diff (worker *wrk, watch *w)
+{
+    assert (wrk != NULL);
+    assert (w != NULL);
+
+    assert (watch_has_dependencies (w));
+
+    /* The path of a subdirectory moved out in this batch is unknown yet */
+    if (w->moving) {
+        return;
+    }
+
+    /* The known listing is incomplete yet, compare against it once done */
+    if (watch_is_busy (w)) {
+        w->dirty = 1;
+        return;
+    }
+
+    char *path = watch_path (w);
+    if (path == NULL) {
+        perror_msg ("Failed to allocate a path of directory %s", w->filename);
+        return;
+    }
+
+    dep_list *now = NULL;
+    if (w->poll == NULL && wrk->params.slice > 0) {
+        dep_listing *ls = dl_listing_start (path);
+        int done = (ls != NULL) ? dl_listing_next (ls, wrk->params.slice) : -1;
+        if (done == 0) {
+            if (watch_register_timer (w, wrk->kq, 0) == 0) {
+                /* The timer of a pending rescan is taken over too */
+                w->rescan_pending = 0;
+                w->listing = ls;
+                free (path);
+                return;
+            }
+            done = dl_listing_next (ls, SIZE_MAX);
+        }
+        if (done == -1) {
+            perror_msg ("Failed to create a listing for directory %s", path);
+            dl_listing_free (ls);
+            free (path);
+            return;
+        }
+        now = dl_listing_finish (ls);
+    } else {
+        int failed = 0;
+        now = dl_listing (path, &failed);
+
+        if (now == NULL && failed && errno != ENOENT) {
+            /* Why do I skip ENOENT? Because the directory could be deleted at this
+             * point */
+            perror_msg ("Failed to create a listing for directory %s",
+                        path);
+            free (path);
+            return;
+        }
+    }
+
+    diff_directory (wrk, w, path, now);
+    free (path);
+}
+
+/**
+ * Check if an entry of a directory snapshot is a directory.
+ *
+ * @param[in] ctx   A pointer to #handle_context.
+ * @param[in] path  File name of the entry.
+ * @param[in] inode Inode number of the entry.
+ * @return IN_ISDIR if directory, 0 otherwise.
+ **/
+static uint32_t
+saved_isdir_mask (const handle_context *ctx, const char *path, ino_t inode)
+{
+    const dep_list *iter;
+    for (iter = ctx->saved; iter != NULL; iter = iter->next) {
+        if (iter->inode == inode && strcmp (iter->path, path) == 0) {
+            return (iter->type == DT_DIR) ? IN_ISDIR : 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Produce an IN_DELETE notification for a file removed while the
+ * directory was not watched.
+ *
+ * This function is used as a callback and is invoked from the dep-list
+ * routines. There is no watch for such file anymore, so its type is
+ * taken from the snapshot.
+ *
+ * @param[in] udata  A pointer to user data (#handle_context).
+ * @param[in] path   File name of the removed file.
+ * @param[in] inode  Inode number of the removed file.
+ **/
+static void
+handle_saved_removed (void *udata, const char *path, ino_t inode)
+{
+    assert (udata != NULL);
+
+    handle_context *ctx = (handle_context *) udata;
+    assert (ctx->wrk != NULL);
+    assert (ctx->w != NULL);
+
+    uint32_t addMask = saved_isdir_mask (ctx, path, inode);
+    enqueue_entry_event (ctx->wrk, ctx->w, IN_DELETE | addMask, 0, path, NULL);
+}
+
+/**
+ * Produce an IN_MOVED_FROM/IN_MOVED_TO notifications pair for a file
+ * renamed while the directory was not watched.
+ *
+ * @param[in] udata       A pointer to user data (#handle_context).
+ * @param[in] from_path   The old name of the file.
+ * @param[in] from_inode  Inode number of the old file.
+ * @param[in] to_path     The new name of the file.
+ * @param[in] to_inode    Inode number of the new file.
+ **/
+static void
+handle_saved_moved (void       *udata,
+                    const char *from_path,
+                    ino_t       from_inode,
+                    const char *to_path,
+                    ino_t       to_inode)
+{
+    assert (udata != NULL);
+
+    handle_context *ctx = (handle_context *) udata;
+    assert (ctx->wrk != NULL);
+    assert (ctx->w != NULL);
+    (void) to_inode;
+
+    uint32_t addMask = saved_isdir_mask (ctx, from_path, from_inode);
+    uint32_t cookie = from_inode & 0x00000000FFFFFFFF;
+
+    enqueue_entry_event (ctx->wrk, ctx->w, IN_MOVED_FROM | addMask, cookie, from_path, NULL);
+    enqueue_entry_event (ctx->wrk, ctx->w, IN_MOVED_TO | addMask, cookie, to_path, NULL);
+}
+
+/**
+ * Produce an IN_CREATE notification for a file added while the
+ * directory was not watched.
+ *
+ * This function is used as a callback and is invoked from the dep-list
+ * routines. The file is already watched at this point.
+ *
+ * @param[in] udata  A pointer to user data (#handle_context).
+ * @param[in] path   File name of the new file.
+ * @param[in] inode  Inode number of the new file.
+ **/
+static void
+handle_saved_added (void *udata, const char *path, ino_t inode)
+{
+    assert (udata != NULL);
+    (void) inode;
+
+    handle_context *ctx = (handle_context *) udata;
+    assert (ctx->wrk != NULL);
+    assert (ctx->w != NULL);
+
+    const watch *dep = find_dependency (ctx->wrk, ctx->w, path);
+    int addMask = (dep != NULL && dep->is_really_dir) ? IN_ISDIR : 0;
+    enqueue_entry_event (ctx->wrk, ctx->w, IN_CREATE | addMask, 0, path, dep);
+}
+
+/**
+ * Produce an IN_DELETE/IN_CREATE notifications pair for a file
+ * overwritten while the directory was not watched.
+ *
+ * @param[in] udata  A pointer to user data (#handle_context).
+ * @param[in] path   File name of the overwritten file.
+ * @param[in] inode  Inode number of the new file.
+ **/
+static void
+handle_saved_overwritten (void *udata, const char *path, ino_t inode)
+{
+    assert (udata != NULL);
+    (void) inode;
+
+    handle_context *ctx = (handle_context *) udata;
+    const watch *dep = find_dependency (ctx->wrk, ctx->w, path);
+    int addMask = (dep != NULL && dep->is_really_dir) ? IN_ISDIR : 0;
+
+    enqueue_entry_event (ctx->wrk, ctx->w, IN_DELETE | addMask, 0, path, NULL);
+    enqueue_entry_event (ctx->wrk, ctx->w, IN_CREATE | addMask, 0, path, dep);
+}
+
+/* The watches already reflect the current contents of the directory,
+ * so these callbacks only produce the notifications */
+static const traverse_cbs saved_cbs = {
+    handle_saved_added,
+    handle_saved_removed,
+    handle_saved_moved,       /* replaced */
+    handle_saved_overwritten,
+    handle_saved_moved,
+    NULL, /* many_added */
+    NULL, /* many_removed */
+    NULL, /* names_updated */
+};
+
+/**
+ * Notify about the changes made in a directory while it was not watched.
+ *
+ * @param[in] wrk   A pointer to #worker.
+ * @param[in] w     A pointer to the just added directory #watch.
+ * @param[in] saved The contents of the directory loaded from a snapshot.
+ **/
+void
+produce_snapshot_diff (worker *wrk, watch *w, dep_list *saved)
+{
+    assert (wrk != NULL);
+    assert (w != NULL);
+    assert (w->type == WATCH_USER);
+    assert (w->is_directory);
+
+    handle_context ctx;
+    memset (&ctx, 0, sizeof (ctx));
+    ctx.wrk = wrk;
+    ctx.w = w;
+    ctx.saved = saved;
+
+    dl_calculate (saved, w->deps, &saved_cbs, &ctx);
+    flush_events (wrk);
+}
+
+/**
+ * Find a watch by its file descriptor.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] fd  A file descriptor of the watch.
+ * @return A pointer to #watch or NULL if not found.
+ **/
+static watch*
+worker_find_watch (worker *wrk, int fd)
+{
+    size_t i;
+    for (i = 0; i < wrk->sets.length; i++) {
+        if (wrk->sets.watches[i]->fd == fd) {
+            return wrk->sets.watches[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find a watch a kqueue event was received for.
+ *
+ * A batch of events may contain events of the watches that have been
+ * removed while processing the previous events of the same batch. The
+ * file descriptors of such watches could be already reused by the new
+ * ones, so the watch serial passed as udata is checked too.
+ *
+ * @param[in] wrk   A pointer to #worker.
+ * @param[in] event A pointer to the received kqueue event.
+ * @return A pointer to #watch or NULL if the event is stale.
+ **/
+static watch*
+worker_find_event_watch (worker *wrk, const struct kevent *event)
+{
+    watch *w = worker_find_watch (wrk, event->ident);
+    if (w != NULL && w->serial != (uintptr_t) event->udata) {
+        return NULL;
+    }
+    return w;
+}
+
+/**
+ * Account a change of a directory and check if it is hot.
+ *
+ * The directories changing at IN_HOT_RATE or more times a second are
+ * rescanned periodically rather than on every change, until their rate
+ * drops below a half of it. The rate is measured over a window, so a
+ * directory cools down on its first change after a quiet period.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to the directory #watch.
+ * @return 1 if the directory is hot, 0 otherwise.
+ **/
+static int
+is_hot (worker *wrk, watch *w)
+{
+    if (wrk->params.hot_rate == 0) {
+        if (w->hot) {
+            w->hot = 0;
+            ++wrk->stats.hot_left;
+        }
+        return 0;
+    }
+
+    uint64_t now = now_msec ();
+
+    ++w->hot_changes;
+    uint64_t elapsed = now - w->hot_since;
+    if (elapsed >= WORKER_HOT_WINDOW_MSEC) {
+        uint64_t rate = (uint64_t) w->hot_changes * 1000 / elapsed;
+        if (!w->hot && rate >= (uint64_t) wrk->params.hot_rate) {
+            w->hot = 1;
+            ++wrk->stats.hot_entered;
+        } else if (w->hot && rate < (uint64_t) wrk->params.hot_rate / 2) {
+            w->hot = 0;
+            ++wrk->stats.hot_left;
+        }
+        w->hot_since = now;
+        w->hot_changes = 0;
+    }
+    return w->hot;
+}
+
+/**
+ * Defer a directory rescan for the debounce window, or for the rescan
+ * interval of a hot directory.
+ *
+ * Changes arriving while the rescan is pending are folded into it.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to the directory #watch.
+ **/
+static void
+schedule_rescan (worker *wrk, watch *w)
+{
+    /* The timer is taken by the work in the background */
+    if (watch_is_busy (w)) {
+        produce_directory_diff (wrk, w);
+        return;
+    }
+
+    if (w->rescan_pending) {
+        ++wrk->stats.rescans_folded;
+        return;
+    }
+
+    int msec = w->hot ? wrk->params.hot_msec : wrk->params.debounce_ms;
+    if (watch_register_timer (w, wrk->kq, msec) == -1) {
+        perror_msg ("Failed to defer a rescan of %s", w->filename);
+        produce_directory_diff (wrk, w);
+        return;
+    }
+    w->rescan_pending = 1;
+}
+
+/**
+ * Run a deferred directory rescan right now.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to the directory #watch.
  **/
-typedef struct {
-    worker *wrk;
-    watch *w;
-} handle_context;
+static void
+produce_pending_rescan (worker *wrk, watch *w)
+{
+    assert (w->rescan_pending);
+
+    watch_unregister_timer (w, wrk->kq);
+    w->rescan_pending = 0;
+    produce_directory_diff (wrk, w);
+}
 
 /**
- * Produce an IN_CREATE notification for a new file and start wathing on it.
+ * Check a watch polled with stat(2) for changes.
  *
- * This function is used as a callback and is invoked from the dep-list
- * routines.
+ * A directory is listed again only when its own modification time
+ * changes. The metadata of its entries is checked a slice at a time, so
+ * the work per tick stays bounded with any number of entries. The
+ * interval grows while the watch is idle and drops back on a change.
  *
- * @param[in] udata  A pointer to user data (#handle_context).
- * @param[in] path   File name of a new file.
- * @param[in] inode  Inode number of a new file.
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to the polled #watch.
  **/
 static void
-handle_added (void *udata, const char *path, ino_t inode)
+produce_poll_notifications (worker *wrk, watch *w)
 {
-    assert (udata != NULL);
+    assert (w->poll != NULL);
 
-    handle_context *ctx = (handle_context *) udata;
-    assert (ctx->wrk != NULL);
-    assert (ctx->w != NULL);
+    poll_state *ps = w->poll;
+    uint32_t isdir = w->is_really_dir ? IN_ISDIR : 0;
 
-    int addMask = 0;
-    char *npath = path_concat (ctx->w->filename, path);
-    if (npath != NULL) {
-        watch *neww = worker_start_watching (ctx->wrk, npath, path, ctx->w->flags, WATCH_DEPENDENCY);
-        if (neww == NULL) {
-            perror_msg ("Failed to start watching on a new dependency %s", npath);
-        } else {
-            neww->parent = ctx->w;
-            if (neww->is_really_dir) {
-                addMask = IN_ISDIR;
-            }
+    if (is_deleted (w->fd)) {
+        if (!oneshot_fire (wrk, w)) {
+            enqueue_event (wrk,
+                           w->fd,
+                           kqueue_to_inotify (NOTE_DELETE, w->is_really_dir, 0),
+                           0,
+                           NULL,
+                           w);
+        }
+        worker_remove (wrk, w->fd);
+        return;
+    }
+
+    int changes = poll_update (&ps->self, w->fd, NULL);
+    int active = (changes > 0);
+
+    if (changes == IN_MODIFY && w->is_directory) {
+        produce_directory_diff (wrk, w);
+    } else if (changes > 0 && (changes & w->flags) && !oneshot_fire (wrk, w)) {
+        enqueue_event (wrk, w->fd, changes | isdir, 0, NULL, w);
+    }
+
+    size_t i, slice = (ps->count < POLL_SLICE) ? ps->count : POLL_SLICE;
+    for (i = 0; i < slice; i++) {
+        if (ps->cursor >= ps->count) {
+            ps->cursor = 0;
+        }
+
+        poll_entry *pe = &ps->entries[ps->cursor++];
+        changes = poll_update (pe, w->fd, pe->name);
+        if (changes <= 0) {
+            continue;
+        }
+        active = 1;
+
+        /* The changes of the subdirectories are not about them */
+        if (S_ISDIR (pe->mode)) {
+            changes = (changes == IN_ATTRIB) ? (IN_ATTRIB | IN_ISDIR) : 0;
+        }
+        if (changes & w->flags) {
+            enqueue_entry_event (wrk, w, changes, 0, pe->name, NULL);
         }
-        free (npath);
-    } else {
-        perror_msg ("Failed to allocate a path to start watching a dependency");
     }
 
-    enqueue_event (ctx->wrk, ctx->w->fd, IN_CREATE | addMask, 0, path);
+    /* Look again soon at a recently changed file, and back off if idle */
+    if (active) {
+        ps->interval = wrk->params.poll_msec;
+    } else if (ps->interval < wrk->params.poll_msec * POLL_BACKOFF) {
+        ps->interval *= 2;
+    }
+    if (ps->interval > wrk->params.poll_msec * POLL_BACKOFF) {
+        ps->interval = wrk->params.poll_msec * POLL_BACKOFF;
+    }
+
+    if (watch_register_timer (w, wrk->kq, ps->interval) == -1) {
+        perror_msg ("Failed to schedule the next poll of %s", w->filename);
+    }
 }
 
 /**
- * Produce an IN_DELETE notification for a removed file.
- *
- * This function is used as a callback and is invoked from the dep-list
- * routines.
+ * Rescan a directory changed while the worker was busy with it, once
+ * it is not.
  *
- * @param[in] udata  A pointer to user data (#handle_context).
- * @param[in] path   File name of the removed file.
- * @param[in] inode  Inode number of the removed file.
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to the directory #watch.
  **/
 static void
-handle_removed (void *udata, const char *path, ino_t inode)
+finish_background (worker *wrk, watch *w)
 {
-    assert (udata != NULL);
-
-    handle_context *ctx = (handle_context *) udata;
-    assert (ctx->wrk != NULL);
-    assert (ctx->w != NULL);
-
-    int addMask = check_is_dir_cached (path, ctx->wrk) ? IN_ISDIR : 0;
-    enqueue_event (ctx->wrk, ctx->w->fd, IN_DELETE | addMask, 0, path);
+    if (!watch_is_busy (w) && w->dirty) {
+        w->dirty = 0;
+        produce_directory_diff (wrk, w);
+    }
 }
 
 /**
- * Produce an IN_MOVED_FROM/IN_MOVED_TO notifications pair for a replaced file.
- * Also stops wathing on the replaced file.
+ * Watch an entry of a directory populated in the background.
  *
- * This function is used as a callback and is invoked from the dep-list
- * routines.
+ * The entry is the one listed when the directory was watched. If it has
+ * been removed or replaced since then, the change is reported now, as
+ * the rescans of the directory wait for the population to finish.
  *
- * @param[in] udata       A pointer to user data (#handle_context).
- * @param[in] from_path   File name of the source file.
- * @param[in] from_inode  Inode number of the source file.
- * @param[in] to_path     File name of the replaced file.
- * @param[in] to_inode    Inode number of the replaced file.
-**/
-static void
-handle_replaced (void       *udata,
-                 const char *from_path,
-                 ino_t       from_inode,
-                 const char *to_path,
-                 ino_t       to_inode)
+ * @param[in] ctx   A pointer to #handle_context.
+ * @param[in] entry The entry to watch.
+ * @return 1 if the entry is gone and should be dropped, 0 otherwise.
+ **/
+static int
+populate_entry (handle_context *ctx, dep_list *entry)
 {
-    assert (udata != NULL);
+    worker *wrk = ctx->wrk;
+    watch *w = ctx->w;
+    uint32_t was_dir = (entry->type == DT_DIR) ? IN_ISDIR : 0;
 
-    handle_context *ctx = (handle_context *) udata;
-    assert (ctx->wrk != NULL);
-    assert (ctx->w != NULL);
+    char *path = path_concat (ctx->path, entry->path);
+    if (path == NULL) {
+        perror_msg ("Failed to allocate a path to start watching a dependency");
+        return 0;
+    }
 
-    handle_moved (udata, from_path, from_inode, to_path, to_inode);
-    worker_remove_watch (ctx->wrk, ctx->w, to_path);
+    watch *neww = worker_start_watching (wrk,
+                                         path,
+                                         entry->path,
+                                         w->flags,
+                                         WATCH_DEPENDENCY,
+                                         w,
+                                         NULL);
+    free (path);
+
+    if (neww == NULL) {
+        struct stat st;
+        if (fstatat (w->fd, entry->path, &st, AT_SYMLINK_NOFOLLOW) == -1
+            && errno == ENOENT) {
+            enqueue_entry_event (wrk, w, IN_DELETE | was_dir, 0, entry->path, NULL);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (neww->inode != entry->inode) {
+        /* Start over to report the new file with its contents */
+        entry->inode = neww->inode;
+        entry->type = DT_UNKNOWN;
+        worker_remove_many (wrk, neww, neww->deps, 1);
+
+        enqueue_entry_event (wrk, w, IN_DELETE | was_dir, 0, entry->path, NULL);
+        add_dependency (ctx, entry->path, IN_CREATE, 0);
+    }
+    return 0;
 }
 
 /**
- * Produce an IN_DELETE/IN_CREATE notifications pair for an overwritten file.
- * Reopen a watch for the overwritten file.
+ * Watch the next slice of the entries of a directory watched with
+ * IN_ASYNC.
  *
- * This function is used as a callback and is invoked from the dep-list
- * routines.
+ * The slices are taken on a zero timer, so the other events and the
+ * commands are served in between. When all the entries are watched,
+ * the changes made to the directory meanwhile are reported. The user
+ * gets IN_POPULATED when its subdirectories are done too, see
+ * worker_populated().
  *
- * @param[in] udata  A pointer to user data (#handle_context).
- * @param[in] path   File name of the overwritten file.
- * @param[in] inode  Inode number of the overwritten file.
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to the #watch on the directory.
  **/
 static void
-handle_overwritten (void *udata, const char *path, ino_t inode)
+populate_directory (worker *wrk, watch *w)
 {
-    assert (udata != NULL);
+    assert (w->populating != NULL);
 
-    handle_context *ctx = (handle_context *) udata;
-    assert (ctx->wrk != NULL);
-    assert (ctx->w != NULL);
+    char *path = watch_path (w);
+    if (path == NULL) {
+        perror_msg ("Failed to allocate a path of directory %s", w->filename);
+        watch_register_timer (w, wrk->kq, 0);
+        return;
+    }
 
-    handle_removed (udata, path, inode);
-    handle_added (udata, path, inode);
-    worker_remove_watch (ctx->wrk, ctx->w, path);
+    handle_context ctx;
+    memset (&ctx, 0, sizeof (ctx));
+    ctx.wrk = wrk;
+    ctx.w = w;
+    ctx.path = path;
+
+    size_t count = 0, slice = wrk->params.slice ? (size_t) wrk->params.slice : SIZE_MAX;
+    while (*w->populating != NULL) {
+        if (count++ == slice) {
+            if (watch_register_timer (w, wrk->kq, 0) == 0) {
+                free (path);
+                return;
+            }
+            perror_msg ("Failed to defer watching the entries of %s", path);
+            slice = SIZE_MAX;
+        }
+
+        dep_list *entry = *w->populating;
+        if (populate_entry (&ctx, entry)) {
+            *w->populating = entry->next;
+            entry->next = NULL;
+            dl_free (entry);
+        } else {
+            w->populating = &entry->next;
+        }
+    }
+    free (path);
+
+    w->populating = NULL;
+    worker_load_snapshot (wrk, w);
+    finish_background (wrk, w);
+    worker_populated (wrk, w);
 }
 
 /**
- * Produce an IN_MOVED_FROM/IN_MOVED_TO notifications pair for a renamed file.
+ * Watch and report the next new entries found by a rescan, see
+ * diff_directory().
  *
- * This function is used as a callback and is invoked from the dep-list
- * routines.
+ * An entry removed meanwhile is dropped from the listing without a
+ * word, as if both changes were folded into the same rescan.
  *
- * @param[in] udata       A pointer to user data (#handle_context).
- * @param[in] from_path   The old name of the file.
- * @param[in] from_inode  Inode number of the old file.
- * @param[in] to_path     The new name of the file.
- * @param[in] to_inode    Inode number of the new file.
-**/
+ * @param[in] ctx   A pointer to #handle_context.
+ * @param[in] count The maximum number of entries to watch.
+ **/
 static void
-handle_moved (void       *udata,
-              const char *from_path,
-              ino_t       from_inode,
-              const char *to_path,
-              ino_t       to_inode)
+watch_added (handle_context *ctx, size_t count)
 {
-    assert (udata != NULL);
-
-    handle_context *ctx = (handle_context *) udata;
-    assert (ctx->wrk != NULL);
-    assert (ctx->w != NULL);
-
-    int addMask = check_is_dir_cached (from_path, ctx->wrk) ? IN_ISDIR : 0;
-    uint32_t cookie = from_inode & 0x00000000FFFFFFFF;
+    watch *w = ctx->w;
+
+    while (w->added != NULL && count-- > 0) {
+        dep_list *entry = w->added;
+        w->added = entry->next;
+        entry->next = NULL;
+
+        struct stat st;
+        dep_list **link = find_entry_link (w, entry->path);
+        if (fstatat (w->fd, entry->path, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            if (errno == ENOENT && link != NULL) {
+                dep_list *gone = *link;
+                *link = gone->next;
+                gone->next = NULL;
+                dl_free (gone);
+                dl_free (entry);
+                continue;
+            }
+        } else if (link != NULL && (*link)->inode != st.st_ino) {
+            /* Replaced meanwhile, the new file is reported below */
+            (*link)->inode = st.st_ino;
+            (*link)->type = DT_UNKNOWN;
+        }
 
-    enqueue_event (ctx->wrk, ctx->w->fd, IN_MOVED_FROM | addMask, cookie, from_path);
-    enqueue_event (ctx->wrk, ctx->w->fd, IN_MOVED_TO | addMask, cookie, to_path);
+        add_dependency (ctx, entry->path, IN_CREATE, 0);
+        dl_free (entry);
+    }
 }
 
 /**
- * Remove the appropriate watches if the files were removed from the directory.
- * 
- * This function is used as a callback and is invoked from the dep-list
- * routines.
+ * Watch the next slice of the new entries found by a rescan.
  *
- * @param[in] udata  A pointer to user data (#handle_context).
- * @param[in] list   A list of the removed files. 
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to the directory #watch.
  **/
 static void
-handle_many_removed (void *udata, const dep_list *list)
+continue_added (worker *wrk, watch *w)
 {
-    assert (udata != NULL);
-    handle_context *ctx = (handle_context *) udata;
+    assert (w->added != NULL);
 
-    if (list) {
-        worker_remove_many (ctx->wrk, ctx->w, list, 0);
+    char *path = watch_path (w);
+    if (path == NULL) {
+        perror_msg ("Failed to allocate a path of directory %s", w->filename);
+        watch_register_timer (w, wrk->kq, 0);
+        return;
+    }
+
+    handle_context ctx;
+    memset (&ctx, 0, sizeof (ctx));
+    ctx.wrk = wrk;
+    ctx.w = w;
+    ctx.path = path;
+
+    watch_added (&ctx, wrk->params.slice ? (size_t) wrk->params.slice : SIZE_MAX);
+    if (w->added != NULL && watch_register_timer (w, wrk->kq, 0) == -1) {
+        perror_msg ("Failed to defer watching the entries of %s", path);
+        watch_added (&ctx, SIZE_MAX);
     }
+    free (path);
+
+    finish_background (wrk, w);
 }
 
 /**
- * Update file names for the renamed files.
- *
- * This function is used as a callback and is invoked from the dep-list
- * routines.
+ * Read the next slice of a large directory listing and, once it is
+ * complete, compare it with the known one.
  *
- * @param[in] udata  A pointer to user data (#handle_context).
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to the directory #watch.
  **/
 static void
-handle_names_updated (void *udata)
+continue_listing (worker *wrk, watch *w)
 {
-    assert (udata != NULL);
+    assert (w->listing != NULL);
 
-    handle_context *ctx = (handle_context *) udata;
-    assert (ctx->wrk != NULL);
-    assert (ctx->w != NULL);
+    size_t slice = wrk->params.slice ? (size_t) wrk->params.slice : SIZE_MAX;
+    int done = dl_listing_next (w->listing, slice);
+    if (done == 0) {
+        if (watch_register_timer (w, wrk->kq, 0) == 0) {
+            return;
+        }
+        done = dl_listing_next (w->listing, SIZE_MAX);
+    }
 
-    worker_update_paths (ctx->wrk, ctx->w);
-}
+    dep_listing *ls = w->listing;
+    w->listing = NULL;
 
+    char *path = watch_path (w);
+    if (done == -1 || path == NULL) {
+        perror_msg ("Failed to create a listing for directory %s", w->filename);
+        dl_listing_free (ls);
+        free (path);
+        return;
+    }
 
-static const traverse_cbs cbs = {
-    handle_added,
-    handle_removed,
-    handle_replaced,
-    handle_overwritten,
-    handle_moved,
-    NULL, /* many_added */
-    handle_many_removed,
-    handle_names_updated,
-};
+    diff_directory (wrk, w, path, dl_listing_finish (ls));
+    free (path);
+
+    finish_background (wrk, w);
+}
 
 /**
- * Detect and notify about the changes in the watched directory.
- *
- * This function is top-level and it operates with other specific routines
- * to notify about different sets of events in a different conditions.
+ * Handle an expired rescan or polling timer.
  *
  * @param[in] wrk   A pointer to #worker.
- * @param[in] w     A pointer to #watch.
- * @param[in] event A pointer to the received kqueue event.
+ * @param[in] event A pointer to the received EVFILT_TIMER event.
  **/
 void
-produce_directory_diff (worker *wrk, watch *w, struct kevent *event)
+process_timer (worker *wrk, struct kevent *event)
 {
     assert (wrk != NULL);
-    assert (w != NULL);
     assert (event != NULL);
 
-    assert (w->type == WATCH_USER);
-    assert (w->is_directory);
+    watch *w = worker_find_event_watch (wrk, event);
 
-    dep_list *was = NULL, *now = NULL;
-    int failed = 0;
-    was = w->deps;
-    now = dl_listing (w->filename, &failed);
-
-    if (now == NULL && failed && errno != ENOENT) {
-        /* Why do I skip ENOENT? Because the directory could be deleted at this
-         * point */
-        perror_msg ("Failed to create a listing for directory %s",
-                    w->filename);
-        printf("Bye!\n");
+    if (w != NULL && w->poll != NULL) {
+        produce_poll_notifications (wrk, w);
         return;
     }
 
-    w->deps = now;
+    if (w != NULL && watch_is_busy (w)) {
+        if (w->moving) {
+            /* Its path is known by the end of the batch */
+            watch_register_timer (w, wrk->kq, 0);
+        } else if (w->populating != NULL) {
+            populate_directory (wrk, w);
+        } else if (w->listing != NULL) {
+            continue_listing (wrk, w);
+        } else {
+            continue_added (wrk, w);
+        }
+        return;
+    }
 
-    handle_context ctx;
-    memset (&ctx, 0, sizeof (ctx));
-    ctx.wrk = wrk;
-    ctx.w = w;
-    
-    dl_calculate (was, now, &cbs, &ctx);
-    
-    dl_free (was);
+    /* The timer could outlive its watch */
+    if (w == NULL || !watch_has_dependencies (w) || !w->rescan_pending) {
+        return;
+    }
+
+    /* The one-shot timer has already been removed by kqueue */
+    w->rescan_pending = 0;
+    produce_directory_diff (wrk, w);
 }
 
 /**
@@ -431,18 +2198,28 @@ produce_notifications (worker *wrk, struct kevent *event)
     assert (wrk != NULL);
     assert (event != NULL);
 
-    watch *w = NULL;
-    size_t i;
-
-    for (i = 0; i < wrk->sets.length; i++) {
-        if (event->ident == wrk->sets.watches[i]->fd) {
-            w = wrk->sets.watches[i];
-            break;
-        }
+    watch *w = worker_find_event_watch (wrk, event);
+    if (w == NULL) {
+        /* The watch has been removed earlier in this batch */
+        return;
     }
-    assert (w != NULL);
 
     uint32_t flags = event->fflags;
+    uint32_t dir_flags = NOTE_WRITE | NOTE_EXTEND | NOTE_LINK;
+    watch *root = (w->type == WATCH_USER) ? w : w->parent;
+    assert (root != NULL);
+
+    /* A folded rescan must go out before anything else observed later on
+     * the directory or on its entries, otherwise the events get reordered */
+    if (root->rescan_pending
+        && !(w == root && (flags & NOTE_WRITE) && !(flags & ~dir_flags))) {
+        produce_pending_rescan (wrk, root);
+
+        /* The rescan could stop watching the entry */
+        if (worker_find_event_watch (wrk, event) != w) {
+            return;
+        }
+    }
 
     if (w->type == WATCH_USER) {
         /* Treat deletes as link number changes if links still exist */
@@ -451,34 +2228,61 @@ produce_notifications (worker *wrk, struct kevent *event)
         }
 
         if (flags & NOTE_WRITE && w->is_directory) {
-            produce_directory_diff (wrk, w, event);
-            flags &= ~(NOTE_WRITE | NOTE_EXTEND | NOTE_LINK);
+            int hot = is_hot (wrk, w);
+            if ((wrk->params.debounce_ms > 0 || hot) && !(flags & ~dir_flags)) {
+                schedule_rescan (wrk, w);
+            } else {
+                produce_directory_diff (wrk, w);
+            }
+            flags &= ~dir_flags;
         }
 
-        if (flags) {
+        if (flags && !oneshot_fire (wrk, w)) {
+            worker_release_arrivals (wrk, w);
             enqueue_event (wrk,
                            w->fd,
                            kqueue_to_inotify (flags, w->is_really_dir, 0),
                            0,
-                           NULL);
+                           NULL,
+                           w);
         }
 
         if (flags & NOTE_DELETE) {
             worker_remove (wrk, w->fd);
         }
     } else {
+        /* The name of a moved file is not known till the end of the batch */
+        if (w->moving) {
+            return;
+        }
+
+        /* A subdirectory of a recursive watch */
+        if (flags & NOTE_WRITE && watch_has_dependencies (w)) {
+            int hot = is_hot (wrk, w);
+            if ((wrk->params.debounce_ms > 0 || hot) && !(flags & ~dir_flags)) {
+                schedule_rescan (wrk, w);
+            } else {
+                if (w->rescan_pending) {
+                    produce_pending_rescan (wrk, w);
+                } else {
+                    produce_directory_diff (wrk, w);
+                }
+            }
+            flags &= ~dir_flags;
+        }
+
         /* for dependency events, ignore some notifications */
         if (flags & (NOTE_ATTRIB | NOTE_LINK | NOTE_WRITE)) {
             watch *p = w->parent;
             assert (p != NULL);
-            enqueue_event (wrk,
-                           p->fd,
-                           kqueue_to_inotify (flags, w->is_really_dir, 1),
-                           0,
-                           w->filename);
+            enqueue_entry_event (wrk,
+                                 p,
+                                 kqueue_to_inotify (flags, w->is_really_dir, 1),
+                                 0,
+                                 w->filename,
+                                 w);
         }
     }
-    flush_events (wrk);
 }
 
 /**
@@ -493,36 +2297,68 @@ worker_thread (void *arg)
     assert (arg != NULL);
     worker* wrk = (worker *) arg;
 
+    worker_thread_setup (&wrk->params);
+
     for (;;) {
-        struct kevent received;
+        struct kevent received[WORKER_BATCH_SIZE];
+        int i;
 
-        int ret = kevent (wrk->kq, NULL, 0, &received, 1, NULL);
+        int ret = kevent (wrk->kq, NULL, 0, received, WORKER_BATCH_SIZE, NULL);
         if (ret == -1) {
             perror_msg ("kevent failed");
             continue;
         }
+        wrk->stats.kevents += ret;
+        ++wrk->stats.batches;
+
+        /* Serve the user first: a pending inotify call blocks its caller,
+         * and a closed socket makes the rest of the batch pointless */
+        for (i = 0; i < ret; i++) {
+            if (received[i].ident == (uintptr_t) wrk->io[KQUEUE_FD]
+                && received[i].filter == EVFILT_READ) {
+                if (received[i].flags & EV_EOF) {
+                    wrk->closed = 1;
+                    wrk->io[INOTIFY_FD] = -1;
+                    worker_erase (wrk);
+
+                    if (pthread_mutex_trylock (&wrk->mutex) == 0) {
+                        pthread_mutex_unlock (&wrk->mutex);
+                        worker_free (wrk);
+                    }
+                    /* If we could not lock on a worker, it means that an
+                     * inotify call (add_watch/rm_watch) has already locked
+                     * it. In this case worker will be freed by a caller
+                     * (caller checks the `closed' flag. */
+                    return NULL;
+                } else {
+                    process_command (wrk);
+                }
+            }
+        }
 
-        if (received.ident == wrk->io[KQUEUE_FD]) {
-            if (received.flags & EV_EOF) {
-                wrk->closed = 1;
-                wrk->io[INOTIFY_FD] = -1;
-                worker_erase (wrk);
-
-                if (pthread_mutex_trylock (&wrk->mutex) == 0) {
-                    pthread_mutex_unlock (&wrk->mutex);
-                    worker_free (wrk);
+        for (i = 0; i < ret; i++) {
+            if (received[i].ident == (uintptr_t) wrk->io[KQUEUE_FD]) {
+                if (received[i].filter == EVFILT_WRITE) {
+                    /* One-shot, the pending events are flushed below */
+                    wrk->write_armed = 0;
                 }
-                /* If we could not lock on a worker, it means that an inotify
-                 * call (add_watch/rm_watch) has already locked it. In this
-                 * case worker will be freed by a caller (caller checks the
-                 * `closed' flag. */
-                return NULL;
+            } else if (received[i].filter == EVFILT_TIMER) {
+                process_timer (wrk, &received[i]);
             } else {
-                process_command (wrk);
+                produce_notifications (wrk, &received[i]);
             }
-        } else {
-            produce_notifications (wrk, &received);
         }
+
+        worker_finish_moves (wrk, NULL);
+
+        if (wrk->oneshots_fired > 0) {
+            remove_fired_watches (wrk);
+        }
+
+        receive_events (wrk);
+
+        /* Send everything produced by the batch at once */
+        flush_events (wrk);
     }
     return NULL;
 }
@@ -24,13 +24,21 @@
 #define __WORKER_THREAD_H__
 
 #include "worker.h"
+#include "watch.h"
+#include "dep-list.h"
 
 void* worker_thread (void *arg);
-int   enqueue_event (worker     *wrk,
-                     int         wd,
-                     uint32_t    mask,
-                     uint32_t    cookie,
-                     const char *name);
+int   enqueue_event (worker      *wrk,
+                     int          wd,
+                     uint32_t     mask,
+                     uint32_t     cookie,
+                     const char  *name,
+                     const watch *source);
 void  flush_events  (worker *wrk);
+void  worker_wake   (worker *wrk);
+void  produce_snapshot_diff (worker *wrk, watch *w, dep_list *saved);
+void  worker_finish_moves   (worker *wrk, const watch *parent);
+void  worker_release_arrival (worker *wrk, watch *w);
+void  worker_release_arrivals (worker *wrk, watch *root);
 
 #endif /* __WORKER_THREAD_H__ */
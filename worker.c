@@ -20,31 +20,259 @@
   THE SOFTWARE.
 *******************************************************************************/
 
+#ifdef __linux__
+#define _GNU_SOURCE /* pthread_setaffinity_np, pthread_setname_np */
+#endif
+
 #include <stdlib.h>
+#include <stddef.h> /* offsetof */
 #include <string.h>
+#include <limits.h> /* INT_MAX */
 #include <fcntl.h> /* open() */
 #include <unistd.h> /* close() */
 #include <assert.h>
 #include <stdio.h>
 #include <dirent.h>
+#include <errno.h>
+
+#include <sched.h>  /* SCHED_FIFO */
+#include <pthread.h>
 
 #include <sys/types.h>
-#include <sys/event.h>
 #include <sys/socket.h>
+#include <sys/stat.h> /* S_ISDIR */
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_NP_H
+#include <pthread_np.h> /* pthread_set_name_np, pthread_setaffinity_np */
+#endif
+#if defined (__FreeBSD__) || defined (__DragonFly__)
+#include <sys/cpuset.h>
+typedef cpuset_t worker_cpus_t;
+#else
+typedef cpu_set_t worker_cpus_t;
+#endif
 
 #include "sys/inotify.h"
 
+#include "backend.h"
+#include "compat.h"
 #include "utils.h"
 #include "conversions.h"
 #include "worker-thread.h"
 #include "worker.h"
+#include "snapshot.h"
+#include "shared.h"
+#include "shard.h"
+#include "open-pool.h"
 
 static void
 worker_update_flags (worker *wrk, watch *w, uint32_t flags);
 
+static void
+worker_update_filter (worker *wrk, watch *w, filter *filter);
+
 static void
 worker_cmd_reset (worker_cmd *cmd);
 
+static void
+worker_save_snapshot (worker *wrk, watch *w);
+
+static watch*
+worker_start_opened (worker      *wrk,
+                     const char  *path,
+                     const char  *entry_name,
+                     uint32_t     flags,
+                     watch_type_t type,
+                     watch       *parent,
+                     filter      *filter,
+                     open_result *opened);
+
+
+worker_params worker_default_params = {
+    0,              /* debounce_ms */
+    "",             /* snapshot_dir */
+    1,              /* coalesce */
+    16384,          /* max_queued */
+    0,              /* stat_events */
+    0,              /* storm_limit */
+    1000,           /* poll_msec */
+    0,              /* hot_rate */
+    250,            /* hot_msec */
+    0,              /* shared */
+    1,              /* shards */
+    0,              /* open_threads */
+    1024,           /* slice */
+    { 0 },          /* thread_cpus */
+    0,              /* thread_stack */
+    -1,             /* thread_policy */
+    0,              /* thread_priority */
+    "libinotify",   /* thread_name */
+};
+
+/**
+ * Set the CPUs the threads of a worker run on.
+ *
+ * @param[in] params A pointer to #worker_params.
+ * @param[in] cpus   The CPU numbers terminated with -1, NULL for any CPU.
+ * @return 0 on success, -1 if a CPU number is out of range.
+ **/
+static int
+worker_params_set_cpus (worker_params *params, const int *cpus)
+{
+    unsigned char set[sizeof (params->thread_cpus)];
+    memset (set, 0, sizeof (set));
+
+    for (; cpus != NULL && *cpus != -1; cpus++) {
+        if (*cpus < 0 || *cpus >= WORKER_MAX_CPUS) {
+            return -1;
+        }
+        set[*cpus / CHAR_BIT] |= 1 << (*cpus % CHAR_BIT);
+    }
+
+    memcpy (params->thread_cpus, set, sizeof (set));
+    return 0;
+}
+
+/**
+ * Set a worker parameter.
+ *
+ * @param[in] params A pointer to #worker_params.
+ * @param[in] param  A parameter id (IN_DEBOUNCE_MSEC, etc).
+ * @param[in] value  A new value of the parameter.
+ * @return 0 on success, -1 if the parameter or its value is invalid.
+ **/
+int
+worker_params_set (worker_params *params, int param, intptr_t value)
+{
+    assert (params != NULL);
+
+    switch (param) {
+    case IN_DEBOUNCE_MSEC:
+        if (value < 0 || value > INT_MAX) {
+            return -1;
+        }
+        params->debounce_ms = value;
+        return 0;
+    case IN_SNAPSHOT_DIR:
+        if (value == 0) {
+            params->snapshot_dir[0] = '\0';
+            return 0;
+        }
+        if (strlcpy (params->snapshot_dir,
+                     (const char *) value,
+                     sizeof (params->snapshot_dir))
+            >= sizeof (params->snapshot_dir)) {
+            params->snapshot_dir[0] = '\0';
+            return -1;
+        }
+        return 0;
+    case IN_COALESCE:
+        if (value != 0 && value != 1) {
+            return -1;
+        }
+        params->coalesce = value;
+        return 0;
+    case IN_MAX_QUEUED_EVENTS:
+        if (value < 1 || value > INT_MAX) {
+            return -1;
+        }
+        params->max_queued = value;
+        return 0;
+    case IN_STAT_EVENTS:
+        if (value != 0 && value != 1) {
+            return -1;
+        }
+        params->stat_events = value;
+        return 0;
+    case IN_STORM_LIMIT:
+        if (value < 0 || value > INT_MAX) {
+            return -1;
+        }
+        params->storm_limit = value;
+        return 0;
+    case IN_POLL_MSEC:
+        if (value < 1 || value > INT_MAX / POLL_BACKOFF) {
+            return -1;
+        }
+        params->poll_msec = value;
+        return 0;
+    case IN_HOT_RATE:
+        if (value < 0 || value > INT_MAX) {
+            return -1;
+        }
+        params->hot_rate = value;
+        return 0;
+    case IN_HOT_MSEC:
+        if (value < 1 || value > INT_MAX) {
+            return -1;
+        }
+        params->hot_msec = value;
+        return 0;
+    case IN_SHARED:
+        if (value != 0 && value != 1) {
+            return -1;
+        }
+        params->shared = value;
+        return 0;
+    case IN_SHARDS:
+        if (value < 1 || value > WORKER_MAX_SHARDS) {
+            return -1;
+        }
+        params->shards = value;
+        return 0;
+    case IN_OPEN_THREADS:
+        if (value < 0 || value > OPEN_POOL_MAX_HELPERS) {
+            return -1;
+        }
+        params->open_threads = value;
+        return 0;
+    case IN_SLICE:
+        if (value < 0) {
+            return -1;
+        }
+        params->slice = value;
+        return 0;
+    case IN_THREAD_CPUS:
+        return worker_params_set_cpus (params, (const int *) value);
+    case IN_THREAD_STACK:
+        if (value != 0 && value < PTHREAD_STACK_MIN) {
+            return -1;
+        }
+        params->thread_stack = value;
+        return 0;
+    case IN_THREAD_POLICY:
+        if (value != -1
+            && value != SCHED_OTHER
+            && value != SCHED_FIFO
+            && value != SCHED_RR) {
+            return -1;
+        }
+        params->thread_policy = value;
+        return 0;
+    case IN_THREAD_PRIORITY:
+        if (value < INT_MIN || value > INT_MAX) {
+            return -1;
+        }
+        params->thread_priority = value;
+        return 0;
+    case IN_THREAD_NAME:
+        if (value == 0) {
+            params->thread_name[0] = '\0';
+            return 0;
+        }
+        if (strlen ((const char *) value) >= sizeof (params->thread_name)) {
+            return -1;
+        }
+        strlcpy (params->thread_name,
+                 (const char *) value,
+                 sizeof (params->thread_name));
+        return 0;
+    default:
+        return -1;
+    }
+}
 
 /**
  * Initialize resources associated with worker command.
@@ -76,6 +304,25 @@ worker_cmd_add (worker_cmd *cmd, const char *filename, uint32_t mask)
     cmd->add.mask = mask;
 }
 
+/**
+ * Prepare a command with the data of the libinotify_add_watch_filtered()
+ * call.
+ *
+ * @param[in] cmd      A pointer to #worker_cmd.
+ * @param[in] filename A file name of the watched entry.
+ * @param[in] mask     A combination of the inotify watch flags.
+ * @param[in] filter   The entries to skip. The command takes it over.
+ **/
+void
+worker_cmd_add_filtered (worker_cmd *cmd,
+                         const char *filename,
+                         uint32_t    mask,
+                         filter     *filter)
+{
+    worker_cmd_add (cmd, filename, mask);
+    cmd->add.filter = filter;
+}
+
 
 /**
  * Prepare a command with the data of the inotify_rm_watch() call.
@@ -93,6 +340,191 @@ worker_cmd_remove (worker_cmd *cmd, int watch_id)
     cmd->rm_id = watch_id;
 }
 
+/**
+ * Prepare a command with the data of the libinotify_set_param() call.
+ *
+ * @param[in] cmd   A pointer to #worker_cmd.
+ * @param[in] param A parameter id.
+ * @param[in] value A new value of the parameter.
+ **/
+void
+worker_cmd_param (worker_cmd *cmd, int param, intptr_t value)
+{
+    assert (cmd != NULL);
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_PARAM;
+    cmd->param.param = param;
+    cmd->param.value = value;
+}
+
+/**
+ * Prepare a command with the data of the libinotify_get_stats() call.
+ *
+ * @param[in] cmd   A pointer to #worker_cmd.
+ * @param[in] stats A pointer to the user's counters to fill.
+ **/
+void
+worker_cmd_stats (worker_cmd *cmd, struct inotify_stats *stats)
+{
+    assert (cmd != NULL);
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_STATS;
+    cmd->stats = stats;
+}
+
+/**
+ * Prepare a command with the data of the libinotify_get_snapshot() call.
+ *
+ * @param[in] cmd    A pointer to #worker_cmd.
+ * @param[in] wd     An ID of the watch on a directory.
+ * @param[in] result A pointer to store the entries to.
+ **/
+void
+worker_cmd_snapshot (worker_cmd             *cmd,
+                     int                     wd,
+                     struct inotify_dirent **result)
+{
+    assert (cmd != NULL);
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_SNAPSHOT;
+    cmd->snapshot.wd = wd;
+    cmd->snapshot.result = result;
+}
+
+/**
+ * Prepare a command to share a watch with an instance.
+ *
+ * Sent to the worker serving the shared watches.
+ *
+ * @param[in] cmd      A pointer to #worker_cmd.
+ * @param[in] sub      A pointer to the #worker of the instance.
+ * @param[in] filename A file name of the watched entry.
+ * @param[in] mask     A combination of the inotify watch flags.
+ * @param[in] share    0 if the watch can not be shared, see shared_add().
+ **/
+void
+worker_cmd_subscribe (worker_cmd *cmd,
+                      worker     *sub,
+                      const char *filename,
+                      uint32_t    mask,
+                      int         share)
+{
+    assert (cmd != NULL);
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_SUBSCRIBE;
+    cmd->subscribe.filename = strdup (filename);
+    cmd->subscribe.mask = mask;
+    cmd->subscribe.sub = sub;
+    cmd->subscribe.share = share;
+}
+
+/**
+ * Prepare a command to stop sharing watches with an instance.
+ *
+ * @param[in] cmd A pointer to #worker_cmd.
+ * @param[in] sub A pointer to the #worker of the instance.
+ * @param[in] wd  An ID of the shared watch, -1 for all of them.
+ **/
+void
+worker_cmd_unsubscribe (worker_cmd *cmd, worker *sub, int wd)
+{
+    assert (cmd != NULL);
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_UNSUBSCRIBE;
+    cmd->unsubscribe.wd = wd;
+    cmd->unsubscribe.sub = sub;
+}
+
+/**
+ * Prepare a command to stop sending the events of a shard to its owner.
+ *
+ * @param[in] cmd A pointer to #worker_cmd.
+ **/
+void
+worker_cmd_detach (worker_cmd *cmd)
+{
+    assert (cmd != NULL);
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_DETACH;
+}
+
+/**
+ * Apply the placement and the scheduling parameters to the calling
+ * worker thread.
+ *
+ * The stack size is set when the thread is created, see worker_create().
+ *
+ * @param[in] params A pointer to #worker_params.
+ * @return 0 on success, -1 on failure.
+ **/
+int
+worker_thread_setup (const worker_params *params)
+{
+    assert (params != NULL);
+
+    int retval = 0;
+    pthread_t self = pthread_self ();
+
+    if (params->thread_name[0] != '\0') {
+#if defined (HAVE_PTHREAD_SET_NAME_NP)
+        pthread_set_name_np (self, params->thread_name);
+#elif defined (HAVE_PTHREAD_SETNAME_NP) && defined (__APPLE__)
+        pthread_setname_np (params->thread_name);
+#elif defined (HAVE_PTHREAD_SETNAME_NP) && defined (__NetBSD__)
+        pthread_setname_np (self, "%s", (void *) params->thread_name);
+#elif defined (HAVE_PTHREAD_SETNAME_NP)
+        pthread_setname_np (self, params->thread_name);
+#endif
+    }
+
+    size_t i;
+    int bound = 0;
+    for (i = 0; i < sizeof (params->thread_cpus); i++) {
+        bound |= params->thread_cpus[i];
+    }
+
+    if (bound) {
+#if defined (HAVE_PTHREAD_SETAFFINITY_NP) && !defined (__NetBSD__)
+        worker_cpus_t cpus;
+
+        CPU_ZERO (&cpus);
+        for (i = 0; i < WORKER_MAX_CPUS && i < CPU_SETSIZE; i++) {
+            if (params->thread_cpus[i / CHAR_BIT] & (1 << (i % CHAR_BIT))) {
+                CPU_SET (i, &cpus);
+            }
+        }
+        errno = pthread_setaffinity_np (self, sizeof (cpus), &cpus);
+        if (errno != 0) {
+            perror_msg ("Failed to set the CPU affinity of a worker thread");
+            retval = -1;
+        }
+#else
+        errno = ENOTSUP;
+        perror_msg ("Failed to set the CPU affinity of a worker thread");
+        retval = -1;
+#endif
+    }
+
+    if (params->thread_policy != -1) {
+        struct sched_param sp;
+        memset (&sp, 0, sizeof (sp));
+        sp.sched_priority = params->thread_priority;
+        errno = pthread_setschedparam (self, params->thread_policy, &sp);
+        if (errno != 0) {
+            perror_msg ("Failed to set the scheduling of a worker thread");
+            retval = -1;
+        }
+    }
+
+    return retval;
+}
+
 /**
  * Reset the worker command.
  *
@@ -105,12 +537,11 @@ worker_cmd_reset (worker_cmd *cmd)
 
     if (cmd->type == WCMD_ADD) {
         free (cmd->add.filename);
+        filter_free (cmd->add.filter);
+    } else if (cmd->type == WCMD_SUBSCRIBE) {
+        free (cmd->subscribe.filename);
     }
-    cmd->type = 0;
-    cmd->retval = 0;
-    cmd->add.filename = NULL;
-    cmd->add.mask = 0;
-    cmd->rm_id = 0;
+    memset (cmd, 0, offsetof (worker_cmd, sync));
 }
 
 /**
@@ -147,10 +578,11 @@ worker_cmd_release (worker_cmd *cmd)
 /**
  * Create a new worker and start its thread.
  *
+ * @param[in] params Initial parameters of the worker.
  * @return A pointer to a new worker.
  **/
 worker*
-worker_create ()
+worker_create (const worker_params *params)
 {
     pthread_attr_t attr;
     struct kevent ev;
@@ -162,9 +594,10 @@ worker_create ()
         goto failure;
     }
 
-    wrk->iovalloc = 0;
-    wrk->iovcnt = 0;
-    wrk->iov = NULL;
+    event_queue_init (&wrk->eq);
+    event_queue_init (&wrk->inbox);
+    pthread_mutex_init (&wrk->inbox_mutex, NULL);
+    wrk->params = *params;
 
     wrk->kq = kqueue ();
     if (wrk->kq == -1) {
@@ -177,6 +610,19 @@ worker_create ()
         goto failure;
     }
 
+    /* A slow user must not stall the worker thread */
+    if (set_nonblock_flag (wrk->io[KQUEUE_FD], 1) == -1) {
+        perror_msg ("Failed to make the worker socket non-blocking");
+        goto failure;
+    }
+#ifdef SO_NOSIGPIPE
+    {
+        int on = 1;
+        setsockopt (wrk->io[KQUEUE_FD], SOL_SOCKET, SO_NOSIGPIPE,
+                    &on, sizeof (on));
+    }
+#endif
+
     if (worker_sets_init (&wrk->sets) == -1) {
         goto failure;
     }
@@ -198,13 +644,23 @@ worker_create ()
 
     worker_cmd_init (&wrk->cmd);
 
+    if (shard_start (wrk, params->shards) == -1) {
+        goto failure;
+    }
+
     /* create a run a worker thread */
     pthread_attr_init (&attr);
     pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    if (params->thread_stack != 0
+        && pthread_attr_setstacksize (&attr, params->thread_stack) != 0) {
+        perror_msg ("Failed to set the stack size of a worker thread");
+    }
     if (pthread_create (&wrk->thread, &attr, worker_thread, wrk) != 0) {
         perror_msg ("Failed to start a new worker thread");
+        pthread_attr_destroy (&attr);
         goto failure;
     }
+    pthread_attr_destroy (&attr);
 
     wrk->closed = 0;
     return wrk;
@@ -226,7 +682,11 @@ worker_free (worker *wrk)
 {
     assert (wrk != NULL);
 
-    int i;
+    size_t i;
+
+    /* The hub and the shards must not deliver to the instance anymore */
+    shared_release (wrk);
+    shard_stop (wrk);
 
     close (wrk->io[KQUEUE_FD]);
     wrk->io[KQUEUE_FD] = -1;
@@ -234,72 +694,248 @@ worker_free (worker *wrk)
     close (wrk->kq);
     wrk->closed = 1;
 
+    for (i = 0; i < wrk->sets.length; i++) {
+        worker_save_snapshot (wrk, wrk->sets.watches[i]);
+    }
+
     worker_cmd_release (&wrk->cmd);
     worker_sets_free (&wrk->sets);
+    free (wrk->arrivals);
 
-    for (i = 0; i < wrk->iovcnt; i++) {
-        free (wrk->iov[i].iov_base);
-    }
-    free (wrk->iov);
+    event_queue_free (&wrk->eq);
+    event_queue_free (&wrk->inbox);
+    pthread_mutex_destroy (&wrk->inbox_mutex);
     pthread_mutex_destroy (&wrk->mutex);
 
     free (wrk);
 }
 
+/**
+ * Save the contents of a watched directory to the snapshot store.
+ *
+ * Does nothing if the snapshot store is not configured or if the watch
+ * is not a user watch on a directory.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to #watch.
+ **/
+static void
+worker_save_snapshot (worker *wrk, watch *w)
+{
+    assert (wrk != NULL);
+    assert (w != NULL);
+
+    if (wrk->params.snapshot_dir[0] != '\0'
+        && w->type == WATCH_USER
+        && w->is_directory) {
+        snapshot_save (wrk->params.snapshot_dir, w);
+    }
+}
+
+/**
+ * Find the user watch a watch belongs to.
+ *
+ * @param[in] w A pointer to #watch.
+ * @return A pointer to the user #watch.
+ **/
+watch*
+worker_root (watch *w)
+{
+    while (w->type != WATCH_USER) {
+        w = w->parent;
+        assert (w != NULL);
+    }
+    return w;
+}
+
+/**
+ * Note that a directory populated in the background has all its entries
+ * watched, or is removed before that.
+ *
+ * The subdirectories of an IN_RECURSIVE watch found while it is
+ * populated are populated in the background too. The user gets
+ * IN_POPULATED when the last of them is done.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to the #watch on the directory.
+ **/
+void
+worker_populated (worker *wrk, watch *w)
+{
+    assert (wrk != NULL);
+    assert (w != NULL);
+
+    watch *root = w;
+    if (w->type != WATCH_USER) {
+        root = w->populated_for;
+        if (root == NULL) {
+            return;
+        }
+        w->populated_for = NULL;
+        --root->populating_subdirs;
+    }
+
+    if (root->populating == NULL && root->populating_subdirs == 0) {
+        worker_release_arrivals (wrk, root);
+        enqueue_event (wrk, root->fd, IN_POPULATED, 0, NULL, NULL);
+    }
+}
+
+/**
+ * Stop waiting for the subdirectories of a user watch to be populated,
+ * as it is removed or populated anew.
+ *
+ * @param[in] wrk  A pointer to #worker.
+ * @param[in] root A pointer to the user #watch.
+ **/
+static void
+worker_forget_populated (worker *wrk, watch *root)
+{
+    size_t i;
+    for (i = 0; i < wrk->sets.length && root->populating_subdirs > 0; i++) {
+        if (wrk->sets.watches[i]->populated_for == root) {
+            wrk->sets.watches[i]->populated_for = NULL;
+            --root->populating_subdirs;
+        }
+    }
+}
+
 /**
  * When starting watching a directory, start also watching its contents.
  *
  * This function creates and initializes additional watches for a directory.
+ * In the recursive mode the subdirectories get their dependencies too.
+ * With IN_ASYNC the entries are watched in the background, and so are
+ * the entries of the subdirectories found until the user watch gets
+ * IN_POPULATED.
  *
  * @param[in] wrk    A pointer to #worker.
  * @param[in] parent A pointer to the parent #watch, i.e. the watch we add
  *     dependencies for.
+ * @param[in] path   The full path of the directory.
  * @return 0 on success, -1 otherwise.
  **/
 static int
 worker_add_dependencies (worker        *wrk,
-                         watch         *parent)
+                         watch         *parent,
+                         const char    *path)
 {
     assert (wrk != NULL);
     assert (parent != NULL);
-    assert (parent->type == WATCH_USER);
+    assert (watch_has_dependencies (parent));
+
+    parent->deps = filter_apply (parent->filter, dl_listing (path, NULL));
+
+    watch *root = worker_root (parent);
+    if (parent->poll == NULL
+        && (parent->flags & IN_ASYNC)
+        && (parent == root
+            || root->populating != NULL
+            || root->populating_subdirs > 0)) {
+        /* The worker takes the entries a slice at a time, see
+         * populate_directory() */
+        parent->populating = &parent->deps;
+        parent->dirty = parent->rescan_pending;
+        parent->rescan_pending = 0;
+        if (watch_register_timer (parent, wrk->kq, 0) == 0) {
+            if (parent != root) {
+                parent->populated_for = root;
+                ++root->populating_subdirs;
+            }
+            return 0;
+        }
+        perror_msg ("Failed to watch the entries of %s in the background", path);
+        parent->populating = NULL;
+    }
 
-    parent->deps = dl_listing (parent->filename, NULL);
+    if (parent->poll != NULL) {
+        /* The entries of a polled directory are not opened */
+        poll_rebuild (parent->poll, parent->deps, parent->fd);
+    } else {
+        open_result *opened = NULL;
+        size_t count = 0;
+        if (wrk->params.open_threads > 0) {
+            opened = open_pool_run (path,
+                                    parent->fd,
+                                    parent->deps,
+                                    &wrk->params);
+        }
 
-    {   dep_list *iter = parent->deps;
+        dep_list *iter = parent->deps;
         while (iter != NULL) {
-            char *path = path_concat (parent->filename, iter->path);
-            if (path != NULL) {
-                watch *neww = worker_start_watching (wrk,
-                                                     path,
-                                                     iter->path,
-                                                     parent->flags,
-                                                     WATCH_DEPENDENCY);
+            char *entry_path = path_concat (path, iter->path);
+            if (entry_path != NULL) {
+                watch *neww = worker_start_opened (wrk,
+                                                   entry_path,
+                                                   iter->path,
+                                                   parent->flags,
+                                                   WATCH_DEPENDENCY,
+                                                   parent,
+                                                   NULL,
+                                                   opened ? &opened[count] : NULL);
                 if (neww == NULL) {
                     perror_msg ("Failed to start watching a dependency %s of %s",
-                                path,
+                                entry_path,
                                 iter->path);
-                } else {
-                    neww->parent = parent;
                 }
-                free (path);
+                free (entry_path);
             } else {
                 perror_msg ("Failed to allocate a path while adding a dependency");
             }
             iter = iter->next;
+            ++count;
+        }
+
+        if (opened != NULL) {
+            open_pool_free (opened, count);
         }
     }
+
+    worker_load_snapshot (wrk, parent);
     return 0;
 }
 
+/**
+ * Report the changes made since a directory was watched last time.
+ *
+ * Does nothing if the snapshot store is not configured or if there is
+ * no snapshot of the directory.
+ *
+ * @param[in] wrk    A pointer to #worker.
+ * @param[in] parent A pointer to the #watch on the directory.
+ **/
+void
+worker_load_snapshot (worker *wrk, watch *parent)
+{
+    assert (wrk != NULL);
+    assert (parent != NULL);
+
+    if (parent->type == WATCH_USER && wrk->params.snapshot_dir[0] != '\0') {
+        int found = 0;
+        dep_list *saved = snapshot_load (wrk->params.snapshot_dir,
+                                         parent,
+                                         &found);
+        if (found) {
+            /* The filter could have been changed since the snapshot */
+            saved = filter_apply (parent->filter, saved);
+            produce_snapshot_diff (wrk, parent, saved);
+            dl_free (saved);
+        }
+    }
+}
+
 /**
  * Start watching a file or a directory.
  *
  * @param[in] wrk        A pointer to #worker.
  * @param[in] path       Path to watch.
- * @param[in] entry_name Entry name. Used for dependencies.
+ * @param[in] entry_name Entry name from the listing of the directory,
+ *     see dl_name_new(). Used for dependencies.
  * @param[in] flags      A combination of inotify event flags.
  * @param[in] type       The type of a watch.
+ * @param[in] parent     The directory watch for dependencies, NULL otherwise.
+ * @param[in] filter     The entries to skip, for user watches. The watch
+ *     takes it over on success. Dependencies share the parent's one.
  * @return A pointer to a created watch.
  **/
 watch*
@@ -307,13 +943,51 @@ worker_start_watching (worker      *wrk,
                        const char  *path,
                        const char  *entry_name,
                        uint32_t     flags,
-                       watch_type_t type)
+                       watch_type_t type,
+                       watch       *parent,
+                       filter      *filter)
+{
+    return worker_start_opened (wrk, path, entry_name, flags, type, parent,
+                                filter, NULL);
+}
+
+/**
+ * Start watching a file or a directory opened in advance.
+ *
+ * @param[in] wrk        A pointer to #worker.
+ * @param[in] path       Path to watch.
+ * @param[in] entry_name Entry name from the listing of the directory,
+ *     see dl_name_new(). Used for dependencies.
+ * @param[in] flags      A combination of inotify event flags.
+ * @param[in] type       The type of a watch.
+ * @param[in] parent     The directory watch for dependencies, NULL otherwise.
+ * @param[in] filter     The entries to skip, for user watches.
+ * @param[in] opened     The file opened by open_pool_run(), its descriptor
+ *     is taken over. NULL to open the file here.
+ * @return A pointer to a created watch.
+ **/
+static watch*
+worker_start_opened (worker      *wrk,
+                     const char  *path,
+                     const char  *entry_name,
+                     uint32_t     flags,
+                     watch_type_t type,
+                     watch       *parent,
+                     filter      *filter,
+                     open_result *opened)
 {
     assert (wrk != NULL);
     assert (path != NULL);
+    assert ((type == WATCH_DEPENDENCY) == (parent != NULL));
 
     int i;
 
+    if (opened != NULL && opened->fd == -1) {
+        errno = opened->error;
+        perror_msg ("Failed to open file %s", path);
+        return NULL;
+    }
+
     if (worker_sets_extend (&wrk->sets, 1) == -1) {
         perror_msg ("Failed to extend worker sets");
         return NULL;
@@ -321,23 +995,110 @@ worker_start_watching (worker      *wrk,
 
     i = wrk->sets.length;
     wrk->sets.watches[i] = calloc (1, sizeof (struct watch));
-    if (watch_init (wrk->sets.watches[i],
-                    type,
-                    wrk->kq,
-                    path,
-                    entry_name,
-                    flags)
-        == -1) {
+
+    int retval;
+    if (opened != NULL) {
+        retval = watch_init_opened (wrk->sets.watches[i],
+                                    type,
+                                    wrk->kq,
+                                    ++wrk->serial,
+                                    opened->fd,
+                                    &opened->st,
+                                    path,
+                                    entry_name,
+                                    flags);
+        opened->fd = -1;
+    } else {
+        retval = watch_init (wrk->sets.watches[i],
+                             type,
+                             wrk->kq,
+                             ++wrk->serial,
+                             path,
+                             entry_name,
+                             flags);
+    }
+
+    if (retval == -1) {
         watch_free (wrk->sets.watches[i]);
         wrk->sets.watches[i] = NULL;
         return NULL;
     }
+
+    if (wrk->sets.watches[i]->flags & IN_POLL) {
+        watch *w = wrk->sets.watches[i];
+        w->poll = poll_create (w->fd, wrk->params.poll_msec);
+        if (w->poll == NULL
+            || watch_register_timer (w, wrk->kq, w->poll->interval) == -1) {
+            perror_msg ("Failed to start polling %s", path);
+            watch_free (w);
+            wrk->sets.watches[i] = NULL;
+            return NULL;
+        }
+    }
     ++wrk->sets.length;
 
-    if (type == WATCH_USER && wrk->sets.watches[i]->is_directory) {
-        worker_add_dependencies (wrk, wrk->sets.watches[i]);
+    watch *w = wrk->sets.watches[i];
+    w->parent = parent;
+    w->filter = parent ? parent->filter : filter;
+    if (watch_has_dependencies (w)) {
+        worker_add_dependencies (wrk, w, path);
     }
-    return wrk->sets.watches[i];
+    return w;
+}
+
+/**
+ * Set a parameter of a worker.
+ *
+ * The number of the shards can be changed only until a watch is added.
+ * The other parameters apply to the shards too.
+ *
+ * @param[in] wrk   A pointer to #worker.
+ * @param[in] param A parameter id.
+ * @param[in] value A new value of the parameter.
+ * @return 0 on success, -1 on failure.
+ **/
+int
+worker_set_param (worker *wrk, int param, intptr_t value)
+{
+    assert (wrk != NULL);
+
+    if (param == IN_SHARDS) {
+        worker_params params = wrk->params;
+        if (wrk->watched
+            || wrk->owner != NULL
+            || wrk->is_hub
+            || worker_params_set (&params, param, value) == -1) {
+            return -1;
+        }
+
+        shard_stop (wrk);
+        wrk->params.shards = params.shards;
+        return shard_start (wrk, params.shards);
+    }
+
+    /* The stack of a running thread can not be changed */
+    if (param == IN_THREAD_STACK) {
+        return -1;
+    }
+
+    worker_params params = wrk->params;
+    if (worker_params_set (&params, param, value) == -1) {
+        return -1;
+    }
+
+    /* The commands are served by the worker thread itself */
+    if ((param == IN_THREAD_CPUS
+         || param == IN_THREAD_POLICY
+         || param == IN_THREAD_PRIORITY
+         || param == IN_THREAD_NAME)
+        && worker_thread_setup (&params) == -1) {
+        worker_thread_setup (&wrk->params);
+        return -1;
+    }
+
+    wrk->params = params;
+    shard_param (wrk, param, value);
+    return 0;
 }
 
 /**
@@ -346,12 +1107,15 @@ worker_start_watching (worker      *wrk,
  * @param[in] wrk   A pointer to #worker.
  * @param[in] path  A file path to watch.
  * @param[in] flags A combination of inotify watch flags.
+ * @param[in] filter The entries to skip, replaces the one of an existing
+ *     watch. NULL to keep the current one. Taken over by the worker.
  * @return An id of an added watch on success, -1 on failure.
 **/
 int
 worker_add_or_modify (worker     *wrk,
                       const char *path,
-                      uint32_t    flags)
+                      uint32_t    flags,
+                      filter     *filter)
 {
     assert (path != NULL);
     assert (wrk != NULL);
@@ -367,14 +1131,42 @@ worker_add_or_modify (worker     *wrk,
 
         if (sets->watches[i]->type == WATCH_USER &&
             strcmp (path, evpath) == 0) {
-            worker_update_flags (wrk, sets->watches[i], flags);
-            return sets->watches[i]->fd;
+            watch *w = sets->watches[i];
+            worker_update_flags (wrk, w, flags);
+            if (filter != NULL) {
+                worker_update_filter (wrk, w, filter);
+            }
+            return w->fd;
         }
     }
 
+    worker *shard = shard_route (wrk, path);
+    if (shard != NULL) {
+        return shard_add (shard, path, flags, filter);
+    }
+
+    /* The metadata of the events of a shared watch is not taken, as
+     * well as the filters and IN_ONESHOT are not applied per instance.
+     * The events of a shared watch are sent to the instance directly */
+    int share = wrk->params.shared
+        && !wrk->params.stat_events
+        && filter == NULL
+        && !(flags & IN_ONESHOT);
+    int wd = shared_add (wrk->owner != NULL ? wrk->owner : wrk,
+                         path,
+                         flags,
+                         share);
+    if (wd != -1) {
+        return wd;
+    }
+
     /* add a new entry if path is not found */
-    watch *w = worker_start_watching (wrk, path, NULL, flags, WATCH_USER);
-    return (w != NULL) ? w->fd : -1;
+    watch *w = worker_start_watching (wrk, path, NULL, flags, WATCH_USER, NULL, filter);
+    if (w == NULL) {
+        filter_free (filter);
+        return -1;
+    }
+    return w->fd;
 }
 
 /**
@@ -391,29 +1183,166 @@ worker_remove (worker *wrk,
     assert (wrk != NULL);
     assert (id != -1);
 
+    if (shared_remove (wrk, id) == 0) {
+        return 0;
+    }
+
     size_t i;
     for (i = 0; i < wrk->sets.length; i++) {
         if (wrk->sets.watches[i]->fd == id) {
+            if (wrk->sets.watches[i]->rescan_pending
+                || wrk->sets.watches[i]->poll != NULL
+                || watch_is_busy (wrk->sets.watches[i])) {
+                watch_unregister_timer (wrk->sets.watches[i], wrk->kq);
+            }
+            worker_save_snapshot (wrk, wrk->sets.watches[i]);
+            worker_forget_populated (wrk, wrk->sets.watches[i]);
             worker_remove_many (wrk,
                                 wrk->sets.watches[i],
                                 wrk->sets.watches[i]->deps,
                                 1);
 
-            enqueue_event (wrk, id, IN_IGNORED, 0, NULL);
-            flush_events (wrk);
+            /* Sent with the rest of the batch */
+            enqueue_event (wrk, id, IN_IGNORED, 0, NULL, NULL);
+            if (wrk->is_hub) {
+                shared_forget (id);
+            }
             break;
         }
     }
+
+    if (i == wrk->sets.length) {
+        shard_remove (wrk, id);
+    }
     /* Assume always success */
     return 0;
 }
 
+/**
+ * Compare directory entries by their inode numbers.
+ *
+ * @param[in] a A pointer to #inotify_dirent.
+ * @param[in] b A pointer to #inotify_dirent.
+ * @return A negative, zero or positive value, as for qsort(3).
+ **/
+static int
+dirent_cmp (const void *a, const void *b)
+{
+    uint64_t ia = ((const struct inotify_dirent *) a)->ino;
+    uint64_t ib = ((const struct inotify_dirent *) b)->ino;
+    return (ia > ib) - (ia < ib);
+}
+
+/**
+ * Copy the listing of a watched directory.
+ *
+ * The listing is the one the events have been produced against, so it
+ * is consistent with the events sent so far: the changes not reported
+ * yet (e.g. folded into a pending rescan) are not in it either.
+ *
+ * @param[in]  wrk    A pointer to #worker.
+ * @param[in]  id     An ID of the watch on a directory.
+ * @param[out] result A pointer to store the entries to. The entries and
+ *     their names are allocated as a single block.
+ * @return The number of entries on success, -1 on failure.
+ **/
+int
+worker_get_snapshot (worker *wrk, int id, struct inotify_dirent **result)
+{
+    assert (wrk != NULL);
+    assert (result != NULL);
+
+    if (shared_has (wrk, id)) {
+        return shared_get_snapshot (id, result);
+    }
+
+    watch *w = NULL;
+    size_t i;
+    for (i = 0; i < wrk->sets.length; i++) {
+        if (wrk->sets.watches[i]->fd == id
+            && wrk->sets.watches[i]->type == WATCH_USER) {
+            w = wrk->sets.watches[i];
+            break;
+        }
+    }
+
+    if (w == NULL) {
+        return shard_get_snapshot (wrk, id, result);
+    }
+    if (!w->is_directory) {
+        return -1;
+    }
+
+    /* Only the entries reported so far, see watch_next_known() */
+    const dep_list *iter, *pending = w->added;
+    size_t count = 0, names_len = 0;
+    for (iter = watch_next_known (w->deps, &pending);
+         iter != NULL;
+         iter = watch_next_known (iter->next, &pending)) {
+        ++count;
+        names_len += strlen (iter->path) + 1;
+    }
+
+    struct inotify_dirent *entries
+        = malloc (count * sizeof (struct inotify_dirent) + names_len + 1);
+    if (entries == NULL) {
+        perror_msg ("Failed to allocate a snapshot of %zu entries", count);
+        return -1;
+    }
+
+    char *name = (char *) (entries + count);
+    pending = w->added;
+    for (i = 0, iter = watch_next_known (w->deps, &pending);
+         iter != NULL;
+         i++, iter = watch_next_known (iter->next, &pending)) {
+        size_t len = strlen (iter->path) + 1;
+        memcpy (name, iter->path, len);
+
+        entries[i].ino = iter->inode;
+        entries[i].mask = (iter->type == DT_DIR) ? IN_ISDIR : 0;
+        entries[i].name = name;
+        name += len;
+    }
+
+    /* The types reported by readdir(3) are refined with the ones known
+     * from the polling and from the watches on the entries */
+    qsort (entries, count, sizeof (struct inotify_dirent), dirent_cmp);
+    if (w->poll != NULL) {
+        for (i = 0; i < count; i++) {
+            const poll_entry *pe = poll_find (w->poll, entries[i].ino);
+            if (pe != NULL && pe->known) {
+                entries[i].mask = S_ISDIR (pe->mode) ? IN_ISDIR : 0;
+            }
+        }
+    }
+    for (i = 0; i < wrk->sets.length; i++) {
+        const watch *dep = wrk->sets.watches[i];
+        if (dep->parent == w) {
+            struct inotify_dirent key;
+            key.ino = dep->inode;
+
+            struct inotify_dirent *entry = bsearch (&key,
+                                                    entries,
+                                                    count,
+                                                    sizeof (struct inotify_dirent),
+                                                    dirent_cmp);
+            if (entry != NULL) {
+                entry->mask = dep->is_really_dir ? IN_ISDIR : 0;
+            }
+        }
+    }
+
+    *result = entries;
+    return count;
+}
+
 
 /**
  * Update watch flags.
  *
  * When called for a directory watch, update also the flags of all the
- * dependent (child) watches.
+ * dependent (child) watches. Switching IN_RECURSIVE on or off starts or
+ * stops watching the contents of the subdirectories.
  *
  * @param[in] wrk   A pointer to #worker.
  * @param[in] w     A pointer to #watch.
@@ -424,27 +1353,97 @@ worker_update_flags (worker *wrk, watch *w, uint32_t flags)
 {
     assert (w != NULL);
 
+    /* A watch is not switched between kqueue and polling */
+    if (w->type == WATCH_USER) {
+        flags = (flags & ~IN_POLL) | (w->flags & IN_POLL);
+    }
+
     w->flags = flags;
-    uint32_t fflags = inotify_to_kqueue (flags, w->is_really_dir, 0);
-    watch_register_event (w, wrk->kq, fflags);
+    if (w->poll != NULL) {
+        return;
+    }
+    watch_register_event (w, wrk->kq, watch_kqueue_flags (w));
 
     /* Propagate the flag changes also on all dependent watches */
     if (w->deps) {
+        size_t count = 0, i;
+        watch **children = calloc (wrk->sets.length, sizeof (watch *));
+        if (children == NULL) {
+            perror_msg ("Failed to allocate a list of dependencies");
+            return;
+        }
 
-        /* Yes, it is quite stupid to iterate over ALL watches of a worker
-         * while we have a linked list of its dependencies.
-         * TODO improve it */
-        size_t i;
+        /* The list of watches changes below, so collect the children
+         * first */
         for (i = 0; i < wrk->sets.length; i++) {
-            watch *depw = wrk->sets.watches[i];
-            if (depw->parent == w) {
-                depw->flags = flags;
-                uint32_t fflags = inotify_to_kqueue (flags,
-                                                     depw->is_really_dir,
-                                                     1);
-                watch_register_event (depw, wrk->kq, fflags);
+            if (wrk->sets.watches[i]->parent == w) {
+                children[count++] = wrk->sets.watches[i];
             }
         }
+
+        for (i = 0; i < count; i++) {
+            watch *depw = children[i];
+            int had_deps = watch_has_dependencies (depw);
+
+            depw->flags = flags;
+            if (had_deps && watch_has_dependencies (depw)) {
+                worker_update_flags (wrk, depw, flags);
+                continue;
+            }
+
+            char *path = NULL;
+            if (!had_deps && depw->is_really_dir && (flags & IN_RECURSIVE)) {
+                path = watch_path (depw);
+                if (path != NULL) {
+                    watch_check_link (depw, path);
+                }
+            }
+
+            watch_register_event (depw, wrk->kq, watch_kqueue_flags (depw));
+            if (had_deps) {
+                worker_remove_many (wrk, depw, depw->deps, 0);
+                dl_free (depw->deps);
+                depw->deps = NULL;
+            } else if (path != NULL && watch_has_dependencies (depw)) {
+                worker_add_dependencies (wrk, depw, path);
+            }
+            free (path);
+        }
+        free (children);
+    }
+}
+
+/**
+ * Replace the filter of a user watch.
+ *
+ * The dependencies are recreated silently, so the entries the new filter
+ * skips are not watched anymore and the ones it lets in are watched.
+ *
+ * @param[in] wrk    A pointer to #worker.
+ * @param[in] w      A pointer to the user #watch.
+ * @param[in] filter The new filter. Taken over by the watch.
+ **/
+static void
+worker_update_filter (worker *wrk, watch *w, filter *filter)
+{
+    assert (wrk != NULL);
+    assert (w != NULL);
+    assert (w->type == WATCH_USER);
+
+    /* The entries are listed and watched anew below */
+    watch_stop_background (w);
+    worker_forget_populated (wrk, w);
+    if (w->deps != NULL) {
+        worker_remove_many (wrk, w, w->deps, 0);
+        dl_free (w->deps);
+        w->deps = NULL;
+    }
+
+    filter_free (w->filter);
+    w->filter = filter;
+
+    if (watch_has_dependencies (w)) {
+        worker_add_dependencies (wrk, w, w->filename);
     }
 }
 
@@ -466,6 +1465,11 @@ worker_remove_many (worker *wrk, watch *parent, const dep_list *items, int remov
     const dep_list *iter = items;
     size_t i;
 
+    /* A new directory is reported before its contents */
+    if (remove_self) {
+        worker_release_arrival (wrk, parent);
+    }
+
     while (iter != NULL) {
 
         worker_remove_watch (wrk, parent, iter->path);
@@ -473,6 +1477,12 @@ worker_remove_many (worker *wrk, watch *parent, const dep_list *items, int remov
     }
 
     if (remove_self) {
+        /* The entries moved out of the directory have lost it too */
+        worker_finish_moves (wrk, parent);
+        if (parent->populated_for != NULL) {
+            worker_populated (wrk, parent);
+        }
+
         for (i = 0; i < wrk->sets.length; i++) {
             if (wrk->sets.watches[i] == parent) {
                 worker_sets_delete (&wrk->sets, i);
@@ -500,8 +1510,18 @@ worker_remove_watch (worker *wrk, watch *parent, const char *path)
     for (i = 0; i < wrk->sets.length; i++) {
         watch *w = wrk->sets.watches[i];
 
-        if ((w->parent == parent) && (strcmp (path, w->filename) == 0)) {
-            worker_sets_delete (&wrk->sets, i);
+        if ((w->parent == parent) && !w->moving
+            && (strcmp (path, w->filename) == 0)) {
+            if (w->deps != NULL) {
+                /* A subdirectory of a recursive watch */
+                worker_remove_many (wrk, w, w->deps, 1);
+            } else {
+                if (w->populated_for != NULL) {
+                    worker_populated (wrk, w);
+                }
+                worker_release_arrival (wrk, w);
+                worker_sets_delete (&wrk->sets, i);
+            }
             break;
         }
     }
@@ -550,9 +1570,9 @@ worker_update_paths (worker *wrk, watch *parent)
                     to_update = iter->next;
                 }
 
-                if (strcmp (iter->path, w->filename)) {
-                    free (w->filename);
-                    w->filename = strdup (iter->path);
+                if (iter->path != w->filename) {
+                    dl_name_unref (w->filename);
+                    w->filename = dl_name_ref (iter->path);
                 }
 
                 free (iter);
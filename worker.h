@@ -23,27 +23,68 @@
 #ifndef __WORKER_H__
 #define __WORKER_H__
 
-#include <sys/uio.h> /* iovec */
-
 #include <pthread.h>
 #include <stdint.h>
+#include <limits.h> /* PATH_MAX */
 
 typedef struct worker worker;
 
+#include "sys/inotify.h"
+
 #include "compat.h"
+#include "event-queue.h"
 #include "worker-thread.h"
 #include "worker-sets.h"
 #include "dep-list.h"
+#include "filter.h"
 
 #define INOTIFY_FD 0
 #define KQUEUE_FD  1
 
+/* The CPUs the threads can be bound to, see IN_THREAD_CPUS */
+#define WORKER_MAX_CPUS 1024
+
 typedef enum {
     WCMD_NONE = 0,   /* uninitialized state */
     WCMD_ADD,        /* add or modify a watch */
     WCMD_REMOVE,     /* remove a watch */
+    WCMD_PARAM,      /* set an instance parameter */
+    WCMD_STATS,      /* read the instance counters */
+    WCMD_SNAPSHOT,   /* copy the listing of a watched directory */
+    WCMD_SUBSCRIBE,  /* share a watch with an instance (shared worker) */
+    WCMD_UNSUBSCRIBE,/* stop sharing watches with an instance */
+    WCMD_DETACH,     /* stop sending the events to the owner (shards) */
 } worker_cmd_type_t;
 
+/**
+ * Tunable parameters of a worker, see libinotify_set_param().
+ **/
+typedef struct worker_params {
+    int debounce_ms;       /* rescan folding window, 0 to disable */
+    char snapshot_dir[PATH_MAX]; /* snapshot store, empty to disable */
+    int coalesce;          /* 1 to merge identical consecutive events */
+    int max_queued;        /* limit of the events waiting for delivery */
+    int stat_events;       /* 1 to attach file metadata to the events */
+    int storm_limit;       /* per-directory events in a batch, 0 if any */
+    int poll_msec;         /* the interval of the IN_POLL watches */
+    int hot_rate;          /* changes a second to make a directory hot */
+    int hot_msec;          /* the rescan interval of the hot directories */
+    int shared;            /* 1 to share the watches with other instances */
+    int shards;            /* the number of threads serving the watches */
+    int open_threads;      /* helpers opening the entries of a directory */
+    int slice;             /* entries handled between commands, 0 if any */
+    unsigned char thread_cpus[WORKER_MAX_CPUS / CHAR_BIT]; /* CPUs the
+                              threads run on (bit N for CPU N), none if any */
+    size_t thread_stack;   /* stack size of the threads, 0 if default */
+    int thread_policy;     /* scheduling policy, -1 to inherit */
+    int thread_priority;   /* scheduling priority with the policy above */
+    char thread_name[16];  /* thread name, empty to leave it unnamed */
+} worker_params;
+
+extern worker_params worker_default_params;
+
+int worker_params_set (worker_params *params, int param, intptr_t value);
+
 /**
  * This structure represents a user call to the inotify API.
  * It is also used to synchronize a user thread with a worker thread.
@@ -56,9 +97,34 @@ typedef struct worker_cmd {
         struct {
             char *filename;
             uint32_t mask;
+            filter *filter;  /* taken by the worker, NULL to keep */
         } add;
 
         int rm_id;
+
+        struct {
+            int param;
+            intptr_t value;
+        } param;
+
+        struct inotify_stats *stats;
+
+        struct {
+            int wd;
+            struct inotify_dirent **result;
+        } snapshot;
+
+        struct {
+            char *filename;
+            uint32_t mask;
+            worker *sub;     /* the subscribing instance */
+            int share;       /* 0 to only leave the watch on the path */
+        } subscribe;
+
+        struct {
+            int wd;          /* -1 for all the watches of the instance */
+            worker *sub;
+        } unsubscribe;
     };
 
     pthread_barrier_t sync;
@@ -66,26 +132,57 @@ typedef struct worker_cmd {
 
 void worker_cmd_init    (worker_cmd *cmd);
 void worker_cmd_add     (worker_cmd *cmd, const char *filename, uint32_t mask);
+void worker_cmd_add_filtered (worker_cmd *cmd,
+                              const char *filename,
+                              uint32_t    mask,
+                              filter     *filter);
 void worker_cmd_remove  (worker_cmd *cmd, int watch_id);
+void worker_cmd_param   (worker_cmd *cmd, int param, intptr_t value);
+void worker_cmd_stats   (worker_cmd *cmd, struct inotify_stats *stats);
+void worker_cmd_snapshot (worker_cmd             *cmd,
+                          int                     wd,
+                          struct inotify_dirent **result);
+void worker_cmd_subscribe (worker_cmd *cmd,
+                           worker     *sub,
+                           const char *filename,
+                           uint32_t    mask,
+                           int         share);
+void worker_cmd_unsubscribe (worker_cmd *cmd, worker *sub, int wd);
+void worker_cmd_detach  (worker_cmd *cmd);
 void worker_cmd_wait    (worker_cmd *cmd);
 void worker_cmd_release (worker_cmd *cmd);
 
 struct worker {
     int kq;                /* kqueue descriptor */
     volatile int io[2];    /* a socket pair */
-    struct iovec *iov;     /* inotify events to send */
-    int iovcnt;            /* number of events enqueued */
-    int iovalloc;          /* number of iovs allocated */
+    event_queue eq;        /* inotify events to send */
+    int write_armed;       /* 1 if waiting for the socket to drain */
     pthread_t thread;      /* worker thread */
     worker_sets sets;      /* filenames, etc */
     volatile int closed;   /* closed flag */
+    uintptr_t serial;      /* serial of the last watch created */
+    size_t oneshots_fired; /* IN_ONESHOT watches to remove after a batch */
+    size_t moves_pending;  /* watches moved out of their directories */
+    watch **arrivals;      /* new entries not reported yet in a batch */
+    size_t arrivals_length;
+    size_t arrivals_allocated;
+    worker_params params;  /* tunable parameters */
+    struct inotify_stats stats; /* counters */
+    int is_hub;            /* 1 for the worker serving the shared watches */
+    size_t subscriptions;  /* the number of shared watches subscribed to */
+    event_queue inbox;     /* events sent by the other workers to deliver */
+    pthread_mutex_t inbox_mutex; /* guards the inbox */
+    worker *owner;         /* the worker of the instance for a shard */
+    worker **shards;       /* the other workers serving the instance */
+    int nshards;           /* the number of them */
+    int watched;           /* 1 once a watch has been added */
 
     pthread_mutex_t mutex; /* worker mutex */
     worker_cmd cmd;        /* operation to perform on a worker */
 };
 
 
-worker* worker_create         ();
+worker* worker_create         (const worker_params *params);
 void    worker_free           (worker *wrk);
 
 watch*
@@ -93,10 +190,18 @@ worker_start_watching (worker      *wrk,
                        const char  *path,
                        const char  *entry_name,
                        uint32_t     flags,
-                       watch_type_t type);
-
-int     worker_add_or_modify  (worker *wrk, const char *path, uint32_t flags);
+                       watch_type_t type,
+                       watch       *parent,
+                       filter      *filter);
+
+int     worker_set_param      (worker *wrk, int param, intptr_t value);
+int     worker_thread_setup   (const worker_params *params);
+void    worker_populated      (worker *wrk, watch *w);
+watch*  worker_root           (watch *w);
+void    worker_load_snapshot  (worker *wrk, watch *parent);
+int     worker_add_or_modify  (worker *wrk, const char *path, uint32_t flags, filter *filter);
 int     worker_remove         (worker *wrk, int id);
+int     worker_get_snapshot   (worker *wrk, int id, struct inotify_dirent **result);
 
 void    worker_update_paths   (worker *wrk, watch *parent);
 void    worker_remove_many    (worker *wrk, watch *parent, const dep_list* items, int remove_self);